@@ -23,11 +23,13 @@
 
 #ifdef HAVE_EBPF
 
+#include <fstream>
 #include <sys/syscall.h>
 #include <linux/bpf.h>
 
 #include "ext/libbpf/libbpf.h"
 
+#include "dolog.hh"
 #include "misc.hh"
 
 static __u64 ptr_to_u64(void *ptr)
@@ -139,21 +141,92 @@ struct QNameValue
   uint16_t qtype;
 };
 
-BPFFilter::BPFFilter(uint32_t maxV4Addresses, uint32_t maxV6Addresses, uint32_t maxQNames): d_maxV4(maxV4Addresses), d_maxV6(maxV6Addresses), d_maxQNames(maxQNames)
+/* the kernel stores the values of a per-CPU map 8-byte aligned, one after the other */
+static_assert(sizeof(uint64_t) % 8 == 0 && sizeof(QNameValue) % 8 == 0, "The values of a per-CPU map need to be 8-byte aligned");
+
+/* the number of possible CPUs, which is the number of values of a per-CPU map,
+   might be larger than the number of online or even present ones */
+static uint32_t getPossibleCPUsCount()
+{
+  std::ifstream ifs("/sys/devices/system/cpu/possible");
+  std::string line;
+  if (!ifs || !std::getline(ifs, line)) {
+    throw std::runtime_error("Unable to get the number of possible CPUs from /sys/devices/system/cpu/possible");
+  }
+
+  /* "0-7", "0" or "0-3,8-11" */
+  uint32_t count = 0;
+  std::vector<std::string> ranges;
+  stringtok(ranges, line, ",");
+  for (const auto& range : ranges) {
+    auto pos = range.find('-');
+    uint32_t last = pdns_stou(pos == std::string::npos ? range : range.substr(pos + 1));
+    count = std::max(count, last + 1);
+  }
+
+  if (count == 0) {
+    throw std::runtime_error("Unable to parse the number of possible CPUs from '" + line + "'");
+  }
+  return count;
+}
+
+static uint64_t sumCounters(const std::vector<uint64_t>& values)
 {
-  d_v4map.fd = bpf_create_map(BPF_MAP_TYPE_HASH, sizeof(uint32_t), sizeof(uint64_t), (int) maxV4Addresses);
-  if (d_v4map.fd == -1) {
-    throw std::runtime_error("Error creating a BPF v4 map of size " + std::to_string(maxV4Addresses) + ": " + stringerror());
+  uint64_t total = 0;
+  for (const auto& value : values) {
+    total += value;
   }
+  return total;
+}
 
-  d_v6map.fd = bpf_create_map(BPF_MAP_TYPE_HASH, sizeof(struct KeyV6), sizeof(uint64_t), (int) maxV6Addresses);
-  if (d_v6map.fd == -1) {
-    throw std::runtime_error("Error creating a BPF v6 map of size " + std::to_string(maxV6Addresses) + ": " + stringerror());
+static uint64_t sumCounters(const std::vector<QNameValue>& values)
+{
+  uint64_t total = 0;
+  for (const auto& value : values) {
+    total += value.counter;
   }
+  return total;
+}
+
+BPFFilter::BPFFilter(uint32_t maxV4Addresses, uint32_t maxV6Addresses, uint32_t maxQNames): d_maxV4(maxV4Addresses), d_maxV6(maxV6Addresses), d_maxQNames(maxQNames)
+{
+  /* the filter is run by whichever CPU received the packet, so per-CPU maps prevent all
+     the CPUs from contending on the same cache line every time a counter is incremented,
+     at the cost of one counter per possible CPU. The eBPF code is the same for both kinds
+     of maps, since a lookup from the kernel only returns the value of the current CPU.
+     Per-CPU hash maps require Linux 4.6+ (EINVAL) and need more locked memory (EPERM, ENOMEM),
+     so we fall back to regular hash maps when they can't be created. */
+  for (const auto mapType : {BPF_MAP_TYPE_PERCPU_HASH, BPF_MAP_TYPE_HASH}) {
+    d_perCPU = mapType == BPF_MAP_TYPE_PERCPU_HASH;
+    d_valuesCount = d_perCPU ? getPossibleCPUsCount() : 1;
+
+    const char* failedMap = nullptr;
+    uint32_t failedMapSize = 0;
+    if ((d_v4map.fd = bpf_create_map(mapType, sizeof(uint32_t), sizeof(uint64_t), (int) maxV4Addresses)) == -1) {
+      failedMap = "v4";
+      failedMapSize = maxV4Addresses;
+    }
+    else if ((d_v6map.fd = bpf_create_map(mapType, sizeof(struct KeyV6), sizeof(uint64_t), (int) maxV6Addresses)) == -1) {
+      failedMap = "v6";
+      failedMapSize = maxV6Addresses;
+    }
+    else if ((d_qnamemap.fd = bpf_create_map(mapType, sizeof(struct QNameKey), sizeof(struct QNameValue), (int) maxQNames)) == -1) {
+      failedMap = "qname";
+      failedMapSize = maxQNames;
+    }
+    else {
+      break;
+    }
 
-  d_qnamemap.fd = bpf_create_map(BPF_MAP_TYPE_HASH, sizeof(struct QNameKey), sizeof(struct QNameValue), (int) maxQNames);
-  if (d_qnamemap.fd == -1) {
-    throw std::runtime_error("Error creating a BPF qname map of size " + std::to_string(maxQNames) + ": " + stringerror());
+    const int err = errno;
+    if (!d_perCPU || (err != EINVAL && err != EPERM && err != ENOMEM)) {
+      throw std::runtime_error("Error creating a BPF " + std::string(failedMap) + " map of size " + std::to_string(failedMapSize) + ": " + stringerror(err));
+    }
+
+    warnlog("Error creating a per-CPU BPF %s map of size %d (%s), falling back to regular hash maps", failedMap, failedMapSize, stringerror(err));
+    d_v4map.reset();
+    d_v6map.reset();
+    d_qnamemap.reset();
   }
 
   d_filtermap.fd = bpf_create_map(BPF_MAP_TYPE_PROG_ARRAY, sizeof(uint32_t), sizeof(uint32_t), 1);
@@ -214,7 +287,7 @@ void BPFFilter::removeSocket(int sock)
 
 void BPFFilter::block(const ComboAddress& addr)
 {
-  uint64_t counter = 0;
+  std::vector<uint64_t> counters(d_valuesCount, 0);
   int res = 0;
   if (addr.isIPv4()) {
     uint32_t key = htonl(addr.sin4.sin_addr.s_addr);
@@ -223,12 +296,12 @@ void BPFFilter::block(const ComboAddress& addr)
     }
 
     std::lock_guard<std::mutex> lock(d_mutex);
-    res = bpf_lookup_elem(d_v4map.fd, &key, &counter);
+    res = bpf_lookup_elem(d_v4map.fd, &key, counters.data());
     if (res != -1) {
       throw std::runtime_error("Trying to block an already blocked address: " + addr.toString());
     }
 
-    res = bpf_update_elem(d_v4map.fd, &key, &counter, BPF_NOEXIST);
+    res = bpf_update_elem(d_v4map.fd, &key, counters.data(), BPF_NOEXIST);
     if (res == 0) {
       d_v4Count++;
     }
@@ -245,12 +318,12 @@ void BPFFilter::block(const ComboAddress& addr)
     }
 
     std::lock_guard<std::mutex> lock(d_mutex);
-    res = bpf_lookup_elem(d_v6map.fd, &key, &counter);
+    res = bpf_lookup_elem(d_v6map.fd, &key, counters.data());
     if (res != -1) {
       throw std::runtime_error("Trying to block an already blocked address: " + addr.toString());
     }
 
-    res = bpf_update_elem(d_v6map.fd, key, &counter, BPF_NOEXIST);
+    res = bpf_update_elem(d_v6map.fd, key, counters.data(), BPF_NOEXIST);
     if (res == 0) {
       d_v6Count++;
     }
@@ -299,6 +372,8 @@ void BPFFilter::block(const DNSName& qname, uint16_t qtype)
   memset(&value, 0, sizeof(value));
   value.counter = 0;
   value.qtype = qtype;
+  /* every CPU looks at its own copy of the qtype */
+  std::vector<QNameValue> values(d_valuesCount, value);
 
   std::string keyStr = qname.toDNSStringLC();
   if (keyStr.size() > sizeof(key.qname)) {
@@ -312,12 +387,13 @@ void BPFFilter::block(const DNSName& qname, uint16_t qtype)
       throw std::runtime_error("Table full when trying to block " + qname.toLogString());
     }
 
-    int res = bpf_lookup_elem(d_qnamemap.fd, &key, &value);
+    std::vector<QNameValue> existing(d_valuesCount);
+    int res = bpf_lookup_elem(d_qnamemap.fd, &key, existing.data());
     if (res != -1) {
       throw std::runtime_error("Trying to block an already blocked qname: " + qname.toLogString());
     }
 
-    res = bpf_update_elem(d_qnamemap.fd, &key, &value, BPF_NOEXIST);
+    res = bpf_update_elem(d_qnamemap.fd, &key, values.data(), BPF_NOEXIST);
     if (res == 0) {
       d_qNamesCount++;
     }
@@ -363,7 +439,7 @@ std::vector<std::pair<ComboAddress, uint64_t> > BPFFilter::getAddrStats()
 
   uint32_t v4Key = 0;
   uint32_t nextV4Key;
-  uint64_t value;
+  std::vector<uint64_t> values(d_valuesCount);
 
   uint8_t v6Key[16];
   uint8_t nextV6Key[16];
@@ -379,9 +455,9 @@ std::vector<std::pair<ComboAddress, uint64_t> > BPFFilter::getAddrStats()
 
   while (res == 0) {
     v4Key = nextV4Key;
-    if (bpf_lookup_elem(d_v4map.fd, &v4Key, &value) == 0) {
+    if (bpf_lookup_elem(d_v4map.fd, &v4Key, values.data()) == 0) {
       v4Addr.sin_addr.s_addr = ntohl(v4Key);
-      result.push_back(make_pair(ComboAddress(&v4Addr), value));
+      result.push_back(make_pair(ComboAddress(&v4Addr), sumCounters(values)));
     }
 
     res = bpf_get_next_key(d_v4map.fd, &v4Key, &nextV4Key);
@@ -390,10 +466,10 @@ std::vector<std::pair<ComboAddress, uint64_t> > BPFFilter::getAddrStats()
   res = bpf_get_next_key(d_v6map.fd, &v6Key, &nextV6Key);
 
   while (res == 0) {
-    if (bpf_lookup_elem(d_v6map.fd, &nextV6Key, &value) == 0) {
+    if (bpf_lookup_elem(d_v6map.fd, &nextV6Key, values.data()) == 0) {
       memcpy(&v6Addr.sin6_addr.s6_addr, &nextV6Key, sizeof(nextV6Key));
 
-      result.push_back(make_pair(ComboAddress(&v6Addr), value));
+      result.push_back(make_pair(ComboAddress(&v6Addr), sumCounters(values)));
     }
 
     res = bpf_get_next_key(d_v6map.fd, &nextV6Key, &nextV6Key);
@@ -408,16 +484,16 @@ std::vector<std::tuple<DNSName, uint16_t, uint64_t> > BPFFilter::getQNameStats()
 
   struct QNameKey key = { { 0 } };
   struct QNameKey nextKey = { { 0 } };
-  struct QNameValue value;
+  std::vector<QNameValue> values(d_valuesCount);
 
   std::lock_guard<std::mutex> lock(d_mutex);
 
   int res = bpf_get_next_key(d_qnamemap.fd, &key, &nextKey);
 
   while (res == 0) {
-    if (bpf_lookup_elem(d_qnamemap.fd, &nextKey, &value) == 0) {
+    if (bpf_lookup_elem(d_qnamemap.fd, &nextKey, values.data()) == 0) {
       nextKey.qname[sizeof(nextKey.qname) - 1 ] = '\0';
-      result.push_back(std::make_tuple(DNSName((const char*) nextKey.qname, sizeof(nextKey.qname), 0, false), value.qtype, value.counter));
+      result.push_back(std::make_tuple(DNSName((const char*) nextKey.qname, sizeof(nextKey.qname), 0, false), values.at(0).qtype, sumCounters(values)));
     }
 
     res = bpf_get_next_key(d_qnamemap.fd, &nextKey, &nextKey);
@@ -427,14 +503,14 @@ std::vector<std::tuple<DNSName, uint16_t, uint64_t> > BPFFilter::getQNameStats()
 
 uint64_t BPFFilter::getHits(const ComboAddress& requestor)
 {
-  uint64_t counter = 0;
+  std::vector<uint64_t> counters(d_valuesCount);
   if (requestor.isIPv4()) {
     uint32_t key = htonl(requestor.sin4.sin_addr.s_addr);
 
     std::lock_guard<std::mutex> lock(d_mutex);
-    int res = bpf_lookup_elem(d_v4map.fd, &key, &counter);
+    int res = bpf_lookup_elem(d_v4map.fd, &key, counters.data());
     if (res == 0) {
-      return counter;
+      return sumCounters(counters);
     }
   }
   else if (requestor.isIPv6()) {
@@ -445,15 +521,75 @@ uint64_t BPFFilter::getHits(const ComboAddress& requestor)
     }
 
     std::lock_guard<std::mutex> lock(d_mutex);
-    int res = bpf_lookup_elem(d_v6map.fd, &key, &counter);
+    int res = bpf_lookup_elem(d_v6map.fd, &key, counters.data());
     if (res == 0) {
-      return counter;
+      return sumCounters(counters);
     }
   }
 
   return 0;
 }
 
+/* sum the hit counters of every entry of a map, one lookup per entry */
+template <typename K, typename V>
+static uint64_t sumMapCounters(int mapFd, std::vector<V>& values)
+{
+  uint64_t total = 0;
+  K key;
+  K nextKey;
+  memset(&key, 0, sizeof(key));
+  memset(&nextKey, 0, sizeof(nextKey));
+
+  int res = bpf_get_next_key(mapFd, &key, &nextKey);
+  while (res == 0) {
+    if (bpf_lookup_elem(mapFd, &nextKey, values.data()) == 0) {
+      total += sumCounters(values);
+    }
+    key = nextKey;
+    res = bpf_get_next_key(mapFd, &key, &nextKey);
+  }
+  return total;
+}
+
+BPFFilter::Counters BPFFilter::getCounters()
+{
+  /* the number of entries is known without asking the kernel, but getting the number of hits
+     requires one syscall per entry, so we only walk the maps once per refresh interval, and
+     concurrent callers wait for the walk in progress instead of starting a new one */
+  std::lock_guard<std::mutex> countersLock(d_countersMutex);
+  time_t now = time(nullptr);
+
+  Counters result = d_counters;
+  {
+    std::lock_guard<std::mutex> lock(d_mutex);
+    result.v4Entries = d_v4Count;
+    result.v6Entries = d_v6Count;
+    result.qnameEntries = d_qNamesCount;
+  }
+
+  if (d_countersUpdated != 0 && now >= d_countersUpdated && (now - d_countersUpdated) < s_countersRefreshInterval) {
+    return result;
+  }
+
+  std::vector<uint64_t> values(d_valuesCount);
+  std::vector<QNameValue> qnameValues(d_valuesCount);
+  {
+    std::lock_guard<std::mutex> lock(d_mutex);
+    result.v4Hits = sumMapCounters<uint32_t>(d_v4map.fd, values);
+    result.v6Hits = sumMapCounters<KeyV6>(d_v6map.fd, values);
+    result.qnameHits = sumMapCounters<QNameKey>(d_qnamemap.fd, qnameValues);
+  }
+
+  d_counters = result;
+  d_countersUpdated = now;
+  return result;
+}
+
+bool BPFFilter::hasPerCPUCounters() const
+{
+  return d_perCPU;
+}
+
 #else
 
 BPFFilter::BPFFilter(uint32_t maxV4Addresses, uint32_t maxV6Addresses, uint32_t maxQNames)
@@ -518,4 +654,14 @@ uint64_t BPFFilter::getHits(const ComboAddress& requestor)
   (void) requestor;
   return 0;
 }
+
+BPFFilter::Counters BPFFilter::getCounters()
+{
+  return Counters();
+}
+
+bool BPFFilter::hasPerCPUCounters() const
+{
+  return false;
+}
 #endif /* HAVE_EBPF */
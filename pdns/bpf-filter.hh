@@ -29,6 +29,16 @@
 class BPFFilter
 {
 public:
+  struct Counters
+  {
+    uint64_t v4Entries{0};
+    uint64_t v6Entries{0};
+    uint64_t qnameEntries{0};
+    uint64_t v4Hits{0};
+    uint64_t v6Hits{0};
+    uint64_t qnameHits{0};
+  };
+
   BPFFilter(uint32_t maxV4Addresses, uint32_t maxV6Addresses, uint32_t maxQNames);
   void addSocket(int sock);
   void removeSocket(int sock);
@@ -39,6 +49,11 @@ public:
   std::vector<std::pair<ComboAddress, uint64_t> > getAddrStats();
   std::vector<std::tuple<DNSName, uint16_t, uint64_t> > getQNameStats();
   uint64_t getHits(const ComboAddress& requestor);
+  /* number of entries and of queries dropped, for every kind of map. The number of
+     queries dropped is refreshed at most once every s_countersRefreshInterval seconds */
+  Counters getCounters();
+  /* whether the maps keep one counter per CPU, which requires a 4.6+ kernel */
+  bool hasPerCPUCounters() const;
 
 private:
 #ifdef HAVE_EBPF
@@ -50,15 +65,31 @@ private:
         close(fd);
       }
     }
+    void reset()
+    {
+      if (fd != -1) {
+        close(fd);
+        fd = -1;
+      }
+    }
     int fd{-1};
   };
+  static const time_t s_countersRefreshInterval{1};
+
   std::mutex d_mutex;
+  /* protects the cached counters, taken before d_mutex */
+  std::mutex d_countersMutex;
+  Counters d_counters;
+  time_t d_countersUpdated{0};
   uint32_t d_maxV4;
   uint32_t d_maxV6;
   uint32_t d_maxQNames;
   uint32_t d_v4Count{0};
   uint32_t d_v6Count{0};
   uint32_t d_qNamesCount{0};
+  /* number of values returned by a lookup: one per possible CPU for per-CPU maps, otherwise one */
+  uint32_t d_valuesCount{1};
+  bool d_perCPU{false};
   FDWrapper d_v4map;
   FDWrapper d_v6map;
   FDWrapper d_qnamemap;
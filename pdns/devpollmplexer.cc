@@ -91,15 +91,14 @@ void DevPollFDMultiplexer::addFD(callbackmap_t& cbmap, int fd, callbackfunc_t to
   devent.revents = 0;
 
   if(write(d_devpollfd, &devent, sizeof(devent)) != sizeof(devent)) {
-    cbmap.erase(fd);
+    accountingRemoveFD(cbmap, fd);
     throw FDMultiplexerException("Adding fd to /dev/poll/ set: "+stringerror());
   }
 }
 
 void DevPollFDMultiplexer::removeFD(callbackmap_t& cbmap, int fd)
 {
-  if(!cbmap.erase(fd))
-    throw FDMultiplexerException("Tried to remove unlisted fd "+std::to_string(fd)+ " from multiplexer");
+  accountingRemoveFD(cbmap, fd);
 
   struct pollfd devent;
   devent.fd=fd;
@@ -107,7 +106,6 @@ void DevPollFDMultiplexer::removeFD(callbackmap_t& cbmap, int fd)
   devent.revents = 0;
 
   if(write(d_devpollfd, &devent, sizeof(devent)) != sizeof(devent)) {
-    cbmap.erase(fd);
     throw FDMultiplexerException("Removing fd from epoll set: "+stringerror());
   }
 }
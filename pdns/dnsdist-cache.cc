@@ -20,6 +20,9 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 #include <cinttypes>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "dnsdist.hh"
 #include "dolog.hh"
@@ -30,14 +33,14 @@
 #include "ednssubnet.hh"
 #include "packetcache.hh"
 
-DNSDistPacketCache::DNSDistPacketCache(size_t maxEntries, uint32_t maxTTL, uint32_t minTTL, uint32_t tempFailureTTL, uint32_t maxNegativeTTL, uint32_t staleTTL, bool dontAge, uint32_t shards, bool deferrableInsertLock, bool parseECS): d_maxEntries(maxEntries), d_shardCount(shards), d_maxTTL(maxTTL), d_tempFailureTTL(tempFailureTTL), d_maxNegativeTTL(maxNegativeTTL), d_minTTL(minTTL), d_staleTTL(staleTTL), d_dontAge(dontAge), d_deferrableInsertLock(deferrableInsertLock), d_parseECS(parseECS)
+DNSDistPacketCache::DNSDistPacketCache(size_t maxEntries, uint32_t maxTTL, uint32_t minTTL, uint32_t tempFailureTTL, uint32_t maxNegativeTTL, uint32_t staleTTL, bool dontAge, uint32_t shards, bool deferrableInsertLock, bool parseECS, Engine engine): d_maxEntries(maxEntries), d_shardCount(shards), d_maxTTL(maxTTL), d_tempFailureTTL(tempFailureTTL), d_maxNegativeTTL(maxNegativeTTL), d_minTTL(minTTL), d_staleTTL(staleTTL), d_engine(engine), d_dontAge(dontAge), d_deferrableInsertLock(deferrableInsertLock), d_parseECS(parseECS)
 {
   d_shards.resize(d_shardCount);
 
   /* we reserve maxEntries + 1 to avoid rehashing from occurring
      when we get to maxEntries, as it means a load factor of 1 */
   for (auto& shard : d_shards) {
-    shard.setSize((maxEntries / d_shardCount) + 1);
+    shard.setSize((maxEntries / d_shardCount) + 1, d_engine);
   }
 }
 
@@ -53,6 +56,98 @@ DNSDistPacketCache::~DNSDistPacketCache()
   }
 }
 
+DNSDistPacketCache::Engine DNSDistPacketCache::getEngineFromName(const std::string& name)
+{
+  if (name == "map") {
+    return Engine::UnorderedMap;
+  }
+  if (name == "flat") {
+    return Engine::OpenAddressing;
+  }
+  throw std::runtime_error("Unknown packet cache engine '" + name + "'");
+}
+
+void DNSDistPacketCache::OpenAddressingTable::reserve(size_t maxEntries)
+{
+  /* keep the load factor under 0.75 so that probe sequences stay short */
+  size_t capacity = 2;
+  uint8_t bits = 1;
+  while (capacity < (maxEntries + (maxEntries / 3) + 1)) {
+    capacity *= 2;
+    bits++;
+  }
+
+  d_slots.clear();
+  d_slots.resize(capacity);
+  d_size = 0;
+  d_mask = capacity - 1;
+  d_shift = 64 - bits;
+}
+
+size_t DNSDistPacketCache::OpenAddressingTable::getIdealIndex(uint32_t key) const
+{
+  /* the lowest bits of the key have been used to select the shard, so use
+     a multiplicative hash to spread the entries using the highest bits */
+  return static_cast<size_t>((static_cast<uint64_t>(key) * 0x9E3779B97F4A7C15ULL) >> d_shift);
+}
+
+const DNSDistPacketCache::OpenAddressingTable::Slot* DNSDistPacketCache::OpenAddressingTable::find(uint32_t key) const
+{
+  if (d_slots.empty()) {
+    return nullptr;
+  }
+
+  for (size_t idx = getIdealIndex(key); d_slots[idx].value; idx = (idx + 1) & d_mask) {
+    if (d_slots[idx].key == key) {
+      return &d_slots[idx];
+    }
+  }
+
+  return nullptr;
+}
+
+std::pair<DNSDistPacketCache::OpenAddressingTable::Slot*, bool> DNSDistPacketCache::OpenAddressingTable::emplace(uint32_t key, const CacheValue& value)
+{
+  /* we need at least one empty slot for lookups to terminate */
+  if (d_slots.empty() || d_size >= d_mask) {
+    return {nullptr, false};
+  }
+
+  size_t idx = getIdealIndex(key);
+  for (; d_slots[idx].value; idx = (idx + 1) & d_mask) {
+    if (d_slots[idx].key == key) {
+      return {&d_slots[idx], false};
+    }
+  }
+
+  auto& slot = d_slots[idx];
+  slot.value = std::make_unique<CacheValue>(value);
+  slot.validity = value.validity;
+  slot.key = key;
+  ++d_size;
+  return {&slot, true};
+}
+
+void DNSDistPacketCache::OpenAddressingTable::erase(size_t idx)
+{
+  /* backward-shift deletion: until we reach an empty slot, move back into the hole
+     every following entry whose probe sequence goes through it, so that we never
+     need tombstones */
+  size_t hole = idx;
+  for (size_t next = (hole + 1) & d_mask; d_slots[next].value; next = (next + 1) & d_mask) {
+    size_t ideal = getIdealIndex(d_slots[next].key);
+    if (((next - ideal) & d_mask) >= ((next - hole) & d_mask)) {
+      d_slots[hole] = std::move(d_slots[next]);
+      hole = next;
+    }
+  }
+
+  d_slots[hole].value.reset();
+  d_slots[hole].validity = 0;
+  d_slots[hole].key = 0;
+  --d_size;
+}
+
 bool DNSDistPacketCache::getClientSubnet(const PacketBuffer& packet, size_t qnameWireLength, boost::optional<Netmask>& subnet)
 {
   uint16_t optRDPosition;
@@ -92,8 +187,52 @@ bool DNSDistPacketCache::cachedValueMatches(const CacheValue& cachedValue, uint1
   return true;
 }
 
+bool DNSDistPacketCache::shouldReplaceExisting(const CacheValue& value, const CacheValue& newValue)
+{
+  /* in case of collision, don't override the existing entry
+     except if it has expired */
+  bool wasExpired = value.validity <= newValue.added;
+
+  if (!wasExpired && !cachedValueMatches(value, newValue.queryFlags, newValue.qname, newValue.qtype, newValue.qclass, newValue.tcp, newValue.dnssecOK, newValue.subnet)) {
+    d_insertCollisions++;
+    return false;
+  }
+
+  /* if the existing entry had a longer TTD, keep it */
+  if (newValue.validity <= value.validity) {
+    return false;
+  }
+
+  return true;
+}
+
 void DNSDistPacketCache::insertLocked(CacheShard& shard, uint32_t key, CacheValue& newValue)
 {
+  if (d_engine == Engine::OpenAddressing) {
+    auto& table = shard.d_table;
+    /* check again now that we hold the lock to prevent a race */
+    if (table.size() >= (d_maxEntries / d_shardCount)) {
+      return;
+    }
+
+    auto result = table.emplace(key, newValue);
+    if (result.first == nullptr) {
+      return;
+    }
+
+    if (result.second) {
+      ++shard.d_entriesCount;
+      return;
+    }
+
+    auto& slot = *result.first;
+    if (shouldReplaceExisting(*slot.value, newValue)) {
+      *slot.value = newValue;
+      slot.validity = newValue.validity;
+    }
+    return;
+  }
+
   auto& map = shard.d_map;
   /* check again now that we hold the lock to prevent a race */
   if (map.size() >= (d_maxEntries / d_shardCount)) {
@@ -109,22 +248,27 @@ void DNSDistPacketCache::insertLocked(CacheShard& shard, uint32_t key, CacheValu
     return;
   }
 
-  /* in case of collision, don't override the existing entry
-     except if it has expired */
   CacheValue& value = it->second;
-  bool wasExpired = value.validity <= newValue.added;
-
-  if (!wasExpired && !cachedValueMatches(value, newValue.queryFlags, newValue.qname, newValue.qtype, newValue.qclass, newValue.tcp, newValue.dnssecOK, newValue.subnet)) {
-    d_insertCollisions++;
-    return;
+  if (shouldReplaceExisting(value, newValue)) {
+    value = newValue;
   }
+}
 
-  /* if the existing entry had a longer TTD, keep it */
-  if (newValue.validity <= value.validity) {
-    return;
+const DNSDistPacketCache::CacheValue* DNSDistPacketCache::findLocked(const CacheShard& shard, uint32_t key) const
+{
+  if (d_engine == Engine::OpenAddressing) {
+    const auto slot = shard.d_table.find(key);
+    if (slot == nullptr) {
+      return nullptr;
+    }
+    return slot->value.get();
   }
 
-  value = newValue;
+  auto it = shard.d_map.find(key);
+  if (it == shard.d_map.end()) {
+    return nullptr;
+  }
+  return &it->second;
 }
 
 void DNSDistPacketCache::insert(uint32_t key, const boost::optional<Netmask>& subnet, uint16_t queryFlags, bool dnssecOK, const DNSName& qname, uint16_t qtype, uint16_t qclass, const PacketBuffer& response, bool tcp, uint8_t rcode, boost::optional<uint32_t> tempFailureTTL)
@@ -202,10 +346,20 @@ void DNSDistPacketCache::insert(uint32_t key, const boost::optional<Netmask>& su
   }
 }
 
-bool DNSDistPacketCache::get(DNSQuestion& dq, uint16_t queryId, uint32_t* keyOut, boost::optional<Netmask>& subnet, bool dnssecOK, uint32_t allowExpired, bool skipAging)
+bool DNSDistPacketCache::shouldPrefetch(const CacheValue& value, time_t now) const
+{
+  if (d_prefetchPercentage == 0 || value.validity <= now) {
+    return false;
+  }
+
+  const uint64_t remaining = value.validity - now;
+  const uint64_t ttl = value.validity - value.added;
+  return (remaining * 100) <= (ttl * d_prefetchPercentage);
+}
+
+bool DNSDistPacketCache::get(DNSQuestion& dq, uint16_t queryId, uint32_t* keyOut, boost::optional<Netmask>& subnet, bool dnssecOK, uint32_t allowExpired, bool skipAging, PacketBuffer* refreshQuery)
 {
-  const auto& dnsQName = dq.qname->getStorage();
-  uint32_t key = getKey(dnsQName, dq.qname->wirelength(), dq.getData(), dq.tcp);
+  uint32_t key = getKey(dq.getData(), dq.qname->wirelength(), dq.tcp);
 
   if (keyOut) {
     *keyOut = key;
@@ -221,7 +375,6 @@ bool DNSDistPacketCache::get(DNSQuestion& dq, uint16_t queryId, uint32_t* keyOut
   bool stale = false;
   auto& response = dq.getMutableData();
   auto& shard = d_shards.at(shardIndex);
-  auto& map = shard.d_map;
   {
     TryReadLock r(&shard.d_lock);
     if (!r.gotIt()) {
@@ -229,13 +382,13 @@ bool DNSDistPacketCache::get(DNSQuestion& dq, uint16_t queryId, uint32_t* keyOut
       return false;
     }
 
-    std::unordered_map<uint32_t,CacheValue>::const_iterator it = map.find(key);
-    if (it == map.end()) {
+    const CacheValue* found = findLocked(shard, key);
+    if (found == nullptr) {
       d_misses++;
       return false;
     }
 
-    const CacheValue& value = it->second;
+    const CacheValue& value = *found;
     if (value.validity <= now) {
       if ((now - value.validity) >= static_cast<time_t>(allowExpired)) {
         d_misses++;
@@ -256,6 +409,11 @@ bool DNSDistPacketCache::get(DNSQuestion& dq, uint16_t queryId, uint32_t* keyOut
       return false;
     }
 
+    if (refreshQuery != nullptr && !stale && shouldPrefetch(value, now) && addInFlightRefresh(shard, key, value, *dq.queryTime)) {
+      /* the buffer still holds the query at this point */
+      *refreshQuery = response;
+    }
+
     response.resize(value.len);
     memcpy(&response.at(0), &queryId, sizeof(queryId));
     memcpy(&response.at(sizeof(queryId)), &value.value.at(sizeof(queryId)), sizeof(dnsheader) - sizeof(queryId));
@@ -266,6 +424,7 @@ bool DNSDistPacketCache::get(DNSQuestion& dq, uint16_t queryId, uint32_t* keyOut
       return true;
     }
 
+    const auto& dnsQName = dq.qname->getStorage();
     const size_t dnsQNameLen = dnsQName.length();
     if (value.len < (sizeof(dnsheader) + dnsQNameLen)) {
       return false;
@@ -298,6 +457,147 @@ bool DNSDistPacketCache::get(DNSQuestion& dq, uint16_t queryId, uint32_t* keyOut
   return true;
 }
 
+bool DNSDistPacketCache::inFlightQueryMatches(const InFlightQuery& query, uint16_t queryFlags, const DNSName& qname, uint16_t qtype, uint16_t qclass, bool dnssecOK, const boost::optional<Netmask>& subnet) const
+{
+  if (query.queryFlags != queryFlags || query.dnssecOK != dnssecOK || query.qtype != qtype || query.qclass != qclass || query.qname != qname) {
+    return false;
+  }
+
+  if (d_parseECS && query.subnet != subnet) {
+    return false;
+  }
+
+  return true;
+}
+
+bool DNSDistPacketCache::hasWaitedTooLong(const struct timespec& since, const struct timespec& now) const
+{
+  return DiffTime(since, now) * 1000 >= d_maxCollapseWaitMS;
+}
+
+DNSDistPacketCache::InFlightResult DNSDistPacketCache::addInFlightQuery(uint32_t key, uint16_t queryFlags, const DNSName& qname, uint16_t qtype, uint16_t qclass, bool dnssecOK, const boost::optional<Netmask>& subnet, InFlightWaiter&& waiter)
+{
+  auto& shard = d_shards.at(getShardIndex(key));
+  std::lock_guard<std::mutex> lock(shard.d_inFlightLock);
+
+  auto it = shard.d_inFlight.find(key);
+  if (it == shard.d_inFlight.end()) {
+    auto& query = shard.d_inFlight[key];
+    query.qname = qname;
+    query.subnet = subnet;
+    query.sent = waiter.queryTime;
+    query.qtype = qtype;
+    query.qclass = qclass;
+    query.queryFlags = queryFlags;
+    query.dnssecOK = dnssecOK;
+    return InFlightResult::Leader;
+  }
+
+  auto& query = it->second;
+  if (!inFlightQueryMatches(query, queryFlags, qname, qtype, qclass, dnssecOK, subnet)) {
+    /* collision, this one will be cached but not collapsed */
+    return InFlightResult::NotCollapsed;
+  }
+
+  if (hasWaitedTooLong(query.sent, waiter.queryTime)) {
+    /* the response to the in-flight query is late, and might never come,
+       so this one takes over and the current waiters will get its response instead */
+    query.sent = waiter.queryTime;
+    return InFlightResult::Leader;
+  }
+
+  if (query.waiters.size() >= d_maxCollapsedQueries) {
+    return InFlightResult::NotCollapsed;
+  }
+
+  query.waiters.push_back(std::move(waiter));
+  ++d_collapsedQueries;
+  return InFlightResult::Attached;
+}
+
+bool DNSDistPacketCache::addInFlightRefresh(CacheShard& shard, uint32_t key, const CacheValue& value, const struct timespec& now)
+{
+  std::lock_guard<std::mutex> lock(shard.d_inFlightLock);
+
+  auto it = shard.d_inFlight.find(key);
+  if (it == shard.d_inFlight.end()) {
+    auto& query = shard.d_inFlight[key];
+    query.qname = value.qname;
+    query.subnet = value.subnet;
+    query.sent = now;
+    query.qtype = value.qtype;
+    query.qclass = value.qclass;
+    query.queryFlags = value.queryFlags;
+    query.dnssecOK = value.dnssecOK;
+    ++d_prefetches;
+    return true;
+  }
+
+  auto& query = it->second;
+  if (!inFlightQueryMatches(query, value.queryFlags, value.qname, value.qtype, value.qclass, value.dnssecOK, value.subnet) || !hasWaitedTooLong(query.sent, now)) {
+    /* either a refresh is already in flight, or a collision we can't track */
+    return false;
+  }
+
+  /* the previous refresh did not get a response in time, try again */
+  query.sent = now;
+  ++d_prefetches;
+  return true;
+}
+
+std::vector<InFlightWaiter> DNSDistPacketCache::takeInFlightWaiters(uint32_t key, uint16_t queryFlags, const DNSName& qname, uint16_t qtype, uint16_t qclass, bool dnssecOK, const boost::optional<Netmask>& subnet)
+{
+  std::vector<InFlightWaiter> result;
+  auto& shard = d_shards.at(getShardIndex(key));
+  std::lock_guard<std::mutex> lock(shard.d_inFlightLock);
+
+  auto it = shard.d_inFlight.find(key);
+  if (it == shard.d_inFlight.end() || !inFlightQueryMatches(it->second, queryFlags, qname, qtype, qclass, dnssecOK, subnet)) {
+    return result;
+  }
+
+  result = std::move(it->second.waiters);
+  shard.d_inFlight.erase(it);
+  return result;
+}
+
+size_t DNSDistPacketCache::purgeInFlight(const struct timespec& now)
+{
+  size_t removed = 0;
+
+  for (auto& shard : d_shards) {
+    std::lock_guard<std::mutex> lock(shard.d_inFlightLock);
+    for (auto it = shard.d_inFlight.begin(); it != shard.d_inFlight.end(); ) {
+      auto& waiters = it->second.waiters;
+      const size_t before = waiters.size();
+      waiters.erase(std::remove_if(waiters.begin(), waiters.end(), [this, &now](const InFlightWaiter& waiter) {
+        return hasWaitedTooLong(waiter.queryTime, now);
+      }), waiters.end());
+      removed += before - waiters.size();
+
+      if (waiters.empty() && hasWaitedTooLong(it->second.sent, now)) {
+        it = shard.d_inFlight.erase(it);
+      }
+      else {
+        ++it;
+      }
+    }
+  }
+
+  d_collapsedTimeouts += removed;
+  return removed;
+}
+
+size_t DNSDistPacketCache::getInFlightCount()
+{
+  size_t count = 0;
+  for (auto& shard : d_shards) {
+    std::lock_guard<std::mutex> lock(shard.d_inFlightLock);
+    count += shard.d_inFlight.size();
+  }
+  return count;
+}
+
 /* Remove expired entries, until the cache has at most
    upTo entries in it.
    If the cache has more than one shard, we will try hard
@@ -311,6 +611,21 @@ size_t DNSDistPacketCache::purgeExpired(size_t upTo, const time_t now)
 
   for (auto& shard : d_shards) {
     WriteLock w(&shard.d_lock);
+    if (d_engine == Engine::OpenAddressing) {
+      auto& table = shard.d_table;
+      if (table.size() <= maxPerShard) {
+        continue;
+      }
+
+      /* the expiration time is stored in the slot, so we don't need to look at the entry itself */
+      auto erased = table.eraseIf(table.size() - maxPerShard, [now](const OpenAddressingTable::Slot& slot) {
+        return slot.validity <= now;
+      });
+      shard.d_entriesCount -= erased;
+      removed += erased;
+      continue;
+    }
+
     auto& map = shard.d_map;
     if (map.size() <= maxPerShard) {
       continue;
@@ -348,6 +663,20 @@ size_t DNSDistPacketCache::expunge(size_t upTo)
 
   for (auto& shard : d_shards) {
     WriteLock w(&shard.d_lock);
+    if (d_engine == Engine::OpenAddressing) {
+      auto& table = shard.d_table;
+      if (table.size() <= maxPerShard) {
+        continue;
+      }
+
+      auto erased = table.eraseIf(table.size() - maxPerShard, [](const OpenAddressingTable::Slot& slot) {
+        return true;
+      });
+      shard.d_entriesCount -= erased;
+      removed += erased;
+      continue;
+    }
+
     auto& map = shard.d_map;
 
     if (map.size() <= maxPerShard) {
@@ -381,6 +710,16 @@ size_t DNSDistPacketCache::expungeByName(const DNSName& name, uint16_t qtype, bo
 
   for (auto& shard : d_shards) {
     WriteLock w(&shard.d_lock);
+    if (d_engine == Engine::OpenAddressing) {
+      auto erased = shard.d_table.eraseIf(std::numeric_limits<size_t>::max(), [&name, qtype, suffixMatch](const OpenAddressingTable::Slot& slot) {
+        const CacheValue& value = *slot.value;
+        return (value.qname == name || (suffixMatch && value.qname.isPartOf(name))) && (qtype == QType::ANY || qtype == value.qtype);
+      });
+      shard.d_entriesCount -= erased;
+      removed += erased;
+      continue;
+    }
+
     auto& map = shard.d_map;
 
     for(auto it = map.begin(); it != map.end(); ) {
@@ -420,19 +759,20 @@ uint32_t DNSDistPacketCache::getMinTTL(const char* packet, uint16_t length, bool
   return getDNSPacketMinTTL(packet, length, seenNoDataSOA);
 }
 
-uint32_t DNSDistPacketCache::getKey(const DNSName::string_t& qname, size_t qnameWireLength, const PacketBuffer& packet, bool tcp)
+uint32_t DNSDistPacketCache::getKey(const PacketBuffer& packet, size_t qnameWireLength, bool tcp)
 {
   uint32_t result = 0;
   /* skip the query ID */
   if (packet.size() < sizeof(dnsheader)) {
     throw std::range_error("Computing packet cache key for an invalid packet size (" + std::to_string(packet.size()) +")");
   }
-
-  result = burtle(&packet.at(2), sizeof(dnsheader) - 2, result);
-  result = burtleCI((const unsigned char*) qname.c_str(), qname.length(), result);
   if (packet.size() < sizeof(dnsheader) + qnameWireLength) {
     throw std::range_error("Computing packet cache key for an invalid packet (" + std::to_string(packet.size()) + " < " + std::to_string(sizeof(dnsheader) + qnameWireLength) + ")");
   }
+
+  result = burtle(&packet.at(2), sizeof(dnsheader) - 2, result);
+  /* the qname of a query is never compressed, so its wire form is the same than the storage of the DNSName */
+  result = burtleCI(&packet.at(sizeof(dnsheader)), qnameWireLength, result);
   if (packet.size() > ((sizeof(dnsheader) + qnameWireLength))) {
     if (!d_cookieHashing) {
       /* skip EDNS Cookie options if any */
@@ -472,28 +812,289 @@ uint64_t DNSDistPacketCache::dump(int fd)
 
   uint64_t count = 0;
   time_t now = time(nullptr);
+  auto dumpEntry = [&fp, &count, now](uint32_t key, const CacheValue& value) {
+    count++;
+
+    try {
+      uint8_t rcode = 0;
+      if (value.len >= sizeof(dnsheader)) {
+        dnsheader dh;
+        memcpy(&dh, value.value.data(), sizeof(dnsheader));
+        rcode = dh.rcode;
+      }
+
+      fprintf(fp.get(), "%s %" PRId64 " %s ; rcode %" PRIu8 ", key %" PRIu32 ", length %" PRIu16 ", tcp %d, added %" PRId64 "\n", value.qname.toString().c_str(), static_cast<int64_t>(value.validity - now), QType(value.qtype).getName().c_str(), rcode, key, value.len, value.tcp, static_cast<int64_t>(value.added));
+    }
+    catch(...) {
+      fprintf(fp.get(), "; error printing '%s'\n", value.qname.empty() ? "EMPTY" : value.qname.toString().c_str());
+    }
+  };
+
   for (auto& shard : d_shards) {
     ReadLock w(&shard.d_lock);
-    auto& map = shard.d_map;
+    if (d_engine == Engine::OpenAddressing) {
+      shard.d_table.forEach([&dumpEntry](const OpenAddressingTable::Slot& slot) {
+        dumpEntry(slot.key, *slot.value);
+      });
+      continue;
+    }
+
+    for (const auto& entry : shard.d_map) {
+      dumpEntry(entry.first, entry.second);
+    }
+  }
+
+  return count;
+}
+
+/* A snapshot starts with a magic value, a version and the cache settings changing the keys,
+   followed by the entries. Integers are stored in host byte order, since a snapshot is meant
+   to be read back by the same host */
+static const std::string s_snapshotMagic{"DNSDISTPC"};
+static const uint8_t s_snapshotVersion{2};
 
-    for (const auto& entry : map) {
-      const CacheValue& value = entry.second;
+template <typename T>
+static void appendToSnapshot(std::string& out, const T& value)
+{
+  out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+static bool readFromSnapshot(const char*& pos, const char* end, T& value)
+{
+  if (static_cast<size_t>(end - pos) < sizeof(value)) {
+    return false;
+  }
+  memcpy(&value, pos, sizeof(value));
+  pos += sizeof(value);
+  return true;
+}
+
+uint64_t DNSDistPacketCache::saveSnapshot(const std::string& path)
+{
+  std::unique_lock<std::mutex> snapshotLock(d_snapshotLock, std::try_to_lock);
+  if (!snapshotLock.owns_lock()) {
+    throw std::runtime_error("A snapshot of this cache is already being written");
+  }
+
+  /* write to a temporary file first, so that an existing snapshot is only replaced by a complete one */
+  const std::string tmpPath = path + ".tmp";
+  int fd = open(tmpPath.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0660);
+  if (fd < 0) {
+    throw std::runtime_error("Error opening the snapshot file '" + tmpPath + "' for writing: " + stringerror());
+  }
+
+  uint64_t count = 0;
+  try {
+    std::string buffer;
+    buffer.append(s_snapshotMagic);
+    appendToSnapshot(buffer, s_snapshotVersion);
+    appendToSnapshot(buffer, static_cast<uint8_t>(d_cookieHashing));
+    appendToSnapshot(buffer, static_cast<uint8_t>(d_parseECS));
+    writen2(fd, buffer);
+
+    const time_t now = time(nullptr);
+    auto saveEntry = [&buffer, &count, now](uint32_t key, const CacheValue& value) {
+      if (value.validity <= now) {
+        return;
+      }
+
+      const auto& qname = value.qname.getStorage();
+      appendToSnapshot(buffer, key);
+      appendToSnapshot(buffer, static_cast<int64_t>(value.added));
+      appendToSnapshot(buffer, static_cast<int64_t>(value.validity));
+      appendToSnapshot(buffer, value.qtype);
+      appendToSnapshot(buffer, value.qclass);
+      appendToSnapshot(buffer, value.queryFlags);
+      appendToSnapshot(buffer, value.len);
+      appendToSnapshot(buffer, static_cast<uint16_t>(qname.size()));
+      appendToSnapshot(buffer, static_cast<uint8_t>(value.tcp));
+      appendToSnapshot(buffer, static_cast<uint8_t>(value.dnssecOK));
+      if (value.subnet) {
+        const auto network = value.subnet->getNetwork();
+        appendToSnapshot(buffer, static_cast<uint8_t>(network.isIPv4() ? 4 : 6));
+        appendToSnapshot(buffer, value.subnet->getBits());
+        if (network.isIPv4()) {
+          appendToSnapshot(buffer, network.sin4.sin_addr.s_addr);
+        }
+        else {
+          appendToSnapshot(buffer, network.sin6.sin6_addr.s6_addr);
+        }
+      }
+      else {
+        appendToSnapshot(buffer, static_cast<uint8_t>(0));
+      }
+      buffer.append(qname);
+      buffer.append(value.value, 0, value.len);
       count++;
+    };
 
-      try {
-        uint8_t rcode = 0;
-        if (value.len >= sizeof(dnsheader)) {
-          dnsheader dh;
-          memcpy(&dh, value.value.data(), sizeof(dnsheader));
-          rcode = dh.rcode;
+    for (auto& shard : d_shards) {
+      buffer.clear();
+      {
+        /* only hold the lock while copying the entries, not while writing them */
+        ReadLock r(&shard.d_lock);
+        if (d_engine == Engine::OpenAddressing) {
+          shard.d_table.forEach([&saveEntry](const OpenAddressingTable::Slot& slot) {
+            saveEntry(slot.key, *slot.value);
+          });
         }
+        else {
+          for (const auto& entry : shard.d_map) {
+            saveEntry(entry.first, entry.second);
+          }
+        }
+      }
+      writen2(fd, buffer);
+    }
+
+    if (fsync(fd) != 0) {
+      throw std::runtime_error("Error syncing the snapshot file '" + tmpPath + "': " + stringerror());
+    }
+  }
+  catch (...) {
+    close(fd);
+    unlink(tmpPath.c_str());
+    throw;
+  }
+
+  close(fd);
+  if (rename(tmpPath.c_str(), path.c_str()) != 0) {
+    int err = errno;
+    unlink(tmpPath.c_str());
+    throw std::runtime_error("Error renaming the snapshot file '" + tmpPath + "' to '" + path + "': " + stringerror(err));
+  }
+
+  return count;
+}
+
+uint64_t DNSDistPacketCache::loadSnapshot(const std::string& path)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("Error opening the snapshot file '" + path + "' for reading: " + stringerror());
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    int err = errno;
+    close(fd);
+    throw std::runtime_error("Error getting the size of the snapshot file '" + path + "': " + stringerror(err));
+  }
+
+  const size_t size = st.st_size;
+  if (size < (s_snapshotMagic.size() + 3 * sizeof(uint8_t))) {
+    close(fd);
+    throw std::runtime_error("The snapshot file '" + path + "' is too small");
+  }
+
+  void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  int err = errno;
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    throw std::runtime_error("Error mapping the snapshot file '" + path + "': " + stringerror(err));
+  }
+  auto unmap = std::unique_ptr<void, std::function<void(void*)>>(mapped, [size](void* ptr) { munmap(ptr, size); });
 
-        fprintf(fp.get(), "%s %" PRId64 " %s ; rcode %" PRIu8 ", key %" PRIu32 ", length %" PRIu16 ", tcp %d, added %" PRId64 "\n", value.qname.toString().c_str(), static_cast<int64_t>(value.validity - now), QType(value.qtype).getName().c_str(), rcode, entry.first, value.len, value.tcp, static_cast<int64_t>(value.added));
+  const char* pos = static_cast<const char*>(mapped);
+  const char* end = pos + size;
+  if (memcmp(pos, s_snapshotMagic.data(), s_snapshotMagic.size()) != 0) {
+    throw std::runtime_error("The file '" + path + "' is not a packet cache snapshot");
+  }
+  pos += s_snapshotMagic.size();
+
+  uint8_t version;
+  uint8_t cookieHashing;
+  uint8_t parseECS;
+  readFromSnapshot(pos, end, version);
+  readFromSnapshot(pos, end, cookieHashing);
+  readFromSnapshot(pos, end, parseECS);
+  if (version != s_snapshotVersion) {
+    throw std::runtime_error("Unsupported version " + std::to_string(version) + " of the packet cache snapshot '" + path + "'");
+  }
+  if (static_cast<bool>(cookieHashing) != d_cookieHashing) {
+    /* the keys would not match the ones of the queries */
+    throw std::runtime_error("The packet cache snapshot '" + path + "' was written by a cache with a different cookie hashing setting");
+  }
+  if (static_cast<bool>(parseECS) != d_parseECS) {
+    /* the keys of the queries with an ECS option, and the subnets of the entries, would not match */
+    throw std::runtime_error("The packet cache snapshot '" + path + "' was written by a cache with a different ECS parsing setting");
+  }
+
+  uint64_t count = 0;
+  const time_t now = time(nullptr);
+  while (pos < end) {
+    uint32_t key;
+    int64_t added;
+    int64_t validity;
+    uint16_t qnameLen;
+    uint8_t tcp;
+    uint8_t dnssecOK;
+    uint8_t subnetFamily;
+    CacheValue value;
+    if (!readFromSnapshot(pos, end, key) ||
+        !readFromSnapshot(pos, end, added) ||
+        !readFromSnapshot(pos, end, validity) ||
+        !readFromSnapshot(pos, end, value.qtype) ||
+        !readFromSnapshot(pos, end, value.qclass) ||
+        !readFromSnapshot(pos, end, value.queryFlags) ||
+        !readFromSnapshot(pos, end, value.len) ||
+        !readFromSnapshot(pos, end, qnameLen) ||
+        !readFromSnapshot(pos, end, tcp) ||
+        !readFromSnapshot(pos, end, dnssecOK) ||
+        !readFromSnapshot(pos, end, subnetFamily)) {
+      throw std::runtime_error("The packet cache snapshot '" + path + "' is truncated");
+    }
+
+    if (subnetFamily != 0) {
+      uint8_t bits;
+      ComboAddress network;
+      bool valid = readFromSnapshot(pos, end, bits);
+      if (subnetFamily == 4) {
+        network.sin4.sin_family = AF_INET;
+        valid = valid && readFromSnapshot(pos, end, network.sin4.sin_addr.s_addr);
+      }
+      else {
+        network.sin6.sin6_family = AF_INET6;
+        valid = valid && readFromSnapshot(pos, end, network.sin6.sin6_addr.s6_addr);
       }
-      catch(...) {
-        fprintf(fp.get(), "; error printing '%s'\n", value.qname.empty() ? "EMPTY" : value.qname.toString().c_str());
+      if (!valid) {
+        throw std::runtime_error("The packet cache snapshot '" + path + "' is truncated");
       }
+      value.subnet = Netmask(network, bits);
+    }
+
+    if (static_cast<size_t>(end - pos) < (static_cast<size_t>(qnameLen) + value.len)) {
+      throw std::runtime_error("The packet cache snapshot '" + path + "' is truncated");
+    }
+    if (value.len < sizeof(dnsheader) || qnameLen == 0 || (value.len > sizeof(dnsheader) && value.len < (sizeof(dnsheader) + qnameLen))) {
+      /* a hit copies the response and rewrites its ID and qname, so it has to hold a header and the qname, unless it is
+         a header-only response, like the ones accepted by insert() */
+      pos += qnameLen + value.len;
+      continue;
     }
+    value.qname = DNSName(pos, qnameLen, 0, false);
+    pos += qnameLen;
+    value.value.assign(pos, value.len);
+    pos += value.len;
+    value.added = added;
+    value.validity = validity;
+    value.tcp = tcp;
+    value.dnssecOK = dnssecOK;
+
+    /* the remaining TTL is adjusted when the entry is served, based on when it was added */
+    if (value.validity <= now) {
+      continue;
+    }
+
+    auto& shard = d_shards.at(getShardIndex(key));
+    if (shard.d_entriesCount >= (d_maxEntries / d_shardCount)) {
+      continue;
+    }
+
+    WriteLock w(&shard.d_lock);
+    insertLocked(shard, key, value);
+    count++;
   }
 
   return count;
@@ -21,24 +21,64 @@
  */
 #pragma once
 
+#include <algorithm>
 #include <atomic>
+#include <mutex>
 #include <unordered_map>
 
+#include "dnsname.hh"
 #include "iputils.hh"
 #include "lock.hh"
 #include "noinitvector.hh"
 #include "stat_t.hh"
 
+struct ClientState;
 struct DNSQuestion;
 
+/* a UDP query waiting for the response to an identical one already sent to a backend */
+struct InFlightWaiter
+{
+  ComboAddress hopLocal;
+  ComboAddress hopRemote;
+  /* might differ from the hop ones when the proxy protocol is used */
+  ComboAddress origDest;
+  ComboAddress origRemote;
+  DNSName qname;
+  struct timespec queryTime{0, 0};
+  const ClientState* cs{nullptr};
+  int origFD{-1};
+  uint16_t origID{0};
+};
+
 class DNSDistPacketCache : boost::noncopyable
 {
 public:
-  DNSDistPacketCache(size_t maxEntries, uint32_t maxTTL=86400, uint32_t minTTL=0, uint32_t tempFailureTTL=60, uint32_t maxNegativeTTL=3600, uint32_t staleTTL=60, bool dontAge=false, uint32_t shards=1, bool deferrableInsertLock=true, bool parseECS=false);
+  /* how entries are stored inside a shard:
+     - UnorderedMap is a node-based std::unordered_map ;
+     - OpenAddressing is a flat, linear-probing table where the key, the expiration time
+       and the pointer to the entry are stored next to each other, so that a lookup
+       only touches one cache line until it finds the right entry.
+     Both are protected by the lock of the shard, readers included.
+  */
+  enum class Engine : uint8_t { UnorderedMap, OpenAddressing };
+
+  /* what happened to a query that missed the cache and is about to be sent to a backend:
+     - Leader: no identical query is in flight, this one has to be sent and the identical
+       queries received until its response arrives will be attached to it ;
+     - Attached: an identical query is in flight, this one will be answered with its response
+       and must not be sent ;
+     - NotCollapsed: this one has to be sent, but identical queries will not wait for it.
+  */
+  enum class InFlightResult : uint8_t { Leader, Attached, NotCollapsed };
+
+  DNSDistPacketCache(size_t maxEntries, uint32_t maxTTL=86400, uint32_t minTTL=0, uint32_t tempFailureTTL=60, uint32_t maxNegativeTTL=3600, uint32_t staleTTL=60, bool dontAge=false, uint32_t shards=1, bool deferrableInsertLock=true, bool parseECS=false, Engine engine=Engine::UnorderedMap);
   ~DNSDistPacketCache();
 
   void insert(uint32_t key, const boost::optional<Netmask>& subnet, uint16_t queryFlags, bool dnssecOK, const DNSName& qname, uint16_t qtype, uint16_t qclass, const PacketBuffer& response, bool tcp, uint8_t rcode, boost::optional<uint32_t> tempFailureTTL);
-  bool get(DNSQuestion& dq, uint16_t queryId, uint32_t* keyOut, boost::optional<Netmask>& subnet, bool dnssecOK, uint32_t allowExpired = 0, bool skipAging = false);
+  /* if refreshQuery is set and prefetching is enabled, a hit on an entry that is about to expire copies
+     the query there before replacing it with the response, and the caller is expected to send it to a backend
+     so that the entry gets refreshed. Only one refresh is requested at a time for a given entry */
+  bool get(DNSQuestion& dq, uint16_t queryId, uint32_t* keyOut, boost::optional<Netmask>& subnet, bool dnssecOK, uint32_t allowExpired = 0, bool skipAging = false, PacketBuffer* refreshQuery = nullptr);
   size_t purgeExpired(size_t upTo, const time_t now);
   size_t expunge(size_t upTo=0);
   size_t expungeByName(const DNSName& name, uint16_t qtype=QType::ANY, bool suffixMatch=false);
@@ -53,9 +93,20 @@ public:
   uint64_t getInsertCollisions() const { return d_insertCollisions; }
   uint64_t getMaxEntries() const { return d_maxEntries; }
   uint64_t getTTLTooShorts() const { return d_ttlTooShorts; }
+  uint64_t getCollapsedQueries() const { return d_collapsedQueries; }
+  uint64_t getCollapsedTimeouts() const { return d_collapsedTimeouts; }
+  uint64_t getPrefetches() const { return d_prefetches; }
   uint64_t getEntriesCount();
   uint64_t dump(int fd);
+  /* write every valid entry to path, in a binary format that can be read back by loadSnapshot().
+     The shards are locked one at a time. Returns the number of entries written, throws
+     std::runtime_error on failure, including when another snapshot is being written */
+  uint64_t saveSnapshot(const std::string& path);
+  /* insert the entries, that have not expired in the meantime, of a snapshot written by
+     saveSnapshot(). Returns the number of entries inserted, throws std::runtime_error on failure */
+  uint64_t loadSnapshot(const std::string& path);
 
+  Engine getEngine() const { return d_engine; }
   bool isECSParsingEnabled() const { return d_parseECS; }
   bool isCookieHashingEnabled() const { return d_cookieHashing; }
 
@@ -78,10 +129,66 @@ public:
     d_parseECS = enabled;
   }
 
-  uint32_t getKey(const DNSName::string_t& qname, size_t qnameWireLength, const PacketBuffer& packet, bool tcp);
+  /* the default path of the snapshots, see saveSnapshot() and loadSnapshot().
+     This should only be called at configuration time. */
+  void setSnapshotFile(const std::string& path)
+  {
+    d_snapshotFile = path;
+  }
+
+  const std::string& getSnapshotFile() const
+  {
+    return d_snapshotFile;
+  }
+
+  /* attach identical cache misses to the first one sent to a backend, up to maxWaiters
+     queries per in-flight query, for at most maxWaitMS milliseconds. 0 disables it.
+     This should only be called at configuration time. */
+  void setQueryCollapsing(size_t maxWaiters, uint32_t maxWaitMS)
+  {
+    d_maxCollapsedQueries = maxWaiters;
+    d_maxCollapseWaitMS = maxWaitMS;
+  }
+
+  bool isQueryCollapsingEnabled() const
+  {
+    return d_maxCollapsedQueries > 0;
+  }
+
+  /* refresh the entries hit when less than percentage % of their TTL remains, 0 disables it.
+     This should only be called at configuration time. */
+  void setPrefetchPercentage(uint8_t percentage)
+  {
+    d_prefetchPercentage = std::min(percentage, static_cast<uint8_t>(100));
+  }
+
+  bool isPrefetchEnabled() const
+  {
+    return d_prefetchPercentage > 0;
+  }
+
+  /* whether queries sent to a backend are tracked until their response arrives,
+     and thus need to be purged if it does not */
+  bool tracksInFlightQueries() const
+  {
+    return isQueryCollapsingEnabled() || isPrefetchEnabled();
+  }
+
+  InFlightResult addInFlightQuery(uint32_t key, uint16_t queryFlags, const DNSName& qname, uint16_t qtype, uint16_t qclass, bool dnssecOK, const boost::optional<Netmask>& subnet, InFlightWaiter&& waiter);
+  /* remove the in-flight query and return the queries waiting for its response */
+  std::vector<InFlightWaiter> takeInFlightWaiters(uint32_t key, uint16_t queryFlags, const DNSName& qname, uint16_t qtype, uint16_t qclass, bool dnssecOK, const boost::optional<Netmask>& subnet);
+  /* drop the queries that have been waiting for more than the maximum wait time,
+     and forget about in-flight queries that did not get a response in time. now should be
+     a 'real' time, like the queryTime of the waiters */
+  size_t purgeInFlight(const struct timespec& now);
+  size_t getInFlightCount();
+
+  /* the qname is hashed straight from the packet, case-insensitively */
+  uint32_t getKey(const PacketBuffer& packet, size_t qnameWireLength, bool tcp);
 
   static uint32_t getMinTTL(const char* packet, uint16_t length, bool* seenNoDataSOA);
   static bool getClientSubnet(const PacketBuffer& packet, size_t qnameWireLength, boost::optional<Netmask>& subnet);
+  static Engine getEngineFromName(const std::string& name);
 
 private:
 
@@ -101,6 +208,76 @@ private:
     bool dnssecOK{false};
   };
 
+  class OpenAddressingTable
+  {
+  public:
+    /* two slots per cache line, an empty slot has no value */
+    struct alignas(32) Slot
+    {
+      std::unique_ptr<CacheValue> value{nullptr};
+      time_t validity{0};
+      uint32_t key{0};
+    };
+
+    void reserve(size_t maxEntries);
+    const Slot* find(uint32_t key) const;
+    /* returns the slot holding that key and whether it has just been inserted,
+       or a nullptr if the table is full */
+    std::pair<Slot*, bool> emplace(uint32_t key, const CacheValue& value);
+
+    size_t size() const
+    {
+      return d_size;
+    }
+
+    /* remove at most upTo entries for which pred(slot) returns true */
+    template<typename T> size_t eraseIf(size_t upTo, const T& pred)
+    {
+      size_t removed = 0;
+      for (size_t idx = 0; removed < upTo && idx < d_slots.size(); ) {
+        if (d_slots[idx].value && pred(d_slots[idx])) {
+          /* the next entry might have been moved into this slot, so look at it again */
+          erase(idx);
+          ++removed;
+        }
+        else {
+          ++idx;
+        }
+      }
+      return removed;
+    }
+
+    template<typename T> void forEach(const T& visitor) const
+    {
+      for (const auto& slot : d_slots) {
+        if (slot.value) {
+          visitor(slot);
+        }
+      }
+    }
+
+  private:
+    size_t getIdealIndex(uint32_t key) const;
+    void erase(size_t idx);
+
+    std::vector<Slot> d_slots;
+    size_t d_size{0};
+    size_t d_mask{0};
+    uint8_t d_shift{64};
+  };
+
+  struct InFlightQuery
+  {
+    std::vector<InFlightWaiter> waiters;
+    DNSName qname;
+    boost::optional<Netmask> subnet;
+    struct timespec sent{0, 0};
+    uint16_t qtype{0};
+    uint16_t qclass{0};
+    uint16_t queryFlags{0};
+    bool dnssecOK{false};
+  };
+
   class CacheShard
   {
   public:
@@ -111,21 +288,40 @@ private:
     {
     }
 
-    void setSize(size_t maxSize)
+    void setSize(size_t maxSize, Engine engine)
     {
-      d_map.reserve(maxSize);
+      if (engine == Engine::OpenAddressing) {
+        d_table.reserve(maxSize);
+      }
+      else {
+        d_map.reserve(maxSize);
+      }
     }
 
     std::unordered_map<uint32_t,CacheValue> d_map;
+    OpenAddressingTable d_table;
     ReadWriteLock d_lock;
     std::atomic<uint64_t> d_entriesCount{0};
+    /* queries sent to a backend after a cache miss, when query collapsing is enabled,
+       or to refresh an entry, when prefetching is enabled.
+       They have their own lock since they are rarely accessed by cache hits */
+    std::unordered_map<uint32_t, InFlightQuery> d_inFlight;
+    std::mutex d_inFlightLock;
   };
 
   bool cachedValueMatches(const CacheValue& cachedValue, uint16_t queryFlags, const DNSName& qname, uint16_t qtype, uint16_t qclass, bool tcp, bool dnssecOK, const boost::optional<Netmask>& subnet) const;
+  bool inFlightQueryMatches(const InFlightQuery& query, uint16_t queryFlags, const DNSName& qname, uint16_t qtype, uint16_t qclass, bool dnssecOK, const boost::optional<Netmask>& subnet) const;
+  bool hasWaitedTooLong(const struct timespec& since, const struct timespec& now) const;
+  bool shouldPrefetch(const CacheValue& value, time_t now) const;
+  bool addInFlightRefresh(CacheShard& shard, uint32_t key, const CacheValue& value, const struct timespec& now);
   uint32_t getShardIndex(uint32_t key) const;
+  bool shouldReplaceExisting(const CacheValue& existing, const CacheValue& newValue);
   void insertLocked(CacheShard& shard, uint32_t key, CacheValue& newValue);
+  const CacheValue* findLocked(const CacheShard& shard, uint32_t key) const;
 
   std::vector<CacheShard> d_shards;
+  std::mutex d_snapshotLock;
+  std::string d_snapshotFile;
 
   pdns::stat_t d_deferredLookups{0};
   pdns::stat_t d_deferredInserts{0};
@@ -134,14 +330,21 @@ private:
   pdns::stat_t d_insertCollisions{0};
   pdns::stat_t d_lookupCollisions{0};
   pdns::stat_t d_ttlTooShorts{0};
+  pdns::stat_t d_collapsedQueries{0};
+  pdns::stat_t d_collapsedTimeouts{0};
+  pdns::stat_t d_prefetches{0};
 
   size_t d_maxEntries;
+  size_t d_maxCollapsedQueries{0};
+  uint32_t d_maxCollapseWaitMS{1000};
   uint32_t d_shardCount;
   uint32_t d_maxTTL;
   uint32_t d_tempFailureTTL;
   uint32_t d_maxNegativeTTL;
   uint32_t d_minTTL;
   uint32_t d_staleTTL;
+  Engine d_engine;
+  uint8_t d_prefetchPercentage{0};
   bool d_dontAge;
   bool d_deferrableInsertLock;
   bool d_parseECS;
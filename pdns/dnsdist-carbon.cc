@@ -105,6 +105,8 @@ void carbonDumpThread()
             str<<base<<"tcpcurrentconnections" << ' '<< state->tcpCurrentConnections.load() << " " << now << "\r\n";
             str<<base<<"tcpnewconnections" << ' '<< state->tcpNewConnections.load() << " " << now << "\r\n";
             str<<base<<"tcpreusedconnections" << ' '<< state->tcpReusedConnections.load() << " " << now << "\r\n";
+            str<<base<<"tcpidlepoolmisses" << ' '<< state->tcpIdlePoolMisses.load() << " " << now << "\r\n";
+            str<<base<<"tcpidlepoolevictions" << ' '<< state->tcpIdlePoolEvictions.load() << " " << now << "\r\n";
             str<<base<<"tcpavgqueriesperconnection" << ' '<< state->tcpAvgQueriesPerConnection.load() << " " << now << "\r\n";
             str<<base<<"tcpavgconnectionduration" << ' '<< state->tcpAvgConnectionDuration.load() << " " << now << "\r\n";
           }
@@ -183,6 +185,9 @@ void carbonDumpThread()
               str<<base<<"cache-lookup-collisions" << " " << cache->getLookupCollisions() << " " << now << "\r\n";
               str<<base<<"cache-insert-collisions" << " " << cache->getInsertCollisions() << " " << now << "\r\n";
               str<<base<<"cache-ttl-too-shorts" << " " << cache->getTTLTooShorts() << " " << now << "\r\n";
+              str<<base<<"cache-collapsed-queries" << " " << cache->getCollapsedQueries() << " " << now << "\r\n";
+              str<<base<<"cache-collapsed-timeouts" << " " << cache->getCollapsedTimeouts() << " " << now << "\r\n";
+              str<<base<<"cache-prefetches" << " " << cache->getPrefetches() << " " << now << "\r\n";
             }
           }
 
@@ -423,6 +423,10 @@ const std::vector<ConsoleKeyword> g_consoleKeywords{
   { "clearDynBlocks", true, "", "clear all dynamic blocks" },
   { "clearQueryCounters", true, "", "clears the query counter buffer" },
   { "clearRules", true, "", "remove all current rules" },
+  { "CompiledNetmaskMatchRule", true, "set [, src]", "Matches traffic from/to the network ranges of the compiled set. Set the src parameter to false to match against the destination address instead of the source address" },
+  { "compileNetmaskMatchSet", true, "input, output", "Compile the netmasks listed in the 'input' text file, one per line, into the 'output' file that can be loaded via newCompiledMatchSet()" },
+  { "CompiledSuffixMatchRule", true, "set", "Matches if the qname is part of one of the domain suffixes of the compiled set" },
+  { "compileSuffixMatchSet", true, "input, output", "Compile the domain names listed in the 'input' text file, one per line, into the 'output' file that can be loaded via newCompiledMatchSet()" },
   { "controlSocket", true, "addr", "open a control socket on this address / connect to this address in client mode" },
   { "ContinueAction", true, "action", "execute the specified action and continue the processing of the remaining rules, regardless of the return of the action" },
   { "DelayAction", true, "milliseconds", "delay the response by the specified amount of milliseconds (UDP-only)" },
@@ -465,6 +469,7 @@ const std::vector<ConsoleKeyword> g_consoleKeywords{
   { "getServers", true, "", "returns a table with all defined servers" },
   { "getStatisticsCounters", true, "", "returns a map of statistic counters" },
   { "getTopCacheHitResponseRules", true, "[top]", "return the `top` cache-hit response rules" },
+  { "getTopHeavyHitters", true, "kind[, top]", "return the `top` heavy hitters of that kind (queries, clients, bandwidth, servfail or nxdomain)" },
   { "getTopResponseRules", true, "[top]", "return the `top` response rules" },
   { "getTopRules", true, "[top]", "return the `top` rules" },
   { "getTopSelfAnsweredResponseRules", true, "[top]", "return the `top` self-answered response rules" },
@@ -512,6 +517,8 @@ const std::vector<ConsoleKeyword> g_consoleKeywords{
 #ifdef HAVE_CDB
   { "newCDBKVStore", true, "fname, refreshDelay", "Return a new KeyValueStore object associated to the corresponding CDB database" },
 #endif
+  { "newCachingKVStore", true, "kvs, maxEntries [, {ttl=60, negativeTTL=60, numberOfShards=16}]", "Return a new KeyValueStore object caching the results of the lookups done into the 'kvs' store" },
+  { "newCompiledMatchSet", true, "fname [, refreshDelay]", "Return a new CompiledMatchSet object, mapping into memory the corresponding compiled set file" },
   { "newDNSName", true, "name", "make a DNSName based on this .-terminated name" },
   { "newDNSNameSet", true, "", "returns a new DNSNameSet" },
   { "newDynBPFFilter", true, "bpf", "Return a new dynamic eBPF filter associated to a given BPF Filter" },
@@ -584,8 +591,11 @@ const std::vector<ConsoleKeyword> g_consoleKeywords{
   { "setECSOverride", true, "bool", "whether to override an existing EDNS Client Subnet value in the query" },
   { "setECSSourcePrefixV4", true, "prefix-length", "the EDNS Client Subnet prefix-length used for IPv4 queries" },
   { "setECSSourcePrefixV6", true, "prefix-length", "the EDNS Client Subnet prefix-length used for IPv6 queries" },
+  { "setHeavyHittersOptions", true, "{enabled=true, capacity=100, width=2048, depth=4, halfLife=60}", "set the options of the heavy hitters tracker, at configuration time only" },
   { "setKey", true, "key", "set access key to that key" },
   { "setLocal", true, "addr [, {doTCP=true, reusePort=false, tcpFastOpenQueueSize=0, interface=\"\", cpus={}}]", "reset the list of addresses we listen on to this address" },
+  { "setMaglevBalancingFactor", true, "factor", "Set the balancing factor for the bounded-load Maglev policy" },
+  { "setMaxIdleTCPConnectionsPerDownstream", true, "max", "set the maximum number of idle TCP connections to a given backend kept for reuse, per thread or in total if the idle pool is shared. Defaults to 20" },
   { "setMaxTCPClientThreads", true, "n", "set the maximum of TCP client threads, handling TCP connections" },
   { "setMaxTCPConnectionDuration", true, "n", "set the maximum duration of an incoming TCP connection, in seconds. 0 means unlimited" },
   { "setMaxTCPConnectionsPerClient", true, "n", "set the maximum number of TCP connections per client. 0 means unlimited" },
@@ -603,6 +613,7 @@ const std::vector<ConsoleKeyword> g_consoleKeywords{
   { "setQueryCount", true, "bool", "set whether queries should be counted" },
   { "setQueryCountFilter", true, "func", "filter queries that would be counted, where `func` is a function with parameter `dq` which decides whether a query should and how it should be counted" },
   { "setRingBuffersLockRetries", true, "n", "set the number of attempts to get a non-blocking lock to a ringbuffer shard before blocking" },
+  { "setRingBuffersOptions", true, "{ perThread=bool }", "set the ringbuffers options" },
   { "setRingBuffersSize", true, "n [, numberOfShards]", "set the capacity of the ringbuffers used for live traffic inspection to `n`, and optionally the number of shards to use to `numberOfShards`" },
   { "setRoundRobinFailOnNoServer", true, "value", "By default the roundrobin load-balancing policy will still try to select a backend even if all backends are currently down. Setting this to true will make the policy fail and return that no server is available instead" },
   { "setRules", true, "list of rules", "replace the current rules with the supplied list of pairs of DNS Rules and DNS Actions (see `newRuleAction()`)" },
@@ -615,7 +626,11 @@ const std::vector<ConsoleKeyword> g_consoleKeywords{
   { "setServFailWhenNoServer", true, "bool", "if set, return a ServFail when no servers are available, instead of the default behaviour of dropping the query" },
   { "setStaleCacheEntriesTTL", true, "n", "allows using cache entries expired for at most n seconds when there is no backend available to answer for a query" },
   { "setSyslogFacility", true, "facility", "set the syslog logging facility to 'facility'. Defaults to LOG_DAEMON" },
+  { "setTCPAcceptInWorkers", true, "enabled [, cpuSteering]", "whether every TCP worker should accept the incoming TCP connections itself, on a listening socket of its own, instead of receiving them from an acceptor thread" },
   { "setTCPDownstreamCleanupInterval", true, "interval", "minimum interval in seconds between two cleanups of the idle TCP downstream connections" },
+  { "setTCPDownstreamMaxConnectionAge", true, "max", "do not reuse TCP connections to a backend that have been opened more than this number of seconds ago. 0 means no limit, the default" },
+  { "setTCPDownstreamMaxIdleTime", true, "max", "do not reuse TCP connections to a backend that have been idle for more than this number of seconds. 0 means no limit, defaults to 300" },
+  { "setTCPDownstreamSharedIdlePool", true, "bool", "whether the idle TCP connections to a backend can be reused by any TCP worker thread instead of the one that opened them. Defaults to false" },
   { "setTCPInternalPipeBufferSize", true, "size", "Set the size in bytes of the internal buffer of the pipes used internally to distribute connections to TCP (and DoT) workers threads" },
   { "setTCPUseSinglePipe", true, "bool", "whether the incoming TCP connections should be put into a single queue instead of using per-thread queues. Defaults to false" },
   { "setTCPRecvTimeout", true, "n", "set the read timeout on TCP connections from the client, in seconds" },
@@ -680,6 +695,7 @@ const std::vector<ConsoleKeyword> g_consoleKeywords{
   { "topBandwidth", true, "top", "show top-`top` clients that consume the most bandwidth over length of ringbuffer" },
   { "topCacheHitResponseRules", true, "[top][, vars]", "show `top` cache-hit response rules" },
   { "topClients", true, "n", "show top-`n` clients sending the most queries over length of ringbuffer" },
+  { "topHeavyHitters", true, "kind[, top]", "show the `top` heavy hitters of that kind (queries, clients, bandwidth, servfail or nxdomain), over the whole lifetime of the process" },
   { "topQueries", true, "n[, labels]", "show top 'n' queries, as grouped when optionally cut down to 'labels' labels" },
   { "topResponses", true, "n, kind[, labels]", "show top 'n' responses with RCODE=kind (0=NO Error, 2=ServFail, 3=NXDomain), as grouped when optionally cut down to 'labels' labels" },
   { "topResponseRules", true, "[top][, vars]", "show `top` response rules" },
@@ -692,6 +708,9 @@ const std::vector<ConsoleKeyword> g_consoleKeywords{
   { "webserver", true, "address:port", "launch a webserver with stats on that address" },
   { "whashed", false, "", "Weighted hashed ('sticky') distribution over available servers, based on the server 'weight' parameter" },
   { "chashed", false, "", "Consistent hashed ('sticky') distribution over available servers, also based on the server 'weight' parameter" },
+  { "p2c", false, "", "Pick two available servers at random and send the query to the one with the fewest queries in the air and the lowest latency" },
+  { "maglev", false, "", "Maglev consistent hashed ('sticky') distribution over available servers, also based on the server 'weight' parameter" },
+  { "maglevBoundedLoad", false, "", "Maglev consistent hashed ('sticky') distribution over available servers, moving queries away from overloaded servers" },
   { "wrandom", false, "", "Weighted random over available servers, based on the server 'weight' parameter" },
 };
 
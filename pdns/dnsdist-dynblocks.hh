@@ -21,6 +21,7 @@
  */
 #pragma once
 
+#include <array>
 #include <unordered_set>
 
 #include "dolog.hh"
@@ -221,30 +222,35 @@ public:
   void setQueryRate(unsigned int rate, unsigned int warningRate, unsigned int seconds, std::string reason, unsigned int blockDuration, DNSAction::Action action)
   {
     d_queryRateRule = DynBlockRule(reason, blockDuration, rate, warningRate, seconds, action);
+    d_incrementalState.reset();
   }
 
   /* rate is in bytes per second */
   void setResponseByteRate(unsigned int rate, unsigned int warningRate, unsigned int seconds, std::string reason, unsigned int blockDuration, DNSAction::Action action)
   {
     d_respRateRule = DynBlockRule(reason, blockDuration, rate, warningRate, seconds, action);
+    d_incrementalState.reset();
   }
 
   void setRCodeRate(uint8_t rcode, unsigned int rate, unsigned int warningRate, unsigned int seconds, std::string reason, unsigned int blockDuration, DNSAction::Action action)
   {
     auto& entry = d_rcodeRules[rcode];
     entry = DynBlockRule(reason, blockDuration, rate, warningRate, seconds, action);
+    d_incrementalState.reset();
   }
 
   void setRCodeRatio(uint8_t rcode, double ratio, double warningRatio, unsigned int seconds, std::string reason, unsigned int blockDuration, DNSAction::Action action, size_t minimumNumberOfResponses)
   {
     auto& entry = d_rcodeRatioRules[rcode];
     entry = DynBlockRatioRule(reason, blockDuration, ratio, warningRatio, seconds, action, minimumNumberOfResponses);
+    d_incrementalState.reset();
   }
 
   void setQTypeRate(uint16_t qtype, unsigned int rate, unsigned int warningRate, unsigned int seconds, std::string reason, unsigned int blockDuration, DNSAction::Action action)
   {
     auto& entry = d_qtypeRules[qtype];
     entry = DynBlockRule(reason, blockDuration, rate, warningRate, seconds, action);
+    d_incrementalState.reset();
   }
 
   typedef std::function<bool(const StatNode&, const StatNode::Stat&, const StatNode::Stat&)> smtVisitor_t;
@@ -253,12 +259,14 @@ public:
   {
     d_suffixMatchRule = DynBlockRule(reason, blockDuration, 0, 0, seconds, action);
     d_smtVisitor = visitor;
+    d_incrementalState.reset();
   }
 
   void setSuffixMatchRuleFFI(unsigned int seconds, std::string reason, unsigned int blockDuration, DNSAction::Action action, dnsdist_ffi_stat_node_visitor_t visitor)
   {
     d_suffixMatchRule = DynBlockRule(reason, blockDuration, 0, 0, seconds, action);
     d_smtVisitorFFI = visitor;
+    d_incrementalState.reset();
   }
 
   void apply()
@@ -325,6 +333,25 @@ public:
     d_beQuiet = quiet;
   }
 
+  /* In incremental mode, the counters are kept between two runs as sliding windows,
+     per requestor and, for the suffix match rule, per qname. They are only updated
+     with the entries inserted into the rings since the previous run, and the rules
+     are only evaluated for the requestors seen since then, or that were exceeding
+     a rule during the previous run. The windows have a granularity of one tenth of
+     the largest rule duration (and at least one second), and entries evicted from
+     the rings are still accounted for. Rules without a duration are not supported,
+     the whole rings are scanned on every run if there is one. */
+  void setIncremental(bool incremental)
+  {
+    d_incremental = incremental;
+    d_incrementalState.reset();
+  }
+
+  bool isIncremental() const
+  {
+    return d_incremental;
+  }
+
 private:
 
   bool checkIfQueryTypeMatches(const Rings::Query& query);
@@ -364,6 +391,69 @@ private:
 
   void processQueryRules(counts_t& counts, const struct timespec& now);
   void processResponseRules(counts_t& counts, StatNode& root, const struct timespec& now);
+  bool processCounts(boost::optional<NetmaskTree<DynBlock> >& blocks, const struct timespec& now, const ComboAddress& requestor, const Counts& counters, bool& updated);
+  void processSuffixMatchTree(const StatNode& root, const struct timespec& now);
+
+  static const size_t s_windowBuckets{10};
+
+  struct RequestorBucket
+  {
+    time_t start{0};
+    uint32_t queries{0};
+    uint32_t responses{0};
+    uint64_t respBytes{0};
+  };
+
+  struct NameBucket
+  {
+    time_t start{0};
+    StatNode::Stat stat;
+  };
+
+  template <typename Bucket>
+  struct Window
+  {
+    std::array<Bucket, s_windowBuckets> buckets;
+    time_t lastSeen{0};
+  };
+
+  struct RequestorWindow : public Window<RequestorBucket>
+  {
+    /* position of the qtype and rcode counters of our buckets in IncrementalState::counters */
+    size_t countersOffset{std::numeric_limits<size_t>::max()};
+  };
+
+  struct IncrementalState
+  {
+    Rings::Cursor queryCursor;
+    Rings::Cursor responseCursor;
+    std::unordered_map<ComboAddress, RequestorWindow, ComboAddress::addressOnlyHash, ComboAddress::addressOnlyEqual> requestors;
+    /* the qtype and rcode counters of all the requestors, s_windowBuckets * countersSize per
+       requestor, so that we do not need to allocate them for every requestor and every bucket.
+       The space used by the requestors we have forgotten about is reused */
+    std::vector<uint32_t> counters;
+    std::vector<size_t> freeCounters;
+    std::unordered_map<DNSName, Window<NameBucket>> names;
+    std::unordered_set<ComboAddress, ComboAddress::addressOnlyHash, ComboAddress::addressOnlyEqual> toEvaluate;
+    std::map<uint16_t, size_t> qtypeIndexes;
+    std::map<uint8_t, size_t> rcodeIndexes;
+    std::map<uint8_t, unsigned int> rcodeWindows;
+    /* one counter per qtype rule, then one per rcode of interest */
+    size_t countersSize{0};
+    unsigned int responsesWindow{0};
+    unsigned int window{1};
+    time_t bucketWidth{1};
+    time_t nextPurge{0};
+  };
+
+  bool canBeIncremental() const;
+  void initIncrementalState(IncrementalState& state) const;
+  void applyIncremental(const struct timespec& now);
+  template <typename Bucket>
+  static Bucket* getBucket(std::array<Bucket, s_windowBuckets>& buckets, const IncrementalState& state, time_t when, const struct timespec& now, bool& reset);
+  static uint32_t* getBucketCounters(IncrementalState& state, RequestorWindow& window, size_t bucketIdx, bool reset);
+  template <typename Bucket>
+  static bool isBucketInWindow(const Bucket& bucket, const IncrementalState& state, unsigned int seconds, const struct timespec& now);
 
   std::map<uint8_t, DynBlockRule> d_rcodeRules;
   std::map<uint8_t, DynBlockRatioRule> d_rcodeRatioRules;
@@ -375,7 +465,9 @@ private:
   SuffixMatchNode d_excludedDomains;
   smtVisitor_t d_smtVisitor;
   dnsdist_ffi_stat_node_visitor_t d_smtVisitorFFI;
+  std::unique_ptr<IncrementalState> d_incrementalState{nullptr};
   bool d_beQuiet{false};
+  bool d_incremental{false};
 };
 
 class DynBlockMaintenance
@@ -29,6 +29,9 @@ struct DownstreamState;
 
 struct PerThreadPoliciesState;
 
+struct ServerPool;
+class MaglevTable;
+
 class ServerPolicy
 {
 public:
@@ -36,11 +39,17 @@ public:
   using NumberedServerVector = NumberedVector<shared_ptr<DownstreamState>>;
   typedef std::function<shared_ptr<DownstreamState>(const NumberedServerVector& servers, const DNSQuestion*)> policyfunc_t;
   typedef std::function<unsigned int(dnsdist_ffi_servers_list_t* servers, dnsdist_ffi_dnsquestion_t* dq)> ffipolicyfunc_t;
+  typedef std::function<shared_ptr<DownstreamState>(const MaglevTable& table, const DNSQuestion*)> maglevpolicyfunc_t;
 
   ServerPolicy(const std::string& name_, policyfunc_t policy_, bool isLua_): d_name(name_), d_policy(policy_), d_isLua(isLua_)
   {
   }
 
+  /* a policy using the Maglev lookup table of the pool, 'policy_' being used when we only have the servers */
+  ServerPolicy(const std::string& name_, maglevpolicyfunc_t maglevPolicy_, policyfunc_t policy_): d_name(name_), d_policy(policy_), d_maglevPolicy(maglevPolicy_)
+  {
+  }
+
   ServerPolicy(const std::string& name_, ffipolicyfunc_t policy_): d_name(name_), d_ffipolicy(policy_), d_isLua(true), d_isFFI(true)
   {
   }
@@ -53,6 +62,7 @@ public:
   }
 
   std::shared_ptr<DownstreamState> getSelectedBackend(const ServerPolicy::NumberedServerVector& servers, DNSQuestion& dq) const;
+  std::shared_ptr<DownstreamState> getSelectedBackend(ServerPool& pool, DNSQuestion& dq) const;
 
   const std::string& getName() const
   {
@@ -81,23 +91,24 @@ public:
 
   policyfunc_t d_policy;
   ffipolicyfunc_t d_ffipolicy;
+  maglevpolicyfunc_t d_maglevPolicy;
 
   bool d_isLua{false};
   bool d_isFFI{false};
   bool d_isPerThread{false};
 };
 
-struct ServerPool;
-
 using pools_t = map<std::string, std::shared_ptr<ServerPool>>;
 std::shared_ptr<ServerPool> getPool(const pools_t& pools, const std::string& poolName);
 std::shared_ptr<ServerPool> createPoolIfNotExists(pools_t& pools, const string& poolName);
 void setPoolPolicy(pools_t& pools, const string& poolName, std::shared_ptr<ServerPolicy> policy);
 void addServerToPool(pools_t& pools, const string& poolName, std::shared_ptr<DownstreamState> server);
 void removeServerFromPool(pools_t& pools, const string& poolName, std::shared_ptr<DownstreamState> server);
+void serverChangedInPools(const pools_t& pools, const DownstreamState& server);
 
 const std::shared_ptr<ServerPolicy::NumberedServerVector> getDownstreamCandidates(const map<std::string,std::shared_ptr<ServerPool>>& pools, const std::string& poolName);
 
+std::shared_ptr<DownstreamState> p2c(const ServerPolicy::NumberedServerVector& servers, const DNSQuestion* dq);
 std::shared_ptr<DownstreamState> firstAvailable(const ServerPolicy::NumberedServerVector& servers, const DNSQuestion* dq);
 
 std::shared_ptr<DownstreamState> leastOutstanding(const ServerPolicy::NumberedServerVector& servers, const DNSQuestion* dq);
@@ -108,7 +119,50 @@ std::shared_ptr<DownstreamState> chashed(const ServerPolicy::NumberedServerVecto
 std::shared_ptr<DownstreamState> chashedFromHash(const ServerPolicy::NumberedServerVector& servers, size_t hash);
 std::shared_ptr<DownstreamState> roundrobin(const ServerPolicy::NumberedServerVector& servers, const DNSQuestion* dq);
 
+/* Maglev hashing (Eisenbud et al., NSDI 2016) lookup table, built from the servers of a pool
+   and never modified afterwards, so that it can be shared by all the threads */
+class MaglevTable
+{
+public:
+  MaglevTable(std::shared_ptr<const ServerPolicy::NumberedServerVector> servers, uint64_t generation);
+
+  /* the servers the table has been built for */
+  const ServerPolicy::NumberedServerVector& getServers() const
+  {
+    return *d_servers;
+  }
+
+  uint64_t getGeneration() const
+  {
+    return d_generation;
+  }
+
+  size_t size() const
+  {
+    return d_slots.size();
+  }
+
+  /* index in getServers() of the server owning the slot at this position */
+  uint32_t getServerIndex(size_t position) const
+  {
+    return d_slots[position % d_slots.size()];
+  }
+
+private:
+  std::vector<uint32_t> d_slots;
+  std::shared_ptr<const ServerPolicy::NumberedServerVector> d_servers;
+  uint64_t d_generation;
+};
+
+std::shared_ptr<DownstreamState> maglev(const ServerPolicy::NumberedServerVector& servers, const DNSQuestion* dq);
+std::shared_ptr<DownstreamState> maglevFromTable(const MaglevTable& table, const DNSQuestion* dq);
+std::shared_ptr<DownstreamState> maglevFromHash(const MaglevTable& table, size_t hash);
+std::shared_ptr<DownstreamState> maglevBoundedLoad(const ServerPolicy::NumberedServerVector& servers, const DNSQuestion* dq);
+std::shared_ptr<DownstreamState> maglevBoundedLoadFromTable(const MaglevTable& table, const DNSQuestion* dq);
+std::shared_ptr<DownstreamState> maglevBoundedLoadFromHash(const MaglevTable& table, size_t hash);
+
 extern double g_consistentHashBalancingFactor;
+extern double g_maglevBalancingFactor;
 extern double g_weightedBalancingFactor;
 extern uint32_t g_hashperturb;
 extern bool g_roundrobinFailOnNoServer;
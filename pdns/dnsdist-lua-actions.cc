@@ -1089,7 +1089,7 @@ public:
 
     DNSDistProtoBufMessage message(*dq);
     if (!d_serverID.empty()) {
-      message.setServerIdentity(d_serverID);
+      message.setServerIdentityRef(d_serverID);
     }
 
 #if HAVE_LIBCRYPTO
@@ -1222,7 +1222,7 @@ public:
 
     DNSDistProtoBufMessage message(*dr, d_includeCNAME);
     if (!d_serverID.empty()) {
-      message.setServerIdentity(d_serverID);
+      message.setServerIdentityRef(d_serverID);
     }
 
 #if HAVE_LIBCRYPTO
@@ -72,6 +72,9 @@ void setupLuaBindings(LuaContext& luaCtx, bool client)
   luaCtx.writeVariable("wrandom", ServerPolicy{"wrandom", wrandom, false});
   luaCtx.writeVariable("whashed", ServerPolicy{"whashed", whashed, false});
   luaCtx.writeVariable("chashed", ServerPolicy{"chashed", chashed, false});
+  luaCtx.writeVariable("p2c", ServerPolicy{"p2c", p2c, false});
+  luaCtx.writeVariable("maglev", ServerPolicy{"maglev", maglevFromTable, maglev});
+  luaCtx.writeVariable("maglevBoundedLoad", ServerPolicy{"maglevBoundedLoad", maglevBoundedLoadFromTable, maglevBoundedLoad});
   luaCtx.writeVariable("leastOutstanding", ServerPolicy{"leastOutstanding", leastOutstanding, false});
 
   /* ServerPool */
@@ -120,7 +123,10 @@ void setupLuaBindings(LuaContext& luaCtx, bool client)
   luaCtx.registerMember("upStatus", &DownstreamState::upStatus);
   luaCtx.registerMember<int (DownstreamState::*)>("weight",
     [](const DownstreamState& s) -> int {return s.weight;},
-    [](DownstreamState& s, int newWeight) {s.setWeight(newWeight);}
+    [](DownstreamState& s, int newWeight) {
+      s.setWeight(newWeight);
+      serverChangedInPools(g_pools.getCopy(), s);
+    }
   );
   luaCtx.registerMember("order", &DownstreamState::order);
   luaCtx.registerMember<const std::string(DownstreamState::*)>("name", [](const DownstreamState& backend) -> const std::string { return backend.getName(); }, [](DownstreamState& backend, const std::string& newName) { backend.setName(newName); });
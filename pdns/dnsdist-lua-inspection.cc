@@ -22,6 +22,7 @@
 #include "dnsdist.hh"
 #include "dnsdist-lua.hh"
 #include "dnsdist-dynblocks.hh"
+#include "dnsdist-heavyhitters.hh"
 #include "dnsdist-rings.hh"
 
 #include "statnode.hh"
@@ -31,30 +32,25 @@ static std::unordered_map<unsigned int, vector<boost::variant<string,double>>> g
   setLuaNoSideEffect();
   map<DNSName, unsigned int> counts;
   unsigned int total=0;
-  {
-    for (const auto& shard : g_rings.d_shards) {
-      std::lock_guard<std::mutex> rl(shard->respLock);
-      if(!labels) {
-        for(const auto& a : shard->respRing) {
-          if(!pred(a))
-            continue;
-          counts[a.name]++;
-          total++;
-        }
-      }
-      else {
-        unsigned int lab = *labels;
-        for(const auto& a : shard->respRing) {
-          if(!pred(a))
-            continue;
+  if(!labels) {
+    g_rings.forEachResponse([&counts, &total, &pred](const Rings::Response& a) {
+      if(!pred(a))
+        return;
+      counts[a.name]++;
+      total++;
+    });
+  }
+  else {
+    unsigned int lab = *labels;
+    g_rings.forEachResponse([&counts, &total, &pred, lab](const Rings::Response& a) {
+      if(!pred(a))
+        return;
 
-          DNSName temp(a.name);
-          temp.trimToLabels(lab);
-          counts[temp]++;
-          total++;
-        }
-      }
-    }
+      DNSName temp(a.name);
+      temp.trimToLabels(lab);
+      counts[temp]++;
+      total++;
+    });
   }
   //      cout<<"Looked at "<<total<<" responses, "<<counts.size()<<" different ones"<<endl;
   vector<pair<unsigned int, DNSName>> rcounts;
@@ -114,19 +110,15 @@ static void statNodeRespRing(statvisitor_t visitor, unsigned int seconds)
   cutoff.tv_sec -= seconds;
 
   StatNode root;
-  for (const auto& shard : g_rings.d_shards) {
-    std::lock_guard<std::mutex> rl(shard->respLock);
+  g_rings.forEachResponse([&root, &now, &cutoff, seconds](const Rings::Response& c) {
+    if (now < c.when)
+      return;
 
-    for(const auto& c : shard->respRing) {
-      if (now < c.when)
-        continue;
+    if (seconds && c.when < cutoff)
+      return;
 
-      if (seconds && c.when < cutoff)
-        continue;
-
-      root.submit(c.name, ((c.dh.rcode == 0 && c.usec == std::numeric_limits<unsigned int>::max()) ? -1 : c.dh.rcode), c.size, boost::none);
-    }
-  }
+    root.submit(c.name, ((c.dh.rcode == 0 && c.usec == std::numeric_limits<unsigned int>::max()) ? -1 : c.dh.rcode), c.size, boost::none);
+  });
 
   StatNode::Stat node;
   root.visit([visitor](const StatNode* node_, const StatNode::Stat& self, const StatNode::Stat& children) {
@@ -138,20 +130,16 @@ static vector<pair<unsigned int, std::unordered_map<string,string> > > getRespRi
   typedef std::unordered_map<string,string>  entry_t;
   vector<pair<unsigned int, entry_t > > ret;
 
-  for (const auto& shard : g_rings.d_shards) {
-    std::lock_guard<std::mutex> rl(shard->respLock);
-
-    entry_t e;
-    unsigned int count=1;
-    for(const auto& c : shard->respRing) {
-      if(rcode && (rcode.get() != c.dh.rcode))
-        continue;
-      e["qname"]=c.name.toString();
-      e["rcode"]=std::to_string(c.dh.rcode);
-      ret.push_back(std::make_pair(count,e));
-      count++;
-    }
-  }
+  entry_t e;
+  unsigned int count=1;
+  g_rings.forEachResponse([&ret, &e, &count, &rcode](const Rings::Response& c) {
+    if(rcode && (rcode.get() != c.dh.rcode))
+      return;
+    e["qname"]=c.name.toString();
+    e["rcode"]=std::to_string(c.dh.rcode);
+    ret.push_back(std::make_pair(count,e));
+    count++;
+  });
 
   return ret;
 }
@@ -166,20 +154,16 @@ static counts_t exceedRespGen(unsigned int rate, int seconds, std::function<void
 
   counts.reserve(g_rings.getNumberOfResponseEntries());
 
-  for (const auto& shard : g_rings.d_shards) {
-    std::lock_guard<std::mutex> rl(shard->respLock);
-    for(const auto& c : shard->respRing) {
+  g_rings.forEachResponse([&counts, &mintime, &now, &cutoff, seconds, &T](const Rings::Response& c) {
+    if(seconds && c.when < cutoff)
+      return;
+    if(now < c.when)
+      return;
 
-      if(seconds && c.when < cutoff)
-        continue;
-      if(now < c.when)
-        continue;
-
-      T(counts, c);
-      if(c.when < mintime)
-        mintime = c.when;
-    }
-  }
+    T(counts, c);
+    if(c.when < mintime)
+      mintime = c.when;
+  });
 
   double delta = seconds ? seconds : DiffTime(now, mintime);
   return filterScore(counts, delta, rate);
@@ -195,18 +179,15 @@ static counts_t exceedQueryGen(unsigned int rate, int seconds, std::function<voi
 
   counts.reserve(g_rings.getNumberOfQueryEntries());
 
-  for (const auto& shard : g_rings.d_shards) {
-    std::lock_guard<std::mutex> rl(shard->queryLock);
-    for(const auto& c : shard->queryRing) {
-      if(seconds && c.when < cutoff)
-        continue;
-      if(now < c.when)
-        continue;
-      T(counts, c);
-      if(c.when < mintime)
-        mintime = c.when;
-    }
-  }
+  g_rings.forEachQuery([&counts, &mintime, &now, &cutoff, seconds, &T](const Rings::Query& c) {
+    if(seconds && c.when < cutoff)
+      return;
+    if(now < c.when)
+      return;
+    T(counts, c);
+    if(c.when < mintime)
+      mintime = c.when;
+  });
 
   double delta = seconds ? seconds : DiffTime(now, mintime);
   return filterScore(counts, delta, rate);
@@ -237,15 +218,10 @@ void setupLuaInspection(LuaContext& luaCtx)
       auto top = top_.get_value_or(10);
       map<ComboAddress, unsigned int,ComboAddress::addressOnlyLessThan > counts;
       unsigned int total=0;
-      {
-        for (const auto& shard : g_rings.d_shards) {
-          std::lock_guard<std::mutex> rl(shard->queryLock);
-          for(const auto& c : shard->queryRing) {
-            counts[c.requestor]++;
-            total++;
-          }
-        }
-      }
+      g_rings.forEachQuery([&counts, &total](const Rings::Query& c) {
+        counts[c.requestor]++;
+        total++;
+      });
       vector<pair<unsigned int, ComboAddress>> rcounts;
       rcounts.reserve(counts.size());
       for(const auto& c : counts)
@@ -271,24 +247,19 @@ void setupLuaInspection(LuaContext& luaCtx)
       map<DNSName, unsigned int> counts;
       unsigned int total=0;
       if(!labels) {
-        for (const auto& shard : g_rings.d_shards) {
-          std::lock_guard<std::mutex> rl(shard->queryLock);
-          for(const auto& a : shard->queryRing) {
-            counts[a.name]++;
-            total++;
-          }
-        }
+        g_rings.forEachQuery([&counts, &total](const Rings::Query& a) {
+          counts[a.name]++;
+          total++;
+        });
       }
       else {
 	unsigned int lab = *labels;
-        for (const auto& shard : g_rings.d_shards) {
-          std::lock_guard<std::mutex> rl(shard->queryLock);
-          for(auto a : shard->queryRing) {
-            a.name.trimToLabels(lab);
-            counts[a.name]++;
-            total++;
-          }
-        }
+        g_rings.forEachQuery([&counts, &total, lab](const Rings::Query& a) {
+          DNSName temp(a.name);
+          temp.trimToLabels(lab);
+          counts[temp]++;
+          total++;
+        });
       }
       // cout<<"Looked at "<<total<<" queries, "<<counts.size()<<" different ones"<<endl;
       vector<pair<unsigned int, DNSName>> rcounts;
@@ -325,27 +296,21 @@ void setupLuaInspection(LuaContext& luaCtx)
 
   luaCtx.writeFunction("getResponseRing", []() {
       setLuaNoSideEffect();
-      size_t totalEntries = 0;
-      std::vector<boost::circular_buffer<Rings::Response>> rings;
-      rings.reserve(g_rings.getNumberOfShards());
-      for (const auto& shard : g_rings.d_shards) {
-        {
-          std::lock_guard<std::mutex> rl(shard->respLock);
-          rings.push_back(shard->respRing);
-        }
-        totalEntries += rings.back().size();
-      }
+      /* copy the entries first, so we don't hold the locks for too long */
+      std::vector<Rings::Response> responses;
+      responses.reserve(g_rings.getNumberOfResponseEntries());
+      g_rings.forEachResponse([&responses](const Rings::Response& r) {
+        responses.push_back(r);
+      });
       vector<std::unordered_map<string, boost::variant<string, unsigned int> > > ret;
-      ret.reserve(totalEntries);
+      ret.reserve(responses.size());
       decltype(ret)::value_type item;
-      for (size_t idx = 0; idx < rings.size(); idx++) {
-        for(const auto& r : rings[idx]) {
-          item["name"]=r.name.toString();
-          item["qtype"]=r.qtype;
-          item["rcode"]=r.dh.rcode;
-          item["usec"]=r.usec;
-          ret.push_back(item);
-        }
+      for(const auto& r : responses) {
+        item["name"]=r.name.toString();
+        item["qtype"]=r.qtype;
+        item["rcode"]=r.dh.rcode;
+        item["usec"]=r.usec;
+        ret.push_back(item);
       }
       return ret;
     });
@@ -364,6 +329,32 @@ void setupLuaInspection(LuaContext& luaCtx)
 
   luaCtx.executeCode(R"(function topSlow(top, msec, labels) top = top or 10; msec = msec or 500; for k,v in ipairs(getSlowResponses(top, msec, labels)) do show(string.format("%4d  %-40s %4d %4.1f%%",k,v[1],v[2],v[3])) end end)");
 
+  luaCtx.writeFunction("getTopHeavyHitters", [](const std::string& kind, boost::optional<unsigned int> top_) {
+      setLuaNoSideEffect();
+      std::unordered_map<unsigned int, vector<boost::variant<string,double>>> ret;
+      auto top = top_.get_value_or(10);
+      uint64_t total = 0;
+      std::vector<HeavyHitters::Entry> entries;
+      try {
+        entries = g_heavyHitters.getTop(kind, top, total, time(nullptr));
+      }
+      catch (const std::exception& e) {
+        g_outputBuffer = std::string(e.what()) + "\n";
+        return ret;
+      }
+
+      unsigned int count = 1;
+      uint64_t rest = total;
+      for (const auto& entry : entries) {
+        ret.insert({count++, {entry.key, static_cast<double>(entry.count), total > 0 ? 100.0*entry.count/total : 100.0}});
+        rest -= std::min(rest, entry.count);
+      }
+      ret.insert({count, {"Rest", static_cast<double>(rest), total > 0 ? 100.0*rest/total : 100.0}});
+      return ret;
+    });
+
+  luaCtx.executeCode(R"(function topHeavyHitters(kind, top) top = top or 10; for k,v in ipairs(getTopHeavyHitters(kind, top)) do show(string.format("%4d  %-40s %4d %4.1f%%",k,v[1],v[2],v[3])) end end)");
+
   luaCtx.writeFunction("getTopBandwidth", [](unsigned int top) {
       setLuaNoSideEffect();
       return g_rings.getTopBandwidth(top);
@@ -424,20 +415,12 @@ void setupLuaInspection(LuaContext& luaCtx)
       std::vector<Rings::Response> rr;
       qr.reserve(g_rings.getNumberOfQueryEntries());
       rr.reserve(g_rings.getNumberOfResponseEntries());
-      for (const auto& shard : g_rings.d_shards) {
-        {
-          std::lock_guard<std::mutex> rl(shard->queryLock);
-          for (const auto& entry : shard->queryRing) {
-            qr.push_back(entry);
-          }
-        }
-        {
-          std::lock_guard<std::mutex> rl(shard->respLock);
-          for (const auto& entry : shard->respRing) {
-            rr.push_back(entry);
-          }
-        }
-      }
+      g_rings.forEachQuery([&qr](const Rings::Query& entry) {
+        qr.push_back(entry);
+      });
+      g_rings.forEachResponse([&rr](const Rings::Response& entry) {
+        rr.push_back(entry);
+      });
 
       sort(qr.begin(), qr.end(), [](const decltype(qr)::value_type& a, const decltype(qr)::value_type& b) {
         return b.when < a.when;
@@ -542,24 +525,19 @@ void setupLuaInspection(LuaContext& luaCtx)
 
       double totlat=0;
       unsigned int size=0;
-      {
-        for (const auto& shard : g_rings.d_shards) {
-          std::lock_guard<std::mutex> rl(shard->respLock);
-          for(const auto& r : shard->respRing) {
-            /* skip actively discovered timeouts */
-            if (r.usec == std::numeric_limits<unsigned int>::max())
-              continue;
-
-            ++size;
-            auto iter = histo.lower_bound(r.usec);
-            if(iter != histo.end())
-              iter->second++;
-            else
-              histo.rbegin()++;
-            totlat+=r.usec;
-          }
-        }
-      }
+      g_rings.forEachResponse([&histo, &totlat, &size](const Rings::Response& r) {
+        /* skip actively discovered timeouts */
+        if (r.usec == std::numeric_limits<unsigned int>::max())
+          return;
+
+        ++size;
+        auto iter = histo.lower_bound(r.usec);
+        if(iter != histo.end())
+          iter->second++;
+        else
+          histo.rbegin()++;
+        totlat+=r.usec;
+      });
 
       if (size == 0) {
         g_outputBuffer = "No traffic yet.\n";
@@ -597,7 +575,7 @@ void setupLuaInspection(LuaContext& luaCtx)
       ret << (fmt % g_tcpclientthreads->getThreadsCount() % (g_maxTCPClientThreads ? *g_maxTCPClientThreads : 0) % g_tcpclientthreads->getQueuedCount() % g_maxTCPQueuedConnections) << endl;
       ret << endl;
 
-      ret << "Query distribution mode is: " << std::string(g_useTCPSinglePipe ? "single queue" : "per-thread queues") << endl;
+      ret << "Query distribution mode is: " << std::string(g_tcpAcceptInWorkers ? "accepted by the workers" : (g_useTCPSinglePipe ? "single queue" : "per-thread queues")) << endl;
       ret << endl;
 
       ret << "Frontends:" << endl;
@@ -832,5 +810,6 @@ void setupLuaInspection(LuaContext& luaCtx)
     group->apply();
   });
   luaCtx.registerFunction("setQuiet", &DynBlockRulesGroup::setQuiet);
+  luaCtx.registerFunction("setIncremental", &DynBlockRulesGroup::setIncremental);
   luaCtx.registerFunction("toString", &DynBlockRulesGroup::toString);
 }
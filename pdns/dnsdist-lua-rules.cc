@@ -595,6 +595,14 @@ void setupLuaRules(LuaContext& luaCtx)
       return std::shared_ptr<DNSRule>(new KeyValueStoreLookupRule(kvs, lookupKey));
     });
 
+  luaCtx.writeFunction("CompiledSuffixMatchRule", [](std::shared_ptr<CompiledMatchSet>& set) {
+      return std::shared_ptr<DNSRule>(new CompiledSuffixMatchRule(set));
+    });
+
+  luaCtx.writeFunction("CompiledNetmaskMatchRule", [](std::shared_ptr<CompiledMatchSet>& set, boost::optional<bool> src) {
+      return std::shared_ptr<DNSRule>(new CompiledNetmaskMatchRule(set, src ? *src : true));
+    });
+
   luaCtx.writeFunction("LuaRule", [](LuaRule::func_t func) {
       return std::shared_ptr<DNSRule>(new LuaRule(func));
     });
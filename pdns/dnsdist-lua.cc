@@ -36,6 +36,7 @@
 #include "dnsdist-dynblocks.hh"
 #include "dnsdist-ecs.hh"
 #include "dnsdist-healthchecks.hh"
+#include "dnsdist-heavyhitters.hh"
 #include "dnsdist-lua.hh"
 #ifdef LUAJIT_VERSION
 #include "dnsdist-lua-ffi.hh"
@@ -125,6 +126,26 @@ static void parseLocalBindVars(boost::optional<localbind_t> vars, bool& reusePor
   }
 }
 
+static void parseIOUringVars(boost::optional<localbind_t> vars, bool& ioUring, int& ioUringGroup)
+{
+  if (vars) {
+    if (vars->count("ioUring")) {
+      ioUring = boost::get<bool>((*vars)["ioUring"]);
+    }
+    if (vars->count("ioUringGroup")) {
+      ioUring = true;
+      ioUringGroup = boost::get<int>((*vars)["ioUringGroup"]);
+    }
+  }
+
+#ifndef HAVE_LIBURING
+  if (ioUring) {
+    warnlog("io_uring support requested but this version of dnsdist was built without liburing, falling back to the regular UDP receive loop");
+    ioUring = false;
+  }
+#endif /* HAVE_LIBURING */
+}
+
 #if defined(HAVE_DNS_OVER_TLS) || defined(HAVE_DNS_OVER_HTTPS)
 static bool loadTLSCertificateAndKeys(const std::string& context, std::vector<std::pair<std::string, std::string>>& pairs, boost::variant<std::string, std::vector<std::pair<int,std::string>>> certFiles, boost::variant<std::string, std::vector<std::pair<int,std::string>>> keyFiles)
 {
@@ -481,6 +502,43 @@ static void setupLuaConfig(LuaContext& luaCtx, bool client, bool configCheck)
         ret->reconnectOnUp=boost::get<bool>(vars["reconnectOnUp"]);
       }
 
+      if(vars.count("healthCheckMode")) {
+        const auto& mode = boost::get<string>(vars["healthCheckMode"]);
+        if (pdns_iequals(mode, "lazy")) {
+          ret->healthCheckMode = DownstreamState::HealthCheckMode::Lazy;
+        }
+        else if (pdns_iequals(mode, "active")) {
+          ret->healthCheckMode = DownstreamState::HealthCheckMode::Active;
+        }
+        else {
+          warnlog("Dismissing invalid health-check mode '%s', using 'active' instead", mode);
+        }
+      }
+
+      if(vars.count("lazyHealthCheckThreshold")) {
+        const auto threshold = std::stoi(boost::get<string>(vars["lazyHealthCheckThreshold"]));
+        if (threshold >= 0 && threshold <= 100) {
+          ret->lazyHealthCheckThreshold = threshold;
+        }
+        else {
+          warnlog("Dismissing invalid lazy health-check threshold %d, it should be a percentage between 0 and 100, using %d instead", threshold, static_cast<int>(ret->lazyHealthCheckThreshold));
+        }
+      }
+
+      if(vars.count("lazyHealthCheckMinSampleCount")) {
+        const auto minSampleCount = std::stoi(boost::get<string>(vars["lazyHealthCheckMinSampleCount"]));
+        if (minSampleCount >= 0 && minSampleCount <= std::numeric_limits<uint16_t>::max()) {
+          ret->lazyHealthCheckMinSampleCount = minSampleCount;
+        }
+        else {
+          warnlog("Dismissing invalid lazy health-check minimum sample count %d, it should be between 0 and %d, using %d instead", minSampleCount, std::numeric_limits<uint16_t>::max(), ret->lazyHealthCheckMinSampleCount);
+        }
+      }
+
+      if(vars.count("checkTCP")) {
+        ret->checkTCP = boost::get<bool>(vars["checkTCP"]);
+      }
+
       if(vars.count("cpus")) {
         for (const auto& cpu : boost::get<vector<pair<int,string>>>(vars["cpus"])) {
           cpus.insert(std::stoi(cpu.second));
@@ -602,6 +660,9 @@ static void setupLuaConfig(LuaContext& luaCtx, bool client, bool configCheck)
       std::set<int> cpus;
 
       parseLocalBindVars(vars, reusePort, tcpFastOpenQueueSize, interface, cpus, tcpListenQueueSize, maxInFlightQueriesPerConn);
+      bool ioUring = false;
+      int ioUringGroup = -1;
+      parseIOUringVars(vars, ioUring, ioUringGroup);
 
       try {
 	ComboAddress loc(addr, 53);
@@ -616,7 +677,10 @@ static void setupLuaConfig(LuaContext& luaCtx, bool client, bool configCheck)
         }
 
         // only works pre-startup, so no sync necessary
-        g_frontends.push_back(std::unique_ptr<ClientState>(new ClientState(loc, false, reusePort, tcpFastOpenQueueSize, interface, cpus)));
+        auto udpCS = std::unique_ptr<ClientState>(new ClientState(loc, false, reusePort, tcpFastOpenQueueSize, interface, cpus));
+        udpCS->ioUring = ioUring;
+        udpCS->ioUringGroup = ioUringGroup;
+        g_frontends.push_back(std::move(udpCS));
         auto tcpCS = std::unique_ptr<ClientState>(new ClientState(loc, true, reusePort, tcpFastOpenQueueSize, interface, cpus));
         if (tcpListenQueueSize > 0) {
           tcpCS->tcpListenQueueSize = tcpListenQueueSize;
@@ -647,11 +711,17 @@ static void setupLuaConfig(LuaContext& luaCtx, bool client, bool configCheck)
       std::set<int> cpus;
 
       parseLocalBindVars(vars, reusePort, tcpFastOpenQueueSize, interface, cpus, tcpListenQueueSize, maxInFlightQueriesPerConn);
+      bool ioUring = false;
+      int ioUringGroup = -1;
+      parseIOUringVars(vars, ioUring, ioUringGroup);
 
       try {
 	ComboAddress loc(addr, 53);
         // only works pre-startup, so no sync necessary
-        g_frontends.push_back(std::unique_ptr<ClientState>(new ClientState(loc, false, reusePort, tcpFastOpenQueueSize, interface, cpus)));
+        auto udpCS = std::unique_ptr<ClientState>(new ClientState(loc, false, reusePort, tcpFastOpenQueueSize, interface, cpus));
+        udpCS->ioUring = ioUring;
+        udpCS->ioUringGroup = ioUringGroup;
+        g_frontends.push_back(std::move(udpCS));
         auto tcpCS = std::unique_ptr<ClientState>(new ClientState(loc, true, reusePort, tcpFastOpenQueueSize, interface, cpus));
         if (tcpListenQueueSize > 0) {
           tcpCS->tcpListenQueueSize = tcpListenQueueSize;
@@ -941,6 +1011,10 @@ static void setupLuaConfig(LuaContext& luaCtx, bool client, bool configCheck)
       if (vars->count("maxConcurrentConnections")) {
         setWebserverMaxConcurrentConnections(std::stoi(boost::get<std::string>(vars->at("maxConcurrentConnections"))));
       }
+
+      if (vars->count("maxThreads")) {
+        setWebserverMaxThreads(std::stoi(boost::get<std::string>(vars->at("maxThreads"))));
+      }
     });
 
   luaCtx.writeFunction("controlSocket", [client,configCheck](const std::string& str) {
@@ -1780,6 +1854,18 @@ static void setupLuaConfig(LuaContext& luaCtx, bool client, bool configCheck)
       }
     });
 
+  luaCtx.writeFunction("setMaglevBalancingFactor", [](double factor) {
+      setLuaSideEffect();
+      if (factor >= 1.0) {
+        g_maglevBalancingFactor = factor;
+      }
+      else {
+        errlog("Invalid value passed to setMaglevBalancingFactor()!");
+        g_outputBuffer="Invalid value passed to setMaglevBalancingFactor()!\n";
+        return;
+      }
+    });
+
   luaCtx.writeFunction("setWeightedBalancingFactor", [](double factor) {
       setLuaSideEffect();
       if (factor >= 1.0) {
@@ -1807,6 +1893,51 @@ static void setupLuaConfig(LuaContext& luaCtx, bool client, bool configCheck)
       g_rings.setNumberOfLockRetries(retries);
     });
 
+  luaCtx.writeFunction("setRingBuffersOptions", [](boost::optional<std::unordered_map<std::string, boost::variant<bool>>> vars) {
+      setLuaSideEffect();
+      if (g_configurationDone) {
+        errlog("setRingBuffersOptions() cannot be used at runtime!");
+        g_outputBuffer="setRingBuffersOptions() cannot be used at runtime!\n";
+        return;
+      }
+      if (!vars) {
+        return;
+      }
+      if (vars->count("perThread")) {
+        g_rings.setPerThreadRings(boost::get<bool>(vars->at("perThread")));
+      }
+    });
+
+  luaCtx.writeFunction("setHeavyHittersOptions", [](boost::optional<std::unordered_map<std::string, boost::variant<bool, uint64_t>>> vars) {
+      setLuaSideEffect();
+      if (g_configurationDone) {
+        errlog("setHeavyHittersOptions() cannot be used at runtime!");
+        g_outputBuffer="setHeavyHittersOptions() cannot be used at runtime!\n";
+        return;
+      }
+      if (!vars) {
+        return;
+      }
+
+      HeavyHitters::Options options;
+      if (vars->count("enabled")) {
+        options.enabled = boost::get<bool>(vars->at("enabled"));
+      }
+      if (vars->count("capacity")) {
+        options.capacity = boost::get<uint64_t>(vars->at("capacity"));
+      }
+      if (vars->count("width")) {
+        options.width = boost::get<uint64_t>(vars->at("width"));
+      }
+      if (vars->count("depth")) {
+        options.depth = boost::get<uint64_t>(vars->at("depth"));
+      }
+      if (vars->count("halfLife")) {
+        options.halfLife = boost::get<uint64_t>(vars->at("halfLife"));
+      }
+      g_heavyHitters.configure(options);
+    });
+
   luaCtx.writeFunction("setWHashedPertubation", [](uint32_t pertub) {
       setLuaSideEffect();
       g_hashperturb = pertub;
@@ -1821,6 +1952,16 @@ static void setupLuaConfig(LuaContext& luaCtx, bool client, bool configCheck)
       g_useTCPSinglePipe = flag;
     });
 
+  luaCtx.writeFunction("setTCPAcceptInWorkers", [](bool enabled, boost::optional<bool> cpuSteering) {
+      if (g_configurationDone) {
+        g_outputBuffer="setTCPAcceptInWorkers() cannot be used at runtime!\n";
+        return;
+      }
+      setLuaSideEffect();
+      g_tcpAcceptInWorkers = enabled;
+      g_tcpAcceptCPUSteering = cpuSteering ? *cpuSteering : false;
+    });
+
   luaCtx.writeFunction("setTCPInternalPipeBufferSize", [](size_t size) { g_tcpInternalPipeBufferSize = size; });
 
   luaCtx.writeFunction("snmpAgent", [client,configCheck](bool enableTraps, boost::optional<std::string> daemonSocket) {
@@ -1925,6 +2066,30 @@ static void setupLuaConfig(LuaContext& luaCtx, bool client, bool configCheck)
       g_downstreamTCPCleanupInterval = interval;
     });
 
+  luaCtx.writeFunction("setMaxIdleTCPConnectionsPerDownstream", [](size_t max) {
+      setLuaSideEffect();
+      g_maxIdleTCPConnectionsPerDownstream = max;
+    });
+
+  luaCtx.writeFunction("setTCPDownstreamMaxIdleTime", [](uint16_t max) {
+      setLuaSideEffect();
+      g_downstreamTCPMaxIdleTime = max;
+    });
+
+  luaCtx.writeFunction("setTCPDownstreamMaxConnectionAge", [](uint32_t max) {
+      setLuaSideEffect();
+      g_downstreamTCPMaxConnectionAge = max;
+    });
+
+  luaCtx.writeFunction("setTCPDownstreamSharedIdlePool", [](bool shared) {
+      if (g_configurationDone) {
+        g_outputBuffer="setTCPDownstreamSharedIdlePool() cannot be used at runtime!\n";
+        return;
+      }
+      setLuaSideEffect();
+      g_downstreamTCPSharedIdlePool = shared;
+    });
+
   luaCtx.writeFunction("setConsoleConnectionsLogging", [](bool enabled) {
       g_logConsoleConnections = enabled;
     });
@@ -2168,6 +2333,10 @@ static void setupLuaConfig(LuaContext& luaCtx, bool client, bool configCheck)
         frontend->d_exactPathMatching = boost::get<bool>((*vars)["exactPathMatching"]);
       }
 
+      if (vars->count("processQueriesInline")) {
+        frontend->d_processQueriesInline = boost::get<bool>((*vars)["processQueriesInline"]);
+      }
+
       parseTLSConfig(frontend->d_tlsConfig, "addDOHLocal", vars);
     }
     g_dohlocals.push_back(frontend);
@@ -37,6 +37,11 @@ void DNSDistProtoBufMessage::setServerIdentity(const std::string& serverId)
   d_serverIdentity = serverId;
 }
 
+void DNSDistProtoBufMessage::setServerIdentityRef(const std::string& serverId)
+{
+  d_ServerIdentityRef = &serverId;
+}
+
 void DNSDistProtoBufMessage::setRequestor(const ComboAddress& requestor)
 {
   d_requestor = requestor;
@@ -106,6 +111,35 @@ void DNSDistProtoBufMessage::addRR(DNSName&& qname, uint16_t uType, uint16_t uCl
   d_additionalRRs.push_back({std::move(qname), strBlob, uTTL, uType, uClass});
 }
 
+namespace {
+/* The question section of the last message built by this thread, since the same question is
+   often logged several times in a row: to several loggers, or for the query then for the response
+   when it is a cache hit or self-generated. The name is compared byte for byte, since its case
+   is preserved in the message. */
+struct EncodedQuestion
+{
+  DNSName d_name;
+  std::string d_encoded;
+  uint16_t d_type{0};
+  uint16_t d_class{0};
+};
+}
+
+static const std::string& getEncodedQuestion(const DNSName& name, uint16_t qtype, uint16_t qclass)
+{
+  static thread_local EncodedQuestion t_question;
+
+  if (t_question.d_encoded.empty() || t_question.d_type != qtype || t_question.d_class != qclass || t_question.d_name.getStorage() != name.getStorage()) {
+    t_question.d_name = name;
+    t_question.d_type = qtype;
+    t_question.d_class = qclass;
+    t_question.d_encoded.clear();
+    pdns::ProtoZero::Message::encodeQuestion(t_question.d_encoded, name, qtype, qclass);
+  }
+
+  return t_question.d_encoded;
+}
+
 void DNSDistProtoBufMessage::serialize(std::string& data) const
 {
   if ((data.capacity() - data.size()) < 128) {
@@ -124,7 +158,8 @@ void DNSDistProtoBufMessage::serialize(std::string& data) const
     m.setTime(ts.tv_sec, ts.tv_nsec / 1000);
   }
 
-  m.setRequest(d_dq.uniqueId ? *d_dq.uniqueId : getUniqueID(), d_requestor ? *d_requestor : *d_dq.remote, d_responder ? *d_responder : *d_dq.local, d_question ? d_question->d_name : *d_dq.qname, d_question ? d_question->d_type : d_dq.qtype, d_question ? d_question->d_class : d_dq.qclass, d_dq.getHeader()->id, d_dq.tcp, d_bytes ? *d_bytes : d_dq.getData().size());
+  const auto& question = getEncodedQuestion(d_question ? d_question->d_name : *d_dq.qname, d_question ? d_question->d_type : d_dq.qtype, d_question ? d_question->d_class : d_dq.qclass);
+  m.setRequest(d_dq.uniqueId ? *d_dq.uniqueId : getUniqueID(), d_requestor ? *d_requestor : *d_dq.remote, d_responder ? *d_responder : *d_dq.local, question, d_dq.getHeader()->id, d_dq.tcp, d_bytes ? *d_bytes : d_dq.getData().size());
 
   if (d_serverIdentity) {
     m.setServerIdentity(*d_serverIdentity);
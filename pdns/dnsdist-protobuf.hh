@@ -32,6 +32,8 @@ public:
   DNSDistProtoBufMessage(const DNSResponse& dr, bool includeCNAME);
 
   void setServerIdentity(const std::string& serverId);
+  /* same as setServerIdentity() but does not copy the identity, which has to outlive this object */
+  void setServerIdentityRef(const std::string& serverId);
   void setRequestor(const ComboAddress& requestor);
   void setResponder(const ComboAddress& responder);
   void setRequestorPort(uint16_t port);
@@ -24,15 +24,37 @@
 
 #include "dnsdist-rings.hh"
 
-size_t Rings::numDistinctRequestors()
+std::atomic<uint64_t> Rings::s_generation{0};
+
+std::shared_ptr<Rings::PerThreadShard> Rings::getNewPerThreadShard()
 {
-  std::set<ComboAddress, ComboAddress::addressOnlyLessThan> s;
-  for (const auto& shard : d_shards) {
-    std::lock_guard<std::mutex> rl(shard->queryLock);
-    for(const auto& q : shard->queryRing) {
-      s.insert(q.requestor);
+  const auto owner = std::this_thread::get_id();
+  std::lock_guard<std::mutex> lock(d_perThreadShardsLock);
+  /* we might already have a shard if this thread has been inserting into another Rings object in the meantime */
+  for (const auto& shard : d_perThreadShards) {
+    if (shard->owner == owner) {
+      return shard;
     }
   }
+
+  /* hand out what is left of the capacity, without ever going over it */
+  size_t used = 0;
+  for (const auto& shard : d_perThreadShards) {
+    used += shard->queryRing.capacity();
+  }
+  const size_t remaining = used < d_capacity ? d_capacity - used : 0;
+
+  auto shard = std::make_shared<PerThreadShard>(std::min(d_perThreadCapacity, remaining), owner);
+  d_perThreadShards.push_back(shard);
+  return shard;
+}
+
+size_t Rings::numDistinctRequestors()
+{
+  std::set<ComboAddress, ComboAddress::addressOnlyLessThan> s;
+  forEachQuery([&s](const Query& q) {
+    s.insert(q.requestor);
+  });
   return s.size();
 }
 
@@ -40,22 +62,14 @@ std::unordered_map<int, vector<boost::variant<string,double>>> Rings::getTopBand
 {
   map<ComboAddress, unsigned int, ComboAddress::addressOnlyLessThan> counts;
   uint64_t total=0;
-  for (const auto& shard : d_shards) {
-    {
-      std::lock_guard<std::mutex> rl(shard->queryLock);
-      for(const auto& q : shard->queryRing) {
-        counts[q.requestor]+=q.size;
-        total+=q.size;
-      }
-    }
-    {
-      std::lock_guard<std::mutex> rl(shard->respLock);
-      for(const auto& r : shard->respRing) {
-        counts[r.requestor]+=r.size;
-        total+=r.size;
-      }
-    }
-  }
+  forEachQuery([&counts, &total](const Query& q) {
+    counts[q.requestor]+=q.size;
+    total+=q.size;
+  });
+  forEachResponse([&counts, &total](const Response& r) {
+    counts[r.requestor]+=r.size;
+    total+=r.size;
+  });
 
   typedef vector<pair<unsigned int, ComboAddress>> ret_t;
   ret_t rcounts;
@@ -21,8 +21,11 @@
  */
 #pragma once
 
+#include <array>
 #include <mutex>
+#include <thread>
 #include <time.h>
+#include <type_traits>
 #include <unordered_map>
 
 #include <boost/variant.hpp>
@@ -33,6 +36,109 @@
 #include "stat_t.hh"
 
 
+/* A ring buffer of fixed-size, trivially copyable records that can only be written to by
+   a single thread, but read by any number of threads without ever blocking the writer.
+   Every slot is protected by a sequence number, odd while the slot is being written to,
+   and readers skip the entries that have been overwritten while they were copying them. */
+template <typename T>
+class SingleProducerRing
+{
+public:
+  static_assert(std::is_trivially_copyable<T>::value, "The records stored in a SingleProducerRing need to be trivially copyable");
+
+  SingleProducerRing(size_t capacity): d_slots(capacity > 0 ? capacity : 1)
+  {
+  }
+
+  /* only to be called from the thread owning this ring */
+  void push(const T& record)
+  {
+    std::array<uint64_t, s_words> words{};
+    memcpy(words.data(), &record, sizeof(record));
+
+    const uint64_t pos = d_pos.load(std::memory_order_relaxed);
+    auto& slot = d_slots[pos % d_slots.size()];
+    slot.seq.store(2 * pos + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t idx = 0; idx < s_words; idx++) {
+      slot.data[idx].store(words[idx], std::memory_order_relaxed);
+    }
+    slot.seq.store(2 * pos + 2, std::memory_order_release);
+    d_pos.store(pos + 1, std::memory_order_release);
+  }
+
+  /* calls the visitor on a copy of every entry present in the ring, oldest first */
+  template <typename Visitor>
+  void forEach(Visitor&& visitor) const
+  {
+    const uint64_t end = d_pos.load(std::memory_order_acquire);
+    const uint64_t begin = end > d_slots.size() ? end - d_slots.size() : 0;
+    visit(begin, end, visitor);
+  }
+
+  /* same as forEach() but only for the entries inserted since the position pointed by 'pos',
+     which is then updated to the current one */
+  template <typename Visitor>
+  void forEachSince(uint64_t& pos, Visitor&& visitor) const
+  {
+    const uint64_t end = d_pos.load(std::memory_order_acquire);
+    uint64_t begin = end > d_slots.size() ? end - d_slots.size() : 0;
+    if (pos > begin && pos <= end) {
+      begin = pos;
+    }
+    visit(begin, end, visitor);
+    pos = end;
+  }
+
+  size_t size() const
+  {
+    const uint64_t pos = d_pos.load(std::memory_order_acquire);
+    return pos > d_slots.size() ? d_slots.size() : pos;
+  }
+
+  size_t capacity() const
+  {
+    return d_slots.size();
+  }
+
+private:
+  static constexpr size_t s_words = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+  template <typename Visitor>
+  void visit(uint64_t begin, uint64_t end, Visitor& visitor) const
+  {
+    std::array<uint64_t, s_words> words;
+    T record;
+
+    for (uint64_t pos = begin; pos < end; pos++) {
+      const auto& slot = d_slots[pos % d_slots.size()];
+      const uint64_t seq = slot.seq.load(std::memory_order_acquire);
+      if (seq != 2 * pos + 2) {
+        /* being written to, or already overwritten */
+        continue;
+      }
+      for (size_t idx = 0; idx < s_words; idx++) {
+        words[idx] = slot.data[idx].load(std::memory_order_relaxed);
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot.seq.load(std::memory_order_relaxed) != seq) {
+        continue;
+      }
+      memcpy(static_cast<void*>(&record), words.data(), sizeof(record));
+      visitor(record);
+    }
+  }
+
+  struct Slot
+  {
+    std::atomic<uint64_t> seq{0};
+    std::array<std::atomic<uint64_t>, s_words> data;
+  };
+
+  std::vector<Slot> d_slots;
+  std::atomic<uint64_t> d_pos{0};
+};
+
 struct Rings {
   struct Query
   {
@@ -61,6 +167,56 @@ struct Rings {
     boost::circular_buffer<Response> respRing;
     std::mutex queryLock;
     std::mutex respLock;
+    /* total number of insertions, protected by the corresponding lock */
+    uint64_t queryInserts{0};
+    uint64_t respInserts{0};
+  };
+
+  /* used to visit only the entries inserted since the previous visit, see forEachQuerySince() */
+  struct Cursor
+  {
+    std::unordered_map<const void*, uint64_t> positions;
+    uint64_t generation{0};
+  };
+
+  /* Compact, fixed-size and trivially copyable versions of the records above, used by
+     the per-thread rings so that an insertion never allocates. The qname is stored
+     inline in wire format, a name that does not fit is stored as its longest suffix
+     that does. */
+  static constexpr size_t s_inlineQNameSize{64};
+  struct CompactQuery
+  {
+    struct timespec when;
+    ComboAddress requestor;
+    struct dnsheader dh;
+    uint16_t size;
+    uint16_t qtype;
+    uint8_t nameLength;
+    char name[s_inlineQNameSize];
+  };
+  struct CompactResponse
+  {
+    struct timespec when;
+    ComboAddress requestor;
+    ComboAddress ds;
+    struct dnsheader dh;
+    unsigned int usec;
+    unsigned int size;
+    uint16_t qtype;
+    uint8_t nameLength;
+    char name[s_inlineQNameSize];
+  };
+
+  /* a pair of rings owned by a single thread, see setPerThreadRings() */
+  struct PerThreadShard
+  {
+    PerThreadShard(size_t capacity, std::thread::id owner_): queryRing(capacity), respRing(capacity), owner(owner_)
+    {
+    }
+
+    SingleProducerRing<CompactQuery> queryRing;
+    SingleProducerRing<CompactResponse> respRing;
+    const std::thread::id owner;
   };
 
   Rings(size_t capacity=10000, size_t numberOfShards=1, size_t nbLockTries=5, bool keepLockingStats=false): d_blockingQueryInserts(0), d_blockingResponseInserts(0), d_deferredQueryInserts(0), d_deferredResponseInserts(0), d_nbQueryEntries(0), d_nbResponseEntries(0), d_currentShardId(0), d_numberOfShards(numberOfShards), d_nbLockTries(nbLockTries), d_keepLockingStats(keepLockingStats)
@@ -94,12 +250,34 @@ struct Rings {
         shard->respRing.set_capacity(newCapacity / numberOfShards);
       }
     }
+    d_capacity = newCapacity;
+    d_perThreadCapacity = newCapacity / numberOfShards;
+    resetPerThreadShards();
 
     /* we just recreated the shards so they are now empty */
     d_nbQueryEntries = 0;
     d_nbResponseEntries = 0;
   }
 
+  /* In per-thread mode, every thread inserting into the rings gets its own pair of
+     single-producer rings, holding (capacity / number of shards) entries each, so the
+     number of shards should be set to the number of threads inserting into the rings.
+     The total never exceeds the capacity: once it has been handed out, the rings of
+     any additional thread only hold a single entry.
+     Insertions never block and do not need any lock, and readers never block the
+     writers, at the cost of a more compact representation of the entries.
+     This function should only be called at configuration time before any query or response has been inserted */
+  void setPerThreadRings(bool perThread)
+  {
+    d_perThread = perThread;
+    resetPerThreadShards();
+  }
+
+  bool isPerThread() const
+  {
+    return d_perThread;
+  }
+
   void setNumberOfLockRetries(size_t retries)
   {
     if (d_numberOfShards <= 1) {
@@ -116,16 +294,151 @@ struct Rings {
 
   size_t getNumberOfQueryEntries() const
   {
+    if (d_perThread) {
+      size_t total = 0;
+      for (const auto& shard : getPerThreadShards()) {
+        total += shard->queryRing.size();
+      }
+      return total;
+    }
     return d_nbQueryEntries;
   }
 
   size_t getNumberOfResponseEntries() const
   {
+    if (d_perThread) {
+      size_t total = 0;
+      for (const auto& shard : getPerThreadShards()) {
+        total += shard->respRing.size();
+      }
+      return total;
+    }
     return d_nbResponseEntries;
   }
 
+  /* Call the visitor on every query present in the rings, whatever the mode. In the
+     default mode the lock of a shard is held while its entries are visited, in the
+     per-thread one the visitor gets a copy of the entry and the writers are never blocked. */
+  template <typename Visitor>
+  void forEachQuery(Visitor&& visitor) const
+  {
+    if (d_perThread) {
+      for (const auto& shard : getPerThreadShards()) {
+        shard->queryRing.forEach([&visitor](const CompactQuery& entry) {
+          const Query query{entry.when, entry.requestor, getInlineName(entry.nameLength, entry.name), entry.size, entry.qtype, entry.dh};
+          visitor(query);
+        });
+      }
+      return;
+    }
+
+    for (const auto& shard : d_shards) {
+      std::lock_guard<std::mutex> rl(shard->queryLock);
+      for (const auto& entry : shard->queryRing) {
+        visitor(entry);
+      }
+    }
+  }
+
+  template <typename Visitor>
+  void forEachResponse(Visitor&& visitor) const
+  {
+    if (d_perThread) {
+      for (const auto& shard : getPerThreadShards()) {
+        shard->respRing.forEach([&visitor](const CompactResponse& entry) {
+          const Response response{entry.when, entry.requestor, getInlineName(entry.nameLength, entry.name), entry.qtype, entry.usec, entry.size, entry.dh, entry.ds};
+          visitor(response);
+        });
+      }
+      return;
+    }
+
+    for (const auto& shard : d_shards) {
+      std::lock_guard<std::mutex> rl(shard->respLock);
+      for (const auto& entry : shard->respRing) {
+        visitor(entry);
+      }
+    }
+  }
+
+  /* whether the entries visited with this cursor still reflect the content of the rings */
+  bool isCursorValid(const Cursor& cursor) const
+  {
+    return cursor.generation == d_generation.load();
+  }
+
+  /* Call the visitor on every query inserted since the previous call using the same cursor.
+     Entries that have been inserted then evicted between two calls are never visited.
+     Returns false if the rings have been cleared or reconfigured since the previous call,
+     all the existing entries being visited in that case. */
+  template <typename Visitor>
+  bool forEachQuerySince(Cursor& cursor, Visitor&& visitor) const
+  {
+    const bool valid = checkCursor(cursor);
+
+    if (d_perThread) {
+      for (const auto& shard : getPerThreadShards()) {
+        shard->queryRing.forEachSince(cursor.positions[shard.get()], [&visitor](const CompactQuery& entry) {
+          const Query query{entry.when, entry.requestor, getInlineName(entry.nameLength, entry.name), entry.size, entry.qtype, entry.dh};
+          visitor(query);
+        });
+      }
+      return valid;
+    }
+
+    for (const auto& shard : d_shards) {
+      std::lock_guard<std::mutex> rl(shard->queryLock);
+      auto& pos = cursor.positions[shard.get()];
+      const size_t newEntries = std::min(static_cast<uint64_t>(shard->queryRing.size()), shard->queryInserts - std::min(pos, shard->queryInserts));
+      for (auto it = shard->queryRing.end() - newEntries; it != shard->queryRing.end(); ++it) {
+        visitor(*it);
+      }
+      pos = shard->queryInserts;
+    }
+    return valid;
+  }
+
+  template <typename Visitor>
+  bool forEachResponseSince(Cursor& cursor, Visitor&& visitor) const
+  {
+    const bool valid = checkCursor(cursor);
+
+    if (d_perThread) {
+      for (const auto& shard : getPerThreadShards()) {
+        shard->respRing.forEachSince(cursor.positions[shard.get()], [&visitor](const CompactResponse& entry) {
+          const Response response{entry.when, entry.requestor, getInlineName(entry.nameLength, entry.name), entry.qtype, entry.usec, entry.size, entry.dh, entry.ds};
+          visitor(response);
+        });
+      }
+      return valid;
+    }
+
+    for (const auto& shard : d_shards) {
+      std::lock_guard<std::mutex> rl(shard->respLock);
+      auto& pos = cursor.positions[shard.get()];
+      const size_t newEntries = std::min(static_cast<uint64_t>(shard->respRing.size()), shard->respInserts - std::min(pos, shard->respInserts));
+      for (auto it = shard->respRing.end() - newEntries; it != shard->respRing.end(); ++it) {
+        visitor(*it);
+      }
+      pos = shard->respInserts;
+    }
+    return valid;
+  }
+
   void insertQuery(const struct timespec& when, const ComboAddress& requestor, const DNSName& name, uint16_t qtype, uint16_t size, const struct dnsheader& dh)
   {
+    if (d_perThread) {
+      CompactQuery entry;
+      entry.when = when;
+      entry.requestor = requestor;
+      entry.dh = dh;
+      entry.size = size;
+      entry.qtype = qtype;
+      setInlineName(name, entry.nameLength, entry.name);
+      getPerThreadShard().queryRing.push(entry);
+      return;
+    }
+
     for (size_t idx = 0; idx < d_nbLockTries; idx++) {
       auto& shard = getOneShard();
       std::unique_lock<std::mutex> wl(shard->queryLock, std::try_to_lock);
@@ -149,6 +462,20 @@ struct Rings {
 
   void insertResponse(const struct timespec& when, const ComboAddress& requestor, const DNSName& name, uint16_t qtype, unsigned int usec, unsigned int size, const struct dnsheader& dh, const ComboAddress& backend)
   {
+    if (d_perThread) {
+      CompactResponse entry;
+      entry.when = when;
+      entry.requestor = requestor;
+      entry.ds = backend;
+      entry.dh = dh;
+      entry.usec = usec;
+      entry.size = size;
+      entry.qtype = qtype;
+      setInlineName(name, entry.nameLength, entry.name);
+      getPerThreadShard().respRing.push(entry);
+      return;
+    }
+
     for (size_t idx = 0; idx < d_nbLockTries; idx++) {
       auto& shard = getOneShard();
       std::unique_lock<std::mutex> wl(shard->respLock, std::try_to_lock);
@@ -183,6 +510,8 @@ struct Rings {
       }
     }
 
+    resetPerThreadShards();
+
     d_nbQueryEntries.store(0);
     d_nbResponseEntries.store(0);
     d_currentShardId.store(0);
@@ -203,6 +532,67 @@ struct Rings {
   pdns::stat_t d_deferredResponseInserts;
 
 private:
+  static void setInlineName(const DNSName& name, uint8_t& length, char* dest)
+  {
+    const auto& storage = name.getStorage();
+    size_t offset = 0;
+    /* skip the leftmost labels until the remaining part fits */
+    while (storage.size() - offset > s_inlineQNameSize) {
+      offset += 1 + static_cast<uint8_t>(storage.at(offset));
+    }
+    length = storage.size() - offset;
+    memcpy(dest, storage.data() + offset, length);
+  }
+
+  static DNSName getInlineName(uint8_t length, const char* name)
+  {
+    if (length == 0) {
+      return DNSName();
+    }
+    return DNSName(name, length, 0, false);
+  }
+
+  bool checkCursor(Cursor& cursor) const
+  {
+    const uint64_t generation = d_generation.load();
+    if (cursor.generation != generation) {
+      cursor.positions.clear();
+      cursor.generation = generation;
+      return false;
+    }
+    return true;
+  }
+
+  std::vector<std::shared_ptr<PerThreadShard>> getPerThreadShards() const
+  {
+    std::lock_guard<std::mutex> lock(d_perThreadShardsLock);
+    return d_perThreadShards;
+  }
+
+  /* drop all the existing per-thread shards, threads will get a new one on their next insertion,
+     and invalidate the existing cursors */
+  void resetPerThreadShards()
+  {
+    std::lock_guard<std::mutex> lock(d_perThreadShardsLock);
+    d_perThreadShards.clear();
+    d_generation.store(++s_generation);
+  }
+
+  PerThreadShard& getPerThreadShard()
+  {
+    /* the generation is unique across all the Rings objects, so this is only a cache of the shard
+       belonging to this thread for the last Rings object it inserted into */
+    static thread_local std::pair<uint64_t, std::shared_ptr<PerThreadShard>> t_shard{0, nullptr};
+    const uint64_t generation = d_generation.load(std::memory_order_relaxed);
+    if (t_shard.first != generation || t_shard.second == nullptr) {
+      t_shard.second = getNewPerThreadShard();
+      t_shard.first = generation;
+    }
+    return *t_shard.second;
+  }
+
+  std::shared_ptr<PerThreadShard> getNewPerThreadShard();
+
   size_t getShardId()
   {
     return (d_currentShardId++ % d_numberOfShards);
@@ -219,6 +609,7 @@ private:
       d_nbQueryEntries++;
     }
     shard->queryRing.push_back({when, requestor, name, size, qtype, dh});
+    shard->queryInserts++;
   }
 
   void insertResponseLocked(std::unique_ptr<Shard>& shard, const struct timespec& when, const ComboAddress& requestor, const DNSName& name, uint16_t qtype, unsigned int usec, unsigned int size, const struct dnsheader& dh, const ComboAddress& backend)
@@ -227,15 +618,24 @@ private:
       d_nbResponseEntries++;
     }
     shard->respRing.push_back({when, requestor, name, qtype, usec, size, dh, backend});
+    shard->respInserts++;
   }
 
   std::atomic<size_t> d_nbQueryEntries;
   std::atomic<size_t> d_nbResponseEntries;
   std::atomic<size_t> d_currentShardId;
 
+  static std::atomic<uint64_t> s_generation;
+  std::vector<std::shared_ptr<PerThreadShard>> d_perThreadShards;
+  mutable std::mutex d_perThreadShardsLock;
+  std::atomic<uint64_t> d_generation{0};
+  size_t d_perThreadCapacity{0};
+  size_t d_capacity{0};
+
   size_t d_numberOfShards;
   size_t d_nbLockTries = 5;
   bool d_keepLockingStats{false};
+  bool d_perThread{false};
 };
 
 extern Rings g_rings;
@@ -23,9 +23,11 @@
 #include <thread>
 #include <netinet/tcp.h>
 #include <queue>
+#include <sched.h>
 
 #include "dnsdist.hh"
 #include "dnsdist-ecs.hh"
+#include "dnsdist-heavyhitters.hh"
 #include "dnsdist-proxy-protocol.hh"
 #include "dnsdist-rings.hh"
 #include "dnsdist-tcp-downstream.hh"
@@ -64,46 +66,67 @@ size_t g_maxTCPConnectionDuration{0};
 size_t g_maxTCPConnectionsPerClient{0};
 size_t g_tcpInternalPipeBufferSize{0};
 uint16_t g_downstreamTCPCleanupInterval{60};
+size_t g_maxIdleTCPConnectionsPerDownstream{20};
+uint32_t g_downstreamTCPMaxConnectionAge{0};
+uint16_t g_downstreamTCPMaxIdleTime{300};
+bool g_downstreamTCPSharedIdlePool{false};
 int g_tcpRecvTimeout{2};
 int g_tcpSendTimeout{2};
 bool g_useTCPSinglePipe{false};
+bool g_tcpAcceptInWorkers{false};
+bool g_tcpAcceptCPUSteering{false};
 std::atomic<uint64_t> g_tcpStatesDumpRequested{0};
 
+/* Idle connections to a backend, ready to be reused by any incoming connection handled by this thread,
+   or by any thread if the shared pool is enabled. Since an idle connection is not registered to any
+   multiplexer (see TCPConnectionToBackend::release()), it can be picked up by a different thread.
+   Connections are evicted when they have been idle for too long, are too old, have been closed by the
+   backend, or when the backend is down. */
 class DownstreamConnectionsManager
 {
 public:
 
   static std::shared_ptr<TCPConnectionToBackend> getConnectionToDownstream(std::unique_ptr<FDMultiplexer>& mplexer, std::shared_ptr<DownstreamState>& ds, const struct timeval& now)
   {
-    std::shared_ptr<TCPConnectionToBackend> result;
-    struct timeval freshCutOff = now;
-    freshCutOff.tv_sec -= 1;
-
     const auto& it = t_downstreamConnections.find(ds);
     if (it != t_downstreamConnections.end()) {
       auto& list = it->second;
       while (!list.empty()) {
-        result = std::move(list.back());
+        auto result = std::move(list.back());
         list.pop_back();
 
-        result->setReused();
-        /* for connections that have not been used very recently,
-           check whether they have been closed in the meantime */
-        if (freshCutOff < result->getLastDataReceivedTime()) {
-          /* used recently enough, skip the check */
+        if (isUsable(result, now)) {
+          result->setReused();
           ++ds->tcpReusedConnections;
           return result;
         }
+        /* otherwise let's try the next one, if any */
+      }
+    }
+
+    if (g_downstreamTCPSharedIdlePool) {
+      while (true) {
+        std::shared_ptr<TCPConnectionToBackend> result;
+        {
+          std::lock_guard<std::mutex> lock(s_sharedConnectionsLock);
+          auto sharedIt = s_sharedConnections.find(ds);
+          if (sharedIt == s_sharedConnections.end() || sharedIt->second.empty()) {
+            break;
+          }
+          result = std::move(sharedIt->second.back());
+          sharedIt->second.pop_back();
+        }
 
-        if (isTCPSocketUsable(result->getHandle())) {
+        /* checking whether the socket is still usable requires a system call, so we don't hold the lock */
+        if (isUsable(result, now)) {
+          result->setReused();
           ++ds->tcpReusedConnections;
           return result;
         }
-
-        /* otherwise let's try the next one, if any */
       }
     }
 
+    ++ds->tcpIdlePoolMisses;
     return std::make_shared<TCPConnectionToBackend>(ds, now);
   }
 
@@ -119,35 +142,120 @@ public:
     }
 
     const auto& ds = conn->getDS();
-    auto& list = t_downstreamConnections[ds];
-    if (list.size() >= s_maxCachedConnectionsPerDownstream) {
-      /* too many connections queued already */
-      conn.reset();
+    if (g_downstreamTCPSharedIdlePool) {
+      std::lock_guard<std::mutex> lock(s_sharedConnectionsLock);
+      auto& list = s_sharedConnections[ds];
+      if (list.size() < g_maxIdleTCPConnectionsPerDownstream) {
+        list.push_back(std::move(conn));
+        return;
+      }
     }
     else {
-      list.push_back(std::move(conn));
+      auto& list = t_downstreamConnections[ds];
+      if (list.size() < g_maxIdleTCPConnectionsPerDownstream) {
+        list.push_back(std::move(conn));
+        return;
+      }
     }
+
+    /* too many connections queued already */
+    ++ds->tcpIdlePoolEvictions;
+    conn.reset();
   }
 
   static void cleanupClosedTCPConnections(struct timeval now)
   {
+    cleanup(t_downstreamConnections, now);
+
+    if (g_downstreamTCPSharedIdlePool) {
+      /* we might be destroying connections, so not under the lock */
+      std::map<std::shared_ptr<DownstreamState>, std::deque<std::shared_ptr<TCPConnectionToBackend>>> connections;
+      {
+        std::lock_guard<std::mutex> lock(s_sharedConnectionsLock);
+        connections.swap(s_sharedConnections);
+      }
+
+      cleanup(connections, now);
+
+      /* new connections might have been released in the meantime, and are more recent than these ones */
+      std::lock_guard<std::mutex> lock(s_sharedConnectionsLock);
+      for (auto& entry : connections) {
+        auto& list = s_sharedConnections[entry.first];
+        while (!entry.second.empty() && list.size() < g_maxIdleTCPConnectionsPerDownstream) {
+          list.push_front(std::move(entry.second.back()));
+          entry.second.pop_back();
+        }
+        entry.first->tcpIdlePoolEvictions += entry.second.size();
+      }
+    }
+  }
+
+  static size_t clear()
+  {
+    size_t count = 0;
+    for (const auto& downstream : t_downstreamConnections) {
+      count += downstream.second.size();
+    }
+
+    t_downstreamConnections.clear();
+
+    std::map<std::shared_ptr<DownstreamState>, std::deque<std::shared_ptr<TCPConnectionToBackend>>> connections;
+    {
+      std::lock_guard<std::mutex> lock(s_sharedConnectionsLock);
+      connections.swap(s_sharedConnections);
+    }
+    for (const auto& downstream : connections) {
+      count += downstream.second.size();
+    }
+
+    return count;
+  }
+
+private:
+  static bool isUsable(const std::shared_ptr<TCPConnectionToBackend>& conn, const struct timeval& now)
+  {
+    const auto& ds = conn->getDS();
+    if ((g_downstreamTCPMaxIdleTime > 0 && conn->getLastDataReceivedTime().tv_sec + g_downstreamTCPMaxIdleTime < now.tv_sec) ||
+        (g_downstreamTCPMaxConnectionAge > 0 && conn->getConnectionStartTime().tv_sec + g_downstreamTCPMaxConnectionAge < now.tv_sec)) {
+      ++ds->tcpIdlePoolEvictions;
+      return false;
+    }
+
+    /* for connections that have not been used very recently,
+       check whether they have been closed in the meantime */
     struct timeval freshCutOff = now;
     freshCutOff.tv_sec -= 1;
+    if (freshCutOff < conn->getLastDataReceivedTime()) {
+      /* used recently enough, skip the check */
+      return true;
+    }
+
+    if (isTCPSocketUsable(conn->getHandle())) {
+      return true;
+    }
+
+    ++ds->tcpIdlePoolEvictions;
+    return false;
+  }
+
+  static void cleanup(std::map<std::shared_ptr<DownstreamState>, std::deque<std::shared_ptr<TCPConnectionToBackend>>>& connections, const struct timeval& now)
+  {
+    for (auto dsIt = connections.begin(); dsIt != connections.end(); ) {
+      if (!dsIt->first->isUp()) {
+        /* the backend is down, the connections are likely to be broken and we would
+           not send queries there anyway */
+        dsIt->first->tcpIdlePoolEvictions += dsIt->second.size();
+        dsIt = connections.erase(dsIt);
+        continue;
+      }
 
-    for (auto dsIt = t_downstreamConnections.begin(); dsIt != t_downstreamConnections.end(); ) {
       for (auto connIt = dsIt->second.begin(); connIt != dsIt->second.end(); ) {
         if (!(*connIt)) {
           ++connIt;
           continue;
         }
 
-        /* don't bother checking freshly used connections */
-        if (freshCutOff < (*connIt)->getLastDataReceivedTime()) {
-          ++connIt;
-          continue;
-        }
-
-        if (isTCPSocketUsable((*connIt)->getHandle())) {
+        if (isUsable(*connIt, now)) {
           ++connIt;
         }
         else {
@@ -159,30 +267,33 @@ public:
         ++dsIt;
       }
       else {
-        dsIt = t_downstreamConnections.erase(dsIt);
+        dsIt = connections.erase(dsIt);
       }
     }
   }
 
-  static size_t clear()
-  {
-    size_t count = 0;
-    for (const auto& downstream : t_downstreamConnections) {
-      count += downstream.second.size();
-    }
-
-    t_downstreamConnections.clear();
-
-    return count;
-  }
-
-private:
   static thread_local map<std::shared_ptr<DownstreamState>, std::deque<std::shared_ptr<TCPConnectionToBackend>>> t_downstreamConnections;
-  static const size_t s_maxCachedConnectionsPerDownstream;
+  static map<std::shared_ptr<DownstreamState>, std::deque<std::shared_ptr<TCPConnectionToBackend>>> s_sharedConnections;
+  static std::mutex s_sharedConnectionsLock;
 };
 
 thread_local map<std::shared_ptr<DownstreamState>, std::deque<std::shared_ptr<TCPConnectionToBackend>>> DownstreamConnectionsManager::t_downstreamConnections;
-const size_t DownstreamConnectionsManager::s_maxCachedConnectionsPerDownstream{20};
+map<std::shared_ptr<DownstreamState>, std::deque<std::shared_ptr<TCPConnectionToBackend>>> DownstreamConnectionsManager::s_sharedConnections;
+std::mutex DownstreamConnectionsManager::s_sharedConnectionsLock;
+
+/* returns false if that client already has too many connections */
+static bool incrementTCPClientCount(const ComboAddress& client)
+{
+  if (g_maxTCPConnectionsPerClient) {
+    std::lock_guard<std::mutex> lock(s_tcpClientsCountMutex);
+
+    if (s_tcpClientsCount[client] >= g_maxTCPConnectionsPerClient) {
+      return false;
+    }
+    s_tcpClientsCount[client]++;
+  }
+  return true;
+}
 
 static void decrementTCPClientCount(const ComboAddress& client)
 {
@@ -233,7 +344,7 @@ std::shared_ptr<TCPConnectionToBackend> IncomingTCPConnectionState::getDownstrea
   return downstream;
 }
 
-static void tcpClientThread(int pipefd);
+static void tcpClientThread(int pipefd, size_t workerId);
 
 TCPClientCollection::TCPClientCollection(size_t maxThreads, bool useSinglePipe): d_tcpclientthreads(maxThreads), d_maxthreads(maxThreads), d_singlePipe{-1,-1}, d_useSinglePipe(useSinglePipe)
 {
@@ -263,6 +374,44 @@ TCPClientCollection::TCPClientCollection(size_t maxThreads, bool useSinglePipe):
   }
 }
 
+/* when the connections are steered to the worker whose index is the CPU that processed them,
+   modulo the number of workers, that worker should run on these CPUs so that the connection
+   is handled on the CPU that received it */
+static std::set<int> getTCPWorkerSteeredCPUs(size_t workerId, size_t workers)
+{
+  std::set<int> cpus;
+#ifdef __linux__
+  bool steering = false;
+  for (const auto& cs : g_frontends) {
+    if (cs->tcpCPUSteering) {
+      steering = true;
+      break;
+    }
+  }
+  if (!steering || workers == 0) {
+    return cpus;
+  }
+
+  cpu_set_t available;
+  CPU_ZERO(&available);
+  if (sched_getaffinity(0, sizeof(available), &available) != 0) {
+    warnlog("Unable to get the list of available CPUs to pin the TCP worker %d to: %s", workerId, stringerror());
+    return cpus;
+  }
+
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &available) && static_cast<size_t>(cpu) % workers == workerId) {
+      cpus.insert(cpu);
+    }
+  }
+
+  if (cpus.empty()) {
+    warnlog("No available CPU is steering its TCP connections to worker %d, consider lowering the number of TCP workers to the number of CPUs", workerId);
+  }
+#endif /* __linux__ */
+  return cpus;
+}
+
 void TCPClientCollection::addTCPClientThread()
 {
   int pipefds[2] = { -1, -1};
@@ -313,7 +462,13 @@ void TCPClientCollection::addTCPClientThread()
     }
 
     try {
-      std::thread t1(tcpClientThread, pipefds[0]);
+      std::thread t1(tcpClientThread, pipefds[0], d_numthreads.load());
+      auto cpus = getTCPWorkerSteeredCPUs(d_numthreads.load(), d_maxthreads);
+      if (!cpus.empty()) {
+        if (mapThreadToCPUList(t1.native_handle(), cpus) != 0) {
+          warnlog("Unable to pin the TCP worker %d to the CPUs steering their connections to it", d_numthreads.load());
+        }
+      }
       t1.detach();
     }
     catch (const std::runtime_error& e) {
@@ -367,6 +522,10 @@ static void handleResponseSent(std::shared_ptr<IncomingTCPConnectionState>& stat
     const auto& ids = currentResponse.d_idstate;
     double udiff = ids.sentTime.udiff();
     g_rings.insertResponse(answertime, state->d_ci.remote, ids.qname, ids.qtype, static_cast<unsigned int>(udiff), static_cast<unsigned int>(currentResponse.d_buffer.size()), currentResponse.d_cleartextDH, ds->remote);
+    g_heavyHitters.insertResponse(state->d_ci.remote, ids.qname, currentResponse.d_cleartextDH.rcode, static_cast<unsigned int>(currentResponse.d_buffer.size()), answertime.tv_sec);
+    if (currentResponse.d_cleartextDH.rcode == RCode::ServFail) {
+      ++ds->servfailResponses;
+    }
     vinfolog("Got answer from %s, relayed to %s (%s, %d bytes), took %f usec", ds->remote.toStringWithPort(), ids.origRemote.toStringWithPort(), (state->d_ci.cs->tlsFrontend ? "DoT" : "TCP"), currentResponse.d_buffer.size(), udiff);
   }
 
@@ -1109,7 +1268,80 @@ static void handleIncomingTCPQuery(int pipefd, FDMultiplexer::funcparam_t& param
   }
 }
 
-static void tcpClientThread(int pipefd)
+struct TCPWorkerAcceptorParam
+{
+  ClientState* cs;
+  TCPClientThreadData* threadData;
+};
+
+/* the listening socket is non-blocking and shared with the other workers, so another worker
+   might have picked up the connection first. We accept a few connections per event, to
+   drain the queue during a connection storm without starving the existing connections */
+static void handleNewTCPConnection(int listenfd, FDMultiplexer::funcparam_t& param)
+{
+  static const size_t maxAcceptsPerEvent{16};
+  auto acceptorParam = boost::any_cast<TCPWorkerAcceptorParam>(param);
+  ClientState* cs = acceptorParam.cs;
+  auto& threadData = *acceptorParam.threadData;
+  auto& acl = threadData.holders.acl;
+
+  for (size_t count = 0; count < maxAcceptsPerEvent; count++) {
+    ComboAddress remote;
+    remote.sin4.sin_family = cs->local.sin4.sin_family;
+    socklen_t remlen = remote.getSocklen();
+#ifdef HAVE_ACCEPT4
+    int fd = accept4(listenfd, reinterpret_cast<struct sockaddr*>(&remote), &remlen, SOCK_NONBLOCK);
+#else
+    int fd = accept(listenfd, reinterpret_cast<struct sockaddr*>(&remote), &remlen);
+#endif
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+        vinfolog("Error accepting new TCP connection on %s: %s", cs->local.toStringWithPort(), stringerror());
+      }
+      return;
+    }
+
+    // will be decremented when the ConnectionInfo object is destroyed, no matter the reason
+    ++cs->tcpCurrentConnections;
+    ConnectionInfo ci(cs);
+    ci.fd = fd;
+
+    if (!acl->match(remote)) {
+      ++g_stats.aclDrops;
+      vinfolog("Dropped TCP connection from %s because of ACL", remote.toStringWithPort());
+      continue;
+    }
+
+#ifndef HAVE_ACCEPT4
+    if (!setNonBlocking(ci.fd)) {
+      continue;
+    }
+#endif
+    setTCPNoDelay(ci.fd);  // disable NAGLE
+
+    if (!incrementTCPClientCount(remote)) {
+      vinfolog("Dropping TCP connection from %s because we have too many from this client already", remote.toStringWithPort());
+      continue;
+    }
+
+    vinfolog("Got TCP connection from %s", remote.toStringWithPort());
+    ci.remote = remote;
+
+    try {
+      struct timeval now;
+      gettimeofday(&now, nullptr);
+      /* from now on the state is responsible for decrementing the count of connections for this client */
+      auto state = std::make_shared<IncomingTCPConnectionState>(std::move(ci), threadData, now);
+      state->d_remainingTime = g_maxTCPConnectionDuration;
+      IncomingTCPConnectionState::handleIO(state, now);
+    }
+    catch (const std::exception& e) {
+      errlog("While handling a new TCP connection from %s: %s", remote.toStringWithPort(), e.what());
+    }
+  }
+}
+
+static void tcpClientThread(int pipefd, size_t workerId)
 {
   /* we get launched with a pipe on which we receive file descriptors from clients that we own
      from that point on */
@@ -1119,6 +1351,13 @@ static void tcpClientThread(int pipefd)
   TCPClientThreadData data;
 
   data.mplexer->addReadFD(pipefd, handleIncomingTCPQuery, &data);
+
+  /* and, if the workers are accepting the connections themselves, our own listening socket for every frontend */
+  for (const auto& cs : g_frontends) {
+    if (workerId < cs->tcpWorkerFDs.size()) {
+      data.mplexer->addReadFD(cs->tcpWorkerFDs.at(workerId), handleNewTCPConnection, TCPWorkerAcceptorParam{cs.get(), &data});
+    }
+  }
   struct timeval now;
   gettimeofday(&now, nullptr);
   time_t lastTCPCleanup = now.tv_sec;
@@ -1161,6 +1400,9 @@ static void tcpClientThread(int pipefd)
             else if (param.type() == typeid(TCPClientThreadData*)) {
               errlog(" - Worker thread pipe");
             }
+            else if (param.type() == typeid(TCPWorkerAcceptorParam)) {
+              errlog(" - Listening socket for %s", boost::any_cast<TCPWorkerAcceptorParam>(param).cs->local.toStringWithPort());
+            }
           });
         }
       }
@@ -1251,16 +1493,11 @@ void tcpAcceptorThread(ClientState* cs)
         continue;
       }
 
-      if (g_maxTCPConnectionsPerClient) {
-        std::lock_guard<std::mutex> lock(s_tcpClientsCountMutex);
-
-        if (s_tcpClientsCount[remote] >= g_maxTCPConnectionsPerClient) {
-          vinfolog("Dropping TCP connection from %s because we have too many from this client already", remote.toStringWithPort());
-          continue;
-        }
-        s_tcpClientsCount[remote]++;
-        tcpClientCountIncremented = true;
+      if (!incrementTCPClientCount(remote)) {
+        vinfolog("Dropping TCP connection from %s because we have too many from this client already", remote.toStringWithPort());
+        continue;
       }
+      tcpClientCountIncremented = true;
 
       vinfolog("Got TCP connection from %s", remote.toStringWithPort());
 
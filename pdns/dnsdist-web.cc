@@ -21,11 +21,17 @@
  */
 
 #include <boost/format.hpp>
+#include <condition_variable>
+#include <deque>
 #include <sstream>
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <thread>
 
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif /* HAVE_ZLIB */
+
 #include "ext/json11/json11.hpp"
 #include <yahttp/yahttp.hpp>
 
@@ -34,6 +40,7 @@
 #include "dnsdist.hh"
 #include "dnsdist-dynblocks.hh"
 #include "dnsdist-healthchecks.hh"
+#include "dnsdist-heavyhitters.hh"
 #include "dnsdist-prometheus.hh"
 #include "dnsdist-web.hh"
 #include "dolog.hh"
@@ -370,8 +377,29 @@ static json11::Json::array someResponseRulesToJson(GlobalStateHolder<vector<T>>*
   return responseRules;
 }
 
+/* label values can contain anything, including names coming from the queries themselves,
+   but only these three characters need to be escaped */
+static std::string escapePrometheusLabelValue(const std::string& value)
+{
+  std::string result;
+  result.reserve(value.size());
+  for (const char c : value) {
+    if (c == '\\' || c == '"') {
+      result.push_back('\\');
+      result.push_back(c);
+    }
+    else if (c == '\n') {
+      result.append("\\n");
+    }
+    else {
+      result.push_back(c);
+    }
+  }
+  return result;
+}
+
 template<typename T>
-static void addRulesToPrometheusOutput(std::ostringstream& output, GlobalStateHolder<vector<T> >& rules)
+static void addRulesToPrometheusOutput(PrometheusOutput& output, GlobalStateHolder<vector<T> >& rules)
 {
   auto localRules = rules.getLocal();
   for (const auto& entry : *localRules) {
@@ -380,41 +408,203 @@ static void addRulesToPrometheusOutput(std::ostringstream& output, GlobalStateHo
   }
 }
 
-static void handlePrometheus(const YaHTTP::Request& req, YaHTTP::Response& resp)
+struct PrometheusStatEntry
 {
-  handleCORS(req, resp);
-  resp.status = 200;
+  /* the HELP and TYPE lines, followed by the name of the metric */
+  std::string header;
+  const std::pair<std::string, DNSDistStats::entry_t>* entry;
+};
 
-  std::ostringstream output;
-  static const std::set<std::string> metricBlacklist = { "latency-count", "latency-sum" };
-  for (const auto& e : g_stats.entries) {
-    if (e.first == "special-memory-usage")
-      continue; // Too expensive for get-all
-    std::string metricName = std::get<0>(e);
+/* the general metrics never change once dnsdist has started, so their
+   description only needs to be rendered once */
+static const std::vector<PrometheusStatEntry>& getPrometheusStatEntries()
+{
+  static const std::vector<PrometheusStatEntry> entries = []() {
+    static const std::set<std::string> metricBlacklist = { "latency-count", "latency-sum" };
+    std::vector<PrometheusStatEntry> result;
+    result.reserve(g_stats.entries.size());
 
-    // Prometheus suggest using '_' instead of '-'
-    std::string prometheusMetricName = "dnsdist_" + boost::replace_all_copy(metricName, "-", "_");
-    if (metricBlacklist.count(metricName) != 0) {
-      continue;
+    for (const auto& e : g_stats.entries) {
+      if (e.first == "special-memory-usage")
+        continue; // Too expensive for get-all
+      const std::string& metricName = std::get<0>(e);
+
+      // Prometheus suggest using '_' instead of '-'
+      std::string prometheusMetricName = "dnsdist_" + boost::replace_all_copy(metricName, "-", "_");
+      if (metricBlacklist.count(metricName) != 0) {
+        continue;
+      }
+
+      MetricDefinition metricDetails;
+      if (!s_metricDefinitions.getMetricDetails(metricName, metricDetails)) {
+        vinfolog("Do not have metric details for %s", metricName);
+        continue;
+      }
+
+      std::string prometheusTypeName = s_metricDefinitions.getPrometheusStringMetricType(metricDetails.prometheusType);
+
+      if (prometheusTypeName == "") {
+        vinfolog("Unknown Prometheus type for %s", metricName);
+        continue;
+      }
+
+      // for these we have the help and types encoded in the sources:
+      std::string header = "# HELP " + prometheusMetricName + " " + metricDetails.description + "\n";
+      header += "# TYPE " + prometheusMetricName + " " + prometheusTypeName + "\n";
+      header += prometheusMetricName + " ";
+      result.push_back({std::move(header), &e});
     }
 
-    MetricDefinition metricDetails;
-    if (!s_metricDefinitions.getMetricDetails(metricName, metricDetails)) {
-      vinfolog("Do not have metric details for %s", metricName);
-      continue;
+    return result;
+  }();
+
+  return entries;
+}
+
+/* The labels of the backends and frontends only change with the configuration,
+   so they are rendered once and then reused by the following scrapes. */
+struct PrometheusLabelsCache
+{
+  struct BackendLabel
+  {
+    std::weak_ptr<const DownstreamState> state;
+    std::string name;
+    std::string label;
+  };
+
+  struct FrontendLabel
+  {
+    const ClientState* front;
+    /* frontend="...",proto="...",thread="..." */
+    std::string base;
+    /* {frontend="...",proto="...",thread="..."}, followed by a space */
+    std::string label;
+  };
+
+  struct DOHFrontendLabel
+  {
+    const DOHFrontend* front;
+    /* frontend="...",thread="..." */
+    std::string base;
+    /* {frontend="...",thread="..."}, followed by a space */
+    std::string label;
+  };
+
+  const std::string& getBackendLabel(const std::shared_ptr<DownstreamState>& state, uint64_t generation)
+  {
+    auto& cached = d_backends[state.get()];
+    /* a backend that has been removed might have been replaced by a new one
+       at the same address, and the name of a backend can be updated */
+    if (cached.second.state.lock() != state || cached.second.name != state->getName()) {
+      std::string serverName;
+
+      if (state->getName().empty())
+        serverName = state->remote.toStringWithPort();
+      else
+        serverName = state->getName();
+
+      boost::replace_all(serverName, ".", "_");
+
+      cached.second.state = state;
+      cached.second.name = state->getName();
+      cached.second.label = boost::str(boost::format("{server=\"%1%\",address=\"%2%\"}")
+                                       % serverName % state->remote.toStringWithPort());
+    }
+    cached.first = generation;
+    return cached.second.label;
+  }
+
+  /* forget the backends that were not seen since the given generation */
+  void pruneBackends(uint64_t generation)
+  {
+    for (auto it = d_backends.begin(); it != d_backends.end(); ) {
+      if (it->second.first != generation) {
+        it = d_backends.erase(it);
+      }
+      else {
+        ++it;
+      }
     }
+  }
 
-    std::string prometheusTypeName = s_metricDefinitions.getPrometheusStringMetricType(metricDetails.prometheusType);
+  /* the frontends can't be added or removed once the configuration has been parsed */
+  void updateFrontends()
+  {
+    size_t dohCount = 0;
+#ifdef HAVE_DNS_OVER_HTTPS
+    dohCount = g_dohlocals.size();
+#endif /* HAVE_DNS_OVER_HTTPS */
 
-    if (prometheusTypeName == "") {
-      vinfolog("Unknown Prometheus type for %s", metricName);
-      continue;
+    if (d_frontendsCount == g_frontends.size() && d_dohFrontendsCount == dohCount) {
+      return;
+    }
+
+    d_frontends.clear();
+    d_dohFrontends.clear();
+
+    std::map<std::string,uint64_t> frontendDuplicates;
+    for (const auto& front : g_frontends) {
+      if (front->udpFD == -1 && front->tcpFD == -1)
+        continue;
+
+      const string frontName = front->local.toStringWithPort();
+      const string proto = front->getType();
+      const string fullName = frontName + "_" + proto;
+      uint64_t threadNumber = 0;
+      auto dupPair = frontendDuplicates.insert({fullName, 1});
+      if (!dupPair.second) {
+        threadNumber = dupPair.first->second;
+        ++(dupPair.first->second);
+      }
+      std::string base = boost::str(boost::format("frontend=\"%1%\",proto=\"%2%\",thread=\"%3%\"")
+                                    % frontName % proto % threadNumber);
+      std::string label = "{" + base + "} ";
+      d_frontends.push_back({front.get(), std::move(base), std::move(label)});
     }
 
-    // for these we have the help and types encoded in the sources:
-    output << "# HELP " << prometheusMetricName << " " << metricDetails.description    << "\n";
-    output << "# TYPE " << prometheusMetricName << " " << prometheusTypeName << "\n";
-    output << prometheusMetricName << " ";
+#ifdef HAVE_DNS_OVER_HTTPS
+    for (const auto& doh : g_dohlocals) {
+      const string frontName = doh->d_local.toStringWithPort();
+      uint64_t threadNumber = 0;
+      auto dupPair = frontendDuplicates.insert({frontName, 1});
+      if (!dupPair.second) {
+        threadNumber = dupPair.first->second;
+        ++(dupPair.first->second);
+      }
+      std::string base = boost::str(boost::format("frontend=\"%1%\",thread=\"%2%\"") % frontName % threadNumber);
+      std::string label = "{" + base + "} ";
+      d_dohFrontends.push_back({doh.get(), std::move(base), std::move(label)});
+    }
+#endif /* HAVE_DNS_OVER_HTTPS */
+
+    d_frontendsCount = g_frontends.size();
+    d_dohFrontendsCount = dohCount;
+  }
+
+  std::mutex d_lock;
+  std::vector<FrontendLabel> d_frontends;
+  std::vector<DOHFrontendLabel> d_dohFrontends;
+  uint64_t d_generation{0};
+
+private:
+  std::unordered_map<const DownstreamState*, std::pair<uint64_t, BackendLabel>> d_backends;
+  size_t d_frontendsCount{0};
+  size_t d_dohFrontendsCount{0};
+};
+
+static PrometheusLabelsCache s_prometheusLabels;
+/* the size of the last output, to allocate the right amount of memory right away */
+static std::atomic<size_t> s_prometheusOutputSize{0};
+
+static void handlePrometheus(const YaHTTP::Request& req, YaHTTP::Response& resp)
+{
+  handleCORS(req, resp);
+  resp.status = 200;
+
+  PrometheusOutput output(s_prometheusOutputSize.load());
+  for (const auto& stat : getPrometheusStatEntries()) {
+    const auto& e = *stat.entry;
+    output << stat.header;
 
     if (const auto& val = boost::get<pdns::stat_t*>(&std::get<1>(e)))
       output << (*val)->load();
@@ -481,23 +671,20 @@ static void handlePrometheus(const YaHTTP::Request& req, YaHTTP::Response& resp)
   output << "# TYPE " << statesbase << "tcpnewconnections "      << "counter"                                                           << "\n";
   output << "# HELP " << statesbase << "tcpreusedconnections "   << "The number of times a TCP connection has been reused"              << "\n";
   output << "# TYPE " << statesbase << "tcpreusedconnections "   << "counter"                                                           << "\n";
+  output << "# HELP " << statesbase << "tcpidlepoolmisses "      << "The number of times no idle TCP connection was available for reuse" << "\n";
+  output << "# TYPE " << statesbase << "tcpidlepoolmisses "      << "counter"                                                           << "\n";
+  output << "# HELP " << statesbase << "tcpidlepoolevictions "   << "The number of idle TCP connections closed instead of being reused"  << "\n";
+  output << "# TYPE " << statesbase << "tcpidlepoolevictions "   << "counter"                                                           << "\n";
   output << "# HELP " << statesbase << "tcpavgqueriesperconn "   << "The average number of queries per TCP connection"                  << "\n";
   output << "# TYPE " << statesbase << "tcpavgqueriesperconn "   << "gauge"                                                             << "\n";
   output << "# HELP " << statesbase << "tcpavgconnduration "     << "The average duration of a TCP connection (ms)"                     << "\n";
   output << "# TYPE " << statesbase << "tcpavgconnduration "     << "gauge"                                                             << "\n";
 
+  /* held until the end, since the cached labels of the frontends are used below */
+  std::lock_guard<std::mutex> labelsLock(s_prometheusLabels.d_lock);
+  const uint64_t generation = ++s_prometheusLabels.d_generation;
   for (const auto& state : *states) {
-    string serverName;
-
-    if (state->getName().empty())
-      serverName = state->remote.toStringWithPort();
-    else
-      serverName = state->getName();
-
-    boost::replace_all(serverName, ".", "_");
-
-    const std::string label = boost::str(boost::format("{server=\"%1%\",address=\"%2%\"}")
-                                         % serverName % state->remote.toStringWithPort());
+    const std::string& label = s_prometheusLabels.getBackendLabel(state, generation);
 
     output << statesbase << "status"                 << label << " " << (state->isUp() ? "1" : "0")       << "\n";
     output << statesbase << "queries"                << label << " " << state->queries.load()             << "\n";
@@ -516,15 +703,20 @@ static void handlePrometheus(const YaHTTP::Request& req, YaHTTP::Response& resp)
     output << statesbase << "tcpcurrentconnections"  << label << " " << state->tcpCurrentConnections      << "\n";
     output << statesbase << "tcpnewconnections"      << label << " " << state->tcpNewConnections          << "\n";
     output << statesbase << "tcpreusedconnections"   << label << " " << state->tcpReusedConnections       << "\n";
+    output << statesbase << "tcpidlepoolmisses"      << label << " " << state->tcpIdlePoolMisses          << "\n";
+    output << statesbase << "tcpidlepoolevictions"   << label << " " << state->tcpIdlePoolEvictions       << "\n";
     output << statesbase << "tcpavgqueriesperconn"   << label << " " << state->tcpAvgQueriesPerConnection << "\n";
     output << statesbase << "tcpavgconnduration"     << label << " " << state->tcpAvgConnectionDuration   << "\n";
   }
+  s_prometheusLabels.pruneBackends(generation);
 
   const string frontsbase = "dnsdist_frontend_";
   output << "# HELP " << frontsbase << "queries " << "Amount of queries received by this frontend" << "\n";
   output << "# TYPE " << frontsbase << "queries " << "counter" << "\n";
   output << "# HELP " << frontsbase << "responses " << "Amount of responses sent by this frontend" << "\n";
   output << "# TYPE " << frontsbase << "responses " << "counter" << "\n";
+  output << "# HELP " << frontsbase << "udpsyscalls " << "Amount of system calls made to receive queries and send immediate responses over UDP" << "\n";
+  output << "# TYPE " << frontsbase << "udpsyscalls " << "counter" << "\n";
   output << "# HELP " << frontsbase << "tcpdiedreadingquery " << "Amount of TCP connections terminated while reading the query from the client" << "\n";
   output << "# TYPE " << frontsbase << "tcpdiedreadingquery " << "counter" << "\n";
   output << "# HELP " << frontsbase << "tcpdiedsendingresponse " << "Amount of TCP connections terminated while sending a response to the client" << "\n";
@@ -555,25 +747,17 @@ static void handlePrometheus(const YaHTTP::Request& req, YaHTTP::Response& resp)
   output << "# HELP " << frontsbase << "tlshandshakefailures " << "Amount of TLS handshake failures" << "\n";
   output << "# TYPE " << frontsbase << "tlshandshakefailures " << "counter" << "\n";
 
-  std::map<std::string,uint64_t> frontendDuplicates;
-  for (const auto& front : g_frontends) {
-    if (front->udpFD == -1 && front->tcpFD == -1)
-      continue;
-
-    const string frontName = front->local.toStringWithPort();
-    const string proto = front->getType();
-    const string fullName = frontName + "_" + proto;
-    uint64_t threadNumber = 0;
-    auto dupPair = frontendDuplicates.insert({fullName, 1});
-    if (!dupPair.second) {
-      threadNumber = dupPair.first->second;
-      ++(dupPair.first->second);
-    }
-    const std::string label = boost::str(boost::format("{frontend=\"%1%\",proto=\"%2%\",thread=\"%3%\"} ")
-                                         % frontName % proto % threadNumber);
+  s_prometheusLabels.updateFrontends();
+  for (const auto& frontLabel : s_prometheusLabels.d_frontends) {
+    const auto& front = frontLabel.front;
+    const std::string& label = frontLabel.label;
+    const std::string& base = frontLabel.base;
 
     output << frontsbase << "queries" << label << front->queries.load() << "\n";
     output << frontsbase << "responses" << label << front->responses.load() << "\n";
+    if (front->isUDP()) {
+      output << frontsbase << "udpsyscalls" << label << front->udpSyscalls.load() << "\n";
+    }
     if (front->isTCP()) {
       output << frontsbase << "tcpdiedreadingquery" << label << front->tcpDiedReadingQuery.load() << "\n";
       output << frontsbase << "tcpdiedsendingresponse" << label << front->tcpDiedSendingResponse.load() << "\n";
@@ -589,11 +773,11 @@ static void handlePrometheus(const YaHTTP::Request& req, YaHTTP::Response& resp)
         output << frontsbase << "tlsunknownticketkeys" << label << front->tlsUnknownTicketKey.load() << "\n";
         output << frontsbase << "tlsinactiveticketkeys" << label << front->tlsInactiveTicketKey.load() << "\n";
 
-        output << frontsbase << "tlsqueries{frontend=\"" << frontName << "\",proto=\"" << proto << "\",thread=\"" << threadNumber << "\",tls=\"tls10\"} " << front->tls10queries.load() << "\n";
-        output << frontsbase << "tlsqueries{frontend=\"" << frontName << "\",proto=\"" << proto << "\",thread=\"" << threadNumber << "\",tls=\"tls11\"} " << front->tls11queries.load() << "\n";
-        output << frontsbase << "tlsqueries{frontend=\"" << frontName << "\",proto=\"" << proto << "\",thread=\"" << threadNumber << "\",tls=\"tls12\"} " << front->tls12queries.load() << "\n";
-        output << frontsbase << "tlsqueries{frontend=\"" << frontName << "\",proto=\"" << proto << "\",thread=\"" << threadNumber << "\",tls=\"tls13\"} " << front->tls13queries.load() << "\n";
-        output << frontsbase << "tlsqueries{frontend=\"" << frontName << "\",proto=\"" << proto << "\",thread=\"" << threadNumber << "\",tls=\"unknown\"} " << front->tlsUnknownqueries.load() << "\n";
+        output << frontsbase << "tlsqueries{" << base << ",tls=\"tls10\"} " << front->tls10queries.load() << "\n";
+        output << frontsbase << "tlsqueries{" << base << ",tls=\"tls11\"} " << front->tls11queries.load() << "\n";
+        output << frontsbase << "tlsqueries{" << base << ",tls=\"tls12\"} " << front->tls12queries.load() << "\n";
+        output << frontsbase << "tlsqueries{" << base << ",tls=\"tls13\"} " << front->tls13queries.load() << "\n";
+        output << frontsbase << "tlsqueries{" << base << ",tls=\"unknown\"} " << front->tlsUnknownqueries.load() << "\n";
 
         const TLSErrorCounters* errorCounters = nullptr;
         if (front->tlsFrontend != nullptr) {
@@ -604,14 +788,14 @@ static void handlePrometheus(const YaHTTP::Request& req, YaHTTP::Response& resp)
         }
 
         if (errorCounters != nullptr) {
-          output << frontsbase << "tlshandshakefailures{frontend=\"" << frontName << "\",proto=\"" << proto << "\",thread=\"" << threadNumber << "\",error=\"dhKeyTooSmall\"} " << errorCounters->d_dhKeyTooSmall << "\n";
-          output << frontsbase << "tlshandshakefailures{frontend=\"" << frontName << "\",proto=\"" << proto << "\",thread=\"" << threadNumber << "\",error=\"inappropriateFallBack\"} " << errorCounters->d_inappropriateFallBack << "\n";
-          output << frontsbase << "tlshandshakefailures{frontend=\"" << frontName << "\",proto=\"" << proto << "\",thread=\"" << threadNumber << "\",error=\"noSharedCipher\"} " << errorCounters->d_noSharedCipher << "\n";
-          output << frontsbase << "tlshandshakefailures{frontend=\"" << frontName << "\",proto=\"" << proto << "\",thread=\"" << threadNumber << "\",error=\"unknownCipherType\"} " << errorCounters->d_unknownCipherType << "\n";
-          output << frontsbase << "tlshandshakefailures{frontend=\"" << frontName << "\",proto=\"" << proto << "\",thread=\"" << threadNumber << "\",error=\"unknownKeyExchangeType\"} " << errorCounters->d_unknownKeyExchangeType << "\n";
-          output << frontsbase << "tlshandshakefailures{frontend=\"" << frontName << "\",proto=\"" << proto << "\",thread=\"" << threadNumber << "\",error=\"unknownProtocol\"} " << errorCounters->d_unknownProtocol << "\n";
-          output << frontsbase << "tlshandshakefailures{frontend=\"" << frontName << "\",proto=\"" << proto << "\",thread=\"" << threadNumber << "\",error=\"unsupportedEC\"} " << errorCounters->d_unsupportedEC << "\n";
-          output << frontsbase << "tlshandshakefailures{frontend=\"" << frontName << "\",proto=\"" << proto << "\",thread=\"" << threadNumber << "\",error=\"unsupportedProtocol\"} " << errorCounters->d_unsupportedProtocol << "\n";
+          output << frontsbase << "tlshandshakefailures{" << base << ",error=\"dhKeyTooSmall\"} " << errorCounters->d_dhKeyTooSmall << "\n";
+          output << frontsbase << "tlshandshakefailures{" << base << ",error=\"inappropriateFallBack\"} " << errorCounters->d_inappropriateFallBack << "\n";
+          output << frontsbase << "tlshandshakefailures{" << base << ",error=\"noSharedCipher\"} " << errorCounters->d_noSharedCipher << "\n";
+          output << frontsbase << "tlshandshakefailures{" << base << ",error=\"unknownCipherType\"} " << errorCounters->d_unknownCipherType << "\n";
+          output << frontsbase << "tlshandshakefailures{" << base << ",error=\"unknownKeyExchangeType\"} " << errorCounters->d_unknownKeyExchangeType << "\n";
+          output << frontsbase << "tlshandshakefailures{" << base << ",error=\"unknownProtocol\"} " << errorCounters->d_unknownProtocol << "\n";
+          output << frontsbase << "tlshandshakefailures{" << base << ",error=\"unsupportedEC\"} " << errorCounters->d_unsupportedEC << "\n";
+          output << frontsbase << "tlshandshakefailures{" << base << ",error=\"unsupportedProtocol\"} " << errorCounters->d_unsupportedProtocol << "\n";
         }
       }
     }
@@ -636,17 +820,10 @@ static void handlePrometheus(const YaHTTP::Request& req, YaHTTP::Response& resp)
   output << "# TYPE " << frontsbase << "doh_version_status_responses " << "counter" << "\n";
 
 #ifdef HAVE_DNS_OVER_HTTPS
-  std::map<std::string,uint64_t> dohFrontendDuplicates;
-  for(const auto& doh : g_dohlocals) {
-    const string frontName = doh->d_local.toStringWithPort();
-    uint64_t threadNumber = 0;
-    auto dupPair = frontendDuplicates.insert({frontName, 1});
-    if (!dupPair.second) {
-      threadNumber = dupPair.first->second;
-      ++(dupPair.first->second);
-    }
-    const std::string addrlabel = boost::str(boost::format("frontend=\"%1%\",thread=\"%2%\"") % frontName % threadNumber);
-    const std::string label = "{" + addrlabel + "} ";
+  for (const auto& dohLabel : s_prometheusLabels.d_dohFrontends) {
+    const auto& doh = dohLabel.front;
+    const std::string& addrlabel = dohLabel.base;
+    const std::string& label = dohLabel.label;
 
     output << frontsbase << "http_connects" << label << doh->d_httpconnects << "\n";
     output << frontsbase << "doh_http_method_queries{method=\"get\"," << addrlabel << "} " << doh->d_getqueries << "\n";
@@ -701,6 +878,12 @@ static void handlePrometheus(const YaHTTP::Request& req, YaHTTP::Response& resp)
   output << "# TYPE dnsdist_pool_cache_insert_collisions " << "counter" << "\n";
   output << "# HELP dnsdist_pool_cache_ttl_too_shorts " << "Number of insertions into that cache skipped because the TTL of the answer was not long enough" << "\n";
   output << "# TYPE dnsdist_pool_cache_ttl_too_shorts " << "counter" << "\n";
+  output << "# HELP dnsdist_pool_cache_collapsed_queries " << "Number of cache misses that waited for the response to an identical query instead of being sent to a backend" << "\n";
+  output << "# TYPE dnsdist_pool_cache_collapsed_queries " << "counter" << "\n";
+  output << "# HELP dnsdist_pool_cache_collapsed_timeouts " << "Number of collapsed queries dropped because the response to the identical query did not arrive in time" << "\n";
+  output << "# TYPE dnsdist_pool_cache_collapsed_timeouts " << "counter" << "\n";
+  output << "# HELP dnsdist_pool_cache_prefetches " << "Number of queries sent to a backend to refresh an entry of that cache that was about to expire" << "\n";
+  output << "# TYPE dnsdist_pool_cache_prefetches " << "counter" << "\n";
 
   for (const auto& entry : *localPools) {
     string poolName = entry.first;
@@ -725,6 +908,9 @@ static void handlePrometheus(const YaHTTP::Request& req, YaHTTP::Response& resp)
       output << cachebase << "cache_lookup_collisions" <<label << " " << cache->getLookupCollisions() << "\n";
       output << cachebase << "cache_insert_collisions" <<label << " " << cache->getInsertCollisions() << "\n";
       output << cachebase << "cache_ttl_too_shorts"    <<label << " " << cache->getTTLTooShorts()     << "\n";
+      output << cachebase << "cache_collapsed_queries" <<label << " " << cache->getCollapsedQueries() << "\n";
+      output << cachebase << "cache_collapsed_timeouts"<<label << " " << cache->getCollapsedTimeouts() << "\n";
+      output << cachebase << "cache_prefetches"        <<label << " " << cache->getPrefetches()       << "\n";
     }
   }
 
@@ -740,7 +926,7 @@ static void handlePrometheus(const YaHTTP::Request& req, YaHTTP::Response& resp)
   auto topNetmasksByReason = DynBlockMaintenance::getHitsForTopNetmasks();
   for (const auto& entry : topNetmasksByReason) {
     for (const auto& netmask : entry.second) {
-      output << "dnsdist_dynblocks_nmg_top_offenders_hits_per_second{reason=\"" << entry.first << "\",netmask=\"" << netmask.first.toString() << "\"} " << netmask.second << "\n";
+      output << "dnsdist_dynblocks_nmg_top_offenders_hits_per_second{reason=\"" << escapePrometheusLabelValue(entry.first) << "\",netmask=\"" << netmask.first.toString() << "\"} " << netmask.second << "\n";
     }
   }
 
@@ -749,15 +935,45 @@ static void handlePrometheus(const YaHTTP::Request& req, YaHTTP::Response& resp)
   auto topSuffixesByReason = DynBlockMaintenance::getHitsForTopSuffixes();
   for (const auto& entry : topSuffixesByReason) {
     for (const auto& suffix : entry.second) {
-      output << "dnsdist_dynblocks_smt_top_offenders_hits_per_second{reason=\"" << entry.first << "\",suffix=\"" << suffix.first.toString() << "\"} " << suffix.second << "\n";
+      output << "dnsdist_dynblocks_smt_top_offenders_hits_per_second{reason=\"" << escapePrometheusLabelValue(entry.first) << "\",suffix=\"" << escapePrometheusLabelValue(suffix.first.toString()) << "\"} " << suffix.second << "\n";
+    }
+  }
+
+  output << "# HELP dnsdist_heavy_hitters " << "Estimated number of queries (or bytes for the bandwidth kind) for the top heavy hitters of each kind, decayed over time" << "\n";
+  output << "# TYPE dnsdist_heavy_hitters " << "gauge" << "\n";
+  if (g_heavyHitters.isEnabled()) {
+    const time_t now = time(nullptr);
+    for (const auto& kind : HeavyHitters::getKinds()) {
+      uint64_t total = 0;
+      for (const auto& entry : g_heavyHitters.getTop(kind, 10, total, now)) {
+        output << "dnsdist_heavy_hitters{kind=\"" << kind << "\",key=\"" << escapePrometheusLabelValue(entry.key) << "\"} " << entry.count << "\n";
+      }
     }
   }
 
+#ifdef HAVE_EBPF
+  if (g_defaultBPFFilter) {
+    output << "# HELP dnsdist_ebpf_entries " << "Number of entries in the maps of the default eBPF filter" << "\n";
+    output << "# TYPE dnsdist_ebpf_entries " << "gauge" << "\n";
+    output << "# HELP dnsdist_ebpf_dropped_queries " << "Number of queries dropped in the kernel by the default eBPF filter" << "\n";
+    output << "# TYPE dnsdist_ebpf_dropped_queries " << "counter" << "\n";
+
+    const auto counters = g_defaultBPFFilter->getCounters();
+    output << "dnsdist_ebpf_entries{map=\"v4\"} " << counters.v4Entries << "\n";
+    output << "dnsdist_ebpf_entries{map=\"v6\"} " << counters.v6Entries << "\n";
+    output << "dnsdist_ebpf_entries{map=\"qname\"} " << counters.qnameEntries << "\n";
+    output << "dnsdist_ebpf_dropped_queries{map=\"v4\"} " << counters.v4Hits << "\n";
+    output << "dnsdist_ebpf_dropped_queries{map=\"v6\"} " << counters.v6Hits << "\n";
+    output << "dnsdist_ebpf_dropped_queries{map=\"qname\"} " << counters.qnameHits << "\n";
+  }
+#endif /* HAVE_EBPF */
+
   output << "# HELP dnsdist_info " << "Info from dnsdist, value is always 1" << "\n";
   output << "# TYPE dnsdist_info " << "gauge" << "\n";
   output << "dnsdist_info{version=\"" << VERSION << "\"} " << "1" << "\n";
 
-  resp.body = output.str();
+  s_prometheusOutputSize.store(output.size());
+  resp.body = output.release();
   resp.headers["Content-Type"] = "text/plain";
 }
 
@@ -836,6 +1052,55 @@ static void handleJSONStats(const YaHTTP::Request& req, YaHTTP::Response& resp)
     resp.body = my_json.dump();
     resp.headers["Content-Type"] = "application/json";
   }
+  else if (command == "heavyhitters") {
+    size_t top = 10;
+    if (req.getvars.count("top")) {
+      try {
+        top = pdns_stou(req.getvars.at("top"));
+      }
+      catch (const std::exception& e) {
+        resp.status = 400;
+        return;
+      }
+    }
+
+    std::vector<std::string> kinds;
+    if (req.getvars.count("kind")) {
+      kinds.push_back(req.getvars.at("kind"));
+    }
+    else {
+      kinds = HeavyHitters::getKinds();
+    }
+
+    Json::object obj;
+    const time_t now = time(nullptr);
+    for (const auto& kind : kinds) {
+      uint64_t total = 0;
+      std::vector<HeavyHitters::Entry> entries;
+      try {
+        entries = g_heavyHitters.getTop(kind, top, total, now);
+      }
+      catch (const std::exception& e) {
+        resp.status = 404;
+        return;
+      }
+      Json::array items;
+      for (const auto& entry : entries) {
+        items.push_back(Json::object{
+          {"key", entry.key},
+          {"count", static_cast<double>(entry.count)}
+        });
+      }
+      obj.insert({kind, Json::object{
+        {"total", static_cast<double>(total)},
+        {"entries", items}
+      }});
+    }
+
+    Json my_json = obj;
+    resp.body = my_json.dump();
+    resp.headers["Content-Type"] = "application/json";
+  }
   else if (command == "ebpfblocklist") {
     Json::object obj;
 #ifdef HAVE_EBPF
@@ -907,6 +1172,8 @@ static void handleStats(const YaHTTP::Request& req, YaHTTP::Response& resp)
       {"tcpCurrentConnections", (double)a->tcpCurrentConnections},
       {"tcpNewConnections", (double)a->tcpNewConnections},
       {"tcpReusedConnections", (double)a->tcpReusedConnections},
+      {"tcpIdlePoolMisses", (double)a->tcpIdlePoolMisses},
+      {"tcpIdlePoolEvictions", (double)a->tcpIdlePoolEvictions},
       {"tcpAvgQueriesPerConnection", (double)a->tcpAvgQueriesPerConnection},
       {"tcpAvgConnectionDuration", (double)a->tcpAvgConnectionDuration},
       {"dropRate", (double)a->dropRate}
@@ -933,6 +1200,7 @@ static void handleStats(const YaHTTP::Request& req, YaHTTP::Response& resp)
       { "type", front->getType() },
       { "queries", (double) front->queries.load() },
       { "responses", (double) front->responses.load() },
+      { "udpSyscalls", (double) front->udpSyscalls.load() },
       { "tcpDiedReadingQuery", (double) front->tcpDiedReadingQuery.load() },
       { "tcpDiedSendingResponse", (double) front->tcpDiedSendingResponse.load() },
       { "tcpGaveUp", (double) front->tcpGaveUp.load() },
@@ -1023,7 +1291,10 @@ static void handleStats(const YaHTTP::Request& req, YaHTTP::Response& resp)
       { "cacheDeferredLookups", (double) (cache ? cache->getDeferredLookups() : 0) },
       { "cacheLookupCollisions", (double) (cache ? cache->getLookupCollisions() : 0) },
       { "cacheInsertCollisions", (double) (cache ? cache->getInsertCollisions() : 0) },
-      { "cacheTTLTooShorts", (double) (cache ? cache->getTTLTooShorts() : 0) }
+      { "cacheTTLTooShorts", (double) (cache ? cache->getTTLTooShorts() : 0) },
+      { "cacheCollapsedQueries", (double) (cache ? cache->getCollapsedQueries() : 0) },
+      { "cacheCollapsedTimeouts", (double) (cache ? cache->getCollapsedTimeouts() : 0) },
+      { "cachePrefetches", (double) (cache ? cache->getPrefetches() : 0) }
     };
     pools.push_back(entry);
   }
@@ -1295,10 +1566,115 @@ void registerBuiltInWebHandlers()
   }
 }
 
-static void connectionThread(WebClientConnection&& conn)
+#ifdef HAVE_ZLIB
+/* whether the client accepts a gzip-compressed response, and did not explicitly refuse it with q=0 */
+static bool acceptsGzip(const YaHTTP::Request& req)
 {
-  setThreadName("dnsdist/webConn");
+  const auto header = req.headers.find("accept-encoding");
+  if (header == req.headers.end()) {
+    return false;
+  }
+
+  std::vector<std::string> codings;
+  stringtok(codings, header->second, ",");
+  for (const auto& coding : codings) {
+    std::vector<std::string> parts;
+    stringtok(parts, coding, "; \t");
+    if (parts.empty() || (!pdns_iequals(parts.at(0), "gzip") && parts.at(0) != "*")) {
+      continue;
+    }
+
+    for (size_t idx = 1; idx < parts.size(); idx++) {
+      if (parts.at(idx).compare(0, 2, "q=") == 0 && std::atof(parts.at(idx).c_str() + 2) <= 0.0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  return false;
+}
+
+static bool gzipCompress(const std::string& input, std::string& output)
+{
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  /* the output is mostly text that compresses very well even at the fastest level, and we care about the CPU usage */
+  if (deflateInit2(&stream, Z_BEST_SPEED, Z_DEFLATED, 15 + 16 /* gzip header */, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    return false;
+  }
+
+  output.resize(deflateBound(&stream, input.size()));
+  stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.data()));
+  stream.avail_in = input.size();
+  stream.next_out = reinterpret_cast<Bytef*>(&output.at(0));
+  stream.avail_out = output.size();
+
+  int res = deflate(&stream, Z_FINISH);
+  deflateEnd(&stream);
+  if (res != Z_STREAM_END) {
+    return false;
+  }
+
+  output.resize(stream.total_out);
+  return true;
+}
+#endif /* HAVE_ZLIB */
+
+/* below that size, compressing the response is not worth it */
+static const size_t s_minimumSizeToCompress{1024};
+/* how long we wait for a client to send its whole request, then to read our whole response */
+static const int s_connectionIOTimeout{5};
+
+/* the time left until that deadline, false if it has already passed */
+static bool getRemainingTime(const struct timeval& deadline, int& seconds, int& useconds)
+{
+  struct timeval now;
+  gettimeofday(&now, nullptr);
+  if (!(now < deadline)) {
+    return false;
+  }
+
+  const struct timeval remaining = deadline - now;
+  seconds = remaining.tv_sec;
+  useconds = remaining.tv_usec;
+  return true;
+}
 
+static struct timeval getConnectionDeadline()
+{
+  struct timeval deadline;
+  gettimeofday(&deadline, nullptr);
+  deadline.tv_sec += s_connectionIOTimeout;
+  return deadline;
+}
+
+static void writeWithDeadline(int fd, const std::string& data, const struct timeval& deadline)
+{
+  size_t pos = 0;
+  while (pos < data.size()) {
+    ssize_t written = write(fd, data.data() + pos, data.size() - pos);
+    if (written > 0) {
+      pos += static_cast<size_t>(written);
+      continue;
+    }
+    if (written == 0) {
+      throw std::runtime_error("EOF while writing the response");
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      throw std::runtime_error("Error while writing the response: " + stringerror());
+    }
+
+    int seconds = 0;
+    int useconds = 0;
+    if (!getRemainingTime(deadline, seconds, useconds) || waitForRWData(fd, false, seconds, useconds) <= 0) {
+      throw std::runtime_error("Timeout while writing the response");
+    }
+  }
+}
+
+static void handleConnection(WebClientConnection&& conn)
+{
   vinfolog("Webserver handling connection from %s", conn.getClient().toStringWithPort());
 
   try {
@@ -1306,10 +1682,26 @@ static void connectionThread(WebClientConnection&& conn)
     YaHTTP::Request req;
     bool finished = false;
 
+    /* a client that does not send its request or read the response, or does so very slowly,
+       would otherwise hold one of the worker threads forever, so the whole request has to be
+       received before a deadline */
+    setNonBlocking(conn.getSocket().getHandle());
+    const struct timeval readDeadline = getConnectionDeadline();
+
     yarl.initialize(&req);
     while (!finished) {
       int bytes;
       char buf[1024];
+      int seconds = 0;
+      int useconds = 0;
+      if (!getRemainingTime(readDeadline, seconds, useconds)) {
+        break;
+      }
+      int ready = waitForData(conn.getSocket().getHandle(), seconds, useconds);
+      if (ready <= 0) {
+        // timeout or error
+        break;
+      }
       bytes = read(conn.getSocket().getHandle(), buf, sizeof(buf));
       if (bytes > 0) {
         string data = string(buf, bytes);
@@ -1365,10 +1757,26 @@ static void connectionThread(WebClientConnection&& conn)
       }
     }
 
+#ifdef HAVE_ZLIB
+    if (resp.status == 200 && resp.body.size() >= s_minimumSizeToCompress && resp.headers.count("content-encoding") == 0 && acceptsGzip(req)) {
+      std::string compressed;
+      if (gzipCompress(resp.body, compressed)) {
+        resp.body = std::move(compressed);
+        resp.headers["Content-Encoding"] = "gzip";
+        resp.headers["Vary"] = "Accept-Encoding";
+        /* a Lua handler might have set it for the uncompressed body */
+        auto contentLength = resp.headers.find("content-length");
+        if (contentLength != resp.headers.end()) {
+          contentLength->second = std::to_string(resp.body.size());
+        }
+      }
+    }
+#endif /* HAVE_ZLIB */
+
     std::ostringstream ofs;
     ofs << resp;
     string done = ofs.str();
-    writen2(conn.getSocket().getHandle(), done.c_str(), done.size());
+    writeWithDeadline(conn.getSocket().getHandle(), done, getConnectionDeadline());
   }
   catch (const YaHTTP::ParseError& e) {
     vinfolog("Webserver thread died with parse error exception while processing a request from %s: %s", conn.getClient().toStringWithPort(), e.what());
@@ -1429,6 +1837,71 @@ void setWebserverMaxConcurrentConnections(size_t max)
   s_connManager.setMaxConcurrentConnections(max);
 }
 
+/* The connections accepted by the webserver are handled by a bounded pool of threads,
+   created on demand, instead of a new thread per connection. */
+class WebserverWorkers
+{
+public:
+  void setMaxThreads(size_t max)
+  {
+    std::lock_guard<std::mutex> lock(d_lock);
+    d_maxThreads = max > 0 ? max : 1;
+  }
+
+  void push(WebClientConnection&& conn)
+  {
+    std::lock_guard<std::mutex> lock(d_lock);
+    d_queue.push_back(std::move(conn));
+
+    /* an idle worker that has been notified but has not run yet is still counted as idle,
+       so compare the number of waiting connections to the number of idle workers */
+    if (d_queue.size() > d_idle && d_threads < d_maxThreads) {
+      std::thread t([this]() { worker(); });
+      t.detach();
+      ++d_threads;
+    }
+    if (d_idle > 0) {
+      d_cond.notify_one();
+    }
+  }
+
+private:
+  void worker()
+  {
+    setThreadName("dnsdist/webConn");
+
+    for (;;) {
+      std::unique_lock<std::mutex> lock(d_lock);
+      while (d_queue.empty()) {
+        ++d_idle;
+        d_cond.wait(lock);
+        --d_idle;
+      }
+
+      WebClientConnection conn(std::move(d_queue.front()));
+      d_queue.pop_front();
+      lock.unlock();
+
+      handleConnection(std::move(conn));
+    }
+  }
+
+  std::mutex d_lock;
+  std::condition_variable d_cond;
+  /* the number of waiting connections is bounded by the maximum number of concurrent connections, if any */
+  std::deque<WebClientConnection> d_queue;
+  size_t d_maxThreads{4};
+  size_t d_threads{0};
+  size_t d_idle{0};
+};
+
+static WebserverWorkers s_webserverWorkers;
+
+void setWebserverMaxThreads(size_t max)
+{
+  s_webserverWorkers.setMaxThreads(max);
+}
+
 void dnsdistWebserverThread(int sock, const ComboAddress& local)
 {
   setThreadName("dnsdist/webserv");
@@ -1455,8 +1928,7 @@ void dnsdistWebserverThread(int sock, const ComboAddress& local)
       WebClientConnection conn(remote, fd);
       vinfolog("Got a connection to the webserver from %s", remote.toStringWithPort());
 
-      std::thread t(connectionThread, std::move(conn));
-      t.detach();
+      s_webserverWorkers.push(std::move(conn));
     }
     catch (const std::exception& e) {
       errlog("Had an error accepting new webserver connection: %s", e.what());
@@ -28,6 +28,7 @@
 #include <limits>
 #include <netinet/tcp.h>
 #include <pwd.h>
+#include <queue>
 #include <sys/resource.h>
 #include <unistd.h>
 
@@ -44,12 +45,21 @@
 #include <systemd/sd-daemon.h>
 #endif
 
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif /* HAVE_LIBURING */
+
+#ifdef __linux__
+#include <linux/filter.h>
+#endif
+
 #include "dnsdist.hh"
 #include "dnsdist-cache.hh"
 #include "dnsdist-console.hh"
 #include "dnsdist-dynblocks.hh"
 #include "dnsdist-ecs.hh"
 #include "dnsdist-healthchecks.hh"
+#include "dnsdist-heavyhitters.hh"
 #include "dnsdist-lua.hh"
 #include "dnsdist-proxy-protocol.hh"
 #include "dnsdist-rings.hh"
@@ -475,6 +485,49 @@ bool processResponse(PacketBuffer& response, LocalStateHolder<vector<DNSDistResp
   return true;
 }
 
+/* apply the response rules to a response that did not come from a backend (self-generated,
+   cache hit or response to a collapsed query), then encrypt it if needed */
+static bool applyRulesToOutgoingResponse(LocalStateHolder<vector<DNSDistResponseRuleAction> >& respRuleActions, const ClientState& cs, DNSQuestion& dq)
+{
+  DNSResponse dr(dq.qname, dq.qtype, dq.qclass, dq.local, dq.remote, dq.getMutableData(), dq.tcp, dq.queryTime);
+
+  dr.uniqueId = dq.uniqueId;
+  dr.qTag = dq.qTag;
+  dr.delayMsec = dq.delayMsec;
+
+  if (!applyRulesToResponse(respRuleActions, dr)) {
+    return false;
+  }
+
+  /* in case a rule changed it */
+  dq.delayMsec = dr.delayMsec;
+
+#ifdef HAVE_DNSCRYPT
+  if (!cs.muted) {
+    if (!encryptResponse(dq.getMutableData(), dq.getMaximumSize(), dq.tcp, dq.dnsCryptQuery)) {
+      return false;
+    }
+  }
+#endif /* HAVE_DNSCRYPT */
+
+  return true;
+}
+
+static void updateFrontendRCodeStats(uint8_t rcode)
+{
+  switch (rcode) {
+  case RCode::NXDomain:
+    ++g_stats.frontendNXDomain;
+    break;
+  case RCode::ServFail:
+    ++g_stats.frontendServFail;
+    break;
+  case RCode::NoError:
+    ++g_stats.frontendNoError;
+    break;
+  }
+}
+
 static size_t getInitialUDPPacketBufferSize()
 {
   static_assert(s_udpIncomingBufferSize <= s_initialUDPPacketBufferSize, "The incoming buffer size should not be larger than s_initialUDPPacketBufferSize");
@@ -522,9 +575,9 @@ static bool sendUDPResponse(int origFD, const PacketBuffer& response, const int
   return true;
 }
 
-int pickBackendSocketForSending(std::shared_ptr<DownstreamState>& state)
+int pickBackendSocketForSending(std::shared_ptr<DownstreamState>& state, size_t workerId)
 {
-  return state->sockets[state->socketsOffset++ % state->sockets.size()];
+  return state->getSocketForSending(workerId);
 }
 
 static void pickBackendSocketsReadyForReceiving(const std::shared_ptr<DownstreamState>& state, std::vector<int>& ready)
@@ -542,22 +595,289 @@ static void pickBackendSocketsReadyForReceiving(const std::shared_ptr<Downstream
   }
 }
 
+/* the response to a query that identical queries have been waiting for has been received,
+   so answer them as if it had been found in the cache: the content is the one inserted
+   into the cache, and the cache-hit response rules are applied for every waiter.
+   When there is no such response, because it was dropped, could not be cached or the
+   query could not even be sent, the waiters get a ServFail instead of waiting until
+   the maximum collapse wait time has been reached */
+static void sendResponseToInFlightWaiters(const DNSQuestion& dq, const DNSName& qname, const PacketBuffer* response, LocalStateHolder<vector<DNSDistResponseRuleAction> >* cacheHitRespRuleActions, const ComboAddress& backend)
+{
+  auto waiters = dq.packetCache->takeInFlightWaiters(dq.cacheKey, dq.origFlags, qname, dq.qtype, dq.qclass, dq.dnssecOK, dq.subnet);
+  if (waiters.empty()) {
+    return;
+  }
+
+  if (response != nullptr && response->size() < sizeof(dnsheader)) {
+    response = nullptr;
+  }
+
+  const bool hasQuestion = response != nullptr && reinterpret_cast<const struct dnsheader*>(response->data())->qdcount != 0;
+  struct timespec now;
+  gettime(&now, true);
+  struct timespec ringsTime;
+  gettime(&ringsTime);
+
+  PacketBuffer waiterResponse;
+  for (const auto& waiter : waiters) {
+    if (waiter.cs == nullptr || waiter.cs->muted) {
+      continue;
+    }
+
+    if (response != nullptr) {
+      /* the queries only differ by their ID and the case of the qname */
+      waiterResponse = *response;
+      memcpy(waiterResponse.data(), &waiter.origID, sizeof(waiter.origID));
+      const auto& qnameStorage = waiter.qname.getStorage();
+      if (hasQuestion && waiterResponse.size() >= (sizeof(dnsheader) + qnameStorage.size())) {
+        memcpy(&waiterResponse.at(sizeof(dnsheader)), qnameStorage.data(), qnameStorage.size());
+      }
+    }
+    else {
+      const auto& qnameStorage = waiter.qname.getStorage();
+      waiterResponse.clear();
+      waiterResponse.resize(sizeof(dnsheader) + qnameStorage.size() + 4);
+      auto dh = reinterpret_cast<struct dnsheader*>(waiterResponse.data());
+      dh->id = waiter.origID;
+      restoreFlags(dh, dq.origFlags);
+      dh->qr = true;
+      dh->rcode = RCode::ServFail;
+      dh->qdcount = htons(1);
+      size_t pos = sizeof(dnsheader);
+      memcpy(&waiterResponse.at(pos), qnameStorage.data(), qnameStorage.size());
+      pos += qnameStorage.size();
+      waiterResponse.at(pos++) = dq.qtype / 256;
+      waiterResponse.at(pos++) = dq.qtype % 256;
+      waiterResponse.at(pos++) = dq.qclass / 256;
+      waiterResponse.at(pos++) = dq.qclass % 256;
+    }
+
+    DNSQuestion waiterDQ(&waiter.qname, dq.qtype, dq.qclass, &waiter.origDest, &waiter.origRemote, waiterResponse, false, &waiter.queryTime);
+    if (cacheHitRespRuleActions != nullptr && response != nullptr) {
+      if (!applyRulesToOutgoingResponse(*cacheHitRespRuleActions, *waiter.cs, waiterDQ)) {
+        continue;
+      }
+    }
+
+    sendUDPResponse(waiter.origFD, waiterResponse, waiterDQ.delayMsec, waiter.hopLocal, waiter.hopRemote);
+    ++g_stats.responses;
+    ++waiter.cs->responses;
+
+    const auto* dh = reinterpret_cast<const struct dnsheader*>(waiterResponse.data());
+    double udiff = (now.tv_sec - waiter.queryTime.tv_sec) * 1000000.0 + (now.tv_nsec - waiter.queryTime.tv_nsec) / 1000.0;
+    if (udiff < 0) {
+      udiff = 0;
+    }
+    g_rings.insertResponse(ringsTime, waiter.origRemote, waiter.qname, dq.qtype, static_cast<unsigned int>(udiff), static_cast<unsigned int>(waiterResponse.size()), *dh, backend);
+    g_heavyHitters.insertResponse(waiter.origRemote, waiter.qname, dh->rcode, static_cast<unsigned int>(waiterResponse.size()), ringsTime.tv_sec);
+    if (dh->rcode == RCode::ServFail) {
+      ++g_stats.servfailResponses;
+    }
+    updateFrontendRCodeStats(dh->rcode);
+    doLatencyStats(udiff);
+  }
+}
+
+/* process a response received from a backend over UDP, and relay it to the original requestor */
+static void processUDPResponseFromBackend(const std::shared_ptr<DownstreamState>& dss, PacketBuffer& response, LocalStateHolder<vector<DNSDistResponseRuleAction> >& localRespRuleActions, LocalStateHolder<vector<DNSDistResponseRuleAction> >& localCacheHitRespRuleActions)
+{
+  /* the response might be altered (truncated, encrypted..) during its processing,
+     but we want to record the size of what we received in the ring buffer */
+  const size_t got = response.size();
+  /* when the answer is encrypted in place, we need to get a copy
+     of the original header before encryption to fill the ring buffer */
+  dnsheader cleartextDH;
+  uint16_t queryId = 0;
+
+  try {
+    dnsheader* dh = reinterpret_cast<struct dnsheader*>(response.data());
+    queryId = dh->id;
+
+    if (queryId >= dss->idStates.size()) {
+      return;
+    }
+
+    IDState* ids = &dss->idStates[queryId];
+    int64_t usageIndicator = ids->usageIndicator;
+
+    if (!IDState::isInUse(usageIndicator)) {
+      /* the corresponding state is marked as not in use, meaning that:
+         - it was already cleaned up by another thread and the state is gone ;
+         - we already got a response for this query and this one is a duplicate.
+         Either way, we don't touch it.
+      */
+      return;
+    }
+
+    /* read the potential DOHUnit state as soon as possible, but don't use it
+       until we have confirmed that we own this state by updating usageIndicator */
+    auto du = ids->du;
+    /* setting age to 0 to prevent the maintainer thread from
+       cleaning this IDS while we process the response.
+    */
+    ids->age = 0;
+    int origFD = ids->origFD;
+    bool inFlightLeader = ids->inFlightLeader;
+    /* a query sent to refresh a cache entry, no client is waiting for the response */
+    bool cacheRefresh = ids->cs == nullptr;
+
+    unsigned int qnameWireLength = 0;
+    if (!responseContentMatches(response, ids->qname, ids->qtype, ids->qclass, dss->remote, qnameWireLength)) {
+      return;
+    }
+
+    bool isDoH = du != nullptr;
+    /* atomically mark the state as available, but only if it has not been altered
+       in the meantime */
+    if (ids->tryMarkUnused(usageIndicator)) {
+      /* clear the potential DOHUnit asap, it's ours now
+       and since we just marked the state as unused,
+       someone could overwrite it. */
+      ids->du = nullptr;
+      /* we only decrement the outstanding counter if the value was not
+         altered in the meantime, which would mean that the state has been actively reused
+         and the other thread has not incremented the outstanding counter, so we don't
+         want it to be decremented twice. */
+      --dss->outstanding;  // you'd think an attacker could game this, but we're using connected socket
+    } else {
+      /* someone updated the state in the meantime, we can't touch the existing pointer */
+      du = nullptr;
+      /* since the state has been updated, we can't safely access it so let's just drop
+         this response */
+      return;
+    }
+
+    dh->id = ids->origID;
+
+    DNSResponse dr = makeDNSResponseFromIDState(*ids, response, false);
+    if (dh->tc && g_truncateTC) {
+      truncateTC(response, dr.getMaximumSize(), qnameWireLength);
+    }
+    memcpy(&cleartextDH, dr.getHeader(), sizeof(cleartextDH));
+
+    if (!processResponse(response, localRespRuleActions, dr, ids->cs && ids->cs->muted)) {
+      if (inFlightLeader && dr.packetCache) {
+        sendResponseToInFlightWaiters(dr, *dr.qname, nullptr, nullptr, dss->remote);
+      }
+      return;
+    }
+
+    if (ids->cs && !ids->cs->muted) {
+      if (du) {
+  #ifdef HAVE_DNS_OVER_HTTPS
+        // DoH query
+        du->response = std::move(response);
+        static_assert(sizeof(du) <= PIPE_BUF, "Writes up to PIPE_BUF are guaranteed not to be interleaved and to either fully succeed or fail");
+        ssize_t sent = write(du->rsock, &du, sizeof(du));
+        if (sent != sizeof(du)) {
+          if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            ++g_stats.dohResponsePipeFull;
+            vinfolog("Unable to pass a DoH response to the DoH worker thread because the pipe is full");
+          }
+          else {
+            vinfolog("Unable to pass a DoH response to the DoH worker thread because we couldn't write to the pipe: %s", stringerror());
+          }
+
+          /* at this point we have the only remaining pointer on this
+             DOHUnit object since we did set ids->du to nullptr earlier,
+             except if we got the response before the pointer could be
+             released by the frontend */
+          du->release();
+        }
+  #endif /* HAVE_DNS_OVER_HTTPS */
+        du = nullptr;
+      }
+      else {
+        ComboAddress empty;
+        empty.sin4.sin_family = 0;
+        sendUDPResponse(origFD, response, dr.delayMsec, ids->hopLocal, ids->hopRemote);
+      }
+    }
+
+    if (inFlightLeader && dr.packetCache) {
+      /* the response has only been inserted into the cache if these conditions were met, see processResponse() */
+      const bool cached = !dr.skipCache && response.size() <= s_maxPacketCacheEntrySize;
+      sendResponseToInFlightWaiters(dr, *dr.qname, cached ? &response : nullptr, &localCacheHitRespRuleActions, dss->remote);
+    }
+
+    if (cacheRefresh) {
+      ++dss->responses;
+      double udiff = ids->sentTime.udiff();
+      vinfolog("Got answer from %s refreshing the cache entry for %s|%s, took %f usec", dss->remote.toStringWithPort(), dr.qname->toLogString(), QType(dr.qtype).getName(), udiff);
+      dss->latencyUsec = (127.0 * dss->latencyUsec / 128.0) + udiff/128.0;
+      return;
+    }
+
+    ++g_stats.responses;
+    if (ids->cs) {
+      ++ids->cs->responses;
+    }
+    ++dss->responses;
+
+    double udiff = ids->sentTime.udiff();
+    vinfolog("Got answer from %s, relayed to %s%s, took %f usec", dss->remote.toStringWithPort(), ids->origRemote.toStringWithPort(),
+             isDoH ? " (https)": "", udiff);
+
+    struct timespec ts;
+    gettime(&ts);
+    g_rings.insertResponse(ts, *dr.remote, *dr.qname, dr.qtype, static_cast<unsigned int>(udiff), static_cast<unsigned int>(got), cleartextDH, dss->remote);
+    g_heavyHitters.insertResponse(*dr.remote, *dr.qname, cleartextDH.rcode, static_cast<unsigned int>(got), ts.tv_sec);
+
+    switch (cleartextDH.rcode) {
+    case RCode::NXDomain:
+      ++g_stats.frontendNXDomain;
+      break;
+    case RCode::ServFail:
+      ++g_stats.servfailResponses;
+      ++g_stats.frontendServFail;
+      ++dss->servfailResponses;
+      break;
+    case RCode::NoError:
+      ++g_stats.frontendNoError;
+      break;
+    }
+    dss->latencyUsec = (127.0 * dss->latencyUsec / 128.0) + udiff/128.0;
+
+    doLatencyStats(udiff);
+  }
+  catch (const std::exception& e) {
+    vinfolog("Got an error in UDP responder thread while parsing a response from %s, id %d: %s", dss->remote.toStringWithPort(), queryId, e.what());
+  }
+}
+
 // listens on a dedicated socket, lobs answers from downstream servers to original requestors
 void responderThread(std::shared_ptr<DownstreamState> dss)
 {
   try {
   setThreadName("dnsdist/respond");
   auto localRespRuleActions = g_respruleactions.getLocal();
+  auto localCacheHitRespRuleActions = g_cachehitrespruleactions.getLocal();
   const size_t initialBufferSize = getInitialUDPPacketBufferSize();
   PacketBuffer response(initialBufferSize);
 
-  /* when the answer is encrypted in place, we need to get a copy
-     of the original header before encryption to fill the ring buffer */
-  dnsheader cleartextDH;
-  uint16_t queryId = 0;
   std::vector<int> sockets;
   sockets.reserve(dss->sockets.size());
 
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE)
+  /* if we are allowed to, we drain as many responses as possible from a ready
+     socket in a single recvmmsg() call */
+  const size_t vectSize = g_udpVectorSize;
+  std::vector<PacketBuffer> responses;
+  std::unique_ptr<struct iovec[]> iovs;
+  std::unique_ptr<struct mmsghdr[]> msgVec;
+  if (vectSize > 1) {
+    responses.resize(vectSize);
+    iovs = std::unique_ptr<struct iovec[]>(new struct iovec[vectSize]);
+    msgVec = std::unique_ptr<struct mmsghdr[]>(new struct mmsghdr[vectSize]);
+    for (size_t idx = 0; idx < vectSize; idx++) {
+      /* the sockets are connected, we don't need the address of the sender */
+      memset(&msgVec[idx].msg_hdr, 0, sizeof(msgVec[idx].msg_hdr));
+      msgVec[idx].msg_hdr.msg_iov = &iovs[idx];
+      msgVec[idx].msg_hdr.msg_iovlen = 1;
+    }
+  }
+#endif /* defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE) */
+
   for(;;) {
     try {
       pickBackendSocketsReadyForReceiving(dss, sockets);
@@ -566,149 +886,55 @@ void responderThread(std::shared_ptr<DownstreamState> dss)
       }
 
       for (const auto& fd : sockets) {
-        response.resize(initialBufferSize);
-        ssize_t got = recv(fd, response.data(), response.size(), 0);
-
-        if (got == 0 && dss->isStopped()) {
-          break;
-        }
-
-        if (got < 0 || static_cast<size_t>(got) < sizeof(dnsheader)) {
-          continue;
-        }
-
-        response.resize(static_cast<size_t>(got));
-        dnsheader* dh = reinterpret_cast<struct dnsheader*>(response.data());
-        queryId = dh->id;
-
-        if (queryId >= dss->idStates.size()) {
-          continue;
-        }
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE)
+        if (vectSize > 1) {
+          /* the buffers might have been moved away (DoH) or shrunk by the processing of the previous batch */
+          for (size_t idx = 0; idx < vectSize; idx++) {
+            responses[idx].resize(initialBufferSize);
+            iovs[idx].iov_base = responses[idx].data();
+            iovs[idx].iov_len = responses[idx].size();
+          }
 
-        IDState* ids = &dss->idStates[queryId];
-        int64_t usageIndicator = ids->usageIndicator;
+          /* block until we have at least one response ready, but return as many as possible */
+          int msgsGot = recvmmsg(fd, msgVec.get(), vectSize, MSG_WAITFORONE, nullptr);
+          if (msgsGot <= 0) {
+            continue;
+          }
 
-        if (!IDState::isInUse(usageIndicator)) {
-          /* the corresponding state is marked as not in use, meaning that:
-             - it was already cleaned up by another thread and the state is gone ;
-             - we already got a response for this query and this one is a duplicate.
-             Either way, we don't touch it.
-          */
-          continue;
-        }
+          for (int msgIdx = 0; msgIdx < msgsGot; msgIdx++) {
+            const size_t got = msgVec[msgIdx].msg_len;
+            if (got < sizeof(dnsheader)) {
+              continue;
+            }
 
-        /* read the potential DOHUnit state as soon as possible, but don't use it
-           until we have confirmed that we own this state by updating usageIndicator */
-        auto du = ids->du;
-        /* setting age to 0 to prevent the maintainer thread from
-           cleaning this IDS while we process the response.
-        */
-        ids->age = 0;
-        int origFD = ids->origFD;
-
-        unsigned int qnameWireLength = 0;
-        if (!responseContentMatches(response, ids->qname, ids->qtype, ids->qclass, dss->remote, qnameWireLength)) {
-          continue;
-        }
+            responses[msgIdx].resize(got);
+            processUDPResponseFromBackend(dss, responses[msgIdx], localRespRuleActions, localCacheHitRespRuleActions);
+          }
 
-        bool isDoH = du != nullptr;
-        /* atomically mark the state as available, but only if it has not been altered
-           in the meantime */
-        if (ids->tryMarkUnused(usageIndicator)) {
-          /* clear the potential DOHUnit asap, it's ours now
-           and since we just marked the state as unused,
-           someone could overwrite it. */
-          ids->du = nullptr;
-          /* we only decrement the outstanding counter if the value was not
-             altered in the meantime, which would mean that the state has been actively reused
-             and the other thread has not incremented the outstanding counter, so we don't
-             want it to be decremented twice. */
-          --dss->outstanding;  // you'd think an attacker could game this, but we're using connected socket
-        } else {
-          /* someone updated the state in the meantime, we can't touch the existing pointer */
-          du = nullptr;
-          /* since the state has been updated, we can't safely access it so let's just drop
-             this response */
+          if (msgVec[0].msg_len == 0 && dss->isStopped()) {
+            break;
+          }
           continue;
         }
+#endif /* defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE) */
 
-        dh->id = ids->origID;
+        response.resize(initialBufferSize);
+        ssize_t got = recv(fd, response.data(), response.size(), 0);
 
-        DNSResponse dr = makeDNSResponseFromIDState(*ids, response, false);
-        if (dh->tc && g_truncateTC) {
-          truncateTC(response, dr.getMaximumSize(), qnameWireLength);
+        if (got == 0 && dss->isStopped()) {
+          break;
         }
-        memcpy(&cleartextDH, dr.getHeader(), sizeof(cleartextDH));
 
-        if (!processResponse(response, localRespRuleActions, dr, ids->cs && ids->cs->muted)) {
+        if (got < 0 || static_cast<size_t>(got) < sizeof(dnsheader)) {
           continue;
         }
 
-        if (ids->cs && !ids->cs->muted) {
-          if (du) {
-#ifdef HAVE_DNS_OVER_HTTPS
-            // DoH query
-            du->response = std::move(response);
-            static_assert(sizeof(du) <= PIPE_BUF, "Writes up to PIPE_BUF are guaranteed not to be interleaved and to either fully succeed or fail");
-            ssize_t sent = write(du->rsock, &du, sizeof(du));
-            if (sent != sizeof(du)) {
-              if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                ++g_stats.dohResponsePipeFull;
-                vinfolog("Unable to pass a DoH response to the DoH worker thread because the pipe is full");
-              }
-              else {
-                vinfolog("Unable to pass a DoH response to the DoH worker thread because we couldn't write to the pipe: %s", stringerror());
-              }
-
-              /* at this point we have the only remaining pointer on this
-                 DOHUnit object since we did set ids->du to nullptr earlier,
-                 except if we got the response before the pointer could be
-                 released by the frontend */
-              du->release();
-            }
-#endif /* HAVE_DNS_OVER_HTTPS */
-            du = nullptr;
-          }
-          else {
-            ComboAddress empty;
-            empty.sin4.sin_family = 0;
-            sendUDPResponse(origFD, response, dr.delayMsec, ids->hopLocal, ids->hopRemote);
-          }
-        }
-
-        ++g_stats.responses;
-        if (ids->cs) {
-          ++ids->cs->responses;
-        }
-        ++dss->responses;
-
-        double udiff = ids->sentTime.udiff();
-        vinfolog("Got answer from %s, relayed to %s%s, took %f usec", dss->remote.toStringWithPort(), ids->origRemote.toStringWithPort(),
-                 isDoH ? " (https)": "", udiff);
-
-        struct timespec ts;
-        gettime(&ts);
-        g_rings.insertResponse(ts, *dr.remote, *dr.qname, dr.qtype, static_cast<unsigned int>(udiff), static_cast<unsigned int>(got), cleartextDH, dss->remote);
-
-        switch (cleartextDH.rcode) {
-        case RCode::NXDomain:
-          ++g_stats.frontendNXDomain;
-          break;
-        case RCode::ServFail:
-          ++g_stats.servfailResponses;
-          ++g_stats.frontendServFail;
-          break;
-        case RCode::NoError:
-          ++g_stats.frontendNoError;
-          break;
-        }
-        dss->latencyUsec = (127.0 * dss->latencyUsec / 128.0) + udiff/128.0;
-
-        doLatencyStats(udiff);
+        response.resize(static_cast<size_t>(got));
+        processUDPResponseFromBackend(dss, response, localRespRuleActions, localCacheHitRespRuleActions);
       }
     }
     catch (const std::exception& e){
-      vinfolog("Got an error in UDP responder thread while parsing a response from %s, id %d: %s", dss->remote.toStringWithPort(), queryId, e.what());
+      vinfolog("Got an error in UDP responder thread while waiting for responses from %s: %s", dss->remote.toStringWithPort(), e.what());
     }
   }
 }
@@ -846,6 +1072,7 @@ bool processRulesResult(const DNSAction::Action& action, DNSQuestion& dq, std::s
 static bool applyRulesToQuery(LocalHolders& holders, DNSQuestion& dq, const struct timespec& now)
 {
   g_rings.insertQuery(now, *dq.remote, *dq.qname, dq.qtype, dq.getData().size(), *dq.getHeader());
+  g_heavyHitters.insertQuery(*dq.remote, *dq.qname, now.tv_sec);
 
   if(g_qcount.enabled) {
     string qname = (*dq.qname).toLogString();
@@ -985,15 +1212,18 @@ static bool applyRulesToQuery(LocalHolders& holders, DNSQuestion& dq, const stru
   DNSAction::Action action=DNSAction::Action::None;
   string ruleresult;
   bool drop = false;
-  for(const auto& lr : *holders.ruleactions) {
+  /* only the rules that could match this query are evaluated, in order */
+  holders.compiledRuleactions.update(*holders.ruleactions);
+  holders.compiledRuleactions.forEachCandidate(dq, [&](const DNSDistRuleAction& lr) {
     if(lr.d_rule->matches(&dq)) {
       lr.d_rule->d_matches++;
       action=(*lr.d_action)(&dq, &ruleresult);
       if (processRulesResult(action, dq, ruleresult, drop)) {
-        break;
+        return true;
       }
     }
-  }
+    return false;
+  });
 
   if (drop) {
     return false;
@@ -1123,48 +1353,212 @@ static void queueResponse(const ClientState& cs, const PacketBuffer& response, c
 }
 #endif /* defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE) */
 
-/* self-generated responses or cache hits */
-static bool prepareOutgoingResponse(LocalHolders& holders, ClientState& cs, DNSQuestion& dq, bool cacheHit)
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE)
+/* queries that need to be forwarded to a backend while processing a batch of
+   queries received via recvmmsg() are queued, then sent using a single
+   sendmmsg() call per backend socket once the whole batch has been processed */
+class UDPBackendSendBatch
 {
-  DNSResponse dr(dq.qname, dq.qtype, dq.qclass, dq.local, dq.remote, dq.getMutableData(), dq.tcp, dq.queryTime);
+public:
+  UDPBackendSendBatch(size_t maxSize): d_pending(maxSize), d_msgs(maxSize)
+  {
+  }
 
-  dr.uniqueId = dq.uniqueId;
-  dr.qTag = dq.qTag;
-  dr.delayMsec = dq.delayMsec;
+  /* the query buffer has to stay valid, and unmodified, until flush() has been called */
+  void queue(std::shared_ptr<DownstreamState>& ss, const PacketBuffer& query, size_t workerId)
+  {
+    auto& pending = d_pending.at(d_count);
+    pending.ss = ss;
+    pending.fd = -1;
+    pending.sent = false;
+
+    /* use the same socket for all the queries forwarded to a given backend
+       in this batch, so that they can be sent together */
+    for (size_t idx = 0; idx < d_count; idx++) {
+      if (d_pending.at(idx).ss == ss) {
+        pending.fd = d_pending.at(idx).fd;
+        break;
+      }
+    }
+    if (pending.fd == -1) {
+      pending.fd = pickBackendSocketForSending(ss, workerId);
+    }
 
-  if (!applyRulesToResponse(cacheHit ? holders.cacheHitRespRuleactions : holders.selfAnsweredRespRuleactions, dr)) {
-    return false;
+    pending.msg.msg_len = 0;
+    pending.remote = ss->remote;
+    fillMSGHdr(&pending.msg.msg_hdr, &pending.iov, nullptr, 0, const_cast<char*>(reinterpret_cast<const char *>(query.data())), query.size(), &pending.remote);
+    if (ss->sourceItf == 0) {
+      /* the socket is connected */
+      pending.msg.msg_hdr.msg_name = nullptr;
+      pending.msg.msg_hdr.msg_namelen = 0;
+    }
+    else {
+      addCMsgSrcAddr(&pending.msg.msg_hdr, &pending.cbuf, &ss->sourceAddr, ss->sourceItf);
+    }
+
+    ++d_count;
   }
 
-  /* in case a rule changed it */
-  dq.delayMsec = dr.delayMsec;
+  void flush()
+  {
+    for (size_t idx = 0; idx < d_count; idx++) {
+      if (d_pending.at(idx).sent) {
+        continue;
+      }
 
-#ifdef HAVE_DNSCRYPT
-  if (!cs.muted) {
-    if (!encryptResponse(dq.getMutableData(), dq.getMaximumSize(), dq.tcp, dq.dnsCryptQuery)) {
-      return false;
+      const int fd = d_pending.at(idx).fd;
+      const auto ss = d_pending.at(idx).ss;
+      size_t msgsCount = 0;
+      for (size_t other = idx; other < d_count; other++) {
+        auto& pending = d_pending.at(other);
+        if (!pending.sent && pending.fd == fd) {
+          d_msgs.at(msgsCount++) = pending.msg;
+          pending.sent = true;
+        }
+      }
+
+      size_t offset = 0;
+      while (offset < msgsCount) {
+        int sent = sendmmsg(fd, &d_msgs.at(offset), msgsCount - offset, 0);
+        if (sent > 0) {
+          offset += static_cast<size_t>(sent);
+          continue;
+        }
+
+        /* the first remaining query could not be sent */
+        int savederrno = errno;
+        vinfolog("Error sending requests to backend %s with sendmmsg(): %d", ss->remote.toStringWithPort(), savederrno);
+        ++ss->sendErrors;
+        ++g_stats.downstreamSendErrors;
+        ++offset;
+
+        /* see udpClientSendRequestToBackend(), the socket is unusable so there is no point
+           in trying to send the remaining queries */
+        if (savederrno == EINVAL || savederrno == ENODEV) {
+          ss->reconnect();
+          for (; offset < msgsCount; offset++) {
+            ++ss->sendErrors;
+            ++g_stats.downstreamSendErrors;
+          }
+        }
+      }
+    }
+
+    for (size_t idx = 0; idx < d_count; idx++) {
+      d_pending.at(idx).ss.reset();
     }
+    d_count = 0;
+  }
+
+private:
+  struct PendingQuery
+  {
+    std::shared_ptr<DownstreamState> ss{nullptr};
+    ComboAddress remote;
+    struct mmsghdr msg;
+    struct iovec iov;
+    int fd{-1};
+    bool sent{false};
+    /* has to be the last member */
+    cmsgbuf_aligned cbuf;
+  };
+
+  std::vector<PendingQuery> d_pending;
+  std::vector<struct mmsghdr> d_msgs;
+  size_t d_count{0};
+};
+#else
+class UDPBackendSendBatch;
+#endif /* defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE) */
+
+/* self-generated responses or cache hits */
+static bool prepareOutgoingResponse(LocalHolders& holders, ClientState& cs, DNSQuestion& dq, bool cacheHit)
+{
+  if (!applyRulesToOutgoingResponse(cacheHit ? holders.cacheHitRespRuleactions : holders.selfAnsweredRespRuleactions, cs, dq)) {
+    return false;
   }
-#endif /* HAVE_DNSCRYPT */
 
   if (cacheHit) {
     ++g_stats.cacheHits;
   }
 
-  switch (dr.getHeader()->rcode) {
-  case RCode::NXDomain:
-    ++g_stats.frontendNXDomain;
-    break;
-  case RCode::ServFail:
-    ++g_stats.frontendServFail;
-    break;
-  case RCode::NoError:
-    ++g_stats.frontendNoError;
-    break;
+  updateFrontendRCodeStats(dq.getHeader()->rcode);
+
+  doLatencyStats(0);  // we're not going to measure this
+  return true;
+}
+
+/* a cache hit was about to expire, send the query that hit it to the backend so that the entry
+   gets refreshed when the response arrives. Nobody is waiting for that response, so the state
+   has no ClientState, and the response is handled as the one of an in-flight query */
+static void sendCacheRefreshQuery(const DNSQuestion& dq, PacketBuffer& query, LocalHolders& holders, std::shared_ptr<DownstreamState>& ss)
+{
+  DNSQuestion refresh(dq.qname, dq.qtype, dq.qclass, dq.local, dq.remote, query, dq.tcp, dq.queryTime);
+  refresh.origFlags = dq.origFlags;
+  refresh.cacheKey = dq.cacheKey;
+  refresh.cacheKeyNoECS = dq.cacheKeyNoECS;
+  refresh.subnet = dq.subnet;
+  refresh.packetCache = dq.packetCache;
+  refresh.ednsAdded = dq.ednsAdded;
+  refresh.ecsAdded = dq.ecsAdded;
+  refresh.useZeroScope = dq.useZeroScope;
+  refresh.dnssecOK = dq.dnssecOK;
+  refresh.qTag = dq.qTag;
+  if (dq.proxyProtocolValues) {
+    refresh.proxyProtocolValues = make_unique<std::vector<ProxyProtocolValue>>(*dq.proxyProtocolValues);
+  }
+
+  uint16_t idOffset = 0;
+  IDState* ids = ss->getIDState(holders.udpQueryWorkerId, idOffset);
+  ids->age = 0;
+  DOHUnit* du = nullptr;
+
+  /* see processUDPQuery() */
+  if (ids->isInUse()) {
+    du = ids->du;
+  }
+
+  /* we need the generation to release the state if the query can't be sent */
+  int64_t generation = ids->generation++;
+  if (!ids->markAsUsed(generation)) {
+    du = nullptr;
+    ++ss->outstanding;
+  }
+  else {
+    ids->du = nullptr;
+    ++ss->reuseds;
+    ++g_stats.downstreamTimeouts;
+    handleDOHTimeout(du);
   }
 
-  doLatencyStats(0);  // we're not going to measure this
-  return true;
+  ids->cs = nullptr;
+  ids->origFD = -1;
+  ids->origID = refresh.getHeader()->id;
+  setIDStateFromDNSQuestion(*ids, refresh, DNSName(*dq.qname));
+  ids->inFlightLeader = true;
+
+  refresh.getHeader()->id = idOffset;
+
+  if (ss->useProxyProtocol) {
+    addProxyProtocol(refresh);
+  }
+
+  int fd = pickBackendSocketForSending(ss, holders.udpQueryWorkerId);
+  ssize_t ret = udpClientSendRequestToBackend(ss, fd, query);
+  if (ret < 0) {
+    ++ss->sendErrors;
+    ++g_stats.downstreamSendErrors;
+    /* no response will come, so release the state right away instead of waiting for it to time out,
+       unless it has already been reused, then remove the in-flight refresh so that the next hit can
+       send a new one, and answer the queries collapsed on this refresh with a ServFail */
+    if (ids->tryMarkUnused(generation)) {
+      --ss->outstanding;
+    }
+    sendResponseToInFlightWaiters(refresh, *dq.qname, nullptr, nullptr, ss->remote);
+  }
+
+  ss->incQueriesCount();
+  vinfolog("Refreshing the cache entry for %s|%s via %s", dq.qname->toLogString(), QType(dq.qtype).getName(), ss->getName());
 }
 
 ProcessQueryResult processQuery(DNSQuestion& dq, ClientState& cs, LocalHolders& holders, std::shared_ptr<DownstreamState>& selectedBackend)
@@ -1198,8 +1592,7 @@ ProcessQueryResult processQuery(DNSQuestion& dq, ClientState& cs, LocalHolders&
     std::shared_ptr<ServerPolicy> poolPolicy = serverPool->policy;
     dq.packetCache = serverPool->packetCache;
     const auto& policy = poolPolicy != nullptr ? *poolPolicy : *(holders.policy);
-    const auto servers = serverPool->getServers();
-    selectedBackend = policy.getSelectedBackend(*servers, dq);
+    selectedBackend = policy.getSelectedBackend(*serverPool, dq);
 
     uint32_t allowExpired = selectedBackend ? 0 : g_staleCacheEntriesTTL;
 
@@ -1234,7 +1627,15 @@ ProcessQueryResult processQuery(DNSQuestion& dq, ClientState& cs, LocalHolders&
     }
 
     if (dq.packetCache && !dq.skipCache) {
-      if (dq.packetCache->get(dq, dq.getHeader()->id, &dq.cacheKey, dq.subnet, dq.dnssecOK, allowExpired)) {
+      /* the refresh is only sent over UDP, so we can't refresh the entries used by TCP queries,
+         and the DNSCrypt queries are not handled by the responder threads */
+      const bool canRefresh = selectedBackend && !dq.tcp && !dq.dnsCryptQuery && dq.packetCache->isPrefetchEnabled();
+      PacketBuffer refreshQuery;
+      if (dq.packetCache->get(dq, dq.getHeader()->id, &dq.cacheKey, dq.subnet, dq.dnssecOK, allowExpired, false, canRefresh ? &refreshQuery : nullptr)) {
+
+        if (!refreshQuery.empty()) {
+          sendCacheRefreshQuery(dq, refreshQuery, holders, selectedBackend);
+        }
 
         if (!prepareOutgoingResponse(holders, cs, dq, true)) {
           return ProcessQueryResult::Drop;
@@ -1278,7 +1679,7 @@ ProcessQueryResult processQuery(DNSQuestion& dq, ClientState& cs, LocalHolders&
   return ProcessQueryResult::Drop;
 }
 
-static void processUDPQuery(ClientState& cs, LocalHolders& holders, const struct msghdr* msgh, const ComboAddress& remote, ComboAddress& dest, PacketBuffer& query, struct mmsghdr* responsesVect, unsigned int* queuedResponses, struct iovec* respIOV, cmsgbuf_aligned* respCBuf)
+static void processUDPQuery(ClientState& cs, LocalHolders& holders, const struct msghdr* msgh, const ComboAddress& remote, ComboAddress& dest, PacketBuffer& query, struct mmsghdr* responsesVect, unsigned int* queuedResponses, struct iovec* respIOV, cmsgbuf_aligned* respCBuf, UDPBackendSendBatch* backendBatch)
 {
   assert(responsesVect == nullptr || (queuedResponses != nullptr && respIOV != nullptr && respCBuf != nullptr));
   uint16_t queryId = 0;
@@ -1307,6 +1708,7 @@ static void processUDPQuery(ClientState& cs, LocalHolders& holders, const struct
     std::shared_ptr<DNSCryptQuery> dnsCryptQuery = nullptr;
     auto dnsCryptResponse = checkDNSCryptQuery(cs, query, dnsCryptQuery, queryRealTime.tv_sec, false);
     if (dnsCryptResponse) {
+      cs.incUDPSyscalls();
       sendUDPResponse(cs.udpFD, query, 0, dest, remote);
       return;
     }
@@ -1323,6 +1725,7 @@ static void processUDPQuery(ClientState& cs, LocalHolders& holders, const struct
       if (dh->qdcount == 0) {
         dh->rcode = RCode::NotImp;
         dh->qr = true;
+        cs.incUDPSyscalls();
         sendUDPResponse(cs.udpFD, query, 0, dest, remote);
         return;
       }
@@ -1356,6 +1759,7 @@ static void processUDPQuery(ClientState& cs, LocalHolders& holders, const struct
       }
 #endif /* defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE) */
       /* we use dest, always, because we don't want to use the listening address to send a response since it could be 0.0.0.0 */
+      cs.incUDPSyscalls();
       sendUDPResponse(cs.udpFD, query, dq.delayMsec, dest, remote);
       return;
     }
@@ -1364,8 +1768,29 @@ static void processUDPQuery(ClientState& cs, LocalHolders& holders, const struct
       return;
     }
 
-    unsigned int idOffset = (ss->idOffset++) % ss->idStates.size();
-    IDState* ids = &ss->idStates[idOffset];
+    bool inFlightLeader = false;
+    if (dq.packetCache && !dq.skipCache && !dq.dnsCryptQuery && dq.packetCache->isQueryCollapsingEnabled()) {
+      InFlightWaiter waiter;
+      waiter.hopLocal = dest;
+      waiter.hopRemote = remote;
+      waiter.origDest = *dq.local;
+      waiter.origRemote = proxiedRemote;
+      waiter.qname = qname;
+      waiter.queryTime = queryRealTime;
+      waiter.cs = &cs;
+      waiter.origFD = cs.udpFD;
+      waiter.origID = dh->id;
+
+      auto inFlight = dq.packetCache->addInFlightQuery(dq.cacheKey, dq.origFlags, qname, dq.qtype, dq.qclass, dq.dnssecOK, dq.subnet, std::move(waiter));
+      if (inFlight == DNSDistPacketCache::InFlightResult::Attached) {
+        vinfolog("Got query for %s|%s from %s, waiting for the response to an identical query", qname.toLogString(), QType(dq.qtype).getName(), proxiedRemote.toStringWithPort());
+        return;
+      }
+      inFlightLeader = inFlight == DNSDistPacketCache::InFlightResult::Leader;
+    }
+
+    uint16_t idOffset = 0;
+    IDState* ids = ss->getIDState(holders.udpQueryWorkerId, idOffset);
     ids->age = 0;
     DOHUnit* du = nullptr;
 
@@ -1396,6 +1821,7 @@ static void processUDPQuery(ClientState& cs, LocalHolders& holders, const struct
     ids->origFD = cs.udpFD;
     ids->origID = dh->id;
     setIDStateFromDNSQuestion(*ids, dq, std::move(qname));
+    ids->inFlightLeader = inFlightLeader;
 
     if (dest.sin4.sin_family != 0) {
       ids->origDest = dest;
@@ -1411,12 +1837,26 @@ static void processUDPQuery(ClientState& cs, LocalHolders& holders, const struct
       addProxyProtocol(dq);
     }
 
-    int fd = pickBackendSocketForSending(ss);
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE)
+    /* the waiters of an in-flight query need to be released if it can't be sent, which we would not know in a batch */
+    if (backendBatch != nullptr && !inFlightLeader) {
+      /* the query will be sent along with the other ones for this backend, once the whole batch has been processed */
+      backendBatch->queue(ss, query, holders.udpQueryWorkerId);
+      vinfolog("Got query for %s|%s from %s, relayed to %s", ids->qname.toLogString(), QType(ids->qtype).getName(), proxiedRemote.toStringWithPort(), ss->getName());
+      return;
+    }
+#endif /* defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE) */
+
+    int fd = pickBackendSocketForSending(ss, holders.udpQueryWorkerId);
     ssize_t ret = udpClientSendRequestToBackend(ss, fd, query);
 
     if(ret < 0) {
       ++ss->sendErrors;
       ++g_stats.downstreamSendErrors;
+      if (inFlightLeader) {
+        ids->inFlightLeader = false;
+        sendResponseToInFlightWaiters(dq, ids->qname, nullptr, nullptr, ss->remote);
+      }
     }
 
     vinfolog("Got query for %s|%s from %s, relayed to %s", ids->qname.toLogString(), QType(ids->qtype).getName(), proxiedRemote.toStringWithPort(), ss->getName());
@@ -1443,6 +1883,7 @@ static void MultipleMessagesUDPClientThread(ClientState* cs, LocalHolders& holde
   auto recvData = std::unique_ptr<MMReceiver[]>(new MMReceiver[vectSize]);
   auto msgVec = std::unique_ptr<struct mmsghdr[]>(new struct mmsghdr[vectSize]);
   auto outMsgVec = std::unique_ptr<struct mmsghdr[]>(new struct mmsghdr[vectSize]);
+  UDPBackendSendBatch backendBatch(vectSize);
 
   /* the actual buffer is larger because:
      - we may have to add EDNS and/or ECS
@@ -1473,6 +1914,7 @@ static void MultipleMessagesUDPClientThread(ClientState* cs, LocalHolders& holde
     /* block until we have at least one message ready, but return
        as many as possible to save the syscall costs */
     int msgsGot = recvmmsg(cs->udpFD, msgVec.get(), vectSize, MSG_WAITFORONE | MSG_TRUNC, nullptr);
+    cs->incUDPSyscalls();
 
     if (msgsGot <= 0) {
       vinfolog("Getting UDP messages via recvmmsg() failed with: %s", stringerror());
@@ -1493,14 +1935,18 @@ static void MultipleMessagesUDPClientThread(ClientState* cs, LocalHolders& holde
       }
 
       recvData[msgIdx].packet.resize(got);
-      processUDPQuery(*cs, holders, msgh, remote, recvData[msgIdx].dest, recvData[msgIdx].packet, outMsgVec.get(), &msgsToSend, &recvData[msgIdx].iov, &recvData[msgIdx].cbuf);
+      processUDPQuery(*cs, holders, msgh, remote, recvData[msgIdx].dest, recvData[msgIdx].packet, outMsgVec.get(), &msgsToSend, &recvData[msgIdx].iov, &recvData[msgIdx].cbuf, &backendBatch);
     }
 
+    /* queries forwarded to a backend are sent in batch, one sendmmsg() call per backend socket */
+    backendBatch.flush();
+
     /* immediate (not delayed or sent to a backend) responses (mostly from a rule, dynamic block
        or the cache) can be sent in batch too */
 
     if (msgsToSend > 0 && msgsToSend <= static_cast<unsigned int>(msgsGot)) {
       int sent = sendmmsg(cs->udpFD, outMsgVec.get(), msgsToSend, 0);
+      cs->incUDPSyscalls();
 
       if (sent < 0 || static_cast<unsigned int>(sent) != msgsToSend) {
         vinfolog("Error sending responses with sendmmsg() (%d on %u): %s", sent, msgsToSend, stringerror());
@@ -1511,12 +1957,265 @@ static void MultipleMessagesUDPClientThread(ClientState* cs, LocalHolders& holde
 }
 #endif /* defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE) */
 
+#ifdef HAVE_LIBURING
+/* io_uring-based UDP frontend: every listener has a multishot recvmsg operation
+   armed, which picks its buffers from a ring of provided buffers, and immediate
+   responses are sent via sendmsg operations that are submitted along with the
+   wait for the next completions, so a single io_uring_enter() call usually
+   takes care of a whole batch of queries and responses, for all listeners
+   handled by this thread. */
+static const size_t s_ioUringEntries{1024};
+static const size_t s_ioUringBuffers{4096};
+static const int s_ioUringBufferGroupID{0};
+/* the highest bit of the user data tells us whether a completion is for a send
+   (and the remaining bits are the index of the send slot) or for a receive
+   (and the remaining bits are the index of the listener) */
+static const uint64_t s_ioUringSendFlag{1ULL << 63};
+
+static bool IOUringUDPClientThread(const std::vector<ClientState*>& states, LocalHolders& holders)
+{
+  struct Listener
+  {
+    ClientState* cs;
+    struct msghdr msgh;
+    size_t maxIncomingPacketSize;
+    bool hadCompletions{false};
+  };
+  struct SendSlot
+  {
+    PacketBuffer packet;
+    ComboAddress remote;
+    ComboAddress dest;
+    struct mmsghdr msg;
+    struct iovec iov;
+    cmsgbuf_aligned cbuf;
+  };
+
+  struct io_uring ring;
+  int ret = io_uring_queue_init(s_ioUringEntries, &ring, 0);
+  if (ret < 0) {
+    errlog("Error creating an io_uring instance for UDP frontend %s: %s", states.at(0)->local.toStringWithPort(), stringerror(-ret));
+    return false;
+  }
+
+  std::vector<Listener> listeners;
+  listeners.reserve(states.size());
+  size_t maxIncomingPacketSize = 0;
+  for (auto cs : states) {
+    Listener listener;
+    listener.cs = cs;
+    listener.maxIncomingPacketSize = getMaximumIncomingPacketSize(*cs);
+    maxIncomingPacketSize = std::max(maxIncomingPacketSize, listener.maxIncomingPacketSize);
+    /* for multishot receives, the kernel only looks at the sizes reserved for the name and the control data */
+    memset(&listener.msgh, 0, sizeof(listener.msgh));
+    listener.msgh.msg_namelen = sizeof(ComboAddress);
+    listener.msgh.msg_controllen = sizeof(cmsgbuf_aligned);
+    listeners.push_back(listener);
+  }
+
+  /* every provided buffer holds the io_uring_recvmsg_out header, the name, the control data and the payload */
+  const size_t bufferSize = sizeof(struct io_uring_recvmsg_out) + sizeof(ComboAddress) + sizeof(cmsgbuf_aligned) + maxIncomingPacketSize;
+  std::vector<char> buffers(s_ioUringBuffers * bufferSize);
+  struct io_uring_buf_ring* bufferRing = io_uring_setup_buf_ring(&ring, s_ioUringBuffers, s_ioUringBufferGroupID, 0, &ret);
+  if (bufferRing == nullptr) {
+    errlog("Error registering the io_uring provided buffers for UDP frontend %s: %s", states.at(0)->local.toStringWithPort(), stringerror(-ret));
+    io_uring_queue_exit(&ring);
+    return false;
+  }
+
+  const int bufferMask = io_uring_buf_ring_mask(s_ioUringBuffers);
+  for (size_t idx = 0; idx < s_ioUringBuffers; idx++) {
+    io_uring_buf_ring_add(bufferRing, &buffers.at(idx * bufferSize), bufferSize, idx, bufferMask, idx);
+  }
+  io_uring_buf_ring_advance(bufferRing, s_ioUringBuffers);
+
+  auto recycleBuffer = [&](uint16_t bufferID) {
+    io_uring_buf_ring_add(bufferRing, &buffers.at(bufferID * bufferSize), bufferSize, bufferID, bufferMask, 0);
+    io_uring_buf_ring_advance(bufferRing, 1);
+  };
+
+  auto getSQE = [&ring, &listeners]() {
+    struct io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+    if (sqe == nullptr) {
+      /* the submission queue is full, flush it */
+      io_uring_submit(&ring);
+      for (auto& listener : listeners) {
+        listener.cs->incUDPSyscalls();
+      }
+      sqe = io_uring_get_sqe(&ring);
+    }
+    return sqe;
+  };
+
+  auto armReceive = [&](size_t listenerIdx) {
+    auto& listener = listeners.at(listenerIdx);
+    struct io_uring_sqe* sqe = getSQE();
+    if (sqe == nullptr) {
+      throw std::runtime_error("Unable to get a submission queue entry to receive UDP queries");
+    }
+    io_uring_prep_recvmsg_multishot(sqe, listener.cs->udpFD, &listener.msgh, MSG_TRUNC);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = s_ioUringBufferGroupID;
+    io_uring_sqe_set_data64(sqe, listenerIdx);
+  };
+
+  /* the actual buffer is larger because:
+     - we may have to add EDNS and/or ECS
+     - we use it for self-generated responses (from rule or cache)
+     but we only accept incoming payloads up to that size
+  */
+  const size_t initialBufferSize = getInitialUDPPacketBufferSize();
+  std::vector<SendSlot> slots(s_ioUringEntries);
+  std::vector<size_t> freeSlots;
+  freeSlots.reserve(slots.size());
+  for (size_t idx = 0; idx < slots.size(); idx++) {
+    slots.at(idx).packet.reserve(initialBufferSize);
+    freeSlots.push_back(slots.size() - 1 - idx);
+  }
+  /* used when all the send slots are busy, the response will then be sent right away */
+  SendSlot fallback;
+
+  for (size_t idx = 0; idx < listeners.size(); idx++) {
+    armReceive(idx);
+  }
+  /* until a query has been received, a failing receive might mean that multishot receives are not supported */
+  bool receivedAny = false;
+
+  for (;;) {
+    ret = io_uring_submit_and_wait(&ring, 1);
+    for (auto& listener : listeners) {
+      if (listener.hadCompletions) {
+        listener.cs->incUDPSyscalls();
+        listener.hadCompletions = false;
+      }
+    }
+
+    if (ret < 0 && ret != -EINTR) {
+      vinfolog("Error waiting for io_uring completions on UDP frontend %s: %s", states.at(0)->local.toStringWithPort(), stringerror(-ret));
+      continue;
+    }
+
+    struct io_uring_cqe* cqe = nullptr;
+    unsigned int head;
+    unsigned int count = 0;
+    io_uring_for_each_cqe(&ring, head, cqe) {
+      ++count;
+      const uint64_t userData = io_uring_cqe_get_data64(cqe);
+
+      if (userData & s_ioUringSendFlag) {
+        const size_t slotIdx = userData & ~s_ioUringSendFlag;
+        if (cqe->res < 0) {
+          vinfolog("Error sending a UDP response via io_uring: %s", stringerror(-cqe->res));
+        }
+        freeSlots.push_back(slotIdx);
+        continue;
+      }
+
+      auto& listener = listeners.at(userData);
+      auto& cs = *listener.cs;
+
+      if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        if (!receivedAny && (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP)) {
+          /* kernels before 5.19 do not support multishot receives, and would keep failing them.
+             Nothing has been received yet, so no response can be pending */
+          warnlog("Multishot receives via io_uring are not supported on UDP frontend %s: %s", cs.local.toStringWithPort(), stringerror(-cqe->res));
+          io_uring_free_buf_ring(&ring, bufferRing, s_ioUringBuffers, s_ioUringBufferGroupID);
+          io_uring_queue_exit(&ring);
+          return false;
+        }
+        /* the multishot receive has been terminated, for example because we ran out of buffers */
+        armReceive(userData);
+      }
+
+      if (!(cqe->flags & IORING_CQE_F_BUFFER)) {
+        if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+          vinfolog("Getting UDP messages via io_uring failed with: %s", stringerror(-cqe->res));
+        }
+        continue;
+      }
+
+      const uint16_t bufferID = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+      listener.hadCompletions = true;
+      receivedAny = true;
+
+      struct io_uring_recvmsg_out* out = io_uring_recvmsg_validate(&buffers.at(bufferID * bufferSize), cqe->res, &listener.msgh);
+      if (out == nullptr || out->namelen > sizeof(ComboAddress)) {
+        ++g_stats.nonCompliantQueries;
+        recycleBuffer(bufferID);
+        continue;
+      }
+
+      const size_t got = io_uring_recvmsg_payload_length(out, cqe->res, &listener.msgh);
+      if (got < sizeof(struct dnsheader)) {
+        ++g_stats.nonCompliantQueries;
+        recycleBuffer(bufferID);
+        continue;
+      }
+
+      size_t slotIdx = 0;
+      SendSlot* slot = &fallback;
+      if (!freeSlots.empty()) {
+        slotIdx = freeSlots.back();
+        freeSlots.pop_back();
+        slot = &slots.at(slotIdx);
+      }
+
+      slot->remote.sin4.sin_family = cs.local.sin4.sin_family;
+      memcpy(&slot->remote, io_uring_recvmsg_name(out), out->namelen);
+      slot->packet.resize(got);
+      memcpy(slot->packet.data(), io_uring_recvmsg_payload(out, &listener.msgh), got);
+
+      /* rebuild a msghdr describing what we received, so that the destination address can be harvested */
+      struct msghdr msgh;
+      memset(&msgh, 0, sizeof(msgh));
+      msgh.msg_name = &slot->remote;
+      msgh.msg_namelen = out->namelen;
+      msgh.msg_control = out->controllen > 0 ? reinterpret_cast<char*>(out + 1) + listener.msgh.msg_namelen : nullptr;
+      msgh.msg_controllen = out->controllen;
+      msgh.msg_flags = out->flags;
+
+      if (slot == &fallback) {
+        processUDPQuery(cs, holders, &msgh, slot->remote, slot->dest, slot->packet, nullptr, nullptr, nullptr, nullptr, nullptr);
+        recycleBuffer(bufferID);
+        continue;
+      }
+
+      unsigned int queued = 0;
+      processUDPQuery(cs, holders, &msgh, slot->remote, slot->dest, slot->packet, &slot->msg, &queued, &slot->iov, &slot->cbuf, nullptr);
+      /* the query has been copied, so the buffer can go back to the kernel right away */
+      recycleBuffer(bufferID);
+
+      if (queued == 0) {
+        freeSlots.push_back(slotIdx);
+        continue;
+      }
+
+      /* the response will be sent by the next io_uring_enter() call, along with the others */
+      struct io_uring_sqe* sqe = getSQE();
+      if (sqe == nullptr) {
+        cs.incUDPSyscalls();
+        sendmsg(cs.udpFD, &slot->msg.msg_hdr, 0);
+        freeSlots.push_back(slotIdx);
+        continue;
+      }
+      io_uring_prep_sendmsg(sqe, cs.udpFD, &slot->msg.msg_hdr, 0);
+      io_uring_sqe_set_data64(sqe, s_ioUringSendFlag | slotIdx);
+    }
+
+    io_uring_cq_advance(&ring, count);
+  }
+
+  return true;
+}
+#endif /* HAVE_LIBURING */
+
 // listens to incoming queries, sends out to downstream servers, noting the intended return path
-static void udpClientThread(ClientState* cs)
+static void udpClientThread(ClientState* cs, size_t udpQueryWorkerId)
 {
   try {
     setThreadName("dnsdist/udpClie");
     LocalHolders holders;
+    holders.udpQueryWorkerId = udpQueryWorkerId;
 
 #if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(MSG_WAITFORONE)
     if (g_udpVectorSize > 1) {
@@ -1550,6 +2249,7 @@ static void udpClientThread(ClientState* cs)
         iov.iov_len = packet.size();
 
         ssize_t got = recvmsg(cs->udpFD, &msgh, 0);
+        cs->incUDPSyscalls();
 
         if (got < 0 || static_cast<size_t>(got) < sizeof(struct dnsheader)) {
           ++g_stats.nonCompliantQueries;
@@ -1558,7 +2258,7 @@ static void udpClientThread(ClientState* cs)
 
         packet.resize(static_cast<size_t>(got));
 
-        processUDPQuery(*cs, holders, &msgh, remote, dest, packet, nullptr, nullptr, nullptr, nullptr);
+        processUDPQuery(*cs, holders, &msgh, remote, dest, packet, nullptr, nullptr, nullptr, nullptr, nullptr);
       }
     }
   }
@@ -1576,6 +2276,48 @@ static void udpClientThread(ClientState* cs)
   }
 }
 
+#ifdef HAVE_LIBURING
+static void ioUringUDPClientThread(std::vector<ClientState*> states)
+{
+  const size_t udpQueryWorkerId = DownstreamState::registerUDPQueryWorker();
+  try {
+    setThreadName("dnsdist/udpUring");
+    LocalHolders holders;
+    holders.udpQueryWorkerId = udpQueryWorkerId;
+
+    if (IOUringUDPClientThread(states, holders)) {
+      return;
+    }
+  }
+  catch(const std::exception &e)
+  {
+    errlog("io_uring UDP client thread died because of exception: %s", e.what());
+    return;
+  }
+  catch(const PDNSException &e)
+  {
+    errlog("io_uring UDP client thread died because of PowerDNS exception: %s", e.reason);
+    return;
+  }
+  catch(...)
+  {
+    errlog("io_uring UDP client thread died because of an exception: %s", "unknown");
+    return;
+  }
+
+  /* io_uring is not usable, fall back to one regular thread per listener. Only one worker
+     was accounted for this group when the ranges of states were created, so the first
+     listener keeps our range, and the other ones get IDs without a range of their own
+     and use the shared one */
+  warnlog("Falling back to the regular UDP receive loop for %d frontend(s)", states.size());
+  for (size_t idx = 1; idx < states.size(); idx++) {
+    std::thread t1(udpClientThread, states.at(idx), DownstreamState::registerUDPQueryWorker());
+    t1.detach();
+  }
+  udpClientThread(states.at(0), udpQueryWorkerId);
+}
+#endif /* HAVE_LIBURING */
+
 
 uint16_t getRandomDNSID()
 {
@@ -1618,6 +2360,28 @@ static void maintThread()
       }
     }
 
+    {
+      /* the queries waiting for the response to an identical one have to be
+         dropped quickly if that response never comes, and a lost refresh
+         should not prevent the next one from being sent */
+      std::set<std::shared_ptr<DNSDistPacketCache>> trackingCaches;
+      auto localPools = g_pools.getLocal();
+      for (const auto& entry : *localPools) {
+        const auto& packetCache = entry.second->packetCache;
+        if (packetCache && packetCache->tracksInFlightQueries()) {
+          trackingCaches.insert(packetCache);
+        }
+      }
+
+      if (!trackingCaches.empty()) {
+        struct timespec now;
+        gettime(&now, true);
+        for (const auto& packetCache : trackingCaches) {
+          packetCache->purgeInFlight(now);
+        }
+      }
+    }
+
     counter++;
     if (counter >= g_cacheCleaningDelay) {
       /* keep track, for each cache, of whether we should keep
@@ -1684,73 +2448,98 @@ static void secPollThread()
   }
 }
 
+/* the time of the next health check or maintenance of that backend, whichever comes first */
+static struct timeval getNextBackendEvent(const std::shared_ptr<DownstreamState>& dss)
+{
+  if (dss->availability == DownstreamState::Availability::Auto && dss->nextHealthCheck < dss->nextMaintenance) {
+    return dss->nextHealthCheck;
+  }
+  return dss->nextMaintenance;
+}
+
+struct ScheduledBackend
+{
+  struct Later
+  {
+    bool operator()(const ScheduledBackend& a, const ScheduledBackend& b) const
+    {
+      return b.when < a.when;
+    }
+  };
+
+  struct timeval when;
+  std::shared_ptr<DownstreamState> dss;
+};
+
 static void healthChecksThread()
 {
   setThreadName("dnsdist/healthC");
 
-  static const int interval = 1;
+  /* Every backend has its own schedule, starting at a random point, for its health checks
+     and for the scan of its outstanding queries, so that the work is spread over time instead
+     of happening for all backends at the beginning of every second. The backends are kept in
+     a min-heap ordered by the time of their next event, so that a wake-up only visits the ones
+     that are due. The responses to the health checks are processed as they arrive, while the
+     next checks are sent. */
+  auto mplexer = std::shared_ptr<FDMultiplexer>(FDMultiplexer::getMultiplexerSilent());
 
-  for(;;) {
-    sleep(interval);
+  std::priority_queue<ScheduledBackend, std::vector<ScheduledBackend>, ScheduledBackend::Later> schedule;
+  auto states = g_dstates.getLocal(); // this points to the actual shared_ptrs!
+  const servers_t* scheduled = nullptr;
 
-    auto mplexer = std::shared_ptr<FDMultiplexer>(FDMultiplexer::getMultiplexerSilent());
-    auto states = g_dstates.getLocal(); // this points to the actual shared_ptrs!
-    for(auto& dss : *states) {
-      if(++dss->lastCheck < dss->checkInterval) {
-        continue;
+  for(;;) {
+    struct timeval now;
+    gettimeofday(&now, nullptr);
+
+    if (&*states != scheduled) {
+      /* backends have been added or removed, the schedule is rebuilt from the new list.
+         A backend that was already there keeps its schedule */
+      scheduled = &*states;
+      schedule = decltype(schedule)();
+      for (auto& dss : *scheduled) {
+        if (dss->nextMaintenance.tv_sec == 0) {
+          scheduleFirstHealthCheck(dss, now);
+        }
+        schedule.push({getNextBackendEvent(dss), dss});
       }
+    }
 
-      dss->lastCheck = 0;
+    while (!schedule.empty() && !(now < schedule.top().when)) {
+      auto dss = schedule.top().dss;
+      schedule.pop();
 
-      if (dss->availability == DownstreamState::Availability::Auto) {
-        if (!queueHealthCheck(mplexer, dss)) {
-          updateHealthCheckResult(dss, false);
+      if (!(now < dss->nextMaintenance)) {
+        /* the age of the outstanding queries is counted in seconds */
+        dss->nextMaintenance.tv_sec += 1;
+        if (dss->nextMaintenance < now) {
+          /* we fell behind */
+          dss->nextMaintenance = now;
+          dss->nextMaintenance.tv_sec += 1;
         }
-      }
 
-      auto delta = dss->sw.udiffAndSet()/1000000.0;
-      dss->queryLoad = 1.0*(dss->queries.load() - dss->prev.queries.load())/delta;
-      dss->dropRate = 1.0*(dss->reuseds.load() - dss->prev.reuseds.load())/delta;
-      dss->prev.queries.store(dss->queries.load());
-      dss->prev.reuseds.store(dss->reuseds.load());
-      
-      for (IDState& ids  : dss->idStates) { // timeouts
-        int64_t usageIndicator = ids.usageIndicator;
-        if(IDState::isInUse(usageIndicator) && ids.age++ > g_udpTimeout) {
-          /* We mark the state as unused as soon as possible
-             to limit the risk of racing with the
-             responder thread.
-          */
-          auto oldDU = ids.du;
-
-          if (!ids.tryMarkUnused(usageIndicator)) {
-            /* this state has been altered in the meantime,
-               don't go anywhere near it */
-            continue;
-          }
-          ids.du = nullptr;
-          handleDOHTimeout(oldDU);
-          ids.age = 0;
-          dss->reuseds++;
-          --dss->outstanding;
-          ++g_stats.downstreamTimeouts; // this is an 'actively' discovered timeout
-          vinfolog("Had a downstream timeout from %s (%s) for query for %s|%s from %s",
-                   dss->remote.toStringWithPort(), dss->getName(),
-                   ids.qname.toLogString(), QType(ids.qtype).getName(), ids.origRemote.toStringWithPort());
+        auto delta = dss->sw.udiffAndSet()/1000000.0;
+        dss->queryLoad = 1.0*(dss->queries.load() - dss->prev.queries.load())/delta;
+        dss->dropRate = 1.0*(dss->reuseds.load() - dss->prev.reuseds.load())/delta;
+        dss->prev.queries.store(dss->queries.load());
+        dss->prev.reuseds.store(dss->reuseds.load());
 
-          struct timespec ts;
-          gettime(&ts);
+        dss->handleUDPTimeouts();
+      }
 
-          struct dnsheader fake;
-          memset(&fake, 0, sizeof(fake));
-          fake.id = ids.origID;
+      checkHealthIfDue(mplexer, dss, now);
 
-          g_rings.insertResponse(ts, ids.origRemote, ids.qname, ids.qtype, std::numeric_limits<unsigned int>::max(), 0, fake, dss->remote);
-        }          
-      }
+      /* the maintenance is never more than a second away, so a change of the availability
+         of the backend is noticed in time */
+      schedule.push({getNextBackendEvent(dss), dss});
     }
 
-    handleQueuedHealthChecks(mplexer);
+    struct timeval next = now;
+    next.tv_sec += 1;
+    if (!schedule.empty() && schedule.top().when < next) {
+      next = schedule.top().when;
+    }
+
+    handleHealthCheckEvents(mplexer, next);
   }
 }
 
@@ -1852,6 +2641,29 @@ static void checkFileDescriptorsLimits(size_t udpBindsCount, size_t tcpBindsCoun
   }
 }
 
+/* the TCP workers accept the connections to that frontend themselves, instead of an acceptor thread */
+static bool acceptsInTCPWorkers(const ClientState& cs)
+{
+  return g_tcpAcceptInWorkers && cs.tcp && cs.dohFrontend == nullptr;
+}
+
+static void setUpTCPListeningSocket(const ClientState& cs, int fd, bool warn)
+{
+  SSetsockopt(fd, SOL_SOCKET, SO_REUSEADDR, 1);
+#ifdef TCP_DEFER_ACCEPT
+  SSetsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, 1);
+#endif
+  if (cs.fastOpenQueueSize > 0) {
+#ifdef TCP_FASTOPEN
+    SSetsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, cs.fastOpenQueueSize);
+#else
+    if (warn) {
+      warnlog("TCP Fast Open has been configured on local address '%s' but is not supported", cs.local.toStringWithPort());
+    }
+#endif
+  }
+}
+
 static void setUpLocalBind(std::unique_ptr<ClientState>& cs)
 {
   /* skip some warnings if there is an identical UDP context */
@@ -1862,19 +2674,7 @@ static void setUpLocalBind(std::unique_ptr<ClientState>& cs)
   fd = SSocket(cs->local.sin4.sin_family, cs->tcp == false ? SOCK_DGRAM : SOCK_STREAM, 0);
 
   if (cs->tcp) {
-    SSetsockopt(fd, SOL_SOCKET, SO_REUSEADDR, 1);
-#ifdef TCP_DEFER_ACCEPT
-    SSetsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, 1);
-#endif
-    if (cs->fastOpenQueueSize > 0) {
-#ifdef TCP_FASTOPEN
-      SSetsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, cs->fastOpenQueueSize);
-#else
-      if (warn) {
-        warnlog("TCP Fast Open has been configured on local address '%s' but is not supported", cs->local.toStringWithPort());
-      }
-#endif
-    }
+    setUpTCPListeningSocket(*cs, fd, warn);
   }
 
   if(cs->local.sin4.sin_family == AF_INET6) {
@@ -1891,7 +2691,7 @@ static void setUpLocalBind(std::unique_ptr<ClientState>& cs)
 #endif
   }
 
-  if (cs->reuseport) {
+  if (cs->reuseport || acceptsInTCPWorkers(*cs)) {
     if (!setReusePort(fd)) {
       if (warn) {
         /* no need to warn again if configured but support is not available, we already did for UDP */
@@ -1966,6 +2766,92 @@ static void setUpLocalBind(std::unique_ptr<ClientState>& cs)
   cs->ready = true;
 }
 
+/* let the kernel hand a new connection to the worker whose index is the CPU that processed
+   the SYN, modulo the number of workers, instead of a hash of the 4-tuple */
+static bool setUpReusePortCPUSteering(int fd, size_t workers)
+{
+#if defined(SO_ATTACH_REUSEPORT_CBPF) && defined(SKF_AD_CPU)
+  struct sock_filter code[] = {
+    /* A = CPU id */
+    { BPF_LD | BPF_W | BPF_ABS, 0, 0, static_cast<uint32_t>(SKF_AD_OFF + SKF_AD_CPU) },
+    /* A = A % workers */
+    { BPF_ALU | BPF_MOD | BPF_K, 0, 0, static_cast<uint32_t>(workers) },
+    /* return A */
+    { BPF_RET | BPF_A, 0, 0, 0 },
+  };
+  struct sock_fprog prog;
+  prog.len = sizeof(code) / sizeof(code[0]);
+  prog.filter = code;
+  return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == 0;
+#else
+  (void) fd;
+  (void) workers;
+  return false;
+#endif
+}
+
+/* open one SO_REUSEPORT listening socket per TCP worker, the first one being the existing one,
+   so that every worker accepts new connections itself. If that fails, we fall back to
+   the acceptor thread for that frontend */
+static void setUpTCPWorkersBinds(ClientState& cs, size_t workers)
+{
+  cs.tcpWorkerFDs.push_back(cs.tcpFD);
+
+  try {
+    for (size_t idx = 1; idx < workers; idx++) {
+      int fd = SSocket(cs.local.sin4.sin_family, SOCK_STREAM, 0);
+      cs.tcpWorkerFDs.push_back(fd);
+
+      setUpTCPListeningSocket(cs, fd, false);
+      if (cs.local.sin4.sin_family == AF_INET6) {
+        SSetsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, 1);
+      }
+      bindAny(cs.local.sin4.sin_family, fd);
+      if (!setReusePort(fd)) {
+        throw std::runtime_error("SO_REUSEPORT is not supported");
+      }
+#ifdef SO_BINDTODEVICE
+      if (!cs.interface.empty()) {
+        setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, cs.interface.c_str(), cs.interface.length());
+      }
+#endif
+      SBind(fd, cs.local);
+      SListen(fd, cs.tcpListenQueueSize);
+    }
+
+    for (const auto& fd : cs.tcpWorkerFDs) {
+      if (!setNonBlocking(fd)) {
+        throw std::runtime_error("unable to make the listening socket non-blocking: " + stringerror());
+      }
+    }
+  }
+  catch (const std::exception& e) {
+    warnlog("Unable to set up a listening socket per TCP worker on local address '%s', falling back to a TCP acceptor thread: %s", cs.local.toStringWithPort(), e.what());
+    for (size_t idx = 1; idx < cs.tcpWorkerFDs.size(); idx++) {
+      close(cs.tcpWorkerFDs.at(idx));
+    }
+    cs.tcpWorkerFDs.clear();
+    setBlocking(cs.tcpFD);
+    return;
+  }
+
+  if (cs.d_filter) {
+    /* attach the filter to the new sockets as well */
+    for (size_t idx = 1; idx < cs.tcpWorkerFDs.size(); idx++) {
+      cs.d_filter->addSocket(cs.tcpWorkerFDs.at(idx));
+    }
+  }
+
+  if (g_tcpAcceptCPUSteering && workers > 1) {
+    cs.tcpCPUSteering = setUpReusePortCPUSteering(cs.tcpFD, workers);
+    if (!cs.tcpCPUSteering) {
+      warnlog("Unable to steer the TCP connections on local address '%s' to the worker of the CPU processing them: %s", cs.local.toStringWithPort(), stringerror());
+    }
+  }
+
+  vinfolog("Accepting TCP connections on local address '%s' from %d worker threads", cs.local.toStringWithPort(), cs.tcpWorkerFDs.size());
+}
+
 struct 
 {
   vector<string> locals;
@@ -2300,6 +3186,21 @@ int main(int argc, char** argv)
       }
     }
 
+    if (!g_maxTCPClientThreads) {
+      g_maxTCPClientThreads = std::max(tcpBindsCount, static_cast<size_t>(10));
+    }
+    else if (*g_maxTCPClientThreads == 0 && tcpBindsCount > 0) {
+      warnlog("setMaxTCPClientThreads() has been set to 0 while we are accepting TCP connections, raising to 1");
+      g_maxTCPClientThreads = 1;
+    }
+
+    /* the additional listening sockets have to be bound before we drop privileges */
+    for (auto& frontend : g_frontends) {
+      if (acceptsInTCPWorkers(*frontend)) {
+        setUpTCPWorkersBinds(*frontend, *g_maxTCPClientThreads);
+      }
+    }
+
     warnlog("dnsdist %s comes with ABSOLUTELY NO WARRANTY. This is free software, and you are welcome to redistribute it according to the terms of the GPL version 2", VERSION);
 
     vector<string> vec;
@@ -2373,16 +3274,36 @@ int main(int argc, char** argv)
       g_snmpAgent->run();
     }
 
-    if (!g_maxTCPClientThreads) {
-      g_maxTCPClientThreads = std::max(tcpBindsCount, static_cast<size_t>(10));
+    g_tcpclientthreads = std::unique_ptr<TCPClientCollection>(new TCPClientCollection(*g_maxTCPClientThreads, g_useTCPSinglePipe));
+
+    /* every thread sending UDP queries to the backends gets its own range of states,
+       so we need to know how many of them we are going to start */
+    size_t udpQueryWorkers = 0;
+#ifdef HAVE_LIBURING
+    std::set<int> ioUringWorkerGroups;
+#endif /* HAVE_LIBURING */
+    for (const auto& cs : g_frontends) {
+      if (cs->dohFrontend != nullptr) {
+        ++udpQueryWorkers;
+      }
+      else if (cs->udpFD >= 0) {
+#ifdef HAVE_LIBURING
+        if (cs->ioUring && cs->ioUringGroup >= 0) {
+          ioUringWorkerGroups.insert(cs->ioUringGroup);
+          continue;
+        }
+#endif /* HAVE_LIBURING */
+        ++udpQueryWorkers;
+      }
     }
-    else if (*g_maxTCPClientThreads == 0 && tcpBindsCount > 0) {
-      warnlog("setMaxTCPClientThreads() has been set to 0 while we are accepting TCP connections, raising to 1");
-      g_maxTCPClientThreads = 1;
+#ifdef HAVE_LIBURING
+    udpQueryWorkers += ioUringWorkerGroups.size();
+#endif /* HAVE_LIBURING */
+    DownstreamState::s_udpQueryWorkers = udpQueryWorkers;
+    for (auto& dss : g_dstates.getCopy()) {
+      dss->setUDPQueryWorkers(udpQueryWorkers);
     }
 
-    g_tcpclientthreads = std::unique_ptr<TCPClientCollection>(new TCPClientCollection(*g_maxTCPClientThreads, g_useTCPSinglePipe));
-
     for (auto& t : todo) {
       t();
     }
@@ -2418,7 +3339,7 @@ int main(int argc, char** argv)
         }
       }
     }
-    handleQueuedHealthChecks(mplexer, true);
+    handleQueuedHealthChecks(mplexer);
 
     /* we need to create the TCP worker threads before the
        acceptor ones, otherwise we might crash when processing
@@ -2427,6 +3348,10 @@ int main(int argc, char** argv)
       g_tcpclientthreads->addTCPClientThread();
     }
 
+#ifdef HAVE_LIBURING
+    std::map<int, std::vector<ClientState*>> ioUringGroups;
+    int ungroupedIOUringFrontends = 0;
+#endif /* HAVE_LIBURING */
     for(auto& cs : g_frontends) {
       if (cs->dohFrontend != nullptr) {
 #ifdef HAVE_DNS_OVER_HTTPS
@@ -2439,13 +3364,25 @@ int main(int argc, char** argv)
         continue;
       }
       if (cs->udpFD >= 0) {
-        thread t1(udpClientThread, cs.get());
+#ifdef HAVE_LIBURING
+        if (cs->ioUring) {
+          /* frontends without a group get a thread of their own */
+          if (cs->ioUringGroup < 0) {
+            ioUringGroups[--ungroupedIOUringFrontends].push_back(cs.get());
+          }
+          else {
+            ioUringGroups[cs->ioUringGroup].push_back(cs.get());
+          }
+          continue;
+        }
+#endif /* HAVE_LIBURING */
+        thread t1(udpClientThread, cs.get(), DownstreamState::registerUDPQueryWorker());
         if (!cs->cpus.empty()) {
           mapThreadToCPUList(t1.native_handle(), cs->cpus);
         }
         t1.detach();
       }
-      else if (cs->tcpFD >= 0) {
+      else if (cs->tcpFD >= 0 && cs->tcpWorkerFDs.empty()) {
         thread t1(tcpAcceptorThread, cs.get());
         if (!cs->cpus.empty()) {
           mapThreadToCPUList(t1.native_handle(), cs->cpus);
@@ -2454,6 +3391,17 @@ int main(int argc, char** argv)
       }
     }
 
+#ifdef HAVE_LIBURING
+    for (const auto& group : ioUringGroups) {
+      thread t1(ioUringUDPClientThread, group.second);
+      const auto& cpus = group.second.at(0)->cpus;
+      if (!cpus.empty()) {
+        mapThreadToCPUList(t1.native_handle(), cpus);
+      }
+      t1.detach();
+    }
+#endif /* HAVE_LIBURING */
+
     thread carbonthread(carbonDumpThread);
     carbonthread.detach();
 
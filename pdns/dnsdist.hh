@@ -38,6 +38,7 @@
 #include "dnsdist-cache.hh"
 #include "dnsdist-dynbpf.hh"
 #include "dnsdist-lbpolicies.hh"
+#include "dnsdist-rule-chains.hh"
 #include "dnsname.hh"
 #include "doh.hh"
 #include "ednsoptions.hh"
@@ -550,7 +551,7 @@ struct IDState
 {
   IDState(): sentTime(true), delayMsec(0), tempFailureTTL(boost::none) { origDest.sin4.sin_family = 0;}
   IDState(const IDState& orig) = delete;
-  IDState(IDState&& rhs): origRemote(rhs.origRemote), origDest(rhs.origDest), sentTime(rhs.sentTime), qname(std::move(rhs.qname)), dnsCryptQuery(std::move(rhs.dnsCryptQuery)), subnet(rhs.subnet), packetCache(std::move(rhs.packetCache)), qTag(std::move(rhs.qTag)), cs(rhs.cs), du(std::move(rhs.du)), cacheKey(rhs.cacheKey), cacheKeyNoECS(rhs.cacheKeyNoECS), age(rhs.age), qtype(rhs.qtype), qclass(rhs.qclass), origID(rhs.origID), origFlags(rhs.origFlags), origFD(rhs.origFD), delayMsec(rhs.delayMsec), tempFailureTTL(rhs.tempFailureTTL), ednsAdded(rhs.ednsAdded), ecsAdded(rhs.ecsAdded), skipCache(rhs.skipCache), destHarvested(rhs.destHarvested), dnssecOK(rhs.dnssecOK), useZeroScope(rhs.useZeroScope)
+  IDState(IDState&& rhs): origRemote(rhs.origRemote), origDest(rhs.origDest), sentTime(rhs.sentTime), qname(std::move(rhs.qname)), dnsCryptQuery(std::move(rhs.dnsCryptQuery)), subnet(rhs.subnet), packetCache(std::move(rhs.packetCache)), qTag(std::move(rhs.qTag)), cs(rhs.cs), du(std::move(rhs.du)), cacheKey(rhs.cacheKey), cacheKeyNoECS(rhs.cacheKeyNoECS), age(rhs.age), qtype(rhs.qtype), qclass(rhs.qclass), origID(rhs.origID), origFlags(rhs.origFlags), origFD(rhs.origFD), delayMsec(rhs.delayMsec), tempFailureTTL(rhs.tempFailureTTL), ednsAdded(rhs.ednsAdded), ecsAdded(rhs.ecsAdded), skipCache(rhs.skipCache), destHarvested(rhs.destHarvested), dnssecOK(rhs.dnssecOK), useZeroScope(rhs.useZeroScope), inFlightLeader(rhs.inFlightLeader)
   {
     if (rhs.isInUse()) {
       throw std::runtime_error("Trying to move an in-use IDState");
@@ -595,6 +596,7 @@ struct IDState
     destHarvested = rhs.destHarvested;
     dnssecOK = rhs.dnssecOK;
     useZeroScope = rhs.useZeroScope;
+    inFlightLeader = rhs.inFlightLeader;
 
     uniqueId = std::move(rhs.uniqueId);
 
@@ -698,6 +700,7 @@ struct IDState
   bool destHarvested{false}; // if true, origDest holds the original dest addr, otherwise the listening addr
   bool dnssecOK{false};
   bool useZeroScope{false};
+  bool inFlightLeader{false}; // identical queries might be waiting in the packet cache for the response to this one
 };
 
 typedef std::unordered_map<string, unsigned int> QueryCountRecords;
@@ -746,14 +749,25 @@ struct ClientState
   stat_t tls12queries{0};   // valid DNS queries received via TLSv1.2
   stat_t tls13queries{0};   // valid DNS queries received via TLSv1.3
   stat_t tlsUnknownqueries{0};   // valid DNS queries received via unknown TLS version
+  /* system calls made to receive queries and send immediate responses over UDP. Only updated
+     by the thread receiving the queries of this frontend, see incUDPSyscalls() */
+  std::atomic<uint64_t> udpSyscalls{0};
   pdns::stat_t_trait<double> tcpAvgQueriesPerConnection{0.0};
   /* in ms */
   pdns::stat_t_trait<double> tcpAvgConnectionDuration{0.0};
   size_t d_maxInFlightQueriesPerConn{1};
+  /* when the TCP workers accept the connections themselves, one SO_REUSEPORT listening socket per worker,
+     the first one being tcpFD */
+  std::vector<int> tcpWorkerFDs;
+  /* whether new TCP connections are handed to the worker of the CPU that processed them, in which case the workers are pinned to these CPUs */
+  bool tcpCPUSteering{false};
   int udpFD{-1};
   int tcpFD{-1};
   int tcpListenQueueSize{SOMAXCONN};
   int fastOpenQueueSize{0};
+  /* frontends using io_uring with the same group share a thread, a negative value means a thread of its own */
+  int ioUringGroup{-1};
+  bool ioUring{false};
   bool muted{false};
   bool tcp;
   bool reuseport;
@@ -774,6 +788,13 @@ struct ClientState
     return udpFD == -1;
   }
 
+  /* a single thread receives the queries of a given UDP frontend, so the counter is never
+     updated concurrently and does not need an atomic read-modify-write operation */
+  void incUDPSyscalls()
+  {
+    udpSyscalls.store(udpSyscalls.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  }
+
   bool hasTLS() const
   {
     return tlsFrontend != nullptr || dohFrontend != nullptr;
@@ -802,6 +823,9 @@ struct ClientState
   {
     if (d_filter) {
       d_filter->removeSocket(getSocket());
+      for (size_t idx = 1; idx < tcpWorkerFDs.size(); idx++) {
+        d_filter->removeSocket(tcpWorkerFDs.at(idx));
+      }
       d_filter = nullptr;
     }
   }
@@ -811,6 +835,9 @@ struct ClientState
     detachFilter();
 
     bpf->addSocket(getSocket());
+    for (size_t idx = 1; idx < tcpWorkerFDs.size(); idx++) {
+      bpf->addSocket(tcpWorkerFDs.at(idx));
+    }
     d_filter = bpf;
   }
 
@@ -890,12 +917,31 @@ struct DownstreamState
   DNSName checkName{"a.root-servers.net."};
   QType checkType{QType::A};
   uint16_t checkClass{QClass::IN};
-  std::atomic<uint64_t> idOffset{0};
+  /* The states are split in one range per thread sending UDP queries to the backends
+     (UDP and DoH frontends), so that a worker never shares a state, or its position
+     in its range, with another one. The last range is shared by the workers that do
+     not have a range of their own, and is the only one when there are not enough
+     states to go around. */
+  struct alignas(64) IDStateRange
+  {
+    /* number of states handed out from this range so far, only updated
+       by the worker owning the range, except for the shared one */
+    std::atomic<uint64_t> assigned{0};
+    /* only accessed by the health-check thread: every state handed out before 'scanned'
+       is done, and 'settled' is the value of 'assigned' during the previous scan */
+    uint64_t scanned{0};
+    uint64_t settled{0};
+    uint32_t first{0};
+    uint32_t size{0};
+  };
+  std::vector<IDStateRange> idStateRanges;
   stat_t sendErrors{0};
   stat_t outstanding{0};
   stat_t reuseds{0};
   stat_t queries{0};
   stat_t responses{0};
+  /* responses received from this backend with a SERVFAIL rcode */
+  stat_t servfailResponses{0};
   struct {
     stat_t sendErrors{0};
     stat_t reuseds{0};
@@ -909,6 +955,11 @@ struct DownstreamState
   stat_t tcpCurrentConnections{0};
   stat_t tcpReusedConnections{0};
   stat_t tcpNewConnections{0};
+  /* no idle connection was available for reuse */
+  stat_t tcpIdlePoolMisses{0};
+  /* idle connections closed because they were too old, idle for too long, closed by the backend,
+     because the backend was down or there were too many of them */
+  stat_t tcpIdlePoolEvictions{0};
   pdns::stat_t_trait<double> tcpAvgQueriesPerConnection{0.0};
   /* in ms */
   pdns::stat_t_trait<double> tcpAvgConnectionDuration{0.0};
@@ -923,7 +974,6 @@ struct DownstreamState
   int tcpRecvTimeout{30};
   int tcpSendTimeout{30};
   unsigned int checkInterval{1};
-  unsigned int lastCheck{0};
   const unsigned int sourceItf{0};
   uint16_t retries{5};
   uint16_t xpfRRCode{0};
@@ -934,7 +984,26 @@ struct DownstreamState
   uint8_t minRiseSuccesses{1};
   StopWatch sw;
   set<string> pools;
+  /* only accessed by the health-check thread: when the next health check and the next
+     scan of the outstanding queries are due, the values of the counters at the time of
+     the previous health check, used by the lazy health checks, and the connection used
+     by the health checks over TCP, kept open between two checks */
+  struct timeval nextHealthCheck{0, 0};
+  struct timeval nextMaintenance{0, 0};
+  struct {
+    uint64_t queries{0};
+    uint64_t reuseds{0};
+    uint64_t servfailResponses{0};
+  } lastHealthCheckCounters;
+  std::unique_ptr<TCPIOHandler> healthCheckConnection{nullptr};
+  bool healthCheckInProgress{false};
   enum class Availability { Up, Down, Auto} availability{Availability::Auto};
+  /* with Lazy, a health check query is only sent when the share of timeouts and SERVFAIL
+     responses of the regular queries is above lazyHealthCheckThreshold, or when the backend is down */
+  enum class HealthCheckMode : uint8_t { Active, Lazy } healthCheckMode{HealthCheckMode::Active};
+  uint16_t lazyHealthCheckMinSampleCount{1};
+  uint8_t lazyHealthCheckThreshold{20}; /* in percent */
+  bool checkTCP{false};
   bool mustResolve{false};
   bool upStatus{false};
   bool useECS{false};
@@ -991,6 +1060,49 @@ struct DownstreamState
     return d_stopped;
   }
 
+  /* return a state for a new query sent by that worker, and the corresponding query ID.
+     When the next state of the worker's own range is still in use, because that worker
+     is sending more queries than its range can hold, one is borrowed from the shared range
+     instead of overwriting a query that might still get a response */
+  IDState* getIDState(size_t workerId, uint16_t& queryId)
+  {
+    if (workerId < idStateRanges.size() - 1) {
+      /* that range is ours, no need for a read-modify-write operation */
+      auto& range = idStateRanges[workerId];
+      const uint64_t position = range.assigned.load(std::memory_order_relaxed);
+      range.assigned.store(position + 1, std::memory_order_release);
+      queryId = range.first + (position % range.size);
+      if (!idStates[queryId].isInUse()) {
+        return &idStates[queryId];
+      }
+    }
+
+    auto& shared = idStateRanges.back();
+    const uint64_t position = shared.assigned++;
+    queryId = shared.first + (position % shared.size);
+    return &idStates[queryId];
+  }
+
+  /* the socket used by that worker to send its queries, each worker gets a socket
+     of its own when the backend has at least as many sockets as there are workers */
+  int getSocketForSending(size_t workerId)
+  {
+    if (workerId < idStateRanges.size() - 1) {
+      return sockets[workerId % sockets.size()];
+    }
+    return sockets[socketsOffset++ % sockets.size()];
+  }
+
+  void setUDPQueryWorkers(size_t workers);
+  /* called by the health-check thread every second, to expire the queries that
+     have been waiting for a response for more than g_udpTimeout seconds */
+  void handleUDPTimeouts();
+
+  /* number of workers with a range of their own in the backends created from now on */
+  static size_t s_udpQueryWorkers;
+  /* give a new ID to a thread sending UDP queries to the backends */
+  static size_t registerUDPQueryWorker();
+
   void updateTCPMetrics(size_t nbQueries, uint64_t durationMs)
   {
     tcpAvgQueriesPerConnection = (99.0 * tcpAvgQueriesPerConnection / 100.0) + (nbQueries / 100.0);
@@ -1023,6 +1135,12 @@ public:
   }
   virtual bool matches(const DNSQuestion* dq) const =0;
   virtual string toString() const = 0;
+  /* fill the condition that a query has to meet for this rule to match, if any,
+     see CompiledRuleChain */
+  virtual bool getDiscriminator(RuleDiscriminator& discriminator) const
+  {
+    return false;
+  }
   mutable stat_t d_matches{0};
 };
 
@@ -1073,6 +1191,21 @@ struct ServerPool
     return result;
   }
 
+  /* the Maglev lookup table for the current servers of the pool, built only once after every change */
+  std::shared_ptr<const MaglevTable> getMaglevTable();
+
+  /* the weight or id of one of the servers changed */
+  void serverChanged(const DownstreamState& server)
+  {
+    WriteLock wl(&d_lock);
+    for (const auto& entry : *d_servers) {
+      if (entry.second.get() == &server) {
+        ++d_generation;
+        break;
+      }
+    }
+  }
+
   void addServer(shared_ptr<DownstreamState>& server)
   {
     WriteLock wl(&d_lock);
@@ -1091,6 +1224,7 @@ struct ServerPool
       serv.first = idx++;
     }
     d_servers = newServers;
+    ++d_generation;
   }
 
   void removeServer(shared_ptr<DownstreamState>& server)
@@ -1117,11 +1251,16 @@ struct ServerPool
       }
     }
     d_servers = newServers;
+    ++d_generation;
   }
 
 private:
   std::shared_ptr<ServerPolicy::NumberedServerVector> d_servers;
+  std::shared_ptr<const MaglevTable> d_maglevTable{nullptr};
+  std::mutex d_maglevTableMutex;
   ReadWriteLock d_lock;
+  /* incremented every time the servers change, so that the tables built from them can be rebuilt */
+  uint64_t d_generation{0};
   bool d_useECS{false};
 };
 
@@ -1195,7 +1334,13 @@ extern bool g_apiReadWrite;
 extern std::string g_apiConfigDirectory;
 extern bool g_servFailOnNoPolicy;
 extern bool g_useTCPSinglePipe;
+extern bool g_tcpAcceptInWorkers;
+extern bool g_tcpAcceptCPUSteering;
 extern uint16_t g_downstreamTCPCleanupInterval;
+extern size_t g_maxIdleTCPConnectionsPerDownstream;
+extern uint32_t g_downstreamTCPMaxConnectionAge;
+extern uint16_t g_downstreamTCPMaxIdleTime;
+extern bool g_downstreamTCPSharedIdlePool;
 extern size_t g_udpVectorSize;
 extern bool g_allowEmptyResponse;
 
@@ -1211,12 +1356,15 @@ struct LocalHolders
   LocalStateHolder<NetmaskGroup> acl;
   LocalStateHolder<ServerPolicy> policy;
   LocalStateHolder<vector<DNSDistRuleAction> > ruleactions;
+  CompiledRuleChain<DNSDistRuleAction> compiledRuleactions;
   LocalStateHolder<vector<DNSDistResponseRuleAction> > cacheHitRespRuleactions;
   LocalStateHolder<vector<DNSDistResponseRuleAction> > selfAnsweredRespRuleactions;
   LocalStateHolder<servers_t> servers;
   LocalStateHolder<NetmaskTree<DynBlock> > dynNMGBlock;
   LocalStateHolder<SuffixMatchTree<DynBlock> > dynSMTBlock;
   LocalStateHolder<pools_t> pools;
+  /* set by the threads sending UDP queries to the backends, see DownstreamState::getIDState() */
+  size_t udpQueryWorkerId{std::numeric_limits<size_t>::max()};
 };
 
 vector<std::function<void(void)>> setupLua(bool client, const std::string& config);
@@ -1260,5 +1408,5 @@ ProcessQueryResult processQuery(DNSQuestion& dq, ClientState& cs, LocalHolders&
 DNSResponse makeDNSResponseFromIDState(IDState& ids, PacketBuffer& data, bool isTCP);
 void setIDStateFromDNSQuestion(IDState& ids, DNSQuestion& dq, DNSName&& qname);
 
-int pickBackendSocketForSending(std::shared_ptr<DownstreamState>& state);
+int pickBackendSocketForSending(std::shared_ptr<DownstreamState>& state, size_t workerId);
 ssize_t udpClientSendRequestToBackend(const std::shared_ptr<DownstreamState>& ss, const int sd, const PacketBuffer& request, bool healthCheck = false);
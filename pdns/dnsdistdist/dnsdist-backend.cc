@@ -21,6 +21,7 @@
  */
 
 #include "dnsdist.hh"
+#include "dnsdist-rings.hh"
 #include "dolog.hh"
 
 bool DownstreamState::reconnect()
@@ -153,6 +154,100 @@ void DownstreamState::setWeight(int newWeight)
   }
 }
 
+size_t DownstreamState::s_udpQueryWorkers{0};
+
+size_t DownstreamState::registerUDPQueryWorker()
+{
+  static std::atomic<size_t> workers{0};
+  return workers++;
+}
+
+/* This should only be called before any query has been sent to this backend */
+void DownstreamState::setUDPQueryWorkers(size_t workers)
+{
+  /* we want at least a few states per range, otherwise everyone uses the shared one */
+  const size_t minimumRangeSize = 16;
+  /* half of the states are split between the workers, the other half being shared by the
+     threads that do not have a range of their own and by the workers whose range is full */
+  const size_t perWorkerStates = idStates.size() / 2;
+  if (workers > 0 && perWorkerStates / workers < minimumRangeSize) {
+    workers = 0;
+  }
+
+  idStateRanges = std::vector<IDStateRange>(workers + 1);
+  const size_t rangeSize = workers > 0 ? perWorkerStates / workers : 0;
+  for (size_t idx = 0; idx <= workers; idx++) {
+    auto& range = idStateRanges.at(idx);
+    range.first = idx * rangeSize;
+    /* the shared range gets the remaining states as well */
+    range.size = idx < workers ? rangeSize : idStates.size() - range.first;
+  }
+}
+
+/* The states of a range are handed out in order, so they are sorted by the time the
+   query was sent: we only need to look at the ones handed out since the oldest state
+   that was still in use during the previous scan, instead of scanning all of them. */
+void DownstreamState::handleUDPTimeouts()
+{
+  for (auto& range : idStateRanges) {
+    const uint64_t assigned = range.assigned.load(std::memory_order_acquire);
+    /* a worker might have been handed out a position without having marked the state
+       as used yet, so we only skip the unused states that were handed out before the
+       previous scan */
+    const uint64_t settled = range.settled;
+    range.settled = assigned;
+
+    if (assigned - range.scanned > range.size) {
+      /* the worker went over the whole range since the previous scan, reusing states */
+      range.scanned = assigned - range.size;
+    }
+
+    for (uint64_t position = range.scanned; position < assigned; position++) {
+      IDState& ids = idStates[range.first + (position % range.size)];
+      int64_t usageIndicator = ids.usageIndicator;
+      if (IDState::isInUse(usageIndicator)) {
+        if (ids.age++ <= g_udpTimeout) {
+          continue;
+        }
+
+        /* We mark the state as unused as soon as possible
+           to limit the risk of racing with the
+           responder thread.
+        */
+        auto oldDU = ids.du;
+
+        if (!ids.tryMarkUnused(usageIndicator)) {
+          /* this state has been altered in the meantime,
+             don't go anywhere near it */
+          continue;
+        }
+        ids.du = nullptr;
+        handleDOHTimeout(oldDU);
+        ids.age = 0;
+        reuseds++;
+        --outstanding;
+        ++g_stats.downstreamTimeouts; // this is an 'actively' discovered timeout
+        vinfolog("Had a downstream timeout from %s (%s) for query for %s|%s from %s",
+                 remote.toStringWithPort(), getName(),
+                 ids.qname.toLogString(), QType(ids.qtype).getName(), ids.origRemote.toStringWithPort());
+
+        struct timespec ts;
+        gettime(&ts);
+
+        struct dnsheader fake;
+        memset(&fake, 0, sizeof(fake));
+        fake.id = ids.origID;
+
+        g_rings.insertResponse(ts, ids.origRemote, ids.qname, ids.qtype, std::numeric_limits<unsigned int>::max(), 0, fake, remote);
+      }
+
+      if (position == range.scanned && position < settled) {
+        range.scanned++;
+      }
+    }
+  }
+}
+
 DownstreamState::DownstreamState(const ComboAddress& remote_, const ComboAddress& sourceAddr_, unsigned int sourceItf_, const std::string& sourceItfName_, size_t numberOfSockets, bool connect=true): sourceItfName(sourceItfName_), remote(remote_), idStates(g_maxOutstanding), sourceAddr(sourceAddr_), sourceItf(sourceItf_), name(remote_.toStringWithPort()), nameWithAddr(remote_.toStringWithPort())
 {
   id = getUniqueID();
@@ -165,6 +260,8 @@ DownstreamState::DownstreamState(const ComboAddress& remote_, const ComboAddress
     fd = -1;
   }
 
+  setUDPQueryWorkers(s_udpQueryWorkers);
+
   if (connect && !IsAnyAddress(remote)) {
     reconnect();
     sw.start();
@@ -4,6 +4,11 @@
 
 void DynBlockRulesGroup::apply(const struct timespec& now)
 {
+  if (d_incremental && canBeIncremental()) {
+    applyIncremental(now);
+    return;
+  }
+
   counts_t counts;
   StatNode statNodeRoot;
 
@@ -27,111 +32,432 @@ void DynBlockRulesGroup::apply(const struct timespec& now)
   bool updated = false;
 
   for (const auto& entry : counts) {
-    const auto& requestor = entry.first;
-    const auto& counters = entry.second;
+    processCounts(blocks, now, entry.first, entry.second, updated);
+  }
 
-    if (d_queryRateRule.warningRateExceeded(counters.queries, now)) {
-      handleWarning(blocks, now, requestor, d_queryRateRule, updated);
+  if (updated && blocks) {
+    g_dynblockNMG.setState(std::move(*blocks));
+  }
+
+  processSuffixMatchTree(statNodeRoot, now);
+}
+
+bool DynBlockRulesGroup::processCounts(boost::optional<NetmaskTree<DynBlock> >& blocks, const struct timespec& now, const ComboAddress& requestor, const Counts& counters, bool& updated)
+{
+  bool exceeded = false;
+
+  if (d_queryRateRule.warningRateExceeded(counters.queries, now)) {
+    handleWarning(blocks, now, requestor, d_queryRateRule, updated);
+    exceeded = true;
+  }
+
+  if (d_queryRateRule.rateExceeded(counters.queries, now)) {
+    addBlock(blocks, now, requestor, d_queryRateRule, updated);
+    return true;
+  }
+
+  if (d_respRateRule.warningRateExceeded(counters.respBytes, now)) {
+    handleWarning(blocks, now, requestor, d_respRateRule, updated);
+    exceeded = true;
+  }
+
+  if (d_respRateRule.rateExceeded(counters.respBytes, now)) {
+    addBlock(blocks, now, requestor, d_respRateRule, updated);
+    return true;
+  }
+
+  for (const auto& pair : d_qtypeRules) {
+    const auto qtype = pair.first;
+
+    const auto& typeIt = counters.d_qtypeCounts.find(qtype);
+    if (typeIt != counters.d_qtypeCounts.cend()) {
+
+      if (pair.second.warningRateExceeded(typeIt->second, now)) {
+        handleWarning(blocks, now, requestor, pair.second, updated);
+        exceeded = true;
+      }
+
+      if (pair.second.rateExceeded(typeIt->second, now)) {
+        addBlock(blocks, now, requestor, pair.second, updated);
+        exceeded = true;
+        break;
+      }
     }
+  }
 
-    if (d_queryRateRule.rateExceeded(counters.queries, now)) {
-      addBlock(blocks, now, requestor, d_queryRateRule, updated);
-      continue;
+  for (const auto& pair : d_rcodeRules) {
+    const auto rcode = pair.first;
+
+    const auto& rcodeIt = counters.d_rcodeCounts.find(rcode);
+    if (rcodeIt != counters.d_rcodeCounts.cend()) {
+      if (pair.second.warningRateExceeded(rcodeIt->second, now)) {
+        handleWarning(blocks, now, requestor, pair.second, updated);
+        exceeded = true;
+      }
+
+      if (pair.second.rateExceeded(rcodeIt->second, now)) {
+        addBlock(blocks, now, requestor, pair.second, updated);
+        exceeded = true;
+        break;
+      }
     }
+  }
+
+  for (const auto& pair : d_rcodeRatioRules) {
+    const auto rcode = pair.first;
+
+    const auto& rcodeIt = counters.d_rcodeCounts.find(rcode);
+    if (rcodeIt != counters.d_rcodeCounts.cend()) {
+      if (pair.second.warningRatioExceeded(counters.responses, rcodeIt->second)) {
+        handleWarning(blocks, now, requestor, pair.second, updated);
+        exceeded = true;
+      }
 
-    if (d_respRateRule.warningRateExceeded(counters.respBytes, now)) {
-      handleWarning(blocks, now, requestor, d_respRateRule, updated);
+      if (pair.second.ratioExceeded(counters.responses, rcodeIt->second)) {
+        addBlock(blocks, now, requestor, pair.second, updated);
+        exceeded = true;
+        break;
+      }
     }
+  }
 
-    if (d_respRateRule.rateExceeded(counters.respBytes, now)) {
-      addBlock(blocks, now, requestor, d_respRateRule, updated);
-      continue;
+  return exceeded;
+}
+
+void DynBlockRulesGroup::processSuffixMatchTree(const StatNode& statNodeRoot, const struct timespec& now)
+{
+  if (statNodeRoot.empty()) {
+    return;
+  }
+
+  StatNode::Stat node;
+  std::unordered_set<DNSName> namesToBlock;
+  statNodeRoot.visit([this,&namesToBlock](const StatNode* node_, const StatNode::Stat& self, const StatNode::Stat& children) {
+                       bool block = false;
+
+                       if (d_smtVisitorFFI) {
+                         dnsdist_ffi_stat_node_t tmp(*node_, self, children);
+                         block = d_smtVisitorFFI(&tmp);
+                       }
+                       else {
+                         block = d_smtVisitor(*node_, self, children);
+                       }
+
+                       if (block) {
+                         namesToBlock.insert(DNSName(node_->fullname));
+                       }
+                     },
+    node);
+
+  if (!namesToBlock.empty()) {
+    bool updated = false;
+    SuffixMatchTree<DynBlock> smtBlocks = g_dynblockSMT.getCopy();
+    for (const auto& name : namesToBlock) {
+      addOrRefreshBlockSMT(smtBlocks, now, name, d_suffixMatchRule, updated);
     }
+    if (updated) {
+      g_dynblockSMT.setState(std::move(smtBlocks));
+    }
+  }
+}
 
-    for (const auto& pair : d_qtypeRules) {
-      const auto qtype = pair.first;
+bool DynBlockRulesGroup::canBeIncremental() const
+{
+  /* the incremental engine needs a sliding window for every rule */
+  if ((d_queryRateRule.isEnabled() && d_queryRateRule.d_seconds == 0) ||
+      (d_respRateRule.isEnabled() && d_respRateRule.d_seconds == 0) ||
+      (d_suffixMatchRule.isEnabled() && d_suffixMatchRule.d_seconds == 0)) {
+    return false;
+  }
+  for (const auto& rule : d_qtypeRules) {
+    if (rule.second.d_seconds == 0) {
+      return false;
+    }
+  }
+  for (const auto& rule : d_rcodeRules) {
+    if (rule.second.d_seconds == 0) {
+      return false;
+    }
+  }
+  for (const auto& rule : d_rcodeRatioRules) {
+    if (rule.second.d_seconds == 0) {
+      return false;
+    }
+  }
+  return true;
+}
 
-      const auto& typeIt = counters.d_qtypeCounts.find(qtype);
-      if (typeIt != counters.d_qtypeCounts.cend()) {
+void DynBlockRulesGroup::initIncrementalState(IncrementalState& state) const
+{
+  unsigned int window = std::max(d_queryRateRule.d_seconds, d_respRateRule.d_seconds);
+  window = std::max(window, d_suffixMatchRule.d_seconds);
 
-        if (pair.second.warningRateExceeded(typeIt->second, now)) {
-          handleWarning(blocks, now, requestor, pair.second, updated);
-        }
+  size_t idx = 0;
+  for (const auto& rule : d_qtypeRules) {
+    state.qtypeIndexes[rule.first] = idx++;
+    window = std::max(window, rule.second.d_seconds);
+  }
 
-        if (pair.second.rateExceeded(typeIt->second, now)) {
-          addBlock(blocks, now, requestor, pair.second, updated);
-          break;
-        }
-      }
+  /* the rcode and rcode ratio rules for a given rcode share the same counter, using the
+     largest window, and so does the total number of responses, like in the non-incremental case */
+  unsigned int responsesWindow = d_respRateRule.d_seconds;
+  for (const auto& rule : d_rcodeRules) {
+    auto& rcodeWindow = state.rcodeWindows[rule.first];
+    rcodeWindow = std::max(rcodeWindow, rule.second.d_seconds);
+    responsesWindow = std::max(responsesWindow, rule.second.d_seconds);
+  }
+  for (const auto& rule : d_rcodeRatioRules) {
+    auto& rcodeWindow = state.rcodeWindows[rule.first];
+    rcodeWindow = std::max(rcodeWindow, rule.second.d_seconds);
+    responsesWindow = std::max(responsesWindow, rule.second.d_seconds);
+  }
+  for (const auto& rcode : state.rcodeWindows) {
+    state.rcodeIndexes[rcode.first] = idx++;
+    window = std::max(window, rcode.second);
+  }
+
+  state.countersSize = idx;
+  state.responsesWindow = responsesWindow;
+  state.window = std::max(window, 1U);
+  state.bucketWidth = (state.window + s_windowBuckets - 1) / s_windowBuckets;
+}
+
+/* 'reset' is set when the bucket was used for an older time period, or not at all */
+template <typename Bucket>
+Bucket* DynBlockRulesGroup::getBucket(std::array<Bucket, s_windowBuckets>& buckets, const IncrementalState& state, time_t when, const struct timespec& now, bool& reset)
+{
+  reset = false;
+  /* too old to matter, or too far in the future */
+  if (when + state.window + state.bucketWidth < now.tv_sec || when > now.tv_sec + static_cast<time_t>(state.window)) {
+    return nullptr;
+  }
+
+  const time_t start = when - (when % state.bucketWidth);
+  auto& bucket = buckets.at((when / state.bucketWidth) % s_windowBuckets);
+  if (bucket.start == start) {
+    return &bucket;
+  }
+  if (start < bucket.start) {
+    /* this slot is already used by a more recent time period */
+    return nullptr;
+  }
+
+  bucket = Bucket();
+  bucket.start = start;
+  reset = true;
+  return &bucket;
+}
+
+uint32_t* DynBlockRulesGroup::getBucketCounters(IncrementalState& state, RequestorWindow& window, size_t bucketIdx, bool reset)
+{
+  if (state.countersSize == 0) {
+    return nullptr;
+  }
+
+  const size_t windowSize = s_windowBuckets * state.countersSize;
+  if (window.countersOffset == std::numeric_limits<size_t>::max()) {
+    if (!state.freeCounters.empty()) {
+      window.countersOffset = state.freeCounters.back();
+      state.freeCounters.pop_back();
+      std::fill(state.counters.begin() + window.countersOffset, state.counters.begin() + window.countersOffset + windowSize, 0);
     }
+    else {
+      window.countersOffset = state.counters.size();
+      state.counters.resize(state.counters.size() + windowSize, 0);
+    }
+  }
+  else if (reset) {
+    const auto first = state.counters.begin() + window.countersOffset + bucketIdx * state.countersSize;
+    std::fill(first, first + state.countersSize, 0);
+  }
+
+  return &state.counters.at(window.countersOffset + bucketIdx * state.countersSize);
+}
 
-    for (const auto& pair : d_rcodeRules) {
-      const auto rcode = pair.first;
+template <typename Bucket>
+bool DynBlockRulesGroup::isBucketInWindow(const Bucket& bucket, const IncrementalState& state, unsigned int seconds, const struct timespec& now)
+{
+  return bucket.start != 0 && bucket.start <= now.tv_sec && (bucket.start + state.bucketWidth) > (now.tv_sec - static_cast<time_t>(seconds));
+}
+
+void DynBlockRulesGroup::applyIncremental(const struct timespec& now)
+{
+  if (!d_incrementalState) {
+    d_incrementalState = std::make_unique<IncrementalState>();
+    initIncrementalState(*d_incrementalState);
+  }
 
-      const auto& rcodeIt = counters.d_rcodeCounts.find(rcode);
-      if (rcodeIt != counters.d_rcodeCounts.cend()) {
-        if (pair.second.warningRateExceeded(rcodeIt->second, now)) {
-          handleWarning(blocks, now, requestor, pair.second, updated);
+  auto& state = *d_incrementalState;
+  const bool queryRules = hasQueryRules();
+  const bool responseRules = hasResponseRules() || hasSuffixMatchRules();
+  if ((queryRules && !g_rings.isCursorValid(state.queryCursor)) || (responseRules && !g_rings.isCursorValid(state.responseCursor))) {
+    /* the rings have been cleared or reconfigured, start over */
+    state.requestors.clear();
+    state.counters.clear();
+    state.freeCounters.clear();
+    state.names.clear();
+    state.toEvaluate.clear();
+  }
+
+  if (queryRules) {
+    g_rings.forEachQuerySince(state.queryCursor, [this, &state, &now](const Rings::Query& c) {
+      auto& window = state.requestors[c.requestor];
+      bool reset;
+      auto bucket = getBucket(window.buckets, state, c.when.tv_sec, now, reset);
+      if (bucket == nullptr) {
+        return;
+      }
+      auto counters = getBucketCounters(state, window, bucket - window.buckets.data(), reset);
+
+      ++bucket->queries;
+      const auto& qtypeIt = state.qtypeIndexes.find(c.qtype);
+      if (qtypeIt != state.qtypeIndexes.end()) {
+        ++counters[qtypeIt->second];
+      }
+      window.lastSeen = std::max(window.lastSeen, c.when.tv_sec);
+      state.toEvaluate.insert(c.requestor);
+    });
+  }
+
+  if (responseRules) {
+    g_rings.forEachResponseSince(state.responseCursor, [this, &state, &now](const Rings::Response& c) {
+      if (hasResponseRules()) {
+        auto& window = state.requestors[c.requestor];
+        bool reset;
+        auto bucket = getBucket(window.buckets, state, c.when.tv_sec, now, reset);
+        if (bucket != nullptr) {
+          auto counters = getBucketCounters(state, window, bucket - window.buckets.data(), reset);
+
+          ++bucket->responses;
+          bucket->respBytes += c.size;
+          const auto& rcodeIt = state.rcodeIndexes.find(c.dh.rcode);
+          if (rcodeIt != state.rcodeIndexes.end()) {
+            ++counters[rcodeIt->second];
+          }
+          window.lastSeen = std::max(window.lastSeen, c.when.tv_sec);
+          state.toEvaluate.insert(c.requestor);
         }
+      }
 
-        if (pair.second.rateExceeded(rcodeIt->second, now)) {
-          addBlock(blocks, now, requestor, pair.second, updated);
-          break;
+      if (hasSuffixMatchRules()) {
+        auto& window = state.names[c.name];
+        bool reset;
+        auto bucket = getBucket(window.buckets, state, c.when.tv_sec, now, reset);
+        if (bucket == nullptr) {
+          return;
+        }
+        /* same logic than StatNode::submit() */
+        int rcode = (c.dh.rcode == 0 && c.usec == std::numeric_limits<unsigned int>::max()) ? -1 : c.dh.rcode;
+        auto& stat = bucket->stat;
+        ++stat.queries;
+        stat.bytes += c.size;
+        if (rcode < 0) {
+          ++stat.drops;
+        }
+        else if (rcode == RCode::NoError) {
+          ++stat.noerrors;
+        }
+        else if (rcode == RCode::ServFail) {
+          ++stat.servfails;
+        }
+        else if (rcode == RCode::NXDomain) {
+          ++stat.nxdomains;
         }
+        window.lastSeen = std::max(window.lastSeen, c.when.tv_sec);
       }
-    }
+    });
+  }
+
+  /* only evaluate the requestors we have seen since the last run, and the ones that were exceeding a rule back then */
+  boost::optional<NetmaskTree<DynBlock> > blocks;
+  bool updated = false;
+  std::unordered_set<ComboAddress, ComboAddress::addressOnlyHash, ComboAddress::addressOnlyEqual> exceeding;
 
-    for (const auto& pair : d_rcodeRatioRules) {
-      const auto rcode = pair.first;
+  for (const auto& requestor : state.toEvaluate) {
+    const auto& windowIt = state.requestors.find(requestor);
+    if (windowIt == state.requestors.end()) {
+      continue;
+    }
 
-      const auto& rcodeIt = counters.d_rcodeCounts.find(rcode);
-      if (rcodeIt != counters.d_rcodeCounts.cend()) {
-        if (pair.second.warningRatioExceeded(counters.responses, rcodeIt->second)) {
-          handleWarning(blocks, now, requestor, pair.second, updated);
+    const auto& window = windowIt->second;
+    Counts counters;
+    for (size_t bucketIdx = 0; bucketIdx < window.buckets.size(); bucketIdx++) {
+      const auto& bucket = window.buckets[bucketIdx];
+      if (isBucketInWindow(bucket, state, d_queryRateRule.d_seconds, now)) {
+        counters.queries += bucket.queries;
+      }
+      if (isBucketInWindow(bucket, state, d_respRateRule.d_seconds, now)) {
+        counters.respBytes += bucket.respBytes;
+      }
+      if (isBucketInWindow(bucket, state, state.responsesWindow, now)) {
+        counters.responses += bucket.responses;
+      }
+      if (window.countersOffset == std::numeric_limits<size_t>::max()) {
+        continue;
+      }
+      const uint32_t* bucketCounters = &state.counters.at(window.countersOffset + bucketIdx * state.countersSize);
+      for (const auto& qtype : state.qtypeIndexes) {
+        if (bucketCounters[qtype.second] > 0 && isBucketInWindow(bucket, state, d_qtypeRules.at(qtype.first).d_seconds, now)) {
+          counters.d_qtypeCounts[qtype.first] += bucketCounters[qtype.second];
         }
-
-        if (pair.second.ratioExceeded(counters.responses, rcodeIt->second)) {
-          addBlock(blocks, now, requestor, pair.second, updated);
-          break;
+      }
+      for (const auto& rcode : state.rcodeIndexes) {
+        if (bucketCounters[rcode.second] > 0 && isBucketInWindow(bucket, state, state.rcodeWindows.at(rcode.first), now)) {
+          counters.d_rcodeCounts[rcode.first] += bucketCounters[rcode.second];
         }
       }
     }
+
+    if (processCounts(blocks, now, requestor, counters, updated)) {
+      exceeding.insert(requestor);
+    }
   }
 
+  state.toEvaluate = std::move(exceeding);
+
   if (updated && blocks) {
     g_dynblockNMG.setState(std::move(*blocks));
   }
 
-  if (!statNodeRoot.empty()) {
-    StatNode::Stat node;
-    std::unordered_set<DNSName> namesToBlock;
-    statNodeRoot.visit([this,&namesToBlock](const StatNode* node_, const StatNode::Stat& self, const StatNode::Stat& children) {
-                         bool block = false;
-
-                         if (d_smtVisitorFFI) {
-                           dnsdist_ffi_stat_node_t tmp(*node_, self, children);
-                           block = d_smtVisitorFFI(&tmp);
-                         }
-                         else {
-                           block = d_smtVisitor(*node_, self, children);
-                         }
-
-                         if (block) {
-                           namesToBlock.insert(DNSName(node_->fullname));
-                         }
-                       },
-      node);
+  if (hasSuffixMatchRules()) {
+    StatNode statNodeRoot;
+    for (const auto& entry : state.names) {
+      StatNode::Stat stat;
+      for (const auto& bucket : entry.second.buckets) {
+        if (isBucketInWindow(bucket, state, d_suffixMatchRule.d_seconds, now)) {
+          stat += bucket.stat;
+        }
+      }
+      if (stat.queries > 0) {
+        statNodeRoot.submit(entry.first, stat);
+      }
+    }
+    processSuffixMatchTree(statNodeRoot, now);
+  }
 
-    if (!namesToBlock.empty()) {
-      updated = false;
-      SuffixMatchTree<DynBlock> smtBlocks = g_dynblockSMT.getCopy();
-      for (const auto& name : namesToBlock) {
-        addOrRefreshBlockSMT(smtBlocks, now, name, d_suffixMatchRule, updated);
+  /* get rid of the entries we have not seen for a while, from time to time */
+  if (state.nextPurge <= now.tv_sec) {
+    const time_t cutOff = now.tv_sec - state.window - state.bucketWidth;
+    for (auto it = state.requestors.begin(); it != state.requestors.end(); ) {
+      if (it->second.lastSeen < cutOff) {
+        if (it->second.countersOffset != std::numeric_limits<size_t>::max()) {
+          state.freeCounters.push_back(it->second.countersOffset);
+        }
+        it = state.requestors.erase(it);
       }
-      if (updated) {
-        g_dynblockSMT.setState(std::move(smtBlocks));
+      else {
+        ++it;
       }
     }
+    for (auto it = state.names.begin(); it != state.names.end(); ) {
+      if (it->second.lastSeen < cutOff) {
+        it = state.names.erase(it);
+      }
+      else {
+        ++it;
+      }
+    }
+    state.nextPurge = now.tv_sec + state.window;
   }
 }
 
@@ -289,27 +615,24 @@ void DynBlockRulesGroup::processQueryRules(counts_t& counts, const struct timesp
     rule.second.d_cutOff.tv_sec -= rule.second.d_seconds;
   }
 
-  for (const auto& shard : g_rings.d_shards) {
-    std::lock_guard<std::mutex> rl(shard->queryLock);
-    for(const auto& c : shard->queryRing) {
-      if (now < c.when) {
-        continue;
-      }
+  g_rings.forEachQuery([this, &counts, &now](const Rings::Query& c) {
+    if (now < c.when) {
+      return;
+    }
 
-      bool qRateMatches = d_queryRateRule.matches(c.when);
-      bool typeRuleMatches = checkIfQueryTypeMatches(c);
+    bool qRateMatches = d_queryRateRule.matches(c.when);
+    bool typeRuleMatches = checkIfQueryTypeMatches(c);
 
-      if (qRateMatches || typeRuleMatches) {
-        auto& entry = counts[c.requestor];
-        if (qRateMatches) {
-          ++entry.queries;
-        }
-        if (typeRuleMatches) {
-          ++entry.d_qtypeCounts[c.qtype];
-        }
+    if (qRateMatches || typeRuleMatches) {
+      auto& entry = counts[c.requestor];
+      if (qRateMatches) {
+        ++entry.queries;
+      }
+      if (typeRuleMatches) {
+        ++entry.d_qtypeCounts[c.qtype];
       }
     }
-  }
+  });
 }
 
 void DynBlockRulesGroup::processResponseRules(counts_t& counts, StatNode& root, const struct timespec& now)
@@ -348,38 +671,35 @@ void DynBlockRulesGroup::processResponseRules(counts_t& counts, StatNode& root,
     }
   }
 
-  for (const auto& shard : g_rings.d_shards) {
-    std::lock_guard<std::mutex> rl(shard->respLock);
-    for(const auto& c : shard->respRing) {
-      if (now < c.when) {
-        continue;
-      }
+  g_rings.forEachResponse([this, &counts, &root, &now, &responseCutOff](const Rings::Response& c) {
+    if (now < c.when) {
+      return;
+    }
 
-      if (c.when < responseCutOff) {
-        continue;
-      }
+    if (c.when < responseCutOff) {
+      return;
+    }
 
-      auto& entry = counts[c.requestor];
-      ++entry.responses;
+    auto& entry = counts[c.requestor];
+    ++entry.responses;
 
-      bool respRateMatches = d_respRateRule.matches(c.when);
-      bool suffixMatchRuleMatches = d_suffixMatchRule.matches(c.when);
-      bool rcodeRuleMatches = checkIfResponseCodeMatches(c);
+    bool respRateMatches = d_respRateRule.matches(c.when);
+    bool suffixMatchRuleMatches = d_suffixMatchRule.matches(c.when);
+    bool rcodeRuleMatches = checkIfResponseCodeMatches(c);
 
-      if (respRateMatches || rcodeRuleMatches) {
-        if (respRateMatches) {
-          entry.respBytes += c.size;
-        }
-        if (rcodeRuleMatches) {
-          ++entry.d_rcodeCounts[c.dh.rcode];
-        }
+    if (respRateMatches || rcodeRuleMatches) {
+      if (respRateMatches) {
+        entry.respBytes += c.size;
       }
-
-      if (suffixMatchRuleMatches) {
-        root.submit(c.name, ((c.dh.rcode == 0 && c.usec == std::numeric_limits<unsigned int>::max()) ? -1 : c.dh.rcode), c.size, boost::none);
+      if (rcodeRuleMatches) {
+        ++entry.d_rcodeCounts[c.dh.rcode];
       }
     }
-  }
+
+    if (suffixMatchRuleMatches) {
+      root.submit(c.name, ((c.dh.rcode == 0 && c.usec == std::numeric_limits<unsigned int>::max()) ? -1 : c.dh.rcode), c.size, boost::none);
+    }
+  });
 }
 
 void DynBlockMaintenance::purgeExpired(const struct timespec& now)
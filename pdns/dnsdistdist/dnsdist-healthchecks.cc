@@ -77,27 +77,15 @@ void updateHealthCheckResult(const std::shared_ptr<DownstreamState>& dss, bool n
   }
 }
 
-static bool handleResponse(std::shared_ptr<HealthCheckData>& data)
+static bool handleResponse(std::shared_ptr<HealthCheckData>& data, const char* reply, size_t replySize)
 {
   auto& ds = data->d_ds;
   try {
-    string reply;
-    ComboAddress from;
-    data->d_sock.recvFrom(reply, from);
-
-    /* we are using a connected socket but hey.. */
-    if (from != ds->remote) {
-      if (g_verboseHealthChecks) {
-        infolog("Invalid health check response received from %s, expecting one from %s", from.toStringWithPort(), ds->remote.toStringWithPort());
-      }
-      return false;
-    }
-
-    const dnsheader * responseHeader = reinterpret_cast<const dnsheader *>(reply.c_str());
+    const dnsheader * responseHeader = reinterpret_cast<const dnsheader *>(reply);
 
-    if (reply.size() < sizeof(*responseHeader)) {
+    if (replySize < sizeof(*responseHeader)) {
       if (g_verboseHealthChecks) {
-        infolog("Invalid health check response of size %d from backend %s, expecting at least %d", reply.size(), ds->getNameWithAddr(), sizeof(*responseHeader));
+        infolog("Invalid health check response of size %d from backend %s, expecting at least %d", replySize, ds->getNameWithAddr(), sizeof(*responseHeader));
       }
       return false;
     }
@@ -132,7 +120,7 @@ static bool handleResponse(std::shared_ptr<HealthCheckData>& data)
 
     uint16_t receivedType;
     uint16_t receivedClass;
-    DNSName receivedName(reply.c_str(), reply.size(), sizeof(dnsheader), false, &receivedType, &receivedClass);
+    DNSName receivedName(reply, replySize, sizeof(dnsheader), false, &receivedType, &receivedClass);
 
     if (receivedName != data->d_checkName || receivedType != data->d_checkType || receivedClass != data->d_checkClass) {
       if (g_verboseHealthChecks) {
@@ -159,20 +147,225 @@ static bool handleResponse(std::shared_ptr<HealthCheckData>& data)
   return true;
 }
 
+static void finishHealthCheck(const std::shared_ptr<HealthCheckData>& data, bool up)
+{
+  data->d_ds->healthCheckInProgress = false;
+
+  if (data->d_initial) {
+    warnlog("Marking downstream %s as '%s'", data->d_ds->getNameWithAddr(), up ? "up" : "down");
+    data->d_ds->upStatus = up;
+  }
+  else {
+    updateHealthCheckResult(data->d_ds, up);
+  }
+}
+
 static void healthCheckCallback(int fd, FDMultiplexer::funcparam_t& param)
 {
   auto data = boost::any_cast<std::shared_ptr<HealthCheckData>>(param);
   data->d_mplexer->removeReadFD(fd);
-  updateHealthCheckResult(data->d_ds, handleResponse(data));
+
+  auto& ds = data->d_ds;
+  bool up = false;
+  try {
+    string reply;
+    ComboAddress from;
+    data->d_udpSocket->recvFrom(reply, from);
+
+    /* we are using a connected socket but hey.. */
+    if (from != ds->remote) {
+      if (g_verboseHealthChecks) {
+        infolog("Invalid health check response received from %s, expecting one from %s", from.toStringWithPort(), ds->remote.toStringWithPort());
+      }
+    }
+    else {
+      up = handleResponse(data, reply.c_str(), reply.size());
+    }
+  }
+  catch(const std::exception& e)
+  {
+    if (g_verboseHealthChecks) {
+      infolog("Error checking the health of backend %s: %s", ds->getNameWithAddr(), e.what());
+    }
+  }
+  catch(...)
+  {
+    if (g_verboseHealthChecks) {
+      infolog("Unknown exception while checking the health of backend %s", ds->getNameWithAddr());
+    }
+  }
+
+  finishHealthCheck(data, up);
+}
+
+static void bindHealthCheckSocket(const std::shared_ptr<DownstreamState>& ds, Socket& sock)
+{
+  if (!IsAnyAddress(ds->sourceAddr)) {
+    sock.setReuseAddr();
+    if (!ds->sourceItfName.empty()) {
+#ifdef SO_BINDTODEVICE
+      int res = setsockopt(sock.getHandle(), SOL_SOCKET, SO_BINDTODEVICE, ds->sourceItfName.c_str(), ds->sourceItfName.length());
+      if (res != 0 && g_verboseHealthChecks) {
+        infolog("Error setting SO_BINDTODEVICE on the health check socket for backend '%s': %s", ds->getNameWithAddr(), stringerror());
+      }
+#endif
+    }
+    sock.bind(ds->sourceAddr);
+  }
+}
+
+/* Reuse the TCP connection of the previous check if the backend did not close it,
+   or open a new one, then prepare the query to be sent over it. */
+static void prepareTCPHealthCheck(const std::shared_ptr<HealthCheckData>& data)
+{
+  auto& ds = data->d_ds;
+  auto& conn = ds->healthCheckConnection;
+
+  if (conn && !isTCPSocketUsable(conn->getDescriptor())) {
+    conn.reset();
+  }
+
+  data->d_freshConnection = conn == nullptr;
+  if (!conn) {
+    Socket sock(ds->remote.sin4.sin_family, SOCK_STREAM);
+    sock.setNonBlocking();
+    bindHealthCheckSocket(ds, sock);
+    conn = std::make_unique<TCPIOHandler>("", sock.releaseHandle(), 0, ds->d_tlsCtx, time(nullptr));
+    conn->tryConnect(false, ds->remote);
+  }
+
+  data->d_buffer.clear();
+  if (data->d_freshConnection && ds->useProxyProtocol) {
+    auto payload = makeLocalProxyHeader();
+    data->d_buffer.insert(data->d_buffer.end(), payload.begin(), payload.end());
+  }
+  const uint16_t querySize = data->d_query.size();
+  data->d_buffer.push_back(querySize / 256);
+  data->d_buffer.push_back(querySize % 256);
+  data->d_buffer.insert(data->d_buffer.end(), data->d_query.begin(), data->d_query.end());
+  data->d_bufferPos = 0;
+  data->d_tcpState = HealthCheckData::TCPState::WritingQuery;
+}
+
+static void tcpHealthCheckCallback(int fd, FDMultiplexer::funcparam_t& param);
+
+static void unregisterTCPHealthCheck(const std::shared_ptr<HealthCheckData>& data, int fd)
+{
+  if (data->d_registeredForWrite) {
+    data->d_mplexer->removeWriteFD(fd);
+  }
+  else {
+    data->d_mplexer->removeReadFD(fd);
+  }
 }
 
-static void initialHealthCheckCallback(int fd, FDMultiplexer::funcparam_t& param)
+/* send the query and read the response as far as we can without blocking, then wait for the connection to be usable again */
+static void handleTCPHealthCheckIO(std::shared_ptr<HealthCheckData>& data, bool registered)
+{
+  auto& ds = data->d_ds;
+  const int fd = ds->healthCheckConnection->getDescriptor();
+  IOState state = IOState::Done;
+  bool retry = false;
+
+  try {
+    auto& conn = ds->healthCheckConnection;
+
+    if (data->d_tcpState == HealthCheckData::TCPState::WritingQuery) {
+      state = conn->tryWrite(data->d_buffer, data->d_bufferPos, data->d_buffer.size());
+      if (state == IOState::Done) {
+        data->d_tcpState = HealthCheckData::TCPState::ReadingResponseSize;
+        data->d_buffer.resize(sizeof(uint16_t));
+        data->d_bufferPos = 0;
+      }
+    }
+
+    if (data->d_tcpState == HealthCheckData::TCPState::ReadingResponseSize) {
+      state = conn->tryRead(data->d_buffer, data->d_bufferPos, sizeof(uint16_t));
+      if (state == IOState::Done) {
+        const uint16_t responseSize = data->d_buffer.at(0) * 256 + data->d_buffer.at(1);
+        if (responseSize < sizeof(dnsheader)) {
+          throw std::runtime_error("Invalid health check response of size " + std::to_string(responseSize));
+        }
+        data->d_tcpState = HealthCheckData::TCPState::ReadingResponse;
+        data->d_buffer.resize(responseSize);
+        data->d_bufferPos = 0;
+      }
+    }
+
+    if (data->d_tcpState == HealthCheckData::TCPState::ReadingResponse) {
+      state = conn->tryRead(data->d_buffer, data->d_bufferPos, data->d_buffer.size());
+      if (state == IOState::Done) {
+        if (registered) {
+          unregisterTCPHealthCheck(data, fd);
+        }
+
+        bool up = handleResponse(data, reinterpret_cast<const char*>(data->d_buffer.data()), data->d_buffer.size());
+        if (!up) {
+          /* we can't be sure that the next response will be in sync */
+          conn.reset();
+        }
+        finishHealthCheck(data, up);
+        return;
+      }
+    }
+  }
+  catch (const std::exception& e) {
+    if (registered) {
+      unregisterTCPHealthCheck(data, fd);
+    }
+    ds->healthCheckConnection.reset();
+
+    if (!data->d_freshConnection) {
+      /* the backend might have closed the connection since the previous check */
+      retry = true;
+    }
+    else {
+      if (g_verboseHealthChecks) {
+        infolog("Error checking the health of backend %s over TCP: %s", ds->getNameWithAddr(), e.what());
+      }
+      finishHealthCheck(data, false);
+      return;
+    }
+  }
+
+  if (retry) {
+    try {
+      prepareTCPHealthCheck(data);
+    }
+    catch (const std::exception& e) {
+      if (g_verboseHealthChecks) {
+        infolog("Error connecting to backend %s to check its health over TCP: %s", ds->getNameWithAddr(), e.what());
+      }
+      ds->healthCheckConnection.reset();
+      finishHealthCheck(data, false);
+      return;
+    }
+    handleTCPHealthCheckIO(data, false);
+    return;
+  }
+
+  const bool needWrite = state == IOState::NeedWrite;
+  if (!registered) {
+    if (needWrite) {
+      data->d_mplexer->addWriteFD(fd, &tcpHealthCheckCallback, data, &data->d_ttd);
+    }
+    else {
+      data->d_mplexer->addReadFD(fd, &tcpHealthCheckCallback, data, &data->d_ttd);
+    }
+  }
+  else if (needWrite && !data->d_registeredForWrite) {
+    data->d_mplexer->alterFDToWrite(fd, &tcpHealthCheckCallback, data, &data->d_ttd);
+  }
+  else if (!needWrite && data->d_registeredForWrite) {
+    data->d_mplexer->alterFDToRead(fd, &tcpHealthCheckCallback, data, &data->d_ttd);
+  }
+  data->d_registeredForWrite = needWrite;
+}
+
+static void tcpHealthCheckCallback(int fd, FDMultiplexer::funcparam_t& param)
 {
   auto data = boost::any_cast<std::shared_ptr<HealthCheckData>>(param);
-  data->d_mplexer->removeReadFD(fd);
-  bool up = handleResponse(data);
-  warnlog("Marking downstream %s as '%s'", data->d_ds->getNameWithAddr(), up ? "up" : "down");
-  data->d_ds->upStatus = up;
+  handleTCPHealthCheckIO(data, true);
 }
 
 bool queueHealthCheck(std::shared_ptr<FDMultiplexer>& mplexer, const std::shared_ptr<DownstreamState>& ds, bool initialCheck)
@@ -207,27 +400,33 @@ bool queueHealthCheck(std::shared_ptr<FDMultiplexer>& mplexer, const std::shared
     dnsheader * requestHeader = dpw.getHeader();
     *requestHeader = checkHeader;
 
+    auto data = std::make_shared<HealthCheckData>(mplexer, ds, std::move(checkName), checkType, checkClass, queryID, initialCheck);
+    gettimeofday(&data->d_ttd, nullptr);
+    data->d_ttd.tv_sec += ds->checkTimeout / 1000; /* ms to seconds */
+    data->d_ttd.tv_usec += (ds->checkTimeout % 1000) * 1000; /* remaining ms to us */
+    if (data->d_ttd.tv_usec > 1000000) {
+      ++data->d_ttd.tv_sec;
+      data->d_ttd.tv_usec -= 1000000;
+    }
+
+    if (ds->checkTCP) {
+      data->d_query = std::move(packet);
+      prepareTCPHealthCheck(data);
+      ds->healthCheckInProgress = true;
+      handleTCPHealthCheckIO(data, false);
+      return true;
+    }
+
     if (ds->useProxyProtocol) {
       auto payload = makeLocalProxyHeader();
       packet.insert(packet.begin(), payload.begin(), payload.end());
     }
 
-    Socket sock(ds->remote.sin4.sin_family, SOCK_DGRAM);
-    sock.setNonBlocking();
-    if (!IsAnyAddress(ds->sourceAddr)) {
-      sock.setReuseAddr();
-      if (!ds->sourceItfName.empty()) {
-#ifdef SO_BINDTODEVICE
-        int res = setsockopt(sock.getHandle(), SOL_SOCKET, SO_BINDTODEVICE, ds->sourceItfName.c_str(), ds->sourceItfName.length());
-        if (res != 0 && g_verboseHealthChecks) {
-          infolog("Error setting SO_BINDTODEVICE on the health check socket for backend '%s': %s", ds->getNameWithAddr(), stringerror());
-        }
-#endif
-      }
-      sock.bind(ds->sourceAddr);
-    }
-    sock.connect(ds->remote);
-    ssize_t sent = udpClientSendRequestToBackend(ds, sock.getHandle(), packet, true);
+    auto sock = std::make_unique<Socket>(ds->remote.sin4.sin_family, SOCK_DGRAM);
+    sock->setNonBlocking();
+    bindHealthCheckSocket(ds, *sock);
+    sock->connect(ds->remote);
+    ssize_t sent = udpClientSendRequestToBackend(ds, sock->getHandle(), packet, true);
     if (sent < 0) {
       int ret = errno;
       if (g_verboseHealthChecks)
@@ -235,16 +434,9 @@ bool queueHealthCheck(std::shared_ptr<FDMultiplexer>& mplexer, const std::shared
       return false;
     }
 
-    auto data = std::make_shared<HealthCheckData>(mplexer, ds, std::move(sock), std::move(checkName), checkType, checkClass, queryID);
-    struct timeval ttd;
-    gettimeofday(&ttd, nullptr);
-    ttd.tv_sec += ds->checkTimeout / 1000; /* ms to seconds */
-    ttd.tv_usec += (ds->checkTimeout % 1000) * 1000; /* remaining ms to us */
-    if (ttd.tv_usec > 1000000) {
-      ++ttd.tv_sec;
-      ttd.tv_usec -= 1000000;
-    }
-    mplexer->addReadFD(data->d_sock.getHandle(), initialCheck ? &initialHealthCheckCallback : &healthCheckCallback, data, &ttd);
+    data->d_udpSocket = std::move(sock);
+    ds->healthCheckInProgress = true;
+    mplexer->addReadFD(data->d_udpSocket->getHandle(), &healthCheckCallback, data, &data->d_ttd);
 
     return true;
   }
@@ -264,9 +456,35 @@ bool queueHealthCheck(std::shared_ptr<FDMultiplexer>& mplexer, const std::shared
   }
 }
 
-void handleQueuedHealthChecks(std::shared_ptr<FDMultiplexer>& mplexer, bool initial)
+static void handleHealthCheckTimeouts(std::shared_ptr<FDMultiplexer>& mplexer, const struct timeval& now)
+{
+  for (const bool writes : { false, true }) {
+    auto timeouts = mplexer->getTimeouts(now, writes);
+    for (const auto& timeout : timeouts) {
+      if (writes) {
+        mplexer->removeWriteFD(timeout.first);
+      }
+      else {
+        mplexer->removeReadFD(timeout.first);
+      }
+
+      auto data = boost::any_cast<std::shared_ptr<HealthCheckData>>(timeout.second);
+      if (data->d_udpSocket == nullptr) {
+        /* we don't know where we are in the TCP stream anymore */
+        data->d_ds->healthCheckConnection.reset();
+      }
+
+      if (g_verboseHealthChecks) {
+        infolog("Timeout while waiting for the health check response from backend %s", data->d_ds->getNameWithAddr());
+      }
+      finishHealthCheck(data, false);
+    }
+  }
+}
+
+void handleQueuedHealthChecks(std::shared_ptr<FDMultiplexer>& mplexer)
 {
-  while (mplexer->getWatchedFDCount(false) > 0) {
+  while (mplexer->getWatchedFDCount(false) > 0 || mplexer->getWatchedFDCount(true) > 0) {
     struct timeval now;
     int ret = mplexer->run(&now, 100);
     if (ret == -1) {
@@ -275,20 +493,121 @@ void handleQueuedHealthChecks(std::shared_ptr<FDMultiplexer>& mplexer, bool init
       }
       break;
     }
-    auto timeouts = mplexer->getTimeouts(now);
-    for (const auto& timeout : timeouts) {
-      mplexer->removeReadFD(timeout.first);
-      auto data = boost::any_cast<std::shared_ptr<HealthCheckData>>(timeout.second);
+    handleHealthCheckTimeouts(mplexer, now);
+  }
+}
+
+static void addToTimeval(struct timeval& tv, uint64_t usec)
+{
+  tv.tv_sec += usec / 1000000;
+  tv.tv_usec += usec % 1000000;
+  if (tv.tv_usec >= 1000000) {
+    ++tv.tv_sec;
+    tv.tv_usec -= 1000000;
+  }
+}
+
+/* this is only used to spread the load, there is no need for a strong randomness */
+static uint64_t getRandomDelayUsec(uint64_t max)
+{
+  return max > 0 ? static_cast<uint64_t>(random()) % max : 0;
+}
+
+static uint64_t getHealthCheckIntervalUsec(const std::shared_ptr<DownstreamState>& ds)
+{
+  return std::max(ds->checkInterval, 1U) * 1000000ULL;
+}
+
+void scheduleFirstHealthCheck(const std::shared_ptr<DownstreamState>& ds, const struct timeval& now)
+{
+  ds->nextMaintenance = now;
+  addToTimeval(ds->nextMaintenance, getRandomDelayUsec(1000000));
+
+  ds->nextHealthCheck = now;
+  addToTimeval(ds->nextHealthCheck, getRandomDelayUsec(getHealthCheckIntervalUsec(ds)));
+
+  ds->lastHealthCheckCounters.queries = ds->queries.load();
+  ds->lastHealthCheckCounters.reuseds = ds->reuseds.load();
+  ds->lastHealthCheckCounters.servfailResponses = ds->servfailResponses.load();
+}
+
+bool needsLazyHealthCheck(const std::shared_ptr<DownstreamState>& ds)
+{
+  auto& last = ds->lastHealthCheckCounters;
+  const uint64_t queries = ds->queries.load();
+  const uint64_t reuseds = ds->reuseds.load();
+  const uint64_t servfailResponses = ds->servfailResponses.load();
+  const uint64_t sent = queries - last.queries;
+  const uint64_t failed = (reuseds - last.reuseds) + (servfailResponses - last.servfailResponses);
+  last.queries = queries;
+  last.reuseds = reuseds;
+  last.servfailResponses = servfailResponses;
+
+  if (!ds->upStatus) {
+    /* a backend that is down does not get any traffic, only a health check can bring it back */
+    return true;
+  }
+
+  if (sent == 0 || sent < ds->lazyHealthCheckMinSampleCount) {
+    return false;
+  }
+
+  if (failed * 100 >= sent * ds->lazyHealthCheckThreshold) {
+    if (g_verboseHealthChecks) {
+      infolog("Backend %s had %d timeouts and SERVFAIL responses for %d queries since the previous check, sending a health check query", ds->getNameWithAddr(), failed, sent);
+    }
+    return true;
+  }
+
+  /* the regular traffic shows that the backend is healthy */
+  updateHealthCheckResult(ds, true);
+  return false;
+}
+
+void checkHealthIfDue(std::shared_ptr<FDMultiplexer>& mplexer, const std::shared_ptr<DownstreamState>& ds, const struct timeval& now)
+{
+  if (ds->availability != DownstreamState::Availability::Auto || now < ds->nextHealthCheck) {
+    return;
+  }
+
+  /* up to 10% of jitter, so that the backends sharing the same interval do not end up being checked at the same time */
+  const uint64_t interval = getHealthCheckIntervalUsec(ds);
+  const uint64_t jitter = interval / 10;
+  ds->nextHealthCheck = now;
+  addToTimeval(ds->nextHealthCheck, interval - jitter + getRandomDelayUsec(2 * jitter));
+
+  if (ds->healthCheckInProgress) {
+    /* the previous check has not completed yet */
+    return;
+  }
+
+  if (ds->healthCheckMode == DownstreamState::HealthCheckMode::Lazy && !needsLazyHealthCheck(ds)) {
+    return;
+  }
+
+  if (!queueHealthCheck(mplexer, ds)) {
+    updateHealthCheckResult(ds, false);
+  }
+}
+
+void handleHealthCheckEvents(std::shared_ptr<FDMultiplexer>& mplexer, const struct timeval& until)
+{
+  struct timeval now;
+  gettimeofday(&now, nullptr);
+
+  while (now < until) {
+    const auto remaining = until - now;
+    /* we also need to wake up regularly to notice the checks that timed out */
+    int timeout = std::min(static_cast<int>(remaining.tv_sec * 1000 + remaining.tv_usec / 1000), 100);
+    try {
+      mplexer->run(&now, std::max(timeout, 1));
+    }
+    catch (const std::exception& e) {
       if (g_verboseHealthChecks) {
-        infolog("Timeout while waiting for the health check response from backend %s", data->d_ds->getNameWithAddr());
-      }
-      if (initial) {
-        warnlog("Marking downstream %s as 'down'", data->d_ds->getNameWithAddr());
-        data->d_ds->upStatus = false;
-      }
-      else {
-        updateHealthCheckResult(data->d_ds, false);
+        infolog("Error while waiting for the health check response from backends: %s", e.what());
       }
+      gettimeofday(&now, nullptr);
     }
+    handleHealthCheckTimeouts(mplexer, now);
   }
 }
@@ -27,22 +27,45 @@
 
 struct HealthCheckData
 {
-  HealthCheckData(std::shared_ptr<FDMultiplexer>& mplexer, const std::shared_ptr<DownstreamState>& ds, Socket&& sock, DNSName&& checkName, uint16_t checkType, uint16_t checkClass, uint16_t queryID): d_mplexer(mplexer), d_ds(ds), d_sock(std::move(sock)), d_checkName(std::move(checkName)), d_checkType(checkType), d_checkClass(checkClass), d_queryID(queryID)
+  enum class TCPState : uint8_t { WritingQuery, ReadingResponseSize, ReadingResponse };
+
+  HealthCheckData(std::shared_ptr<FDMultiplexer>& mplexer, const std::shared_ptr<DownstreamState>& ds, DNSName&& checkName, uint16_t checkType, uint16_t checkClass, uint16_t queryID, bool initial): d_mplexer(mplexer), d_ds(ds), d_checkName(std::move(checkName)), d_checkType(checkType), d_checkClass(checkClass), d_queryID(queryID), d_initial(initial)
   {
   }
 
   std::shared_ptr<FDMultiplexer> d_mplexer;
   const std::shared_ptr<DownstreamState> d_ds;
-  Socket d_sock;
+  /* only used over UDP, the TCP connection belongs to the backend */
+  std::unique_ptr<Socket> d_udpSocket{nullptr};
   DNSName d_checkName;
+  /* the query, without the proxy protocol payload, and then the data being sent or received over TCP */
+  PacketBuffer d_query;
+  PacketBuffer d_buffer;
+  struct timeval d_ttd{0, 0};
+  size_t d_bufferPos{0};
   uint16_t d_checkType;
   uint16_t d_checkClass;
   uint16_t d_queryID;
+  TCPState d_tcpState{TCPState::WritingQuery};
+  bool d_initial{false};
+  /* whether the TCP connection was opened for this check, instead of being reused */
+  bool d_freshConnection{false};
+  bool d_registeredForWrite{false};
 };
 
 extern bool g_verboseHealthChecks;
 
 void updateHealthCheckResult(const std::shared_ptr<DownstreamState>& dss, bool newState);
 bool queueHealthCheck(std::shared_ptr<FDMultiplexer>& mplexer, const std::shared_ptr<DownstreamState>& ds, bool initial=false);
-void handleQueuedHealthChecks(std::shared_ptr<FDMultiplexer>& mplexer, bool initial=false);
+void handleQueuedHealthChecks(std::shared_ptr<FDMultiplexer>& mplexer);
 
+/* pick, at random, when the first health check and the first scan of the outstanding
+   queries of a new backend should happen, so that the backends are not all handled at the same time */
+void scheduleFirstHealthCheck(const std::shared_ptr<DownstreamState>& ds, const struct timeval& now);
+/* in lazy mode, whether the timeouts and SERVFAIL responses seen by the regular traffic since the previous
+   call warrant sending a health check query. The backend is marked up if that traffic shows it is healthy */
+bool needsLazyHealthCheck(const std::shared_ptr<DownstreamState>& ds);
+/* send a health check query to that backend if one is due, and schedule the next one */
+void checkHealthIfDue(std::shared_ptr<FDMultiplexer>& mplexer, const std::shared_ptr<DownstreamState>& ds, const struct timeval& now);
+/* process the responses to the health check queries, and the queries that timed out, until 'until' */
+void handleHealthCheckEvents(std::shared_ptr<FDMultiplexer>& mplexer, const struct timeval& until);
@@ -0,0 +1,221 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <atomic>
+
+#include "dnsdist-heavyhitters.hh"
+#include "dns.hh"
+
+HeavyHitters g_heavyHitters;
+
+const std::vector<std::string>& HeavyHitters::getKinds()
+{
+  static const std::vector<std::string> kinds{"queries", "clients", "bandwidth", "servfail", "nxdomain"};
+  return kinds;
+}
+
+static std::atomic<uint64_t> s_heavyHittersNextID{1};
+
+HeavyHitters::QueryTrackers::QueryTrackers(const Options& options): queries(options.capacity, options.width, options.depth, 1, options.halfLife), clients(options.capacity, options.width, options.depth, 1, options.halfLife)
+{
+}
+
+HeavyHitters::ResponseTrackers::ResponseTrackers(const Options& options): bandwidth(options.capacity, options.width, options.depth, 1, options.halfLife), servfails(options.capacity, options.width, options.depth, 1, options.halfLife), nxdomains(options.capacity, options.width, options.depth, 1, options.halfLife)
+{
+}
+
+HeavyHitters::HeavyHitters()
+{
+  configure(Options());
+}
+
+/* This function should only be called at configuration time, before any query has been received */
+void HeavyHitters::configure(const Options& options)
+{
+  std::lock_guard<std::mutex> lock(d_lock);
+  d_options = options;
+  d_enabled = options.enabled;
+  d_id = s_heavyHittersNextID++;
+  d_queryTrackers.clear();
+  d_responseTrackers.clear();
+}
+
+HeavyHitters::ThreadTrackers& HeavyHitters::getThreadTrackers()
+{
+  /* there is usually only one HeavyHitters object, the entries of the
+     destroyed ones are never used again since their ID is unique */
+  static thread_local std::vector<ThreadTrackers> t_trackers;
+
+  for (auto& trackers : t_trackers) {
+    if (trackers.id == d_id) {
+      return trackers;
+    }
+  }
+
+  t_trackers.push_back(ThreadTrackers());
+  t_trackers.back().id = d_id;
+  return t_trackers.back();
+}
+
+void HeavyHitters::insertQuery(const ComboAddress& requestor, const DNSName& qname, time_t now)
+{
+  if (!d_enabled) {
+    return;
+  }
+
+  auto& trackers = getThreadTrackers();
+  if (trackers.queries == nullptr) {
+    std::lock_guard<std::mutex> lock(d_lock);
+    d_queryTrackers.push_back(std::make_unique<QueryTrackers>(d_options));
+    trackers.queries = d_queryTrackers.back().get();
+  }
+
+  trackers.queries->queries.add(qname, 1, now);
+  trackers.queries->clients.add(requestor, 1, now);
+}
+
+void HeavyHitters::insertResponse(const ComboAddress& requestor, const DNSName& qname, uint8_t rcode, unsigned int size, time_t now)
+{
+  if (!d_enabled) {
+    return;
+  }
+
+  auto& trackers = getThreadTrackers();
+  if (trackers.responses == nullptr) {
+    std::lock_guard<std::mutex> lock(d_lock);
+    d_responseTrackers.push_back(std::make_unique<ResponseTrackers>(d_options));
+    trackers.responses = d_responseTrackers.back().get();
+  }
+
+  trackers.responses->bandwidth.add(requestor, size, now);
+  if (rcode == RCode::ServFail) {
+    trackers.responses->servfails.add(qname, 1, now);
+  }
+  else if (rcode == RCode::NXDomain) {
+    trackers.responses->nxdomains.add(qname, 1, now);
+  }
+}
+
+static std::string keyToString(const DNSName& name)
+{
+  return name.makeLowerCase().toString();
+}
+
+static std::string keyToString(const ComboAddress& address)
+{
+  return address.toString();
+}
+
+template <typename T, typename Hash, typename KeyEqual>
+static std::vector<HeavyHitters::Entry> getMergedTopEntries(const std::vector<const HeavyHittersTracker<T, Hash, KeyEqual>*>& trackers, size_t count, uint64_t& total, time_t now)
+{
+  std::unordered_map<T, uint64_t, Hash, KeyEqual> candidates;
+  total = 0;
+  for (const auto& tracker : trackers) {
+    uint64_t trackerTotal = 0;
+    for (const auto& entry : tracker->getTop(tracker->getCapacity(), now, trackerTotal)) {
+      candidates.emplace(entry.first, 0);
+    }
+    total += trackerTotal;
+  }
+
+  std::vector<std::pair<T, uint64_t>> merged;
+  merged.reserve(candidates.size());
+  for (const auto& candidate : candidates) {
+    uint64_t estimate = 0;
+    for (const auto& tracker : trackers) {
+      estimate += tracker->getEstimate(candidate.first, now);
+    }
+    merged.emplace_back(candidate.first, estimate);
+  }
+
+  count = std::min(count, merged.size());
+  std::partial_sort(merged.begin(), merged.begin() + count, merged.end(), [](const std::pair<T, uint64_t>& a, const std::pair<T, uint64_t>& b) {
+    return a.second > b.second;
+  });
+
+  std::vector<HeavyHitters::Entry> result;
+  result.reserve(count);
+  for (size_t idx = 0; idx < count; idx++) {
+    result.push_back({keyToString(merged.at(idx).first), merged.at(idx).second});
+  }
+  return result;
+}
+
+template <typename Trackers, typename Tracker>
+static std::vector<HeavyHitters::Entry> getTopEntries(const std::vector<std::unique_ptr<Trackers>>& all, Tracker Trackers::*member, size_t count, uint64_t& total, time_t now)
+{
+  std::vector<const Tracker*> trackers;
+  trackers.reserve(all.size());
+  for (const auto& entry : all) {
+    trackers.push_back(&((*entry).*member));
+  }
+  return getMergedTopEntries(trackers, count, total, now);
+}
+
+std::vector<HeavyHitters::Entry> HeavyHitters::getTop(const std::string& kind, size_t count, uint64_t& total, time_t now) const
+{
+  const auto& kinds = getKinds();
+  if (std::find(kinds.cbegin(), kinds.cend(), kind) == kinds.cend()) {
+    throw std::runtime_error("Unknown heavy hitters kind '" + kind + "'");
+  }
+
+  total = 0;
+  if (!d_enabled) {
+    return {};
+  }
+
+  /* the trackers are only released by configure(), which is not called at runtime,
+     but new ones might be added while we are reading them */
+  std::lock_guard<std::mutex> lock(d_lock);
+  if (kind == "queries") {
+    return getTopEntries(d_queryTrackers, &QueryTrackers::queries, count, total, now);
+  }
+  if (kind == "clients") {
+    return getTopEntries(d_queryTrackers, &QueryTrackers::clients, count, total, now);
+  }
+  if (kind == "bandwidth") {
+    return getTopEntries(d_responseTrackers, &ResponseTrackers::bandwidth, count, total, now);
+  }
+  if (kind == "servfail") {
+    return getTopEntries(d_responseTrackers, &ResponseTrackers::servfails, count, total, now);
+  }
+  if (kind == "nxdomain") {
+    return getTopEntries(d_responseTrackers, &ResponseTrackers::nxdomains, count, total, now);
+  }
+
+  return {};
+}
+
+void HeavyHitters::clear()
+{
+  std::lock_guard<std::mutex> lock(d_lock);
+  for (auto& trackers : d_queryTrackers) {
+    trackers->queries.clear();
+    trackers->clients.clear();
+  }
+  for (auto& trackers : d_responseTrackers) {
+    trackers->bandwidth.clear();
+    trackers->servfails.clear();
+    trackers->nxdomains.clear();
+  }
+}
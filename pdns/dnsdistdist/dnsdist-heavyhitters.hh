@@ -0,0 +1,334 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "dnsname.hh"
+#include "iputils.hh"
+
+/* Approximate top-K tracking in a fixed amount of memory. A Count-Min Sketch, using
+   the conservative update rule, estimates the weight of every key ever inserted, and
+   the 'capacity' keys with the largest estimates are kept aside, the smallest one
+   being evicted when a key with a larger estimate shows up.
+   The keys are spread over several independent shards, each one with its own lock,
+   sketch and top keys, to reduce contention between the threads inserting.
+   If 'halfLife' is not 0, every counter is halved every 'halfLife' seconds so that
+   the estimates reflect the recent traffic. */
+template <typename T, typename Hash = std::hash<T>, typename KeyEqual = std::equal_to<T>>
+class HeavyHittersTracker
+{
+public:
+  HeavyHittersTracker(size_t capacity, size_t width, size_t depth, size_t shards, time_t halfLife): d_capacity(std::max(capacity, static_cast<size_t>(1))), d_width(std::max(width, static_cast<size_t>(1))), d_depth(std::max(depth, static_cast<size_t>(1))), d_halfLife(halfLife)
+  {
+    d_shards.resize(std::max(shards, static_cast<size_t>(1)));
+    for (auto& shard : d_shards) {
+      shard = std::make_unique<Shard>();
+      shard->sketch.resize(d_width * d_depth, 0);
+      shard->top.reserve(d_capacity + 1);
+    }
+  }
+
+  void add(const T& key, uint64_t weight, time_t now)
+  {
+    const uint64_t hash = mix(Hash()(key));
+    auto& shard = *d_shards.at(hash % d_shards.size());
+    std::lock_guard<std::mutex> lock(shard.lock);
+
+    decay(shard, now);
+    shard.total += weight;
+
+    /* conservative update: only raise the counters to the new estimate */
+    const uint64_t estimate = readSketch(shard, hash) + weight;
+    forEachCounter(shard, hash, [estimate](uint64_t& counter) {
+      counter = std::max(counter, estimate);
+    });
+
+    auto it = shard.top.find(key);
+    if (it != shard.top.end()) {
+      it->second = estimate;
+      if (shard.minimumValid && KeyEqual()(it->first, shard.minimumKey)) {
+        shard.minimumValid = false;
+      }
+      return;
+    }
+
+    if (shard.top.size() < d_capacity) {
+      shard.top.emplace(key, estimate);
+      if (shard.minimumValid && estimate < shard.minimum) {
+        shard.minimum = estimate;
+        shard.minimumKey = key;
+      }
+      return;
+    }
+
+    updateMinimum(shard);
+    if (estimate <= shard.minimum) {
+      return;
+    }
+
+    shard.top.erase(shard.minimumKey);
+    shard.top.emplace(key, estimate);
+    shard.minimumValid = false;
+  }
+
+  /* estimated weight of that key */
+  uint64_t getEstimate(const T& key, time_t now) const
+  {
+    const uint64_t hash = mix(Hash()(key));
+    auto& shard = *d_shards.at(hash % d_shards.size());
+    std::lock_guard<std::mutex> lock(shard.lock);
+    decay(shard, now);
+    return readSketch(shard, hash);
+  }
+
+  /* the 'count' keys with the largest estimated weight, largest first,
+     and the total weight of all the keys */
+  std::vector<std::pair<T, uint64_t>> getTop(size_t count, time_t now, uint64_t& total) const
+  {
+    std::vector<std::pair<T, uint64_t>> result;
+    result.reserve(d_capacity * d_shards.size());
+    total = 0;
+
+    for (auto& shard : d_shards) {
+      std::lock_guard<std::mutex> lock(shard->lock);
+      decay(*shard, now);
+      total += shard->total;
+      for (const auto& entry : shard->top) {
+        if (entry.second > 0) {
+          result.push_back(entry);
+        }
+      }
+    }
+
+    count = std::min(count, result.size());
+    std::partial_sort(result.begin(), result.begin() + count, result.end(), [](const std::pair<T, uint64_t>& a, const std::pair<T, uint64_t>& b) {
+      return a.second > b.second;
+    });
+    result.resize(count);
+    return result;
+  }
+
+  void clear()
+  {
+    for (auto& shard : d_shards) {
+      std::lock_guard<std::mutex> lock(shard->lock);
+      std::fill(shard->sketch.begin(), shard->sketch.end(), 0);
+      shard->top.clear();
+      shard->total = 0;
+      shard->minimumValid = false;
+    }
+  }
+
+  size_t getCapacity() const
+  {
+    return d_capacity;
+  }
+
+private:
+  struct Shard
+  {
+    std::mutex lock;
+    std::vector<uint64_t> sketch;
+    std::unordered_map<T, uint64_t, Hash, KeyEqual> top;
+    T minimumKey;
+    uint64_t minimum{0};
+    uint64_t total{0};
+    time_t lastDecay{0};
+    bool minimumValid{false};
+  };
+
+  /* the hash functions of DNSName and ComboAddress are not always well distributed in the
+     low bits, which we use to select the shard */
+  static uint64_t mix(uint64_t hash)
+  {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+  }
+
+  /* every row needs its own, independent, position */
+  template <typename Visitor>
+  void forEachCounter(Shard& shard, uint64_t hash, Visitor&& visitor) const
+  {
+    for (size_t row = 0; row < d_depth; row++) {
+      const uint64_t rowHash = mix(hash ^ ((row + 1) * 0x9e3779b97f4a7c15ULL));
+      visitor(shard.sketch.at(row * d_width + (rowHash % d_width)));
+    }
+  }
+
+  uint64_t readSketch(Shard& shard, uint64_t hash) const
+  {
+    uint64_t estimate = std::numeric_limits<uint64_t>::max();
+    forEachCounter(shard, hash, [&estimate](const uint64_t& counter) {
+      estimate = std::min(estimate, counter);
+    });
+    return estimate;
+  }
+
+  void updateMinimum(Shard& shard) const
+  {
+    if (shard.minimumValid) {
+      return;
+    }
+
+    auto it = std::min_element(shard.top.cbegin(), shard.top.cend(), [](const std::pair<const T, uint64_t>& a, const std::pair<const T, uint64_t>& b) {
+      return a.second < b.second;
+    });
+    if (it != shard.top.cend()) {
+      shard.minimum = it->second;
+      shard.minimumKey = it->first;
+      shard.minimumValid = true;
+    }
+  }
+
+  void decay(Shard& shard, time_t now) const
+  {
+    if (d_halfLife == 0) {
+      return;
+    }
+    if (shard.lastDecay == 0) {
+      shard.lastDecay = now;
+      return;
+    }
+    if (now < shard.lastDecay + d_halfLife) {
+      return;
+    }
+
+    const time_t periods = (now - shard.lastDecay) / d_halfLife;
+    shard.lastDecay += periods * d_halfLife;
+    const unsigned int shift = periods >= 64 ? 63 : static_cast<unsigned int>(periods);
+    for (auto& counter : shard.sketch) {
+      counter >>= shift;
+    }
+    for (auto& entry : shard.top) {
+      entry.second >>= shift;
+    }
+    shard.total >>= shift;
+    shard.minimumValid = false;
+  }
+
+  std::vector<std::unique_ptr<Shard>> d_shards;
+  const size_t d_capacity;
+  const size_t d_width;
+  const size_t d_depth;
+  const time_t d_halfLife;
+};
+
+/* Keep track of the names being queried, the clients sending the most queries, using
+   the most bandwidth and getting the most ServFail and NXDomain responses, for the
+   whole lifetime of the process. This is not limited by the size of the ring buffers
+   and the inspection does not need to lock them.
+   Every thread inserting queries or responses gets trackers of its own, so that the
+   insertion never contends with the other threads, and these trackers are merged when
+   the top keys are requested: the candidates are the top keys of every thread, and
+   their weight is the sum of the estimates of every thread. A key that is spread over
+   so many threads that it is not in the top keys of any of them is not reported. */
+class HeavyHitters
+{
+public:
+  struct Options
+  {
+    size_t capacity{100};
+    size_t width{2048};
+    size_t depth{4};
+    time_t halfLife{60};
+    bool enabled{true};
+  };
+
+  struct Entry
+  {
+    std::string key;
+    uint64_t count;
+  };
+
+  static const std::vector<std::string>& getKinds();
+
+  HeavyHitters();
+  void configure(const Options& options);
+
+  bool isEnabled() const
+  {
+    return d_enabled;
+  }
+
+  void insertQuery(const ComboAddress& requestor, const DNSName& qname, time_t now);
+  void insertResponse(const ComboAddress& requestor, const DNSName& qname, uint8_t rcode, unsigned int size, time_t now);
+
+  /* kind is one of the values returned by getKinds(), throws std::runtime_error if it is not */
+  std::vector<Entry> getTop(const std::string& kind, size_t count, uint64_t& total, time_t now) const;
+  void clear();
+
+private:
+  using NameTracker = HeavyHittersTracker<DNSName>;
+  using ClientTracker = HeavyHittersTracker<ComboAddress, ComboAddress::addressOnlyHash, ComboAddress::addressOnlyEqual>;
+
+  /* the threads handling queries and the ones handling responses are not always the same,
+     so these are allocated separately to save memory */
+  struct QueryTrackers
+  {
+    QueryTrackers(const Options& options);
+
+    NameTracker queries;
+    ClientTracker clients;
+  };
+
+  struct ResponseTrackers
+  {
+    ResponseTrackers(const Options& options);
+
+    ClientTracker bandwidth;
+    NameTracker servfails;
+    NameTracker nxdomains;
+  };
+
+  struct ThreadTrackers
+  {
+    uint64_t id{0};
+    QueryTrackers* queries{nullptr};
+    ResponseTrackers* responses{nullptr};
+  };
+
+  ThreadTrackers& getThreadTrackers();
+
+  Options d_options;
+  /* protects the two vectors below, only taken the first time a thread inserts
+     a query or a response, and when the trackers are read */
+  mutable std::mutex d_lock;
+  std::vector<std::unique_ptr<QueryTrackers>> d_queryTrackers;
+  std::vector<std::unique_ptr<ResponseTrackers>> d_responseTrackers;
+  /* unique to this object and configuration, so that threads can tell
+     whether the trackers they know about are still valid */
+  uint64_t d_id{0};
+  bool d_enabled{false};
+};
+
+extern HeavyHitters g_heavyHitters;
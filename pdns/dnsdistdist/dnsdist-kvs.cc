@@ -20,11 +20,14 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <fstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include "dnsdist-kvs.hh"
 #include "dolog.hh"
 
-#include <sys/stat.h>
-
 std::vector<std::string> KeyValueLookupKeySourceIP::getKeys(const ComboAddress& addr)
 {
   std::vector<std::string> result;
@@ -73,21 +76,89 @@ std::vector<std::string> KeyValueLookupKeySuffix::getKeys(const DNSName& qname)
 
 #ifdef HAVE_LMDB
 
-bool LMDBKVStore::getValue(const std::string& key, std::string& value)
+void LMDBKVStore::openDBIfNeeded()
 {
-  try {
-    auto transaction = d_env.getROTransaction();
-    auto dbi = transaction->openDB(d_dbName, 0);
-    MDBOutVal result;
-    int rc = transaction->get(dbi, MDBInVal(key), result);
-    if (rc == 0) {
-      value = result.get<std::string>();
-      return true;
+  if (d_dbiOpened) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(d_dbiLock);
+  if (d_dbiOpened) {
+    return;
+  }
+
+  /* the handle only becomes usable by the other transactions once this one has been committed,
+     and then stays valid until the environment is closed */
+  auto transaction = d_env->getROTransaction();
+  d_dbi = transaction->openDB(d_dbName, 0);
+  transaction->commit();
+  d_dbiOpened = true;
+}
+
+bool LMDBKVStore::lookup(const std::string& key, std::string* value)
+{
+  /* Creating a read transaction is much more expensive than renewing an existing one, so every
+     thread keeps one per database, reset between two lookups so that it does not prevent the
+     writers from reclaiming pages. The transactions belong to the store, which closes them before
+     its environment, and a thread only keeps a weak reference to them, pruned once the store is gone */
+  struct ThreadTransaction
+  {
+    const LMDBKVStore* store;
+    std::weak_ptr<MDBROTransaction> transaction;
+  };
+  static thread_local std::vector<ThreadTransaction> t_transactions;
+
+  openDBIfNeeded();
+
+  std::shared_ptr<MDBROTransaction> current;
+  for (auto it = t_transactions.begin(); it != t_transactions.end(); ) {
+    auto transaction = it->transaction.lock();
+    if (!transaction) {
+      it = t_transactions.erase(it);
+      continue;
+    }
+    /* the transaction being alive means that its store is too, so a new store can't be at the same address */
+    if (it->store == this) {
+      current = std::move(transaction);
     }
-    else if (rc == MDB_NOTFOUND) {
-      return false;
+    ++it;
+  }
+
+  if (!current) {
+    current = std::make_shared<MDBROTransaction>(d_env->getROTransaction());
+    {
+      std::lock_guard<std::mutex> lock(d_transactionsLock);
+      d_transactions.push_back(current);
+    }
+    t_transactions.push_back({this, current});
+  }
+  else {
+    int rc = mdb_txn_renew(**current);
+    if (rc != 0) {
+      throw std::runtime_error("Unable to renew the read transaction: " + std::string(mdb_strerror(rc)));
     }
   }
+
+  auto reset = [](MDB_txn* txn) { mdb_txn_reset(txn); };
+  std::unique_ptr<MDB_txn, decltype(reset)> resetGuard(**current, reset);
+
+  MDBOutVal result;
+  int rc = (*current)->get(d_dbi, MDBInVal(key), result);
+  if (rc == 0) {
+    if (value != nullptr) {
+      *value = result.get<std::string>();
+    }
+    return true;
+  }
+
+  return false;
+}
+
+bool LMDBKVStore::getValue(const std::string& key, std::string& value)
+{
+  try {
+    return lookup(key, &value);
+  }
   catch(const std::exception& e) {
     warnlog("Error while looking up key '%s' from LMDB file '%s', database '%s': %s", key, d_fname, d_dbName, e.what());
   }
@@ -97,16 +168,7 @@ bool LMDBKVStore::getValue(const std::string& key, std::string& value)
 bool LMDBKVStore::keyExists(const std::string& key)
 {
   try {
-    auto transaction = d_env.getROTransaction();
-    auto dbi = transaction->openDB(d_dbName, 0);
-    MDBOutVal result;
-    int rc = transaction->get(dbi, MDBInVal(key), result);
-    if (rc == 0) {
-      return true;
-    }
-    else if (rc == MDB_NOTFOUND) {
-      return false;
-    }
+    return lookup(key, nullptr);
   }
   catch(const std::exception& e) {
     warnlog("Error while looking up key '%s' from LMDB file '%s', database '%s': %s", key, d_fname, d_dbName, e.what());
@@ -229,3 +291,573 @@ bool CDBKVStore::keyExists(const std::string& key)
 }
 
 #endif /* HAVE_CDB */
+
+CachingKVStore::CachingKVStore(std::shared_ptr<KeyValueStore> store, size_t maxEntries, time_t ttl, time_t negativeTTL, size_t shards): d_store(std::move(store)), d_maxEntries(maxEntries), d_maxEntriesPerShard(std::max(maxEntries / std::max(shards, static_cast<size_t>(1)), static_cast<size_t>(1))), d_ttl(ttl), d_negativeTTL(negativeTTL)
+{
+  if (!d_store) {
+    throw std::runtime_error("A caching key value store needs an underlying store");
+  }
+
+  d_shards.resize(std::max(shards, static_cast<size_t>(1)));
+  for (auto& shard : d_shards) {
+    shard = std::make_unique<Shard>();
+  }
+}
+
+CachingKVStore::Shard& CachingKVStore::getShard(const std::string& key)
+{
+  return *d_shards.at(std::hash<std::string>()(key) % d_shards.size());
+}
+
+bool CachingKVStore::lookup(const std::string& key, std::string* value)
+{
+  auto& shard = getShard(key);
+  const time_t now = time(nullptr);
+  {
+    std::lock_guard<std::mutex> lock(shard.lock);
+    auto it = shard.index.find(key);
+    if (it != shard.index.end()) {
+      auto entry = it->second;
+      if (entry->expiration > now) {
+        ++d_hits;
+        /* move it to the front of the LRU list, without invalidating the iterator */
+        shard.entries.splice(shard.entries.begin(), shard.entries, entry);
+        if (entry->found && value != nullptr) {
+          *value = entry->value;
+        }
+        return entry->found;
+      }
+      shard.index.erase(it);
+      shard.entries.erase(entry);
+    }
+  }
+
+  ++d_misses;
+  /* we do not hold the lock while looking into the underlying store. We always retrieve the value
+     so that a subsequent getValue() for that key can be answered from the cache */
+  std::string result;
+  const bool found = d_store->getValue(key, result);
+  if (found && value != nullptr) {
+    *value = result;
+  }
+
+  const time_t ttl = found ? d_ttl : d_negativeTTL;
+  if (ttl <= 0 || d_maxEntries == 0) {
+    return found;
+  }
+
+  std::lock_guard<std::mutex> lock(shard.lock);
+  if (shard.index.count(key) != 0) {
+    /* another thread has been faster */
+    return found;
+  }
+
+  while (shard.entries.size() >= d_maxEntriesPerShard) {
+    shard.index.erase(shard.entries.back().key);
+    shard.entries.pop_back();
+    ++d_evictions;
+  }
+
+  shard.entries.push_front({key, found ? std::move(result) : std::string(), now + ttl, found});
+  shard.index.emplace(shard.entries.front().key, shard.entries.begin());
+  return found;
+}
+
+bool CachingKVStore::keyExists(const std::string& key)
+{
+  return lookup(key, nullptr);
+}
+
+bool CachingKVStore::getValue(const std::string& key, std::string& value)
+{
+  return lookup(key, &value);
+}
+
+bool CachingKVStore::reload()
+{
+  bool result = d_store->reload();
+  clear();
+  return result;
+}
+
+void CachingKVStore::clear()
+{
+  for (auto& shard : d_shards) {
+    std::lock_guard<std::mutex> lock(shard->lock);
+    shard->index.clear();
+    shard->entries.clear();
+  }
+}
+
+size_t CachingKVStore::getEntriesCount()
+{
+  size_t count = 0;
+  for (auto& shard : d_shards) {
+    std::lock_guard<std::mutex> lock(shard->lock);
+    count += shard->entries.size();
+  }
+  return count;
+}
+
+/* the integers are stored in the native byte order, so a compiled file can only be used
+   on a host with the same byte order, which is checked when loading it */
+struct CompiledMatchSetHeader
+{
+  char magic[8];
+  uint8_t version;
+  uint8_t type;
+  uint8_t reserved[2];
+  uint32_t byteOrder;
+  /* number of names (suffix) or IPv4 ranges (netmask) */
+  uint64_t count;
+  /* size of the names (suffix) or number of IPv6 ranges (netmask) */
+  uint64_t extra;
+};
+
+static_assert(sizeof(CompiledMatchSetHeader) == 32, "The header of compiled match sets has the wrong size");
+
+static const char s_compiledMatchSetMagic[8] = { 'D', 'N', 'S', 'D', 'M', 'S', 'E', 'T' };
+static const uint8_t s_compiledMatchSetVersion{1};
+static const uint32_t s_compiledMatchSetByteOrder{0x01020304};
+
+static CompiledMatchSetHeader getCompiledMatchSetHeader(CompiledMatchSet::Type type, uint64_t count, uint64_t extra)
+{
+  CompiledMatchSetHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, s_compiledMatchSetMagic, sizeof(header.magic));
+  header.version = s_compiledMatchSetVersion;
+  header.type = static_cast<uint8_t>(type);
+  header.byteOrder = s_compiledMatchSetByteOrder;
+  header.count = count;
+  header.extra = extra;
+  return header;
+}
+
+/* write to a temporary file first, then rename it, so that a running dnsdist never sees a partial file */
+static void writeCompiledMatchSet(const std::string& output, const std::vector<std::pair<const void*, size_t>>& parts)
+{
+  const std::string tmpPath = output + ".tmp";
+  int fd = open(tmpPath.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+  if (fd < 0) {
+    throw std::runtime_error("Error opening '" + tmpPath + "' for writing: " + stringerror());
+  }
+
+  try {
+    for (const auto& part : parts) {
+      if (part.second > 0) {
+        writen2(fd, part.first, part.second);
+      }
+    }
+    if (fsync(fd) != 0) {
+      throw std::runtime_error("Error syncing '" + tmpPath + "': " + stringerror());
+    }
+  }
+  catch (...) {
+    close(fd);
+    unlink(tmpPath.c_str());
+    throw;
+  }
+
+  close(fd);
+  if (rename(tmpPath.c_str(), output.c_str()) != 0) {
+    int err = errno;
+    unlink(tmpPath.c_str());
+    throw std::runtime_error("Error renaming '" + tmpPath + "' to '" + output + "': " + stringerror(err));
+  }
+}
+
+uint64_t CompiledMatchSet::compileSuffixes(const std::vector<DNSName>& names, const std::string& output)
+{
+  /* the names are stored in lowercase wire format, so that the suffixes of a name are
+     simply the tails of its wire representation starting at a label boundary */
+  std::vector<std::string> wireNames;
+  wireNames.reserve(names.size());
+  for (const auto& name : names) {
+    wireNames.push_back(name.toDNSStringLC());
+  }
+  std::sort(wireNames.begin(), wireNames.end());
+  wireNames.erase(std::unique(wireNames.begin(), wireNames.end()), wireNames.end());
+
+  std::vector<uint64_t> offsets;
+  offsets.reserve(wireNames.size() + 1);
+  std::string blob;
+  for (const auto& name : wireNames) {
+    offsets.push_back(blob.size());
+    blob.append(name);
+  }
+  offsets.push_back(blob.size());
+
+  const auto header = getCompiledMatchSetHeader(Type::Suffix, wireNames.size(), blob.size());
+  writeCompiledMatchSet(output, { { &header, sizeof(header) }, { offsets.data(), offsets.size() * sizeof(uint64_t) }, { blob.data(), blob.size() } });
+  return wireNames.size();
+}
+
+template <typename T>
+static void mergeRanges(std::vector<std::pair<T, T>>& ranges)
+{
+  std::sort(ranges.begin(), ranges.end());
+  size_t kept = 0;
+  for (size_t idx = 0; idx < ranges.size(); idx++) {
+    if (kept > 0 && ranges.at(idx).first <= ranges.at(kept - 1).second) {
+      ranges.at(kept - 1).second = std::max(ranges.at(kept - 1).second, ranges.at(idx).second);
+      continue;
+    }
+    ranges.at(kept++) = ranges.at(idx);
+  }
+  ranges.resize(kept);
+}
+
+uint64_t CompiledMatchSet::compileNetmasks(const std::vector<Netmask>& netmasks, const std::string& output)
+{
+  /* every netmask is turned into a range of addresses, and the overlapping ranges are merged so that
+     an address can only be in the range starting right before it. The IPv6 addresses are kept in
+     network byte order so that they can be compared with memcmp() */
+  std::vector<std::pair<uint32_t, uint32_t>> v4Ranges;
+  std::vector<std::pair<std::array<uint8_t, 16>, std::array<uint8_t, 16>>> v6Ranges;
+
+  for (const auto& netmask : netmasks) {
+    const auto& network = netmask.getNetwork();
+    const auto bits = netmask.getBits();
+    if (network.isIPv4()) {
+      const uint32_t start = ntohl(network.sin4.sin_addr.s_addr);
+      const uint32_t hostMask = bits == 0 ? 0xffffffff : (bits >= 32 ? 0 : (0xffffffff >> bits));
+      v4Ranges.push_back({ start, start | hostMask });
+    }
+    else if (network.isIPv6()) {
+      std::array<uint8_t, 16> start;
+      std::array<uint8_t, 16> end;
+      memcpy(start.data(), network.sin6.sin6_addr.s6_addr, start.size());
+      end = start;
+      for (size_t bit = bits; bit < 128; bit++) {
+        end.at(bit / 8) |= (0x80 >> (bit % 8));
+      }
+      v6Ranges.push_back({ start, end });
+    }
+  }
+
+  mergeRanges(v4Ranges);
+  mergeRanges(v6Ranges);
+
+  std::vector<uint32_t> v4;
+  v4.reserve(v4Ranges.size() * 2);
+  for (const auto& range : v4Ranges) {
+    v4.push_back(range.first);
+    v4.push_back(range.second);
+  }
+  std::string v6;
+  v6.reserve(v6Ranges.size() * 32);
+  for (const auto& range : v6Ranges) {
+    v6.append(reinterpret_cast<const char*>(range.first.data()), range.first.size());
+    v6.append(reinterpret_cast<const char*>(range.second.data()), range.second.size());
+  }
+
+  const auto header = getCompiledMatchSetHeader(Type::Netmask, v4Ranges.size(), v6Ranges.size());
+  writeCompiledMatchSet(output, { { &header, sizeof(header) }, { v4.data(), v4.size() * sizeof(uint32_t) }, { v6.data(), v6.size() } });
+  return v4Ranges.size() + v6Ranges.size();
+}
+
+uint64_t CompiledMatchSet::compile(Type type, const std::string& input, const std::string& output)
+{
+  std::ifstream ifs(input);
+  if (!ifs) {
+    throw std::runtime_error("Error opening '" + input + "' for reading: " + stringerror());
+  }
+
+  std::vector<DNSName> names;
+  std::vector<Netmask> netmasks;
+  std::string line;
+  size_t lineNumber = 0;
+  while (std::getline(ifs, line)) {
+    lineNumber++;
+    const auto comment = line.find('#');
+    if (comment != std::string::npos) {
+      line.resize(comment);
+    }
+    boost::trim(line);
+    if (line.empty()) {
+      continue;
+    }
+
+    try {
+      if (type == Type::Suffix) {
+        names.emplace_back(line);
+      }
+      else {
+        netmasks.emplace_back(line);
+      }
+    }
+    catch (const std::exception& e) {
+      throw std::runtime_error("Error parsing '" + line + "' at line " + std::to_string(lineNumber) + " of '" + input + "': " + e.what());
+    }
+    catch (const PDNSException& e) {
+      throw std::runtime_error("Error parsing '" + line + "' at line " + std::to_string(lineNumber) + " of '" + input + "': " + e.reason);
+    }
+  }
+
+  if (type == Type::Suffix) {
+    return compileSuffixes(names, output);
+  }
+  return compileNetmasks(netmasks, output);
+}
+
+CompiledMatchSet::Mapping::Mapping(const std::string& fname)
+{
+  int fd = open(fname.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("Error opening the compiled set '" + fname + "': " + stringerror());
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    int err = errno;
+    close(fd);
+    throw std::runtime_error("Error getting the size of the compiled set '" + fname + "': " + stringerror(err));
+  }
+
+  if (static_cast<size_t>(st.st_size) < sizeof(CompiledMatchSetHeader)) {
+    close(fd);
+    throw std::runtime_error("The compiled set '" + fname + "' is too small");
+  }
+
+  d_size = st.st_size;
+  void* mapped = mmap(nullptr, d_size, PROT_READ, MAP_SHARED, fd, 0);
+  int err = errno;
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    throw std::runtime_error("Error mapping the compiled set '" + fname + "': " + stringerror(err));
+  }
+  d_data = static_cast<const char*>(mapped);
+
+  try {
+    CompiledMatchSetHeader header;
+    memcpy(&header, d_data, sizeof(header));
+    if (memcmp(header.magic, s_compiledMatchSetMagic, sizeof(header.magic)) != 0) {
+      throw std::runtime_error("The file '" + fname + "' is not a compiled set");
+    }
+    if (header.version != s_compiledMatchSetVersion) {
+      throw std::runtime_error("Unsupported version " + std::to_string(header.version) + " of the compiled set '" + fname + "'");
+    }
+    if (header.byteOrder != s_compiledMatchSetByteOrder) {
+      throw std::runtime_error("The compiled set '" + fname + "' has been compiled on a host with a different byte order");
+    }
+
+    const size_t available = d_size - sizeof(header);
+    const char* body = d_data + sizeof(header);
+    d_count = header.count;
+    if (header.type == static_cast<uint8_t>(Type::Suffix)) {
+      d_type = Type::Suffix;
+      if (d_count >= (available / sizeof(uint64_t)) || (d_count + 1) * sizeof(uint64_t) + header.extra != available) {
+        throw std::runtime_error("The compiled set '" + fname + "' is truncated");
+      }
+      d_offsets = reinterpret_cast<const uint64_t*>(body);
+      d_names = body + (d_count + 1) * sizeof(uint64_t);
+      /* check the offsets once, so that the lookups do not have to */
+      for (uint64_t idx = 0; idx < d_count; idx++) {
+        if (d_offsets[idx] > d_offsets[idx + 1]) {
+          throw std::runtime_error("The compiled set '" + fname + "' is corrupted");
+        }
+      }
+      if (d_offsets[0] != 0 || d_offsets[d_count] != header.extra) {
+        throw std::runtime_error("The compiled set '" + fname + "' is corrupted");
+      }
+    }
+    else if (header.type == static_cast<uint8_t>(Type::Netmask)) {
+      d_type = Type::Netmask;
+      d_v6Count = header.extra;
+      if (d_count > (available / (2 * sizeof(uint32_t))) || d_v6Count > (available / 32) || d_count * 2 * sizeof(uint32_t) + d_v6Count * 32 != available) {
+        throw std::runtime_error("The compiled set '" + fname + "' is truncated");
+      }
+      d_v4Ranges = reinterpret_cast<const uint32_t*>(body);
+      d_v6Ranges = reinterpret_cast<const uint8_t*>(body + d_count * 2 * sizeof(uint32_t));
+    }
+    else {
+      throw std::runtime_error("Unsupported type " + std::to_string(header.type) + " of the compiled set '" + fname + "'");
+    }
+  }
+  catch (...) {
+    munmap(const_cast<char*>(d_data), d_size);
+    throw;
+  }
+}
+
+CompiledMatchSet::Mapping::~Mapping()
+{
+  munmap(const_cast<char*>(d_data), d_size);
+}
+
+bool CompiledMatchSet::Mapping::containsName(const char* name, size_t len) const
+{
+  uint64_t low = 0;
+  uint64_t high = d_count;
+  while (low < high) {
+    const uint64_t middle = low + (high - low) / 2;
+    const char* entry = d_names + d_offsets[middle];
+    const size_t entryLen = d_offsets[middle + 1] - d_offsets[middle];
+    int cmp = memcmp(entry, name, std::min(entryLen, len));
+    if (cmp == 0) {
+      if (entryLen == len) {
+        return true;
+      }
+      cmp = entryLen < len ? -1 : 1;
+    }
+    if (cmp < 0) {
+      low = middle + 1;
+    }
+    else {
+      high = middle;
+    }
+  }
+  return false;
+}
+
+bool CompiledMatchSet::Mapping::containsAddress(const ComboAddress& addr) const
+{
+  /* find the last range starting at or before the address, the address is in the set if that range
+     ends at or after it */
+  if (addr.isIPv4()) {
+    const uint32_t value = ntohl(addr.sin4.sin_addr.s_addr);
+    uint64_t low = 0;
+    uint64_t high = d_count;
+    while (low < high) {
+      const uint64_t middle = low + (high - low) / 2;
+      if (d_v4Ranges[middle * 2] <= value) {
+        low = middle + 1;
+      }
+      else {
+        high = middle;
+      }
+    }
+    return low > 0 && value <= d_v4Ranges[(low - 1) * 2 + 1];
+  }
+
+  if (addr.isIPv6()) {
+    const auto value = addr.sin6.sin6_addr.s6_addr;
+    uint64_t low = 0;
+    uint64_t high = d_v6Count;
+    while (low < high) {
+      const uint64_t middle = low + (high - low) / 2;
+      if (memcmp(d_v6Ranges + middle * 32, value, 16) <= 0) {
+        low = middle + 1;
+      }
+      else {
+        high = middle;
+      }
+    }
+    return low > 0 && memcmp(value, d_v6Ranges + (low - 1) * 32 + 16, 16) <= 0;
+  }
+
+  return false;
+}
+
+CompiledMatchSet::CompiledMatchSet(const std::string& fname, time_t refreshDelay): d_fname(fname), d_refreshDelay(refreshDelay)
+{
+  d_refreshing.clear();
+
+  if (!reload()) {
+    throw std::runtime_error("Unable to load the compiled set '" + fname + "'");
+  }
+
+  if (d_refreshDelay > 0) {
+    d_nextCheck = time(nullptr) + d_refreshDelay;
+  }
+}
+
+bool CompiledMatchSet::reload(const struct stat& st)
+{
+  try {
+    auto newMapping = std::make_unique<Mapping>(d_fname);
+    {
+      WriteLock wl(&d_lock);
+      d_mapping = std::move(newMapping);
+    }
+    d_mtime = st.st_mtime;
+    return true;
+  }
+  catch (const std::exception& e) {
+    warnlog("Error while loading the compiled set '%s': %s", d_fname, e.what());
+  }
+  return false;
+}
+
+bool CompiledMatchSet::reload()
+{
+  struct stat st;
+  if (stat(d_fname.c_str(), &st) == 0) {
+    return reload(st);
+  }
+
+  warnlog("Error while retrieving the last modification time of the compiled set '%s': %s", d_fname, stringerror());
+  return false;
+}
+
+void CompiledMatchSet::refreshIfNeeded(time_t now)
+{
+  if (d_refreshing.test_and_set()) {
+    /* someone else is already refreshing */
+    return;
+  }
+
+  struct stat st;
+  if (stat(d_fname.c_str(), &st) == 0) {
+    if (st.st_mtime > d_mtime) {
+      reload(st);
+    }
+  }
+  else {
+    warnlog("Error while retrieving the last modification time of the compiled set '%s': %s", d_fname, stringerror());
+  }
+  d_nextCheck = now + d_refreshDelay;
+  d_refreshing.clear();
+}
+
+bool CompiledMatchSet::contains(const DNSName& qname)
+{
+  if (d_nextCheck != 0) {
+    time_t now = time(nullptr);
+    if (now >= d_nextCheck) {
+      refreshIfNeeded(now);
+    }
+  }
+
+  const std::string wire = qname.toDNSStringLC();
+  ReadLock rl(&d_lock);
+  if (!d_mapping || d_mapping->d_type != Type::Suffix) {
+    return false;
+  }
+
+  /* every suffix of the name, including the name itself and the root */
+  size_t pos = 0;
+  while (pos < wire.size()) {
+    if (d_mapping->containsName(wire.data() + pos, wire.size() - pos)) {
+      return true;
+    }
+    pos += static_cast<uint8_t>(wire.at(pos)) + 1;
+  }
+  return false;
+}
+
+bool CompiledMatchSet::contains(const ComboAddress& addr)
+{
+  if (d_nextCheck != 0) {
+    time_t now = time(nullptr);
+    if (now >= d_nextCheck) {
+      refreshIfNeeded(now);
+    }
+  }
+
+  ReadLock rl(&d_lock);
+  if (!d_mapping || d_mapping->d_type != Type::Netmask) {
+    return false;
+  }
+
+  return d_mapping->containsAddress(addr);
+}
+
+uint64_t CompiledMatchSet::size()
+{
+  ReadLock rl(&d_lock);
+  if (!d_mapping) {
+    return 0;
+  }
+  return d_mapping->d_type == Type::Suffix ? d_mapping->d_count : d_mapping->d_count + d_mapping->d_v6Count;
+}
@@ -21,6 +21,10 @@
  */
 #pragma once
 
+#include <list>
+#include <string_view>
+#include <unordered_map>
+
 #include "dnsdist.hh"
 
 class KeyValueLookupKey
@@ -165,7 +169,7 @@ public:
 class LMDBKVStore: public KeyValueStore
 {
 public:
-  LMDBKVStore(const std::string& fname, const std::string& dbName): d_env(fname.c_str(), MDB_NOSUBDIR, 0600), d_fname(fname), d_dbName(dbName)
+  LMDBKVStore(const std::string& fname, const std::string& dbName): d_env(std::make_shared<MDBEnv>(fname.c_str(), MDB_NOSUBDIR, 0600)), d_fname(fname), d_dbName(dbName)
   {
   }
 
@@ -173,9 +177,19 @@ public:
   bool getValue(const std::string& key, std::string& value) override;
 
 private:
-  MDBEnv d_env;
+  bool lookup(const std::string& key, std::string* value);
+  void openDBIfNeeded();
+
+  std::shared_ptr<MDBEnv> d_env;
   std::string d_fname;
   std::string d_dbName;
+  std::mutex d_dbiLock;
+  MDBDbi d_dbi;
+  std::atomic<bool> d_dbiOpened{false};
+  /* the read transactions reused by the threads, see lookup(). Declared after the environment
+     so that they are closed first */
+  std::vector<std::shared_ptr<MDBROTransaction>> d_transactions;
+  std::mutex d_transactionsLock;
 };
 
 #endif /* HAVE_LMDB */
@@ -208,3 +222,138 @@ private:
 };
 
 #endif /* HAVE_LMDB */
+
+/* A cache in front of another store, remembering the result of the most recent lookups,
+   including the keys that were not found, so that the most frequent keys do not require
+   a lookup into the underlying database. Positive entries are kept for 'ttl' seconds and
+   negative ones for 'negativeTTL' seconds, so that changes to the database are picked up.
+   The entries are spread over several shards, each one with its own lock and
+   least-recently-used list. */
+class CachingKVStore: public KeyValueStore
+{
+public:
+  CachingKVStore(std::shared_ptr<KeyValueStore> store, size_t maxEntries, time_t ttl, time_t negativeTTL, size_t shards);
+
+  bool keyExists(const std::string& key) override;
+  bool getValue(const std::string& key, std::string& value) override;
+  /* reload the underlying store, if supported, and clear the cache */
+  bool reload() override;
+
+  void clear();
+  size_t getEntriesCount();
+
+  uint64_t getHits() const
+  {
+    return d_hits;
+  }
+  uint64_t getMisses() const
+  {
+    return d_misses;
+  }
+  uint64_t getEvictions() const
+  {
+    return d_evictions;
+  }
+  size_t getMaxEntries() const
+  {
+    return d_maxEntries;
+  }
+
+private:
+  struct Entry
+  {
+    std::string key;
+    std::string value;
+    time_t expiration;
+    bool found;
+  };
+
+  struct Shard
+  {
+    std::mutex lock;
+    /* most recently used first */
+    std::list<Entry> entries;
+    /* the keys point into the entries, whose addresses never change */
+    std::unordered_map<std::string_view, std::list<Entry>::iterator> index;
+  };
+
+  bool lookup(const std::string& key, std::string* value);
+  Shard& getShard(const std::string& key);
+
+  std::vector<std::unique_ptr<Shard>> d_shards;
+  std::shared_ptr<KeyValueStore> d_store;
+  std::atomic<uint64_t> d_hits{0};
+  std::atomic<uint64_t> d_misses{0};
+  std::atomic<uint64_t> d_evictions{0};
+  const size_t d_maxEntries;
+  const size_t d_maxEntriesPerShard;
+  const time_t d_ttl;
+  const time_t d_negativeTTL;
+};
+
+/* An immutable set of domain suffixes or netmasks, compiled beforehand into a sorted file
+   by compile() and mapped into memory: loading it does not require parsing or allocating
+   anything, the pages are shared with the page cache, and the lookups are binary searches
+   directly into the mapping. Like CDBKVStore, the file is checked for modification every
+   'refreshDelay' seconds, and replacing it atomically (rename()) while dnsdist is running
+   is supported. */
+class CompiledMatchSet
+{
+public:
+  enum class Type : uint8_t { Suffix = 1, Netmask = 2 };
+
+  /* compile the domain names or netmasks listed in the 'input' text file, one per line,
+     into the 'output' file. Returns the number of entries, and throws std::runtime_error
+     on error */
+  static uint64_t compile(Type type, const std::string& input, const std::string& output);
+  static uint64_t compileSuffixes(const std::vector<DNSName>& names, const std::string& output);
+  static uint64_t compileNetmasks(const std::vector<Netmask>& netmasks, const std::string& output);
+
+  /* throws std::runtime_error if the file can't be loaded */
+  CompiledMatchSet(const std::string& fname, time_t refreshDelay);
+
+  /* whether this name, or one of its parents, is part of a suffix set */
+  bool contains(const DNSName& qname);
+  /* whether this address is part of one of the netmasks of a netmask set */
+  bool contains(const ComboAddress& addr);
+  bool reload();
+  uint64_t size();
+
+  const std::string& getFilename() const
+  {
+    return d_fname;
+  }
+
+private:
+  struct Mapping
+  {
+    Mapping(const std::string& fname);
+    ~Mapping();
+
+    bool containsName(const char* name, size_t len) const;
+    bool containsAddress(const ComboAddress& addr) const;
+
+    const char* d_data{nullptr};
+    size_t d_size{0};
+    /* suffix sets: the offsets of the 'count' names, plus the end of the last one */
+    const uint64_t* d_offsets{nullptr};
+    const char* d_names{nullptr};
+    /* netmask sets: sorted, non-overlapping, ranges of addresses */
+    const uint32_t* d_v4Ranges{nullptr};
+    const uint8_t* d_v6Ranges{nullptr};
+    uint64_t d_count{0};
+    uint64_t d_v6Count{0};
+    Type d_type{Type::Suffix};
+  };
+
+  void refreshIfNeeded(time_t now);
+  bool reload(const struct stat& st);
+
+  std::unique_ptr<Mapping> d_mapping{nullptr};
+  std::string d_fname;
+  ReadWriteLock d_lock;
+  time_t d_mtime{0};
+  time_t d_nextCheck{0};
+  time_t d_refreshDelay{0};
+  std::atomic_flag d_refreshing;
+};
@@ -56,6 +56,58 @@ shared_ptr<DownstreamState> leastOutstanding(const ServerPolicy::NumberedServerV
   return servers.at(poss.begin()->second).second;
 }
 
+/* the lower the better: a server with twice as many queries in the air, or twice as slow to answer, is as bad.
+   We add one to both values so that an idle server, or one that has not answered yet, still ranks on the other one */
+static double getP2CScore(const DownstreamState& server)
+{
+  return (server.outstanding.load() + 1.0) * (server.latencyUsec + 1.0);
+}
+
+/* "power of two choices": pick two available servers at random and use the one with the lowest score, based on the
+   number of outstanding queries and the average latency, then on the order. Unlike leastOutstanding the cost does not
+   depend on the number of servers, and a server getting slow is quickly avoided even before queries pile up */
+shared_ptr<DownstreamState> p2c(const ServerPolicy::NumberedServerVector& servers, const DNSQuestion* dq)
+{
+  const size_t count = servers.size();
+  if (count == 1 && servers[0].second->isUp()) {
+    return servers[0].second;
+  }
+
+  if (count >= 2) {
+    /* a few attempts to find two distinct available servers before giving up and looking at all of them */
+    for (size_t attempt = 0; attempt < 4; attempt++) {
+      const size_t first = random() % count;
+      size_t second = random() % (count - 1);
+      if (second >= first) {
+        ++second;
+      }
+
+      const auto& a = servers[first].second;
+      const auto& b = servers[second].second;
+      const bool aUp = a->isUp();
+      const bool bUp = b->isUp();
+      if (!aUp && !bUp) {
+        continue;
+      }
+      if (!aUp) {
+        return b;
+      }
+      if (!bUp) {
+        return a;
+      }
+
+      const auto aScore = getP2CScore(*a);
+      const auto bScore = getP2CScore(*b);
+      if (aScore != bScore) {
+        return aScore < bScore ? a : b;
+      }
+      return a->order <= b->order ? a : b;
+    }
+  }
+
+  return leastOutstanding(servers, dq);
+}
+
 shared_ptr<DownstreamState> firstAvailable(const ServerPolicy::NumberedServerVector& servers, const DNSQuestion* dq)
 {
   for(auto& d : servers) {
@@ -199,6 +251,150 @@ shared_ptr<DownstreamState> chashed(const ServerPolicy::NumberedServerVector& se
   return chashedFromHash(servers, dq->qname->hash(g_hashperturb));
 }
 
+double g_maglevBalancingFactor = 1.25;
+
+/* every server fills the slots of the table following its own permutation of the slots, derived
+   from its id, taking turns based on its weight, until the table is full. A query is then sent to
+   the server owning the slot its hash falls into, in O(1), and adding or removing a server only
+   remaps a small part of the slots. The table is built from all the servers of the pool, regardless
+   of their health, and if the server owning a slot is not available the next slots are tried instead,
+   so that the queries going to the remaining servers are not moved. */
+MaglevTable::MaglevTable(std::shared_ptr<const ServerPolicy::NumberedServerVector> servers, uint64_t generation): d_servers(std::move(servers)), d_generation(generation)
+{
+  const auto& pool = *d_servers;
+
+  /* a prime larger than 100 times the number of servers gives a good distribution */
+  static const std::array<uint32_t, 6> sizes{ 65537, 131071, 262147, 524287, 1048573, 2097143 };
+  uint32_t tableSize = sizes.back();
+  for (const auto size : sizes) {
+    if (size >= pool.size() * 100) {
+      tableSize = size;
+      break;
+    }
+  }
+
+  d_slots.assign(tableSize, std::numeric_limits<uint32_t>::max());
+  if (pool.empty()) {
+    return;
+  }
+
+  std::vector<uint32_t> offsets(pool.size());
+  std::vector<uint32_t> skips(pool.size());
+  std::vector<uint32_t> next(pool.size(), 0);
+  std::vector<double> credits(pool.size(), 0);
+  int maxWeight = 1;
+  for (size_t idx = 0; idx < pool.size(); idx++) {
+    const auto& id = pool.at(idx).second->id;
+    offsets.at(idx) = burtle(id.data, id.size(), g_hashperturb) % tableSize;
+    skips.at(idx) = (burtle(id.data, id.size(), g_hashperturb + 1) % (tableSize - 1)) + 1;
+    maxWeight = std::max(maxWeight, pool.at(idx).second->weight);
+  }
+
+  size_t filled = 0;
+  while (filled < tableSize) {
+    for (size_t idx = 0; idx < pool.size() && filled < tableSize; idx++) {
+      /* a server gets as many turns as its weight, relative to the heaviest one */
+      credits.at(idx) += static_cast<double>(std::max(pool.at(idx).second->weight, 1)) / maxWeight;
+      while (credits.at(idx) >= 1.0 && filled < tableSize) {
+        credits.at(idx) -= 1.0;
+        uint32_t slot;
+        do {
+          slot = (offsets.at(idx) + static_cast<uint64_t>(next.at(idx)) * skips.at(idx)) % tableSize;
+          next.at(idx)++;
+        }
+        while (d_slots.at(slot) != std::numeric_limits<uint32_t>::max());
+        d_slots.at(slot) = idx;
+        filled++;
+      }
+    }
+  }
+}
+
+/* at most that many slots are tried before looking at every server */
+static const size_t s_maglevMaxProbes{64};
+
+/* visit the servers owning the slots starting at the one the hash falls into, until the visitor
+   accepts one, then every server if none has been accepted after s_maglevMaxProbes slots */
+template <typename Visitor>
+static shared_ptr<DownstreamState> maglevLookup(const MaglevTable& table, size_t hash, Visitor&& visitor)
+{
+  const auto& servers = table.getServers();
+  if (servers.empty()) {
+    return shared_ptr<DownstreamState>();
+  }
+
+  for (size_t probe = 0; probe < s_maglevMaxProbes && probe < table.size(); probe++) {
+    const auto& server = servers[table.getServerIndex(hash + probe)].second;
+    if (visitor(server)) {
+      return server;
+    }
+  }
+
+  /* most of the servers are unavailable */
+  for (const auto& d : servers) {
+    if (visitor(d.second)) {
+      return d.second;
+    }
+  }
+  return shared_ptr<DownstreamState>();
+}
+
+shared_ptr<DownstreamState> maglevFromHash(const MaglevTable& table, size_t hash)
+{
+  return maglevLookup(table, hash, [](const std::shared_ptr<DownstreamState>& server) {
+    return server->isUp();
+  });
+}
+
+shared_ptr<DownstreamState> maglevFromTable(const MaglevTable& table, const DNSQuestion* dq)
+{
+  return maglevFromHash(table, dq->qname->hash(g_hashperturb));
+}
+
+/* without the table of the pool we have to build one, which is only done when the policy
+   is called from Lua, or for a set of servers that is not a pool */
+shared_ptr<DownstreamState> maglev(const ServerPolicy::NumberedServerVector& servers, const DNSQuestion* dq)
+{
+  const MaglevTable table(std::make_shared<const ServerPolicy::NumberedServerVector>(servers), 0);
+  return maglevFromTable(table, dq);
+}
+
+/* consistent hashing with bounded loads (Mirrokni et al., 2016): a server is skipped, and the query
+   sent to the next one in the table, when its outstanding queries exceed the factor times its share,
+   based on its weight, of the outstanding queries of all the available servers */
+shared_ptr<DownstreamState> maglevBoundedLoadFromHash(const MaglevTable& table, size_t hash)
+{
+  /* we start with one, representing the query we are currently handling */
+  double currentLoad = 1;
+  size_t totalWeight = 0;
+  for (const auto& pair : table.getServers()) {
+    if (pair.second->isUp()) {
+      currentLoad += pair.second->outstanding;
+      totalWeight += pair.second->weight;
+    }
+  }
+
+  if (totalWeight == 0) {
+    return shared_ptr<DownstreamState>();
+  }
+
+  const double targetLoad = (currentLoad / totalWeight) * g_maglevBalancingFactor;
+  return maglevLookup(table, hash, [targetLoad](const std::shared_ptr<DownstreamState>& server) {
+    return server->isUp() && server->outstanding <= (targetLoad * server->weight);
+  });
+}
+
+shared_ptr<DownstreamState> maglevBoundedLoadFromTable(const MaglevTable& table, const DNSQuestion* dq)
+{
+  return maglevBoundedLoadFromHash(table, dq->qname->hash(g_hashperturb));
+}
+
+shared_ptr<DownstreamState> maglevBoundedLoad(const ServerPolicy::NumberedServerVector& servers, const DNSQuestion* dq)
+{
+  const MaglevTable table(std::make_shared<const ServerPolicy::NumberedServerVector>(servers), 0);
+  return maglevBoundedLoadFromTable(table, dq);
+}
+
 shared_ptr<DownstreamState> roundrobin(const ServerPolicy::NumberedServerVector& servers, const DNSQuestion* dq)
 {
   if (servers.empty()) {
@@ -285,6 +481,13 @@ void removeServerFromPool(pools_t& pools, const string& poolName, std::shared_pt
   pool->removeServer(server);
 }
 
+void serverChangedInPools(const pools_t& pools, const DownstreamState& server)
+{
+  for (const auto& pool : pools) {
+    pool.second->serverChanged(server);
+  }
+}
+
 std::shared_ptr<ServerPool> getPool(const pools_t& pools, const std::string& poolName)
 {
   pools_t::const_iterator it = pools.find(poolName);
@@ -355,3 +558,45 @@ std::shared_ptr<DownstreamState> ServerPolicy::getSelectedBackend(const ServerPo
 
   return selectedBackend;
 }
+
+std::shared_ptr<DownstreamState> ServerPolicy::getSelectedBackend(ServerPool& pool, DNSQuestion& dq) const
+{
+  if (d_maglevPolicy) {
+    const auto table = pool.getMaglevTable();
+    return d_maglevPolicy(*table, &dq);
+  }
+
+  const auto servers = pool.getServers();
+  return getSelectedBackend(*servers, dq);
+}
+
+std::shared_ptr<const MaglevTable> ServerPool::getMaglevTable()
+{
+  {
+    ReadLock rl(&d_lock);
+    if (d_maglevTable && d_maglevTable->getGeneration() == d_generation) {
+      return d_maglevTable;
+    }
+  }
+
+  /* the table is built by the first thread needing it after a change of the pool, the other ones
+     wait for it instead of building their own */
+  std::lock_guard<std::mutex> lock(d_maglevTableMutex);
+  std::shared_ptr<const ServerPolicy::NumberedServerVector> servers;
+  uint64_t generation;
+  {
+    ReadLock rl(&d_lock);
+    if (d_maglevTable && d_maglevTable->getGeneration() == d_generation) {
+      return d_maglevTable;
+    }
+    servers = d_servers;
+    generation = d_generation;
+  }
+
+  auto table = std::make_shared<const MaglevTable>(servers, generation);
+  {
+    WriteLock wl(&d_lock);
+    d_maglevTable = table;
+  }
+  return table;
+}
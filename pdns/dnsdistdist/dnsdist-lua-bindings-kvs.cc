@@ -22,6 +22,7 @@
 #include "dnsdist.hh"
 #include "dnsdist-kvs.hh"
 #include "dnsdist-lua.hh"
+#include "dolog.hh"
 
 void setupLuaBindingsKVS(LuaContext& luaCtx, bool client)
 {
@@ -57,6 +58,29 @@ void setupLuaBindingsKVS(LuaContext& luaCtx, bool client)
   });
 #endif /* HAVE_CDB */
 
+  luaCtx.writeFunction("newCachingKVStore", [client](std::shared_ptr<KeyValueStore> kvs, size_t maxEntries, boost::optional<std::unordered_map<std::string, size_t>> vars) {
+    if (client) {
+      return std::shared_ptr<KeyValueStore>(nullptr);
+    }
+
+    time_t ttl = 60;
+    time_t negativeTTL = 60;
+    size_t numberOfShards = 16;
+    if (vars) {
+      if (vars->count("ttl")) {
+        ttl = (*vars)["ttl"];
+      }
+      if (vars->count("negativeTTL")) {
+        negativeTTL = (*vars)["negativeTTL"];
+      }
+      if (vars->count("numberOfShards")) {
+        numberOfShards = (*vars)["numberOfShards"];
+      }
+    }
+
+    return std::shared_ptr<KeyValueStore>(new CachingKVStore(kvs, maxEntries, ttl, negativeTTL, numberOfShards));
+  });
+
   luaCtx.registerFunction<std::string(std::shared_ptr<KeyValueStore>::*)(const boost::variant<ComboAddress, DNSName, std::string>, boost::optional<bool> wireFormat)>("lookup", [](std::shared_ptr<KeyValueStore>& kvs, const boost::variant<ComboAddress, DNSName, std::string> keyVar, boost::optional<bool> wireFormat) {
     std::string result;
     if (!kvs) {
@@ -112,4 +136,80 @@ void setupLuaBindingsKVS(LuaContext& luaCtx, bool client)
 
     return kvs->reload();
   });
+
+  luaCtx.registerFunction<std::unordered_map<std::string, uint64_t>(std::shared_ptr<KeyValueStore>::*)()>("getStats", [](std::shared_ptr<KeyValueStore>& kvs) {
+    std::unordered_map<std::string, uint64_t> stats;
+    auto cache = std::dynamic_pointer_cast<CachingKVStore>(kvs);
+    if (cache) {
+      stats["entries"] = cache->getEntriesCount();
+      stats["maxEntries"] = cache->getMaxEntries();
+      stats["hits"] = cache->getHits();
+      stats["misses"] = cache->getMisses();
+      stats["evictions"] = cache->getEvictions();
+    }
+    return stats;
+  });
+
+  /* Compiled match sets */
+  luaCtx.writeFunction("compileSuffixMatchSet", [client](const std::string& input, const std::string& output) {
+    if (client) {
+      return;
+    }
+    try {
+      auto count = CompiledMatchSet::compile(CompiledMatchSet::Type::Suffix, input, output);
+      g_outputBuffer = "Compiled " + std::to_string(count) + " names into '" + output + "'\n";
+    }
+    catch (const std::exception& e) {
+      errlog("Error while compiling the suffix set '%s': %s", input, e.what());
+      g_outputBuffer = "Error while compiling the suffix set '" + input + "': " + e.what() + "\n";
+    }
+  });
+
+  luaCtx.writeFunction("compileNetmaskMatchSet", [client](const std::string& input, const std::string& output) {
+    if (client) {
+      return;
+    }
+    try {
+      auto count = CompiledMatchSet::compile(CompiledMatchSet::Type::Netmask, input, output);
+      g_outputBuffer = "Compiled " + std::to_string(count) + " ranges into '" + output + "'\n";
+    }
+    catch (const std::exception& e) {
+      errlog("Error while compiling the netmask set '%s': %s", input, e.what());
+      g_outputBuffer = "Error while compiling the netmask set '" + input + "': " + e.what() + "\n";
+    }
+  });
+
+  luaCtx.writeFunction("newCompiledMatchSet", [client](const std::string& fname, boost::optional<time_t> refreshDelay) {
+    if (client) {
+      return std::shared_ptr<CompiledMatchSet>(nullptr);
+    }
+    return std::make_shared<CompiledMatchSet>(fname, refreshDelay ? *refreshDelay : 0);
+  });
+
+  luaCtx.registerFunction<bool(std::shared_ptr<CompiledMatchSet>::*)()>("reload", [](std::shared_ptr<CompiledMatchSet>& set) {
+    if (!set) {
+      return false;
+    }
+
+    return set->reload();
+  });
+
+  luaCtx.registerFunction<uint64_t(std::shared_ptr<CompiledMatchSet>::*)()>("size", [](std::shared_ptr<CompiledMatchSet>& set) {
+    if (!set) {
+      return static_cast<uint64_t>(0);
+    }
+
+    return set->size();
+  });
+
+  luaCtx.registerFunction<bool(std::shared_ptr<CompiledMatchSet>::*)(const boost::variant<ComboAddress, DNSName>)>("contains", [](std::shared_ptr<CompiledMatchSet>& set, const boost::variant<ComboAddress, DNSName> key) {
+    if (!set) {
+      return false;
+    }
+
+    if (key.type() == typeid(ComboAddress)) {
+      return set->contains(*boost::get<ComboAddress>(&key));
+    }
+    return set->contains(*boost::get<DNSName>(&key));
+  });
 }
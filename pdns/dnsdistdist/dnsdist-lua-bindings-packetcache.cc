@@ -26,11 +26,13 @@
 #include "config.h"
 #include "dnsdist.hh"
 #include "dnsdist-lua.hh"
+#include "dolog.hh"
+#include "threadname.hh"
 
 void setupLuaBindingsPacketCache(LuaContext& luaCtx)
 {
   /* PacketCache */
-  luaCtx.writeFunction("newPacketCache", [](size_t maxEntries, boost::optional<std::unordered_map<std::string, boost::variant<bool, size_t>>> vars) {
+  luaCtx.writeFunction("newPacketCache", [](size_t maxEntries, boost::optional<std::unordered_map<std::string, boost::variant<bool, size_t, std::string>>> vars) {
 
       bool keepStaleData = false;
       size_t maxTTL = 86400;
@@ -43,6 +45,13 @@ void setupLuaBindingsPacketCache(LuaContext& luaCtx)
       bool deferrableInsertLock = true;
       bool ecsParsing = false;
       bool cookieHashing = false;
+      bool collapseQueries = false;
+      size_t maxCollapsedQueries = 100;
+      size_t maxCollapseWait = 1000;
+      size_t prefetchPercentage = 0;
+      std::string snapshotFile;
+      bool loadSnapshotOnStart = false;
+      DNSDistPacketCache::Engine engine = DNSDistPacketCache::Engine::UnorderedMap;
 
       if (vars) {
 
@@ -89,12 +98,58 @@ void setupLuaBindingsPacketCache(LuaContext& luaCtx)
         if (vars->count("cookieHashing")) {
           cookieHashing = boost::get<bool>((*vars)["cookieHashing"]);
         }
+
+        if (vars->count("engine")) {
+          engine = DNSDistPacketCache::getEngineFromName(boost::get<std::string>((*vars)["engine"]));
+        }
+
+        if (vars->count("collapseQueries")) {
+          collapseQueries = boost::get<bool>((*vars)["collapseQueries"]);
+        }
+
+        if (vars->count("maxCollapsedQueries")) {
+          maxCollapsedQueries = boost::get<size_t>((*vars)["maxCollapsedQueries"]);
+        }
+
+        if (vars->count("maxCollapseWait")) {
+          maxCollapseWait = boost::get<size_t>((*vars)["maxCollapseWait"]);
+        }
+
+        if (vars->count("prefetchPercentage")) {
+          prefetchPercentage = std::min(boost::get<size_t>((*vars)["prefetchPercentage"]), static_cast<size_t>(100));
+        }
+
+        if (vars->count("snapshotFile")) {
+          snapshotFile = boost::get<std::string>((*vars)["snapshotFile"]);
+        }
+
+        if (vars->count("loadSnapshotOnStart")) {
+          loadSnapshotOnStart = boost::get<bool>((*vars)["loadSnapshotOnStart"]);
+        }
       }
 
-      auto res = std::make_shared<DNSDistPacketCache>(maxEntries, maxTTL, minTTL, tempFailTTL, maxNegativeTTL, staleTTL, dontAge, numberOfShards, deferrableInsertLock, ecsParsing);
+      auto res = std::make_shared<DNSDistPacketCache>(maxEntries, maxTTL, minTTL, tempFailTTL, maxNegativeTTL, staleTTL, dontAge, numberOfShards, deferrableInsertLock, ecsParsing, engine);
 
       res->setKeepStaleData(keepStaleData);
       res->setCookieHashing(cookieHashing);
+      /* the maximum wait also applies to the refreshes */
+      res->setQueryCollapsing(collapseQueries ? maxCollapsedQueries : 0, maxCollapseWait);
+      res->setPrefetchPercentage(static_cast<uint8_t>(prefetchPercentage));
+      res->setSnapshotFile(snapshotFile);
+
+      if (loadSnapshotOnStart && !snapshotFile.empty()) {
+        struct stat st;
+        /* there is no snapshot yet the first time */
+        if (stat(snapshotFile.c_str(), &st) == 0) {
+          try {
+            auto loaded = res->loadSnapshot(snapshotFile);
+            infolog("Loaded %d entries into the packet cache from '%s'", loaded, snapshotFile);
+          }
+          catch (const std::exception& e) {
+            warnlog("Error loading the packet cache snapshot: %s", e.what());
+          }
+        }
+      }
 
       return res;
     });
@@ -150,6 +205,11 @@ void setupLuaBindingsPacketCache(LuaContext& luaCtx)
         g_outputBuffer+="Lookup Collisions: " + std::to_string(cache->getLookupCollisions()) + "\n";
         g_outputBuffer+="Insert Collisions: " + std::to_string(cache->getInsertCollisions()) + "\n";
         g_outputBuffer+="TTL Too Shorts: " + std::to_string(cache->getTTLTooShorts()) + "\n";
+        if (cache->isQueryCollapsingEnabled()) {
+          g_outputBuffer+="Collapsed queries: " + std::to_string(cache->getCollapsedQueries()) + "\n";
+          g_outputBuffer+="Collapsed timeouts: " + std::to_string(cache->getCollapsedTimeouts()) + "\n";
+          g_outputBuffer+="Prefetches: " + std::to_string(cache->getPrefetches()) + "\n";
+        }
       }
     });
   luaCtx.registerFunction<std::unordered_map<std::string, uint64_t>(std::shared_ptr<DNSDistPacketCache>::*)()const>("getStats", [](const std::shared_ptr<DNSDistPacketCache>& cache) {
@@ -164,6 +224,9 @@ void setupLuaBindingsPacketCache(LuaContext& luaCtx)
         stats["lookupCollisions"] = cache->getLookupCollisions();
         stats["insertCollisions"] = cache->getInsertCollisions();
         stats["ttlTooShorts"] = cache->getTTLTooShorts();
+        stats["collapsedQueries"] = cache->getCollapsedQueries();
+        stats["collapsedTimeouts"] = cache->getCollapsedTimeouts();
+        stats["prefetches"] = cache->getPrefetches();
       }
       return stats;
     });
@@ -190,4 +253,50 @@ void setupLuaBindingsPacketCache(LuaContext& luaCtx)
         g_outputBuffer += "Dumped " + std::to_string(records) + " records\n";
       }
     });
+  luaCtx.registerFunction<void(std::shared_ptr<DNSDistPacketCache>::*)(boost::optional<std::string> fname)const>("saveCache", [](const std::shared_ptr<DNSDistPacketCache>& cache, boost::optional<std::string> fname) {
+      if (!cache) {
+        return;
+      }
+
+      const std::string path = fname ? *fname : cache->getSnapshotFile();
+      if (path.empty()) {
+        g_outputBuffer = "No snapshot file name was given, and the cache does not have a default one\n";
+        return;
+      }
+
+      /* the cache might be large, so don't block the console or the Lua lock while writing it */
+      std::thread saver([cache, path]() {
+        setThreadName("dnsdist/cacheSnap");
+        try {
+          auto saved = cache->saveSnapshot(path);
+          infolog("Saved %d entries of the packet cache to '%s'", saved, path);
+        }
+        catch (const std::exception& e) {
+          warnlog("Error saving the packet cache snapshot: %s", e.what());
+        }
+      });
+      saver.detach();
+
+      g_outputBuffer = "Saving the cache to '" + path + "' in the background\n";
+    });
+  luaCtx.registerFunction<void(std::shared_ptr<DNSDistPacketCache>::*)(boost::optional<std::string> fname)>("loadCache", [](std::shared_ptr<DNSDistPacketCache>& cache, boost::optional<std::string> fname) {
+      if (!cache) {
+        return;
+      }
+
+      const std::string path = fname ? *fname : cache->getSnapshotFile();
+      if (path.empty()) {
+        g_outputBuffer = "No snapshot file name was given, and the cache does not have a default one\n";
+        return;
+      }
+
+      try {
+        auto loaded = cache->loadSnapshot(path);
+        g_outputBuffer = "Loaded " + std::to_string(loaded) + " entries\n";
+      }
+      catch (const std::exception& e) {
+        g_outputBuffer = "Error loading the snapshot: " + std::string(e.what()) + "\n";
+        errlog("Error loading the packet cache snapshot: %s", e.what());
+      }
+    });
 }
@@ -21,6 +21,15 @@
  */
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <type_traits>
+
+#include "stat_t.hh"
+
 // Metric types for Prometheus
 enum class PrometheusMetricType: int {
     counter = 1,
@@ -70,3 +79,70 @@ struct MetricDefinitionStorage {
 
   static const std::map<std::string, MetricDefinition> metrics;
 };
+
+/* Accumulates the text exposition format into a string, formatting the values
+   directly instead of going through an ostringstream. The labels are usually
+   pre-rendered by the caller, so only the values need to be formatted. */
+class PrometheusOutput
+{
+public:
+  PrometheusOutput(size_t expectedSize)
+  {
+    d_buffer.reserve(expectedSize);
+  }
+
+  PrometheusOutput& operator<<(const std::string& str)
+  {
+    d_buffer.append(str);
+    return *this;
+  }
+
+  PrometheusOutput& operator<<(const char* str)
+  {
+    d_buffer.append(str);
+    return *this;
+  }
+
+  template <typename T, typename std::enable_if<std::is_integral<T>::value, int>::type = 0>
+  PrometheusOutput& operator<<(T value)
+  {
+    d_buffer.append(std::to_string(value));
+    return *this;
+  }
+
+  /* same output as the default formatting of a std::ostream */
+  PrometheusOutput& operator<<(double value)
+  {
+    char buffer[32];
+    int res = snprintf(buffer, sizeof(buffer), "%g", value);
+    if (res > 0) {
+      d_buffer.append(buffer, std::min(static_cast<size_t>(res), sizeof(buffer) - 1));
+    }
+    return *this;
+  }
+
+  template <typename T>
+  PrometheusOutput& operator<<(const pdns::stat_t_trait<T>& value)
+  {
+    return *this << value.load();
+  }
+
+  template <typename T>
+  PrometheusOutput& operator<<(const std::atomic<T>& value)
+  {
+    return *this << value.load();
+  }
+
+  std::string release()
+  {
+    return std::move(d_buffer);
+  }
+
+  size_t size() const
+  {
+    return d_buffer.size();
+  }
+
+private:
+  std::string d_buffer;
+};
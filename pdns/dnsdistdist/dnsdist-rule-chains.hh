@@ -0,0 +1,264 @@
+/*
+ * This file is part of PowerDNS or dnsdist.
+ * Copyright -- PowerDNS.COM B.V. and its contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * In addition, for the avoidance of any doubt, permission is granted to
+ * link this program with OpenSSL and to (re)distribute the binaries
+ * produced as the result of such linking.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "dnsname.hh"
+
+/* A condition that has to be true for a rule to match, used to skip the rules
+   that can't possibly match a given query without evaluating them. */
+struct RuleDiscriminator
+{
+  /* ordered from the least to the most selective */
+  enum class Type : uint8_t { QClass, Opcode, DSTPort, QType, SNI, Suffix };
+
+  /* the rule can only match if the query has one of these values (QClass, Opcode, DSTPort and QType),
+     if the SNI is one of these strings (SNI) or if the qname is part of one of these names (Suffix) */
+  std::set<uint16_t> values;
+  std::set<std::string> strings;
+  std::vector<DNSName> names;
+  Type type{Type::QClass};
+
+  /* a rule matching if either of two conditions is true can only match if the union of both is,
+     which we can only express if they are of the same type */
+  bool merge(const RuleDiscriminator& other)
+  {
+    if (type != other.type) {
+      return false;
+    }
+    values.insert(other.values.begin(), other.values.end());
+    strings.insert(other.strings.begin(), other.strings.end());
+    names.insert(names.end(), other.names.begin(), other.names.end());
+    return true;
+  }
+};
+
+/* Index of an ordered chain of rules, rebuilt when the chain changes, dispatching a query
+   only to the rules that could match it based on their discriminator: the qtype, qclass,
+   opcode, destination port, SNI or qname suffix they require, looked up in a table.
+   The rules that do not provide a discriminator are always evaluated.
+   The candidate rules are visited in the original order, since the actions do not
+   always stop the processing, and since a rule that is skipped would not have matched,
+   the outcome is the same as evaluating every rule.
+   This object is not thread-safe, and is meant to be kept per-thread alongside the
+   LocalStateHolder of the rules. */
+template <typename RuleAction>
+class CompiledRuleChain
+{
+public:
+  /* below that number of rules, a linear scan is as fast as a lookup */
+  static const size_t s_minimumRules{8};
+
+  /* rebuild the index if the chain is not the one it was built for. The chain has to outlive
+     the index, or at least the next call to update(), which is the case of the chain owned
+     by a LocalStateHolder: a new version of the chain is always allocated while the previous
+     one we know about is still alive, so it can't be at the same address */
+  void update(const std::vector<RuleAction>& rules)
+  {
+    if (&rules == d_rules) {
+      return;
+    }
+
+    compile(rules);
+  }
+
+  /* call visitor() for every rule that could match this query, in order, until it returns true */
+  template <typename Question, typename Visitor>
+  void forEachCandidate(const Question& dq, Visitor&& visitor) const
+  {
+    if (d_rules == nullptr) {
+      return;
+    }
+
+    if (d_linear) {
+      for (const auto& rule : *d_rules) {
+        if (visitor(rule)) {
+          return;
+        }
+      }
+      return;
+    }
+
+    std::array<const std::vector<uint32_t>*, 7> lists;
+    size_t count = 0;
+    lists[count++] = &d_always;
+    lookup(d_qtypes, dq.qtype, lists, count);
+    lookup(d_qclasses, dq.qclass, lists, count);
+    if (!d_opcodes.empty()) {
+      lookup(d_opcodes, static_cast<uint16_t>(dq.getHeader()->opcode), lists, count);
+    }
+    if (!d_dstPorts.empty()) {
+      lookup(d_dstPorts, ntohs(dq.local->sin4.sin_port), lists, count);
+    }
+    if (!d_snis.empty()) {
+      lookup(d_snis, dq.sni, lists, count);
+    }
+    if (d_hasSuffixes) {
+      const auto suffixes = d_suffixes.lookup(*dq.qname);
+      if (suffixes != nullptr) {
+        lists[count++] = suffixes;
+      }
+    }
+
+    /* a given rule is only present in one of these lists, so merging them
+       gives every candidate exactly once, in the original order */
+    std::array<size_t, 7> positions{};
+    while (true) {
+      size_t best = count;
+      uint32_t bestIdx = std::numeric_limits<uint32_t>::max();
+      for (size_t idx = 0; idx < count; idx++) {
+        const auto& list = *lists[idx];
+        if (positions[idx] < list.size() && list[positions[idx]] < bestIdx) {
+          best = idx;
+          bestIdx = list[positions[idx]];
+        }
+      }
+
+      if (best == count) {
+        return;
+      }
+
+      positions[best]++;
+      if (visitor((*d_rules)[bestIdx])) {
+        return;
+      }
+    }
+  }
+
+  /* number of rules always evaluated, because they do not have any discriminator */
+  size_t getAlwaysEvaluatedCount() const
+  {
+    return d_linear && d_rules != nullptr ? d_rules->size() : d_always.size();
+  }
+
+private:
+  template <typename Key, typename Map>
+  static void lookup(const Map& map, const Key& key, std::array<const std::vector<uint32_t>*, 7>& lists, size_t& count)
+  {
+    if (map.empty()) {
+      return;
+    }
+    const auto it = map.find(key);
+    if (it != map.end()) {
+      lists[count++] = &it->second;
+    }
+  }
+
+  void compile(const std::vector<RuleAction>& rules)
+  {
+    d_rules = &rules;
+    d_always.clear();
+    d_qtypes.clear();
+    d_qclasses.clear();
+    d_opcodes.clear();
+    d_dstPorts.clear();
+    d_snis.clear();
+    d_suffixes = SuffixMatchTree<std::vector<uint32_t>>();
+    d_hasSuffixes = false;
+    d_linear = rules.size() < s_minimumRules;
+
+    if (d_linear) {
+      return;
+    }
+
+    std::map<DNSName, std::vector<uint32_t>> suffixes;
+    for (size_t idx = 0; idx < rules.size(); idx++) {
+      const uint32_t ruleIdx = static_cast<uint32_t>(idx);
+      RuleDiscriminator discriminator;
+      if (!rules[idx].d_rule->getDiscriminator(discriminator)) {
+        d_always.push_back(ruleIdx);
+        continue;
+      }
+
+      switch (discriminator.type) {
+      case RuleDiscriminator::Type::QType:
+        add(d_qtypes, discriminator.values, ruleIdx);
+        break;
+      case RuleDiscriminator::Type::QClass:
+        add(d_qclasses, discriminator.values, ruleIdx);
+        break;
+      case RuleDiscriminator::Type::Opcode:
+        add(d_opcodes, discriminator.values, ruleIdx);
+        break;
+      case RuleDiscriminator::Type::DSTPort:
+        add(d_dstPorts, discriminator.values, ruleIdx);
+        break;
+      case RuleDiscriminator::Type::SNI:
+        add(d_snis, discriminator.strings, ruleIdx);
+        break;
+      case RuleDiscriminator::Type::Suffix:
+        for (const auto& name : discriminator.names) {
+          auto& list = suffixes[name];
+          /* the same rule might list the same name twice */
+          if (list.empty() || list.back() != ruleIdx) {
+            list.push_back(ruleIdx);
+          }
+        }
+        break;
+      }
+    }
+
+    /* the lookup only returns the longest matching suffix, so every node carries
+       the rules of the shorter suffixes as well */
+    for (const auto& entry : suffixes) {
+      std::vector<uint32_t> candidates = entry.second;
+      DNSName parent(entry.first);
+      while (parent.chopOff()) {
+        const auto it = suffixes.find(parent);
+        if (it != suffixes.end()) {
+          candidates.insert(candidates.end(), it->second.begin(), it->second.end());
+        }
+      }
+      std::sort(candidates.begin(), candidates.end());
+      candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+      d_suffixes.add(entry.first, std::move(candidates));
+      d_hasSuffixes = true;
+    }
+  }
+
+  template <typename Map, typename Keys>
+  static void add(Map& map, const Keys& keys, uint32_t ruleIdx)
+  {
+    for (const auto& key : keys) {
+      map[key].push_back(ruleIdx);
+    }
+  }
+
+  std::vector<uint32_t> d_always;
+  std::unordered_map<uint16_t, std::vector<uint32_t>> d_qtypes;
+  std::unordered_map<uint16_t, std::vector<uint32_t>> d_qclasses;
+  std::unordered_map<uint16_t, std::vector<uint32_t>> d_opcodes;
+  std::unordered_map<uint16_t, std::vector<uint32_t>> d_dstPorts;
+  std::unordered_map<std::string, std::vector<uint32_t>> d_snis;
+  SuffixMatchTree<std::vector<uint32_t>> d_suffixes;
+  const std::vector<RuleAction>* d_rules{nullptr};
+  bool d_hasSuffixes{false};
+  bool d_linear{true};
+};
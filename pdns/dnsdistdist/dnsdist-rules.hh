@@ -424,6 +424,26 @@ public:
     }
     return ret;
   }
+
+  bool getDiscriminator(RuleDiscriminator& discriminator) const override
+  {
+    /* the rules are evaluated in order and the first one not matching stops the
+       evaluation, so we can't skip this rule based on a discriminator coming after
+       a rule that might have side effects (counting queries, for example) */
+    bool found = false;
+    for (const auto& rule : d_rules) {
+      RuleDiscriminator sub;
+      if (!rule->getDiscriminator(sub)) {
+        break;
+      }
+      if (!found || sub.type > discriminator.type) {
+        discriminator = std::move(sub);
+        found = true;
+      }
+    }
+    return found;
+  }
+
 private:
 
   vector<std::shared_ptr<DNSRule> > d_rules;
@@ -459,6 +479,27 @@ public:
     }
     return ret;
   }
+
+  bool getDiscriminator(RuleDiscriminator& discriminator) const override
+  {
+    if (d_rules.empty()) {
+      return false;
+    }
+    for (auto iter = d_rules.begin(); iter != d_rules.end(); ++iter) {
+      RuleDiscriminator sub;
+      if (!(*iter)->getDiscriminator(sub)) {
+        return false;
+      }
+      if (iter == d_rules.begin()) {
+        discriminator = std::move(sub);
+      }
+      else if (!discriminator.merge(sub)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
 private:
 
   vector<std::shared_ptr<DNSRule> > d_rules;
@@ -560,6 +601,12 @@ public:
   {
     return "SNI == " + d_sni;
   }
+  bool getDiscriminator(RuleDiscriminator& discriminator) const override
+  {
+    discriminator.type = RuleDiscriminator::Type::SNI;
+    discriminator.strings.insert(d_sni);
+    return true;
+  }
 private:
   std::string d_sni;
 };
@@ -581,6 +628,12 @@ public:
     else
       return "qname in "+d_smn.toString();
   }
+  bool getDiscriminator(RuleDiscriminator& discriminator) const override
+  {
+    discriminator.type = RuleDiscriminator::Type::Suffix;
+    discriminator.names = d_smn.d_tree.getNodes();
+    return true;
+  }
 private:
   SuffixMatchNode d_smn;
   bool d_quiet;
@@ -601,6 +654,13 @@ public:
   {
     return "qname=="+d_qname.toString();
   }
+  bool getDiscriminator(RuleDiscriminator& discriminator) const override
+  {
+    /* an exact match is also a suffix match */
+    discriminator.type = RuleDiscriminator::Type::Suffix;
+    discriminator.names.push_back(d_qname);
+    return true;
+  }
 private:
   DNSName d_qname;
 };
@@ -618,6 +678,12 @@ public:
         ss << "qname in DNSNameSet(" << qname_idx.size() << " FQDNs)";
         return ss.str();
     }
+
+    bool getDiscriminator(RuleDiscriminator& discriminator) const override {
+        discriminator.type = RuleDiscriminator::Type::Suffix;
+        discriminator.names.assign(qname_idx.begin(), qname_idx.end());
+        return true;
+    }
 private:
     DNSNameSet qname_idx;
 };
@@ -637,6 +703,12 @@ public:
     QType qt(d_qtype);
     return "qtype=="+qt.getName();
   }
+  bool getDiscriminator(RuleDiscriminator& discriminator) const override
+  {
+    discriminator.type = RuleDiscriminator::Type::QType;
+    discriminator.values.insert(d_qtype);
+    return true;
+  }
 private:
   uint16_t d_qtype;
 };
@@ -655,6 +727,12 @@ public:
   {
     return "qclass=="+std::to_string(d_qclass);
   }
+  bool getDiscriminator(RuleDiscriminator& discriminator) const override
+  {
+    discriminator.type = RuleDiscriminator::Type::QClass;
+    discriminator.values.insert(d_qclass);
+    return true;
+  }
 private:
   uint16_t d_qclass;
 };
@@ -673,6 +751,12 @@ public:
   {
     return "opcode=="+std::to_string(d_opcode);
   }
+  bool getDiscriminator(RuleDiscriminator& discriminator) const override
+  {
+    discriminator.type = RuleDiscriminator::Type::Opcode;
+    discriminator.values.insert(d_opcode);
+    return true;
+  }
 private:
   uint8_t d_opcode;
 };
@@ -691,6 +775,12 @@ public:
   {
     return "dst port=="+std::to_string(d_port);
   }
+  bool getDiscriminator(RuleDiscriminator& discriminator) const override
+  {
+    discriminator.type = RuleDiscriminator::Type::DSTPort;
+    discriminator.values.insert(d_port);
+    return true;
+  }
 private:
   uint16_t d_port;
 };
@@ -1121,6 +1211,49 @@ private:
   std::shared_ptr<KeyValueLookupKey> d_key;
 };
 
+class CompiledSuffixMatchRule : public DNSRule
+{
+public:
+  CompiledSuffixMatchRule(const std::shared_ptr<CompiledMatchSet>& set): d_set(set)
+  {
+  }
+
+  bool matches(const DNSQuestion* dq) const override
+  {
+    return d_set->contains(*dq->qname);
+  }
+
+  string toString() const override
+  {
+    return "qname suffix in compiled set '" + d_set->getFilename() + "'";
+  }
+
+private:
+  std::shared_ptr<CompiledMatchSet> d_set;
+};
+
+class CompiledNetmaskMatchRule : public DNSRule
+{
+public:
+  CompiledNetmaskMatchRule(const std::shared_ptr<CompiledMatchSet>& set, bool src): d_set(set), d_src(src)
+  {
+  }
+
+  bool matches(const DNSQuestion* dq) const override
+  {
+    return d_set->contains(d_src ? *dq->remote : *dq->local);
+  }
+
+  string toString() const override
+  {
+    return std::string(d_src ? "Src" : "Dst") + " in compiled set '" + d_set->getFilename() + "'";
+  }
+
+private:
+  std::shared_ptr<CompiledMatchSet> d_set;
+  bool d_src;
+};
+
 class LuaRule : public DNSRule
 {
 public:
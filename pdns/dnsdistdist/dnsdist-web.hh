@@ -6,6 +6,7 @@ void setWebserverACL(const std::string& acl);
 void setWebserverCustomHeaders(const boost::optional<std::map<std::string, std::string> > customHeaders);
 void setWebserverStatsRequireAuthentication(bool);
 void setWebserverMaxConcurrentConnections(size_t);
+void setWebserverMaxThreads(size_t);
 
 void dnsdistWebserverThread(int sock, const ComboAddress& local);
 
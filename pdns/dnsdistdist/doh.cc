@@ -46,6 +46,10 @@
 
    For coordination, we use the h2o socket multiplexer, which is sensitive to our
    pipe too.
+
+   When 'processQueriesInline' is set, the query is instead processed right away
+   in the main DoH thread, the same way the UDP path does, and only the queries
+   that need to be sent to a backend wait for the response pipe.
 */
 
 /* h2o notes.
@@ -169,27 +173,34 @@ private:
 // through the bowels of h2o
 struct DOHServerConfig
 {
-  DOHServerConfig(uint32_t idleTimeout, uint32_t internalPipeBufferSize): accept_ctx(std::make_shared<DOHAcceptContext>())
+  DOHServerConfig(uint32_t idleTimeout, uint32_t internalPipeBufferSize, bool processQueriesInline): accept_ctx(std::make_shared<DOHAcceptContext>()), processInline(processQueriesInline)
   {
     int fd[2];
-    if (pipe(fd) < 0) {
-      unixDie("Creating a pipe for DNS over HTTPS");
+    /* the query pipe is not needed when the queries are processed in the main DoH thread */
+    if (!processInline) {
+      if (pipe(fd) < 0) {
+        unixDie("Creating a pipe for DNS over HTTPS");
+      }
+      dohquerypair[0] = fd[1];
+      dohquerypair[1] = fd[0];
     }
-    dohquerypair[0] = fd[1];
-    dohquerypair[1] = fd[0];
 
     if (pipe(fd) < 0) {
-      close(dohquerypair[0]);
-      close(dohquerypair[1]);
+      if (!processInline) {
+        close(dohquerypair[0]);
+        close(dohquerypair[1]);
+      }
       unixDie("Creating a pipe for DNS over HTTPS");
     }
 
     dohresponsepair[0] = fd[1];
     dohresponsepair[1] = fd[0];
 
-    setNonBlocking(dohquerypair[0]);
-    if (internalPipeBufferSize > 0) {
-      setPipeBufferSize(dohquerypair[0], internalPipeBufferSize);
+    if (!processInline) {
+      setNonBlocking(dohquerypair[0]);
+      if (internalPipeBufferSize > 0) {
+        setPipeBufferSize(dohquerypair[0], internalPipeBufferSize);
+      }
     }
 
     setNonBlocking(dohresponsepair[0]);
@@ -214,6 +225,8 @@ struct DOHServerConfig
   std::shared_ptr<DOHFrontend> df{nullptr};
   int dohquerypair[2]{-1,-1};
   int dohresponsepair[2]{-1,-1};
+  /* whether the queries are processed in the main DoH thread instead of the DoH client one */
+  const bool processInline{false};
 };
 
 
@@ -237,6 +250,21 @@ static void sendDoHUnitToTheMainThread(DOHUnit* du, const char* description)
   }
 }
 
+static void sendDoHUnitResponse(DOHServerConfig* dsc, DOHUnit* du);
+
+/* Called for queries that we answered without sending them to a backend (self-answered, cache hits and errors):
+   when they are processed in the main DoH thread we can send the response right away, otherwise
+   we need to pass it to the main DoH thread first */
+static void sendImmediateResponse(DOHUnit* du, const char* description)
+{
+  if (!du->dsc->processInline) {
+    sendDoHUnitToTheMainThread(du, description);
+    return;
+  }
+
+  sendDoHUnitResponse(du->dsc, du);
+}
+
 /* This function is called from other threads than the main DoH one,
    instructing it to send a 502 error to the client */
 void handleDOHTimeout(DOHUnit* oldDU)
@@ -407,7 +435,8 @@ static void handleResponse(DOHFrontend& df, st_h2o_req_t* req, uint16_t statusCo
 /*
    this function calls 'return -1' to drop a query without sending it
    caller should make sure HTTPS thread hears of that
-   We are not in the main DoH thread but in the DoH 'client' thread.
+   We are in the DoH 'client' thread, unless the queries are processed inline
+   in which case we are in the main DoH thread.
 */
 static int processDOHQuery(DOHUnit* du)
 {
@@ -455,7 +484,7 @@ static int processDOHQuery(DOHUnit* du)
         dh->qr = true;
         du->response = std::move(du->query);
 
-        sendDoHUnitToTheMainThread(du, "DoH self-answered response");
+        sendImmediateResponse(du, "DoH self-answered response");
 
         return 0;
       }
@@ -484,7 +513,7 @@ static int processDOHQuery(DOHUnit* du)
         du->response = std::move(du->query);
       }
 
-      sendDoHUnitToTheMainThread(du, "DoH self-answered response");
+      sendImmediateResponse(du, "DoH self-answered response");
 
       return 0;
     }
@@ -500,8 +529,8 @@ static int processDOHQuery(DOHUnit* du)
     }
 
     ComboAddress dest = du->dest;
-    unsigned int idOffset = (ss->idOffset++) % ss->idStates.size();
-    IDState* ids = &ss->idStates[idOffset];
+    uint16_t idOffset = 0;
+    IDState* ids = ss->getIDState(holders.udpQueryWorkerId, idOffset);
     ids->age = 0;
     DOHUnit* oldDU = nullptr;
     if (ids->isInUse()) {
@@ -559,7 +588,7 @@ static int processDOHQuery(DOHUnit* du)
       addProxyProtocol(dq);
     }
 
-    int fd = pickBackendSocketForSending(ss);
+    int fd = pickBackendSocketForSending(ss, holders.udpQueryWorkerId);
     try {
       /* you can't touch du after this line, because it might already have been freed */
       ssize_t ret = udpClientSendRequestToBackend(ss, fd, du->query);
@@ -598,6 +627,32 @@ static int processDOHQuery(DOHUnit* du)
   return 0;
 }
 
+/* add EDNS to the query if needed then process it, sending an error response if that fails */
+static void handleDOHQuery(DOHUnit* du)
+{
+  // if there was no EDNS, we add it with a large buffer size
+  // so we can use UDP to talk to the backend.
+  auto dh = const_cast<struct dnsheader*>(reinterpret_cast<const struct dnsheader*>(du->query.data()));
+
+  if (!dh->arcount) {
+    if (generateOptRR(std::string(), du->query, 4096, 4096, 0, false)) {
+      dh = const_cast<struct dnsheader*>(reinterpret_cast<const struct dnsheader*>(du->query.data())); // may have reallocated
+      dh->arcount = htons(1);
+      du->ednsAdded = true;
+    }
+  }
+  else {
+    // we leave existing EDNS in place
+  }
+
+  if (processDOHQuery(du) < 0) {
+    du->status_code = 500;
+
+    sendImmediateResponse(du, "DoH internal error");
+    // XXX if we failed to send it to the main thread, now what - will h2o eventually time this out for us
+  }
+}
+
 /* called when a HTTP response is about to be sent, from the main DoH thread */
 static void on_response_ready_cb(struct st_h2o_filter_t *self, h2o_req_t *req, h2o_ostream_t **slot)
 {
@@ -654,7 +709,7 @@ static void on_generator_dispose(void *_self)
 
 /* This executes in the main DoH thread.
    We allocate a DOHUnit and send it to dnsdistclient() function in the doh client thread
-   via a pipe */
+   via a pipe, or process it right away if the queries are processed inline */
 static void doh_dispatch_query(DOHServerConfig* dsc, h2o_handler_t* self, h2o_req_t* req, PacketBuffer&& query, const ComboAddress& local, const ComboAddress& remote, std::string&& path)
 {
   try {
@@ -695,6 +750,21 @@ static void doh_dispatch_query(DOHServerConfig* dsc, h2o_handler_t* self, h2o_re
     du->self = reinterpret_cast<DOHUnit**>(h2o_mem_alloc_shared(&req->pool, sizeof(*self), on_generator_dispose));
     auto ptr = du.release();
     *(ptr->self) = ptr;
+
+    if (dsc->processInline) {
+      try {
+        handleDOHQuery(ptr);
+      }
+      catch (const std::exception& e) {
+        errlog("Error while processing query received over DoH: %s", e.what());
+      }
+      catch (...) {
+        errlog("Unspecified error while processing query received over DoH");
+      }
+      ptr->release();
+      return;
+    }
+
     try  {
       static_assert(sizeof(ptr) <= PIPE_BUF, "Writes up to PIPE_BUF are guaranteed not to be interleaved and to either fully succeed or fail");
       ssize_t sent = write(dsc->dohquerypair[0], &ptr, sizeof(ptr));
@@ -1089,27 +1159,7 @@ static void dnsdistclient(int qsock)
         continue;
       }
 
-      // if there was no EDNS, we add it with a large buffer size
-      // so we can use UDP to talk to the backend.
-      auto dh = const_cast<struct dnsheader*>(reinterpret_cast<const struct dnsheader*>(du->query.data()));
-
-      if (!dh->arcount) {
-        if (generateOptRR(std::string(), du->query, 4096, 4096, 0, false)) {
-          dh = const_cast<struct dnsheader*>(reinterpret_cast<const struct dnsheader*>(du->query.data())); // may have reallocated
-          dh->arcount = htons(1);
-          du->ednsAdded = true;
-        }
-      }
-      else {
-        // we leave existing EDNS in place
-      }
-
-      if (processDOHQuery(du) < 0) {
-        du->status_code = 500;
-
-        sendDoHUnitToTheMainThread(du, "DoH internal error");
-        // XXX if we failed to send it to the main thread, now what - will h2o eventually time this out for us
-      }
+      handleDOHQuery(du);
       du->release();
     }
     catch(const std::exception& e) {
@@ -1121,12 +1171,31 @@ static void dnsdistclient(int qsock)
   }
 }
 
+/* Called in the main DoH thread to turn the response held by the DOHUnit into a HTTP one */
+static void sendDoHUnitResponse(DOHServerConfig* dsc, DOHUnit* du)
+{
+  if (!du->req) { // it got killed in flight
+    du->self = nullptr;
+    return;
+  }
+
+  if (du->self) {
+    // we are back in the h2o main thread now, so we don't risk
+    // a race (h2o killing the query) when accessing du->req anymore
+    *du->self = nullptr; // so we don't clean up again in on_generator_dispose
+    du->self = nullptr;
+  }
+
+  handleResponse(*dsc->df, du->req, du->status_code, du->response, dsc->df->d_customResponseHeaders, du->contentType, true);
+}
+
 /* Called in the main DoH thread if h2o finds that dnsdist gave us an answer by writing into
    the dohresponsepair[0] side of the pipe so from:
    - handleDOHTimeout() when we did not get a response fast enough (called
      either from the health check thread (active) or from the frontend ones (reused))
    - dnsdistclient (error 500 because processDOHQuery() returned a negative value)
    - processDOHQuery (self-answered queries)
+   - the responder thread of a backend (regular responses)
    */
 static void on_dnsdist(h2o_socket_t *listener, const char *err)
 {
@@ -1142,20 +1211,7 @@ static void on_dnsdist(h2o_socket_t *listener, const char *err)
     return;
   }
 
-  if (!du->req) { // it got killed in flight
-    du->self = nullptr;
-    du->release();
-    return;
-  }
-
-  if (du->self) {
-    // we are back in the h2o main thread now, so we don't risk
-    // a race (h2o killing the query) when accessing du->req anymore
-    *du->self = nullptr; // so we don't clean up again in on_generator_dispose
-    du->self = nullptr;
-  }
-
-  handleResponse(*dsc->df, du->req, du->status_code, du->response, dsc->df->d_customResponseHeaders, du->contentType, true);
+  sendDoHUnitResponse(dsc, du);
 
   du->release();
 }
@@ -1350,7 +1406,7 @@ void DOHFrontend::setup()
 {
   registerOpenSSLUser();
 
-  d_dsc = std::make_shared<DOHServerConfig>(d_idleTimeout, d_internalPipeBufferSize);
+  d_dsc = std::make_shared<DOHServerConfig>(d_idleTimeout, d_internalPipeBufferSize, d_processQueriesInline);
 
   if  (!d_tlsConfig.d_certKeyPairs.empty()) {
     try {
@@ -1393,8 +1449,13 @@ void dohThread(ClientState* cs)
     dsc->df = cs->dohFrontend;
     dsc->h2o_config.server_name = h2o_iovec_init(df->d_serverTokens.c_str(), df->d_serverTokens.size());
 
-    std::thread dnsdistThread(dnsdistclient, dsc->dohquerypair[1]);
-    dnsdistThread.detach(); // gets us better error reporting
+    /* the queries are processed, and sent to the backends, by that thread,
+       or by this one if they are processed inline */
+    dsc->holders.udpQueryWorkerId = DownstreamState::registerUDPQueryWorker();
+    if (!dsc->processInline) {
+      std::thread dnsdistThread(dnsdistclient, dsc->dohquerypair[1]);
+      dnsdistThread.detach(); // gets us better error reporting
+    }
 
     setThreadName("dnsdist/doh");
     // I wonder if this registers an IP address.. I think it does
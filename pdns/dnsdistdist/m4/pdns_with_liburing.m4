@@ -0,0 +1,26 @@
+AC_DEFUN([PDNS_WITH_LIBURING], [
+  AC_MSG_CHECKING([whether we will be linking in liburing])
+  HAVE_LIBURING=0
+  AC_ARG_WITH([liburing],
+    AS_HELP_STRING([--with-liburing],[use liburing for the io_uring UDP frontend @<:@default=auto@:>@]),
+    [with_liburing=$withval],
+    [with_liburing=auto],
+  )
+  AC_MSG_RESULT([$with_liburing])
+
+  AS_IF([test "x$with_liburing" != "xno"], [
+    AS_IF([test "x$with_liburing" = "xyes" -o "x$with_liburing" = "xauto"], [
+      dnl we need io_uring_setup_buf_ring(), which appeared in 2.4
+      PKG_CHECK_MODULES([LIBURING], [liburing >= 2.4], [
+        [HAVE_LIBURING=1]
+        AC_DEFINE([HAVE_LIBURING], [1], [Define to 1 if you have liburing])
+      ], [ : ])
+    ])
+  ])
+  AM_CONDITIONAL([HAVE_LIBURING], [test "x$LIBURING_LIBS" != "x"])
+  AS_IF([test "x$with_liburing" = "xyes"], [
+    AS_IF([test x"$LIBURING_LIBS" = "x"], [
+      AC_MSG_ERROR([liburing requested but libraries were not found])
+    ])
+  ])
+])
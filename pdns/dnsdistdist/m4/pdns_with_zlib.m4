@@ -0,0 +1,25 @@
+AC_DEFUN([PDNS_WITH_ZLIB], [
+  AC_MSG_CHECKING([whether we will be linking in zlib])
+  HAVE_ZLIB=0
+  AC_ARG_WITH([zlib],
+    AS_HELP_STRING([--with-zlib],[use zlib to compress the responses of the internal webserver @<:@default=auto@:>@]),
+    [with_zlib=$withval],
+    [with_zlib=auto],
+  )
+  AC_MSG_RESULT([$with_zlib])
+
+  AS_IF([test "x$with_zlib" != "xno"], [
+    AS_IF([test "x$with_zlib" = "xyes" -o "x$with_zlib" = "xauto"], [
+      PKG_CHECK_MODULES([ZLIB], [zlib], [
+        [HAVE_ZLIB=1]
+        AC_DEFINE([HAVE_ZLIB], [1], [Define to 1 if you have zlib])
+      ], [ : ])
+    ])
+  ])
+  AM_CONDITIONAL([HAVE_ZLIB], [test "x$ZLIB_LIBS" != "x"])
+  AS_IF([test "x$with_zlib" = "xyes"], [
+    AS_IF([test x"$ZLIB_LIBS" = "x"], [
+      AC_MSG_ERROR([zlib requested but libraries were not found])
+    ])
+  ])
+])
@@ -0,0 +1,199 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+
+#include <boost/test/unit_test.hpp>
+
+#include "dnsdist.hh"
+
+int g_udpTimeout{2};
+
+/* add stub implementations, we don't want to include the corresponding object files
+   and their dependencies */
+
+void handleDOHTimeout(DOHUnit* oldDU)
+{
+}
+
+static std::shared_ptr<DownstreamState> getBackend(size_t workers)
+{
+  auto ds = std::make_shared<DownstreamState>(ComboAddress("192.0.2.1:53"), ComboAddress(), 0, std::string(), 1, false);
+  ds->setUDPQueryWorkers(workers);
+  return ds;
+}
+
+static void markAsUsed(std::shared_ptr<DownstreamState>& ds, uint16_t queryId)
+{
+  BOOST_REQUIRE(!ds->idStates.at(queryId).markAsUsed());
+  ++ds->outstanding;
+}
+
+BOOST_AUTO_TEST_SUITE(dnsdistbackend_cc)
+
+BOOST_AUTO_TEST_CASE(test_IDStateRanges) {
+  const size_t workers = 4;
+  auto ds = getBackend(workers);
+  const size_t total = ds->idStates.size();
+  const size_t rangeSize = (total / 2) / workers;
+
+  /* one range per worker, then the shared one with the remaining states */
+  BOOST_REQUIRE_EQUAL(ds->idStateRanges.size(), workers + 1);
+  for (size_t idx = 0; idx < workers; idx++) {
+    BOOST_CHECK_EQUAL(ds->idStateRanges.at(idx).first, idx * rangeSize);
+    BOOST_CHECK_EQUAL(ds->idStateRanges.at(idx).size, rangeSize);
+  }
+  BOOST_CHECK_EQUAL(ds->idStateRanges.back().first, workers * rangeSize);
+  BOOST_CHECK_EQUAL(ds->idStateRanges.back().size, total - workers * rangeSize);
+
+  /* every worker goes through its own range, in order, then wraps around */
+  for (size_t worker = 0; worker < workers; worker++) {
+    for (size_t idx = 0; idx < rangeSize + 1; idx++) {
+      uint16_t queryId = 0;
+      auto ids = ds->getIDState(worker, queryId);
+      BOOST_CHECK_EQUAL(queryId, worker * rangeSize + (idx % rangeSize));
+      BOOST_CHECK(ids == &ds->idStates.at(queryId));
+    }
+    BOOST_CHECK_EQUAL(ds->idStateRanges.at(worker).assigned.load(), rangeSize + 1);
+  }
+  BOOST_CHECK_EQUAL(ds->idStateRanges.back().assigned.load(), 0U);
+
+  /* and a thread without a range of its own uses the shared one */
+  uint16_t queryId = 0;
+  ds->getIDState(workers, queryId);
+  BOOST_CHECK_EQUAL(queryId, workers * rangeSize);
+  ds->getIDState(workers + 42, queryId);
+  BOOST_CHECK_EQUAL(queryId, workers * rangeSize + 1);
+  BOOST_CHECK_EQUAL(ds->idStateRanges.back().assigned.load(), 2U);
+}
+
+BOOST_AUTO_TEST_CASE(test_IDStateRanges_NotEnoughStates) {
+  /* not enough states to give at least 16 of them to every worker, everyone shares a single range */
+  auto ds = getBackend(g_maxOutstanding);
+  BOOST_REQUIRE_EQUAL(ds->idStateRanges.size(), 1U);
+  BOOST_CHECK_EQUAL(ds->idStateRanges.at(0).first, 0U);
+  BOOST_CHECK_EQUAL(ds->idStateRanges.at(0).size, ds->idStates.size());
+
+  uint16_t queryId = 42;
+  ds->getIDState(0, queryId);
+  BOOST_CHECK_EQUAL(queryId, 0U);
+  ds->getIDState(1, queryId);
+  BOOST_CHECK_EQUAL(queryId, 1U);
+}
+
+BOOST_AUTO_TEST_CASE(test_IDStateRanges_Borrow) {
+  const size_t workers = 2;
+  auto ds = getBackend(workers);
+  const size_t rangeSize = (ds->idStates.size() / 2) / workers;
+  const auto& shared = ds->idStateRanges.back();
+
+  /* fill the range of the first worker with queries waiting for a response */
+  for (size_t idx = 0; idx < rangeSize; idx++) {
+    uint16_t queryId = 0;
+    ds->getIDState(0, queryId);
+    BOOST_REQUIRE_EQUAL(queryId, idx);
+    markAsUsed(ds, queryId);
+  }
+
+  /* the next state of its range is still in use, so one is borrowed from the shared range
+     instead of overwriting it */
+  uint16_t queryId = 0;
+  auto ids = ds->getIDState(0, queryId);
+  BOOST_CHECK_EQUAL(queryId, shared.first);
+  BOOST_CHECK(ids == &ds->idStates.at(shared.first));
+  BOOST_CHECK(ds->idStates.at(0).isInUse());
+  BOOST_CHECK_EQUAL(shared.assigned.load(), 1U);
+
+  /* the other worker is not affected */
+  ds->getIDState(1, queryId);
+  BOOST_CHECK_EQUAL(queryId, rangeSize);
+
+  /* once a response has been received for the query using the next state of its range,
+     the worker uses its own range again */
+  auto& next = ds->idStates.at(1);
+  BOOST_REQUIRE(next.tryMarkUnused(next.usageIndicator));
+  ds->getIDState(0, queryId);
+  BOOST_CHECK_EQUAL(queryId, 1U);
+  BOOST_CHECK_EQUAL(shared.assigned.load(), 1U);
+}
+
+BOOST_AUTO_TEST_CASE(test_IDStateRanges_IOUringFallback) {
+  /* an io_uring group of three listeners is accounted for as a single worker, so when the
+     group falls back to one regular thread per listener, the first one keeps the group's ID
+     and range, and the two others get IDs beyond the number of workers */
+  const size_t workers = 1;
+  auto ds = getBackend(workers);
+  const auto& shared = ds->idStateRanges.back();
+  const size_t groupWorkerId = 0;
+
+  uint16_t queryId = 0;
+  ds->getIDState(groupWorkerId, queryId);
+  BOOST_CHECK_EQUAL(queryId, 0U);
+  BOOST_CHECK_EQUAL(ds->idStateRanges.at(0).assigned.load(), 1U);
+
+  for (size_t fallbackWorkerId = workers; fallbackWorkerId < workers + 2; fallbackWorkerId++) {
+    ds->getIDState(fallbackWorkerId, queryId);
+    BOOST_CHECK_EQUAL(queryId, shared.first + (fallbackWorkerId - workers));
+    BOOST_CHECK(ds->getSocketForSending(fallbackWorkerId) == ds->sockets.at(0));
+  }
+  BOOST_CHECK_EQUAL(ds->idStateRanges.at(0).assigned.load(), 1U);
+  BOOST_CHECK_EQUAL(shared.assigned.load(), 2U);
+}
+
+BOOST_AUTO_TEST_CASE(test_UDPTimeouts) {
+  const size_t workers = 1;
+  auto ds = getBackend(workers);
+  auto& range = ds->idStateRanges.at(0);
+
+  /* three queries have been sent, and we got a response for the second one */
+  for (size_t idx = 0; idx < 3; idx++) {
+    uint16_t queryId = 0;
+    ds->getIDState(0, queryId);
+    markAsUsed(ds, queryId);
+  }
+  auto& answered = ds->idStates.at(1);
+  BOOST_REQUIRE(answered.tryMarkUnused(answered.usageIndicator));
+  --ds->outstanding;
+
+  /* the queries are not expired until they have been waiting for more than g_udpTimeout scans,
+     and we can't skip anything until the oldest one is done */
+  for (int scan = 0; scan <= g_udpTimeout; scan++) {
+    ds->handleUDPTimeouts();
+    BOOST_CHECK_EQUAL(range.scanned, 0U);
+    BOOST_CHECK_EQUAL(range.settled, 3U);
+    BOOST_CHECK_EQUAL(ds->outstanding.load(), 2U);
+  }
+
+  ds->handleUDPTimeouts();
+  BOOST_CHECK(!ds->idStates.at(0).isInUse());
+  BOOST_CHECK(!ds->idStates.at(2).isInUse());
+  BOOST_CHECK_EQUAL(ds->outstanding.load(), 0U);
+  BOOST_CHECK_EQUAL(ds->reuseds.load(), 2U);
+  /* everything handed out before the scan is done, the next scan starts after it */
+  BOOST_CHECK_EQUAL(range.scanned, 3U);
+  BOOST_CHECK_EQUAL(range.settled, 3U);
+
+  /* a state has been handed out but not marked as used yet, it can't be skipped
+     before the next scan */
+  uint16_t queryId = 0;
+  ds->getIDState(0, queryId);
+  BOOST_CHECK_EQUAL(queryId, 3U);
+  ds->handleUDPTimeouts();
+  BOOST_CHECK_EQUAL(range.scanned, 3U);
+  BOOST_CHECK_EQUAL(range.settled, 4U);
+  ds->handleUDPTimeouts();
+  BOOST_CHECK_EQUAL(range.scanned, 4U);
+  BOOST_CHECK_EQUAL(range.settled, 4U);
+
+  /* the worker went over its whole range since the last scan, the oldest states
+     have been reused so there is no point in looking at the older positions */
+  for (size_t idx = 0; idx < range.size + 10; idx++) {
+    ds->getIDState(0, queryId);
+  }
+  ds->handleUDPTimeouts();
+  BOOST_CHECK_EQUAL(range.settled, 4 + range.size + 10);
+  BOOST_CHECK_EQUAL(range.scanned, 4U + 10U);
+  ds->handleUDPTimeouts();
+  BOOST_CHECK_EQUAL(range.scanned, range.settled);
+  BOOST_CHECK_EQUAL(ds->reuseds.load(), 2U);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
@@ -149,6 +149,94 @@ BOOST_AUTO_TEST_CASE(test_DynBlockRulesGroup_QueryRate) {
   }
 }
 
+BOOST_AUTO_TEST_CASE(test_DynBlockRulesGroup_QueryRate_Incremental) {
+  dnsheader dh;
+  memset(&dh, 0, sizeof(dh));
+  DNSName qname("rings.powerdns.com.");
+  ComboAddress requestor1("192.0.2.1");
+  ComboAddress requestor2("192.0.2.2");
+  uint16_t qtype = QType::AAAA;
+  uint16_t size = 42;
+  struct timespec now;
+  gettime(&now);
+  NetmaskTree<DynBlock> emptyNMG;
+
+  size_t numberOfSeconds = 10;
+  size_t blockDuration = 60;
+  const auto action = DNSAction::Action::Drop;
+  const std::string reason = "Exceeded query rate";
+
+  DynBlockRulesGroup dbrg;
+  dbrg.setQuiet(true);
+  dbrg.setIncremental(true);
+  BOOST_CHECK(dbrg.isIncremental());
+
+  /* block above 50 qps for numberOfSeconds seconds, no warning */
+  dbrg.setQueryRate(50, 0, numberOfSeconds, reason, blockDuration, action);
+
+  g_rings.clear();
+  g_dynblockNMG.setState(emptyNMG);
+
+  {
+    /* insert 45 qps from a given client in the last 10s
+       this should not trigger the rule */
+    size_t numberOfQueries = 45 * numberOfSeconds;
+    for (size_t idx = 0; idx < numberOfQueries; idx++) {
+      g_rings.insertQuery(now, requestor1, qname, qtype, size, dh);
+    }
+
+    dbrg.apply(now);
+    BOOST_CHECK_EQUAL(g_dynblockNMG.getLocal()->size(), 0U);
+  }
+
+  {
+    /* insert 6 more qps without clearing the rings, only these new
+       entries are read but the total is now above 50 qps */
+    size_t numberOfQueries = 6 * numberOfSeconds;
+    for (size_t idx = 0; idx < numberOfQueries; idx++) {
+      g_rings.insertQuery(now, requestor1, qname, qtype, size, dh);
+    }
+
+    dbrg.apply(now);
+    BOOST_CHECK_EQUAL(g_dynblockNMG.getLocal()->size(), 1U);
+    BOOST_CHECK(g_dynblockNMG.getLocal()->lookup(requestor1) != nullptr);
+    BOOST_CHECK(g_dynblockNMG.getLocal()->lookup(requestor2) == nullptr);
+    const auto& block = g_dynblockNMG.getLocal()->lookup(requestor1)->second;
+    BOOST_CHECK_EQUAL(block.reason, reason);
+    BOOST_CHECK_EQUAL(static_cast<size_t>(block.until.tv_sec), now.tv_sec + blockDuration);
+    BOOST_CHECK(block.action == action);
+  }
+
+  {
+    /* the admin removes the block, and we apply the rules again without any new entry,
+       the requestor was exceeding during the last run so it is evaluated again */
+    g_dynblockNMG.setState(emptyNMG);
+    dbrg.apply(now);
+    BOOST_CHECK_EQUAL(g_dynblockNMG.getLocal()->size(), 1U);
+
+    /* but not 20s later, since the window is 10s */
+    g_dynblockNMG.setState(emptyNMG);
+    struct timespec later = now;
+    later.tv_sec += 20;
+    dbrg.apply(later);
+    BOOST_CHECK_EQUAL(g_dynblockNMG.getLocal()->size(), 0U);
+  }
+
+  {
+    /* clearing the rings discards what has been computed so far */
+    g_rings.clear();
+    g_dynblockNMG.setState(emptyNMG);
+
+    size_t numberOfQueries = 45 * numberOfSeconds;
+    for (size_t idx = 0; idx < numberOfQueries; idx++) {
+      g_rings.insertQuery(now, requestor1, qname, qtype, size, dh);
+    }
+
+    dbrg.apply(now);
+    BOOST_CHECK_EQUAL(g_dynblockNMG.getLocal()->size(), 0U);
+  }
+}
+
 BOOST_AUTO_TEST_CASE(test_DynBlockRulesGroup_QueryRate_responses) {
   /* check that the responses are not accounted as queries when a
      rcode rate rule is defined (sounds very specific but actually happened) */
@@ -387,6 +475,70 @@ BOOST_AUTO_TEST_CASE(test_DynBlockRulesGroup_RCodeRate) {
 
 }
 
+BOOST_AUTO_TEST_CASE(test_DynBlockRulesGroup_RCodeRate_Incremental) {
+  dnsheader dh;
+  memset(&dh, 0, sizeof(dh));
+  DNSName qname("rings.powerdns.com.");
+  ComboAddress requestor1("192.0.2.1");
+  ComboAddress requestor2("192.0.2.2");
+  ComboAddress backend("192.0.2.42");
+  uint16_t qtype = QType::AAAA;
+  uint16_t size = 42;
+  unsigned int responseTime = 100 * 1000; /* 100ms */
+  struct timespec now;
+  gettime(&now);
+  NetmaskTree<DynBlock> emptyNMG;
+
+  size_t numberOfSeconds = 10;
+  size_t blockDuration = 60;
+  const auto action = DNSAction::Action::Drop;
+  const std::string reason = "Exceeded query rate";
+  const uint16_t rcode = RCode::ServFail;
+
+  DynBlockRulesGroup dbrg;
+  dbrg.setQuiet(true);
+  dbrg.setIncremental(true);
+
+  /* block above 50 ServFail/s for numberOfSeconds seconds, no warning */
+  dbrg.setRCodeRate(rcode, 50, 0, numberOfSeconds, reason, blockDuration, action);
+
+  g_rings.clear();
+  g_dynblockNMG.setState(emptyNMG);
+
+  {
+    /* insert 45 ServFail/s from a given client, and a lot of FormErr from the other one,
+       this should not trigger the rule */
+    dh.rcode = rcode;
+    for (size_t idx = 0; idx < 45 * numberOfSeconds; idx++) {
+      g_rings.insertResponse(now, requestor1, qname, qtype, responseTime, size, dh, backend);
+    }
+    dh.rcode = RCode::FormErr;
+    for (size_t idx = 0; idx < 100 * numberOfSeconds; idx++) {
+      g_rings.insertResponse(now, requestor2, qname, qtype, responseTime, size, dh, backend);
+    }
+
+    dbrg.apply(now);
+    BOOST_CHECK_EQUAL(g_dynblockNMG.getLocal()->size(), 0U);
+  }
+
+  {
+    /* 6 more ServFail/s from the first client, read without going over the previous ones again */
+    dh.rcode = rcode;
+    for (size_t idx = 0; idx < 6 * numberOfSeconds; idx++) {
+      g_rings.insertResponse(now, requestor1, qname, qtype, responseTime, size, dh, backend);
+    }
+
+    dbrg.apply(now);
+    BOOST_CHECK_EQUAL(g_dynblockNMG.getLocal()->size(), 1U);
+    BOOST_CHECK(g_dynblockNMG.getLocal()->lookup(requestor1) != nullptr);
+    BOOST_CHECK(g_dynblockNMG.getLocal()->lookup(requestor2) == nullptr);
+    const auto& block = g_dynblockNMG.getLocal()->lookup(requestor1)->second;
+    BOOST_CHECK_EQUAL(block.reason, reason);
+    BOOST_CHECK_EQUAL(static_cast<size_t>(block.until.tv_sec), now.tv_sec + blockDuration);
+    BOOST_CHECK(block.action == action);
+  }
+}
+
 BOOST_AUTO_TEST_CASE(test_DynBlockRulesGroup_RCodeRatio) {
   dnsheader dh;
   DNSName qname("rings.powerdns.com.");
@@ -576,6 +728,217 @@ BOOST_AUTO_TEST_CASE(test_DynBlockRulesGroup_ResponseByteRate) {
 
 }
 
+BOOST_AUTO_TEST_CASE(test_DynBlockRulesGroup_ResponseByteRate_Incremental) {
+  dnsheader dh;
+  memset(&dh, 0, sizeof(dh));
+  DNSName qname("rings.powerdns.com.");
+  ComboAddress requestor1("192.0.2.1");
+  ComboAddress requestor2("192.0.2.2");
+  ComboAddress backend("192.0.2.42");
+  uint16_t qtype = QType::AAAA;
+  uint16_t size = 100;
+  unsigned int responseTime = 100 * 1000; /* 100ms */
+  struct timespec now;
+  gettime(&now);
+  NetmaskTree<DynBlock> emptyNMG;
+
+  size_t numberOfSeconds = 10;
+  size_t blockDuration = 60;
+  const auto action = DNSAction::Action::Drop;
+  const std::string reason = "Exceeded query rate";
+
+  DynBlockRulesGroup dbrg;
+  dbrg.setQuiet(true);
+  dbrg.setIncremental(true);
+
+  /* block above 10kB/s for numberOfSeconds seconds, no warning */
+  dbrg.setResponseByteRate(10000, 0, numberOfSeconds, reason, blockDuration, action);
+
+  g_rings.clear();
+  g_dynblockNMG.setState(emptyNMG);
+
+  {
+    /* insert 99 answers of 100 bytes per second from both clients,
+       this should not trigger the rule */
+    for (size_t idx = 0; idx < 99 * numberOfSeconds; idx++) {
+      g_rings.insertResponse(now, requestor1, qname, qtype, responseTime, size, dh, backend);
+      g_rings.insertResponse(now, requestor2, qname, qtype, responseTime, size, dh, backend);
+    }
+
+    dbrg.apply(now);
+    BOOST_CHECK_EQUAL(g_dynblockNMG.getLocal()->size(), 0U);
+  }
+
+  {
+    /* just above 100 answers of 100 bytes per second for the first client now */
+    for (size_t idx = 0; idx < numberOfSeconds + 1; idx++) {
+      g_rings.insertResponse(now, requestor1, qname, qtype, responseTime, size, dh, backend);
+    }
+
+    dbrg.apply(now);
+    BOOST_CHECK_EQUAL(g_dynblockNMG.getLocal()->size(), 1U);
+    BOOST_CHECK(g_dynblockNMG.getLocal()->lookup(requestor1) != nullptr);
+    BOOST_CHECK(g_dynblockNMG.getLocal()->lookup(requestor2) == nullptr);
+    const auto& block = g_dynblockNMG.getLocal()->lookup(requestor1)->second;
+    BOOST_CHECK_EQUAL(block.reason, reason);
+    BOOST_CHECK_EQUAL(static_cast<size_t>(block.until.tv_sec), now.tv_sec + blockDuration);
+    BOOST_CHECK(block.action == action);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_DynBlockRulesGroup_SuffixMatch_Incremental) {
+  dnsheader dh;
+  memset(&dh, 0, sizeof(dh));
+  DNSName name1("a.rings.powerdns.com.");
+  DNSName name2("b.rings.powerdns.com.");
+  DNSName blocked("rings.powerdns.com.");
+  ComboAddress requestor("192.0.2.1");
+  ComboAddress backend("192.0.2.42");
+  uint16_t qtype = QType::AAAA;
+  uint16_t size = 42;
+  unsigned int responseTime = 100 * 1000; /* 100ms */
+  struct timespec now;
+  gettime(&now);
+  SuffixMatchTree<DynBlock> emptySMT;
+
+  size_t numberOfSeconds = 10;
+  size_t blockDuration = 60;
+  const auto action = DNSAction::Action::Drop;
+  const std::string reason = "Exceeded ServFail rate for a zone";
+
+  DynBlockRulesGroup dbrg;
+  dbrg.setQuiet(true);
+  dbrg.setIncremental(true);
+
+  /* block a zone, and therefore every name below it, getting more than 100 ServFail in numberOfSeconds seconds */
+  dbrg.setSuffixMatchRule(numberOfSeconds, reason, blockDuration, action, [](const StatNode& node, const StatNode::Stat& self, const StatNode::Stat& children) {
+    return node.fullname == "rings.powerdns.com." && (self.servfails + children.servfails) > 100;
+  });
+
+  g_rings.clear();
+  g_dynblockSMT.setState(emptySMT);
+
+  {
+    /* 40 ServFail for each of the two names, and NoError ones */
+    for (size_t idx = 0; idx < 40; idx++) {
+      dh.rcode = RCode::ServFail;
+      g_rings.insertResponse(now, requestor, name1, qtype, responseTime, size, dh, backend);
+      g_rings.insertResponse(now, requestor, name2, qtype, responseTime, size, dh, backend);
+      dh.rcode = RCode::NoError;
+      g_rings.insertResponse(now, requestor, name1, qtype, responseTime, size, dh, backend);
+    }
+
+    dbrg.apply(now);
+    BOOST_CHECK(g_dynblockSMT.getLocal()->lookup(blocked) == nullptr);
+  }
+
+  {
+    /* 11 more for each name, only these are read but the totals are kept */
+    dh.rcode = RCode::ServFail;
+    for (size_t idx = 0; idx < 11; idx++) {
+      g_rings.insertResponse(now, requestor, name1, qtype, responseTime, size, dh, backend);
+      g_rings.insertResponse(now, requestor, name2, qtype, responseTime, size, dh, backend);
+    }
+
+    dbrg.apply(now);
+    const auto block = g_dynblockSMT.getLocal()->lookup(name1);
+    BOOST_REQUIRE(block != nullptr);
+    BOOST_CHECK_EQUAL(block->domain, blocked);
+    BOOST_CHECK_EQUAL(block->reason, reason);
+    BOOST_CHECK_EQUAL(static_cast<size_t>(block->until.tv_sec), now.tv_sec + blockDuration);
+    BOOST_CHECK(block->action == action);
+  }
+
+  {
+    /* the block is removed, the ServFail responses are now too old to count */
+    g_dynblockSMT.setState(emptySMT);
+    struct timespec later = now;
+    later.tv_sec += numberOfSeconds + 1;
+    dbrg.apply(later);
+    BOOST_CHECK(g_dynblockSMT.getLocal()->lookup(blocked) == nullptr);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_DynBlockRulesGroup_Incremental_WindowRollover) {
+  dnsheader dh;
+  memset(&dh, 0, sizeof(dh));
+  DNSName qname("rings.powerdns.com.");
+  ComboAddress requestor1("192.0.2.1");
+  ComboAddress requestor2("192.0.2.2");
+  ComboAddress backend("192.0.2.42");
+  uint16_t qtype = QType::AAAA;
+  uint16_t size = 42;
+  unsigned int responseTime = 100 * 1000; /* 100ms */
+  struct timespec now;
+  gettime(&now);
+  NetmaskTree<DynBlock> emptyNMG;
+
+  /* with a 10s window, every bucket covers one second */
+  time_t numberOfSeconds = 10;
+  size_t blockDuration = 60;
+  const auto action = DNSAction::Action::Drop;
+  const std::string reason = "Exceeded ServFail rate";
+
+  DynBlockRulesGroup dbrg;
+  dbrg.setQuiet(true);
+  dbrg.setIncremental(true);
+
+  /* block above 50 ServFail/s, so 500 over numberOfSeconds seconds */
+  dbrg.setRCodeRate(RCode::ServFail, 50, 0, numberOfSeconds, reason, blockDuration, action);
+
+  g_rings.clear();
+  g_dynblockNMG.setState(emptyNMG);
+  dh.rcode = RCode::ServFail;
+
+  auto insert = [&](const ComboAddress& requestor, const struct timespec& when, size_t count) {
+    for (size_t idx = 0; idx < count; idx++) {
+      g_rings.insertResponse(when, requestor, qname, qtype, responseTime, size, dh, backend);
+    }
+  };
+
+  insert(requestor1, now, 300);
+  dbrg.apply(now);
+  BOOST_CHECK_EQUAL(g_dynblockNMG.getLocal()->size(), 0U);
+
+  /* the responses received in different buckets of the window add up */
+  struct timespec later = now;
+  later.tv_sec += 5;
+  insert(requestor1, later, 201);
+  dbrg.apply(later);
+  BOOST_CHECK(g_dynblockNMG.getLocal()->lookup(requestor1) != nullptr);
+
+  /* twice the window later, the bucket used for the first responses is used again, and only
+     the new responses are counted */
+  g_dynblockNMG.setState(emptyNMG);
+  later = now;
+  later.tv_sec += 2 * numberOfSeconds;
+  insert(requestor1, later, 300);
+  dbrg.apply(later);
+  BOOST_CHECK_EQUAL(g_dynblockNMG.getLocal()->size(), 0U);
+
+  insert(requestor1, later, 201);
+  dbrg.apply(later);
+  BOOST_CHECK(g_dynblockNMG.getLocal()->lookup(requestor1) != nullptr);
+
+  /* the first requestor has not been seen for a while and is forgotten about,
+     a new one starts from scratch, reusing its counters */
+  g_dynblockNMG.setState(emptyNMG);
+  later = now;
+  later.tv_sec += 10 * numberOfSeconds;
+  dbrg.apply(later);
+  BOOST_CHECK_EQUAL(g_dynblockNMG.getLocal()->size(), 0U);
+
+  insert(requestor2, later, 300);
+  dbrg.apply(later);
+  BOOST_CHECK_EQUAL(g_dynblockNMG.getLocal()->size(), 0U);
+
+  insert(requestor2, later, 201);
+  dbrg.apply(later);
+  BOOST_CHECK_EQUAL(g_dynblockNMG.getLocal()->size(), 1U);
+  BOOST_CHECK(g_dynblockNMG.getLocal()->lookup(requestor1) == nullptr);
+  BOOST_CHECK(g_dynblockNMG.getLocal()->lookup(requestor2) != nullptr);
+}
+
 BOOST_AUTO_TEST_CASE(test_DynBlockRulesGroup_Warning) {
   dnsheader dh;
   DNSName qname("rings.powerdns.com.");
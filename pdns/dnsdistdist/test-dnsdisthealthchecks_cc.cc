@@ -0,0 +1,188 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+
+#include <boost/test/unit_test.hpp>
+#include <thread>
+
+#include "dnsdist.hh"
+#include "dnsdist-healthchecks.hh"
+#include "iputils.hh"
+
+/* add stub implementations, we don't want to include the corresponding object files
+   and their dependencies */
+
+uint16_t getRandomDNSID()
+{
+  return random() % 65536;
+}
+
+void responderThread(std::shared_ptr<DownstreamState> dss)
+{
+}
+
+ssize_t udpClientSendRequestToBackend(const std::shared_ptr<DownstreamState>& ss, const int sd, const PacketBuffer& request, bool healthCheck)
+{
+  return send(sd, request.data(), request.size(), 0);
+}
+
+bool DNSDistSNMPAgent::sendBackendStatusChangeTrap(const std::shared_ptr<DownstreamState>& dss)
+{
+  return false;
+}
+
+static std::shared_ptr<DownstreamState> getLazyBackend()
+{
+  auto ds = std::make_shared<DownstreamState>(ComboAddress("192.0.2.1:53"), ComboAddress(), 0, std::string(), 1, false);
+  ds->healthCheckMode = DownstreamState::HealthCheckMode::Lazy;
+  ds->upStatus = true;
+  return ds;
+}
+
+BOOST_AUTO_TEST_SUITE(dnsdisthealthchecks_cc)
+
+BOOST_AUTO_TEST_CASE(test_LazyHealthCheck_Threshold) {
+  auto ds = getLazyBackend();
+  ds->lazyHealthCheckThreshold = 20;
+
+  /* no traffic, no need to check */
+  BOOST_CHECK(!needsLazyHealthCheck(ds));
+
+  /* 19% of failures, below the threshold */
+  ds->queries += 100;
+  ds->reuseds += 10;
+  ds->servfailResponses += 9;
+  BOOST_CHECK(!needsLazyHealthCheck(ds));
+  BOOST_CHECK(ds->upStatus);
+
+  /* only the traffic since the previous call is considered: 20% of failures */
+  ds->queries += 100;
+  ds->reuseds += 15;
+  ds->servfailResponses += 5;
+  BOOST_CHECK(needsLazyHealthCheck(ds));
+
+  /* the previous failures are not counted again */
+  ds->queries += 100;
+  BOOST_CHECK(!needsLazyHealthCheck(ds));
+
+  /* a threshold of 0 means that any traffic triggers a check */
+  ds->lazyHealthCheckThreshold = 0;
+  ds->queries += 1;
+  BOOST_CHECK(needsLazyHealthCheck(ds));
+
+  /* and a threshold of 100 that every query has to fail */
+  ds->lazyHealthCheckThreshold = 100;
+  ds->queries += 10;
+  ds->reuseds += 9;
+  BOOST_CHECK(!needsLazyHealthCheck(ds));
+  ds->queries += 10;
+  ds->reuseds += 5;
+  ds->servfailResponses += 5;
+  BOOST_CHECK(needsLazyHealthCheck(ds));
+}
+
+BOOST_AUTO_TEST_CASE(test_LazyHealthCheck_MinSampleCount) {
+  auto ds = getLazyBackend();
+  ds->lazyHealthCheckThreshold = 20;
+  ds->lazyHealthCheckMinSampleCount = 50;
+
+  /* not enough queries to decide, even if all of them failed */
+  ds->queries += 49;
+  ds->reuseds += 49;
+  BOOST_CHECK(!needsLazyHealthCheck(ds));
+
+  /* enough queries, and above the threshold */
+  ds->queries += 50;
+  ds->servfailResponses += 10;
+  BOOST_CHECK(needsLazyHealthCheck(ds));
+
+  /* enough queries, below the threshold */
+  ds->queries += 50;
+  ds->servfailResponses += 9;
+  BOOST_CHECK(!needsLazyHealthCheck(ds));
+}
+
+BOOST_AUTO_TEST_CASE(test_LazyHealthCheck_UpDown) {
+  auto ds = getLazyBackend();
+  ds->maxCheckFailures = 2;
+
+  /* a failed check has been recorded, the healthy traffic clears it */
+  ds->currentCheckFailures = 1;
+  ds->queries += 100;
+  BOOST_CHECK(!needsLazyHealthCheck(ds));
+  BOOST_CHECK_EQUAL(ds->currentCheckFailures, 0U);
+
+  /* a backend that is down does not get any traffic, it always needs to be checked */
+  ds->upStatus = false;
+  BOOST_CHECK(needsLazyHealthCheck(ds));
+  BOOST_CHECK(!ds->upStatus);
+}
+
+static void answerHealthCheck(int fd, bool respond)
+{
+  uint16_t size;
+  if (readn2(fd, &size, sizeof(size)) != sizeof(size)) {
+    throw std::runtime_error("Error reading the size of the health check query");
+  }
+  PacketBuffer query(ntohs(size));
+  if (readn2(fd, query.data(), query.size()) != query.size()) {
+    throw std::runtime_error("Error reading the health check query");
+  }
+  if (!respond) {
+    return;
+  }
+  auto dh = reinterpret_cast<struct dnsheader*>(query.data());
+  dh->qr = true;
+  writen2(fd, &size, sizeof(size));
+  writen2(fd, query.data(), query.size());
+}
+
+BOOST_AUTO_TEST_CASE(test_TCPHealthCheck_ReuseAndRetry) {
+  ComboAddress local("127.0.0.1:0");
+  int listener = SSocket(local.sin4.sin_family, SOCK_STREAM, 0);
+  SBind(listener, local);
+  SListen(listener, 10);
+  socklen_t localLen = local.getSocklen();
+  BOOST_REQUIRE_EQUAL(getsockname(listener, reinterpret_cast<struct sockaddr*>(&local), &localLen), 0);
+
+  std::atomic<size_t> accepted{0};
+  std::thread server([listener,&accepted]() {
+    ComboAddress remote("0.0.0.0");
+    try {
+      /* the first two checks are sent over the same connection, then the third one is read but the connection is closed */
+      int conn = SAccept(listener, remote);
+      accepted++;
+      answerHealthCheck(conn, true);
+      answerHealthCheck(conn, true);
+      answerHealthCheck(conn, false);
+      close(conn);
+
+      /* so the third check is sent again over a new connection */
+      conn = SAccept(listener, remote);
+      accepted++;
+      answerHealthCheck(conn, true);
+      close(conn);
+    }
+    catch (const std::exception& e) {
+      BOOST_TEST_MESSAGE("Error in the health check server: " << e.what());
+    }
+  });
+
+  auto ds = std::make_shared<DownstreamState>(local, ComboAddress(), 0, std::string(), 1, false);
+  ds->checkTCP = true;
+  ds->upStatus = true;
+  auto mplexer = std::shared_ptr<FDMultiplexer>(FDMultiplexer::getMultiplexerSilent());
+
+  for (size_t idx = 0; idx < 3; idx++) {
+    BOOST_REQUIRE(queueHealthCheck(mplexer, ds));
+    handleQueuedHealthChecks(mplexer);
+    BOOST_CHECK(ds->upStatus);
+    BOOST_CHECK_EQUAL(ds->currentCheckFailures, 0U);
+    BOOST_CHECK(!ds->healthCheckInProgress);
+  }
+
+  server.join();
+  close(listener);
+  BOOST_CHECK_EQUAL(accepted.load(), 2U);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
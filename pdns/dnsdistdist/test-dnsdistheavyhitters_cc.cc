@@ -0,0 +1,188 @@
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+
+#include <boost/test/unit_test.hpp>
+#include <thread>
+
+#include "dnsdist-heavyhitters.hh"
+#include "dns.hh"
+
+BOOST_AUTO_TEST_SUITE(dnsdistheavyhitters_cc)
+
+BOOST_AUTO_TEST_CASE(test_HeavyHittersTracker) {
+  const time_t now = 1000;
+  /* small enough to get collisions in the sketch and evictions from the top keys */
+  HeavyHittersTracker<DNSName> tracker(10, 64, 4, 2, 0);
+
+  /* 5 heavy hitters, the first one being the heaviest */
+  for (size_t idx = 0; idx < 5; idx++) {
+    const DNSName name("heavy" + std::to_string(idx) + ".powerdns.com.");
+    for (size_t count = 0; count < (1000 - idx * 100); count++) {
+      tracker.add(name, 1, now);
+    }
+  }
+
+  /* and a long tail of names seen only once */
+  for (size_t idx = 0; idx < 1000; idx++) {
+    tracker.add(DNSName("tail" + std::to_string(idx) + ".powerdns.com."), 1, now);
+  }
+
+  uint64_t total = 0;
+  auto top = tracker.getTop(5, now, total);
+  BOOST_CHECK_EQUAL(total, 1000U + 900U + 800U + 700U + 600U + 1000U);
+  BOOST_REQUIRE_EQUAL(top.size(), 5U);
+  for (size_t idx = 0; idx < top.size(); idx++) {
+    BOOST_CHECK_EQUAL(top.at(idx).first, DNSName("heavy" + std::to_string(idx) + ".powerdns.com."));
+    /* the estimate is never lower than the real value */
+    BOOST_CHECK_GE(top.at(idx).second, 1000U - idx * 100);
+  }
+
+  /* case-insensitive */
+  BOOST_CHECK_GE(tracker.getEstimate(DNSName("HEAVY0.powerdns.com."), now), 1000U);
+
+  /* asking for more than we have */
+  top = tracker.getTop(100, now, total);
+  BOOST_CHECK_LE(top.size(), 2U * tracker.getCapacity());
+
+  tracker.clear();
+  top = tracker.getTop(5, now, total);
+  BOOST_CHECK_EQUAL(top.size(), 0U);
+  BOOST_CHECK_EQUAL(total, 0U);
+}
+
+BOOST_AUTO_TEST_CASE(test_HeavyHittersTracker_Decay) {
+  time_t now = 1000;
+  const time_t halfLife = 10;
+  HeavyHittersTracker<ComboAddress, ComboAddress::addressOnlyHash, ComboAddress::addressOnlyEqual> tracker(10, 1024, 4, 1, halfLife);
+
+  const ComboAddress first("192.0.2.1");
+  const ComboAddress second("192.0.2.2");
+  for (size_t count = 0; count < 1000; count++) {
+    tracker.add(first, 1, now);
+  }
+  BOOST_CHECK_EQUAL(tracker.getEstimate(first, now), 1000U);
+
+  /* the port is ignored */
+  BOOST_CHECK_EQUAL(tracker.getEstimate(ComboAddress("192.0.2.1:53"), now), 1000U);
+
+  /* one half-life later */
+  now += halfLife;
+  BOOST_CHECK_EQUAL(tracker.getEstimate(first, now), 500U);
+
+  /* the second client is now the heaviest one */
+  for (size_t count = 0; count < 600; count++) {
+    tracker.add(second, 1, now);
+  }
+
+  uint64_t total = 0;
+  auto top = tracker.getTop(2, now, total);
+  BOOST_CHECK_EQUAL(total, 1100U);
+  BOOST_REQUIRE_EQUAL(top.size(), 2U);
+  BOOST_CHECK_EQUAL(top.at(0).first.toString(), second.toString());
+  BOOST_CHECK_EQUAL(top.at(0).second, 600U);
+  BOOST_CHECK_EQUAL(top.at(1).first.toString(), first.toString());
+  BOOST_CHECK_EQUAL(top.at(1).second, 500U);
+
+  /* much later, everything is gone */
+  now += 100 * halfLife;
+  top = tracker.getTop(2, now, total);
+  BOOST_CHECK_EQUAL(top.size(), 0U);
+  BOOST_CHECK_EQUAL(total, 0U);
+}
+
+BOOST_AUTO_TEST_CASE(test_HeavyHitters) {
+  const time_t now = 1000;
+  HeavyHitters hh;
+  BOOST_CHECK(hh.isEnabled());
+
+  const ComboAddress client("192.0.2.1:4242");
+  const DNSName name("PowerDNS.com.");
+  for (size_t count = 0; count < 10; count++) {
+    hh.insertQuery(client, name, now);
+    hh.insertResponse(client, name, RCode::ServFail, 100, now);
+  }
+  hh.insertResponse(client, DNSName("nx.powerdns.com."), RCode::NXDomain, 100, now);
+
+  uint64_t total = 0;
+  auto top = hh.getTop("queries", 10, total, now);
+  BOOST_REQUIRE_EQUAL(top.size(), 1U);
+  BOOST_CHECK_EQUAL(top.at(0).key, "powerdns.com.");
+  BOOST_CHECK_EQUAL(top.at(0).count, 10U);
+  BOOST_CHECK_EQUAL(total, 10U);
+
+  top = hh.getTop("clients", 10, total, now);
+  BOOST_REQUIRE_EQUAL(top.size(), 1U);
+  BOOST_CHECK_EQUAL(top.at(0).key, "192.0.2.1");
+  BOOST_CHECK_EQUAL(top.at(0).count, 10U);
+
+  top = hh.getTop("bandwidth", 10, total, now);
+  BOOST_REQUIRE_EQUAL(top.size(), 1U);
+  BOOST_CHECK_EQUAL(top.at(0).count, 1100U);
+
+  top = hh.getTop("servfail", 10, total, now);
+  BOOST_REQUIRE_EQUAL(top.size(), 1U);
+  BOOST_CHECK_EQUAL(top.at(0).key, "powerdns.com.");
+
+  top = hh.getTop("nxdomain", 10, total, now);
+  BOOST_REQUIRE_EQUAL(top.size(), 1U);
+  BOOST_CHECK_EQUAL(top.at(0).key, "nx.powerdns.com.");
+
+  BOOST_CHECK_THROW(hh.getTop("unknown", 10, total, now), std::runtime_error);
+
+  HeavyHitters::Options options;
+  options.enabled = false;
+  hh.configure(options);
+  BOOST_CHECK(!hh.isEnabled());
+  hh.insertQuery(client, name, now);
+  top = hh.getTop("queries", 10, total, now);
+  BOOST_CHECK_EQUAL(top.size(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(test_HeavyHitters_Threads) {
+  const time_t now = 1000;
+  HeavyHitters hh;
+  const DNSName heavy("heavy.powerdns.com.");
+  const size_t threadsCount = 4;
+  const size_t perThread = 1000;
+
+  std::vector<std::thread> threads;
+  for (size_t idx = 0; idx < threadsCount; idx++) {
+    threads.emplace_back([&hh, &heavy, idx]() {
+      const ComboAddress client("192.0.2." + std::to_string(idx + 1));
+      for (size_t count = 0; count < perThread; count++) {
+        hh.insertQuery(client, heavy, now);
+        hh.insertQuery(client, DNSName("name-" + std::to_string(count % 100) + ".powerdns.com."), now);
+        hh.insertResponse(client, heavy, RCode::ServFail, 100, now);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  /* the per-thread estimates are added up */
+  uint64_t total = 0;
+  auto top = hh.getTop("queries", 1, total, now);
+  BOOST_REQUIRE_EQUAL(top.size(), 1U);
+  BOOST_CHECK_EQUAL(top.at(0).key, "heavy.powerdns.com.");
+  BOOST_CHECK_EQUAL(top.at(0).count, threadsCount * perThread);
+  BOOST_CHECK_EQUAL(total, 2 * threadsCount * perThread);
+
+  top = hh.getTop("clients", 10, total, now);
+  BOOST_CHECK_EQUAL(top.size(), threadsCount);
+  for (const auto& entry : top) {
+    BOOST_CHECK_EQUAL(entry.count, 2 * perThread);
+  }
+
+  top = hh.getTop("servfail", 10, total, now);
+  BOOST_REQUIRE_EQUAL(top.size(), 1U);
+  BOOST_CHECK_EQUAL(top.at(0).count, threadsCount * perThread);
+
+  hh.clear();
+  top = hh.getTop("queries", 10, total, now);
+  BOOST_CHECK_EQUAL(top.size(), 0U);
+  BOOST_CHECK_EQUAL(total, 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -4,6 +4,8 @@
 
 #include <boost/test/unit_test.hpp>
 
+#include <fstream>
+
 #include "dnsdist-kvs.hh"
 
 #if defined(HAVE_LMDB) || defined(HAVE_CDB)
@@ -341,4 +343,222 @@ BOOST_AUTO_TEST_CASE(test_CDB) {
 }
 #endif /* HAVE_CDB */
 
+class CountingKVStore: public KeyValueStore
+{
+public:
+  bool keyExists(const std::string& key) override
+  {
+    ++d_lookups;
+    return d_entries.count(key) != 0;
+  }
+
+  bool getValue(const std::string& key, std::string& value) override
+  {
+    ++d_lookups;
+    auto it = d_entries.find(key);
+    if (it == d_entries.end()) {
+      return false;
+    }
+    value = it->second;
+    return true;
+  }
+
+  bool reload() override
+  {
+    ++d_reloads;
+    return true;
+  }
+
+  std::map<std::string, std::string> d_entries;
+  size_t d_lookups{0};
+  size_t d_reloads{0};
+};
+
+BOOST_AUTO_TEST_CASE(test_CachingKVStore) {
+  auto store = std::make_shared<CountingKVStore>();
+  store->d_entries["powerdns.com"] = "this is the value for powerdns.com";
+  store->d_entries["powerdns.org"] = "this is the value for powerdns.org";
+
+  /* a single shard so that the eviction order is predictable */
+  CachingKVStore cache(store, 3, 3600, 3600, 1);
+
+  std::string value;
+  BOOST_CHECK(cache.getValue("powerdns.com", value));
+  BOOST_CHECK_EQUAL(value, "this is the value for powerdns.com");
+  BOOST_CHECK_EQUAL(store->d_lookups, 1U);
+  BOOST_CHECK_EQUAL(cache.getMisses(), 1U);
+  BOOST_CHECK_EQUAL(cache.getHits(), 0U);
+
+  /* from the cache now, for both kinds of lookups */
+  value.clear();
+  BOOST_CHECK(cache.getValue("powerdns.com", value));
+  BOOST_CHECK_EQUAL(value, "this is the value for powerdns.com");
+  BOOST_CHECK(cache.keyExists("powerdns.com"));
+  BOOST_CHECK_EQUAL(store->d_lookups, 1U);
+  BOOST_CHECK_EQUAL(cache.getHits(), 2U);
+
+  /* negative caching */
+  BOOST_CHECK(!cache.keyExists("not-powerdns.com"));
+  BOOST_CHECK(!cache.getValue("not-powerdns.com", value));
+  BOOST_CHECK_EQUAL(store->d_lookups, 2U);
+  BOOST_CHECK_EQUAL(cache.getEntriesCount(), 2U);
+
+  /* the cache is full after this one */
+  BOOST_CHECK(cache.keyExists("powerdns.org"));
+  BOOST_CHECK_EQUAL(store->d_lookups, 3U);
+  BOOST_CHECK_EQUAL(cache.getEntriesCount(), 3U);
+  /* the value has been cached by keyExists() */
+  BOOST_CHECK(cache.getValue("powerdns.org", value));
+  BOOST_CHECK_EQUAL(value, "this is the value for powerdns.org");
+  BOOST_CHECK_EQUAL(store->d_lookups, 3U);
+
+  /* use powerdns.com so that not-powerdns.com becomes the least recently used entry */
+  BOOST_CHECK(cache.keyExists("powerdns.com"));
+  BOOST_CHECK(!cache.keyExists("powerdns.net"));
+  BOOST_CHECK_EQUAL(store->d_lookups, 4U);
+  BOOST_CHECK_EQUAL(cache.getEntriesCount(), 3U);
+  BOOST_CHECK_EQUAL(cache.getEvictions(), 1U);
+  BOOST_CHECK(cache.keyExists("powerdns.com"));
+  BOOST_CHECK(cache.keyExists("powerdns.org"));
+  BOOST_CHECK_EQUAL(store->d_lookups, 4U);
+  BOOST_CHECK(!cache.keyExists("not-powerdns.com"));
+  BOOST_CHECK_EQUAL(store->d_lookups, 5U);
+
+  /* reloading clears the cache */
+  BOOST_CHECK(cache.reload());
+  BOOST_CHECK_EQUAL(store->d_reloads, 1U);
+  BOOST_CHECK_EQUAL(cache.getEntriesCount(), 0U);
+  BOOST_CHECK(cache.keyExists("powerdns.com"));
+  BOOST_CHECK_EQUAL(store->d_lookups, 6U);
+
+  /* no negative caching */
+  CachingKVStore positiveOnly(store, 10, 3600, 0, 4);
+  BOOST_CHECK(!positiveOnly.keyExists("not-powerdns.com"));
+  BOOST_CHECK(!positiveOnly.keyExists("not-powerdns.com"));
+  BOOST_CHECK_EQUAL(store->d_lookups, 8U);
+  BOOST_CHECK_EQUAL(positiveOnly.getEntriesCount(), 0U);
+
+  /* expired entries */
+  CachingKVStore expired(store, 10, -1, -1, 4);
+  BOOST_CHECK(expired.keyExists("powerdns.com"));
+  BOOST_CHECK(expired.keyExists("powerdns.com"));
+  BOOST_CHECK_EQUAL(store->d_lookups, 10U);
+  BOOST_CHECK_EQUAL(expired.getHits(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(test_CompiledMatchSet_Suffix) {
+  char input[] = "/tmp/test_compiled_suffixes.XXXXXX";
+  {
+    int fd = mkstemp(input);
+    BOOST_REQUIRE(fd >= 0);
+    const std::string content = "# a comment\npowerdns.com.\n  PowerDNS.org  # case-insensitive, with a comment\n\nsub.example.net.\npowerdns.com.\n";
+    BOOST_REQUIRE_EQUAL(write(fd, content.data(), content.size()), static_cast<ssize_t>(content.size()));
+    close(fd);
+  }
+  const std::string output = std::string(input) + ".set";
+
+  BOOST_CHECK_EQUAL(CompiledMatchSet::compile(CompiledMatchSet::Type::Suffix, input, output), 3U);
+
+  CompiledMatchSet set(output, 0);
+  BOOST_CHECK_EQUAL(set.size(), 3U);
+  BOOST_CHECK(set.contains(DNSName("powerdns.com.")));
+  BOOST_CHECK(set.contains(DNSName("www.PowerDNS.com.")));
+  BOOST_CHECK(set.contains(DNSName("a.b.c.powerdns.org.")));
+  BOOST_CHECK(set.contains(DNSName("sub.example.net.")));
+  BOOST_CHECK(set.contains(DNSName("www.sub.example.net.")));
+  BOOST_CHECK(!set.contains(DNSName("example.net.")));
+  BOOST_CHECK(!set.contains(DNSName("other.example.net.")));
+  BOOST_CHECK(!set.contains(DNSName("com.")));
+  BOOST_CHECK(!set.contains(DNSName("not-powerdns.com.")));
+  BOOST_CHECK(!set.contains(DNSName("powerdns.com.net.")));
+  BOOST_CHECK(!set.contains(DNSName(".")));
+  /* not a netmask set */
+  BOOST_CHECK(!set.contains(ComboAddress("192.0.2.1")));
+
+  /* a lot of names, replacing the existing file */
+  std::vector<DNSName> names;
+  for (size_t idx = 0; idx < 10000; idx++) {
+    names.push_back(DNSName("name-" + std::to_string(idx) + ".powerdns.net."));
+  }
+  BOOST_CHECK_EQUAL(CompiledMatchSet::compileSuffixes(names, output), names.size());
+  BOOST_CHECK(set.reload());
+  BOOST_CHECK_EQUAL(set.size(), names.size());
+  for (const auto& name : names) {
+    BOOST_CHECK(set.contains(name));
+    BOOST_CHECK(set.contains(DNSName("sub") + name));
+  }
+  BOOST_CHECK(!set.contains(DNSName("powerdns.com.")));
+  BOOST_CHECK(!set.contains(DNSName("name-10000.powerdns.net.")));
+
+  /* the root matches everything */
+  BOOST_CHECK_EQUAL(CompiledMatchSet::compileSuffixes({ DNSName(".") }, output), 1U);
+  BOOST_CHECK(set.reload());
+  BOOST_CHECK(set.contains(DNSName("powerdns.com.")));
+  BOOST_CHECK(set.contains(DNSName(".")));
+
+  /* an invalid file is not loaded, and the existing set is kept. The file is mapped so it should never be modified in place */
+  {
+    std::ofstream ofs(output + ".invalid", std::ios::trunc);
+    ofs << "this is not a compiled set, not at all";
+  }
+  BOOST_REQUIRE_EQUAL(rename((output + ".invalid").c_str(), output.c_str()), 0);
+  BOOST_CHECK(!set.reload());
+  BOOST_CHECK(set.contains(DNSName("powerdns.com.")));
+  BOOST_CHECK_THROW(CompiledMatchSet(output, 0), std::runtime_error);
+
+  unlink(input);
+  unlink(output.c_str());
+  BOOST_CHECK_THROW(CompiledMatchSet(output, 0), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(test_CompiledMatchSet_Netmask) {
+  char input[] = "/tmp/test_compiled_netmasks.XXXXXX";
+  {
+    int fd = mkstemp(input);
+    BOOST_REQUIRE(fd >= 0);
+    const std::string content = "192.0.2.0/24\n192.0.2.128/25 # overlapping\n198.51.100.42\n10.0.0.0/8\n2001:db8::/32\n2001:db8:1::/48\n::1\n";
+    BOOST_REQUIRE_EQUAL(write(fd, content.data(), content.size()), static_cast<ssize_t>(content.size()));
+    close(fd);
+  }
+  const std::string output = std::string(input) + ".set";
+
+  /* the overlapping ranges are merged */
+  BOOST_CHECK_EQUAL(CompiledMatchSet::compile(CompiledMatchSet::Type::Netmask, input, output), 5U);
+
+  CompiledMatchSet set(output, 0);
+  BOOST_CHECK_EQUAL(set.size(), 5U);
+  BOOST_CHECK(set.contains(ComboAddress("192.0.2.0")));
+  BOOST_CHECK(set.contains(ComboAddress("192.0.2.1:53")));
+  BOOST_CHECK(set.contains(ComboAddress("192.0.2.255")));
+  BOOST_CHECK(!set.contains(ComboAddress("192.0.3.0")));
+  BOOST_CHECK(!set.contains(ComboAddress("192.0.1.255")));
+  BOOST_CHECK(set.contains(ComboAddress("198.51.100.42")));
+  BOOST_CHECK(!set.contains(ComboAddress("198.51.100.43")));
+  BOOST_CHECK(!set.contains(ComboAddress("198.51.100.41")));
+  BOOST_CHECK(set.contains(ComboAddress("10.255.255.255")));
+  BOOST_CHECK(!set.contains(ComboAddress("0.0.0.0")));
+  BOOST_CHECK(!set.contains(ComboAddress("255.255.255.255")));
+  BOOST_CHECK(set.contains(ComboAddress("2001:db8::1")));
+  BOOST_CHECK(set.contains(ComboAddress("2001:db8:ffff:ffff:ffff:ffff:ffff:ffff")));
+  BOOST_CHECK(!set.contains(ComboAddress("2001:db9::")));
+  BOOST_CHECK(set.contains(ComboAddress("::1")));
+  BOOST_CHECK(!set.contains(ComboAddress("::2")));
+  BOOST_CHECK(!set.contains(ComboAddress("::")));
+  /* not a suffix set */
+  BOOST_CHECK(!set.contains(DNSName("powerdns.com.")));
+
+  /* invalid netmask */
+  {
+    std::ofstream ofs(input, std::ios::trunc);
+    ofs << "192.0.2.0/24\nnot a netmask\n";
+  }
+  BOOST_CHECK_THROW(CompiledMatchSet::compile(CompiledMatchSet::Type::Netmask, input, output), std::runtime_error);
+  /* the existing file has not been touched */
+  BOOST_CHECK(set.reload());
+  BOOST_CHECK_EQUAL(set.size(), 5U);
+
+  unlink(input);
+  unlink(output.c_str());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
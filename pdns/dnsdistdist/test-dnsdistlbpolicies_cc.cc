@@ -327,6 +327,87 @@ BOOST_AUTO_TEST_CASE(test_leastOutstanding) {
   benchPolicy(pol);
 }
 
+BOOST_AUTO_TEST_CASE(test_p2c) {
+  auto dq = getDQ();
+
+  ServerPolicy pol{"p2c", p2c, false};
+  ServerPolicy::NumberedServerVector servers;
+  servers.push_back({ 1, std::make_shared<DownstreamState>(ComboAddress("192.0.2.1:53")) });
+
+  /* servers start as 'down' */
+  auto server = pol.getSelectedBackend(servers, dq);
+  BOOST_CHECK(server == nullptr);
+
+  /* mark the server as 'up' */
+  servers.at(0).second->setUp();
+  server = pol.getSelectedBackend(servers, dq);
+  BOOST_CHECK(server == servers.at(0).second);
+
+  /* add a second server, 'down', we should always get the first one */
+  servers.push_back({ 2, std::make_shared<DownstreamState>(ComboAddress("192.0.2.2:53")) });
+  for (size_t idx = 0; idx < 100; idx++) {
+    server = pol.getSelectedBackend(servers, dq);
+    BOOST_REQUIRE(server != nullptr);
+    BOOST_CHECK(server == servers.at(0).second);
+  }
+
+  /* both 'up', the first one has more queries in the air */
+  servers.at(1).second->setUp();
+  servers.at(0).second->outstanding = 42;
+  for (size_t idx = 0; idx < 100; idx++) {
+    server = pol.getSelectedBackend(servers, dq);
+    BOOST_CHECK(server == servers.at(1).second);
+  }
+
+  /* same number of queries in the air, but the second one is much slower */
+  servers.at(0).second->outstanding = 10;
+  servers.at(1).second->outstanding = 10;
+  servers.at(0).second->latencyUsec = 1000;
+  servers.at(1).second->latencyUsec = 50000;
+  for (size_t idx = 0; idx < 100; idx++) {
+    server = pol.getSelectedBackend(servers, dq);
+    BOOST_CHECK(server == servers.at(0).second);
+  }
+
+  /* with a lot of servers, the slowest one should never be picked, and the load spread over the others */
+  servers.clear();
+  std::map<std::shared_ptr<DownstreamState>, uint64_t> serversMap;
+  for (size_t idx = 1; idx <= 10; idx++) {
+    servers.push_back({ idx, std::make_shared<DownstreamState>(ComboAddress("192.0.2." + std::to_string(idx) + ":53")) });
+    servers.at(idx - 1).second->setUp();
+    servers.at(idx - 1).second->latencyUsec = 1000;
+    serversMap[servers.at(idx - 1).second] = 0;
+  }
+  auto slowest = servers.at(3).second;
+  slowest->latencyUsec = 100000000;
+
+  const size_t queries = 10000;
+  for (size_t idx = 0; idx < queries; idx++) {
+    server = pol.getSelectedBackend(servers, dq);
+    BOOST_REQUIRE(serversMap.count(server) == 1);
+    ++serversMap[server];
+    /* pretend the query is now in the air */
+    ++server->outstanding;
+  }
+
+  BOOST_CHECK_EQUAL(serversMap[slowest], 0U);
+  for (const auto& entry : serversMap) {
+    if (entry.first != slowest) {
+      BOOST_CHECK_GT(entry.second, queries / (servers.size() - 1) / 2);
+      BOOST_CHECK_LT(entry.second, queries / (servers.size() - 1) * 2);
+    }
+  }
+
+  /* all servers are 'down' */
+  for (auto& entry : servers) {
+    entry.second->setDown();
+  }
+  server = pol.getSelectedBackend(servers, dq);
+  BOOST_CHECK(server == nullptr);
+
+  benchPolicy(pol);
+}
+
 BOOST_AUTO_TEST_CASE(test_wrandom) {
   auto dq = getDQ();
 
@@ -554,6 +635,234 @@ BOOST_AUTO_TEST_CASE(test_chashed) {
   g_verbose = existingVerboseValue;
 }
 
+BOOST_AUTO_TEST_CASE(test_maglev) {
+  std::vector<DNSName> names;
+  names.reserve(1000);
+  for (size_t idx = 0; idx < 1000; idx++) {
+    names.push_back(DNSName("powerdns-" + std::to_string(idx) + ".com."));
+  }
+
+  ServerPolicy pol{"maglev", maglevFromTable, maglev};
+  ServerPool pool;
+  std::map<std::shared_ptr<DownstreamState>, uint64_t> serversMap;
+  for (size_t idx = 1; idx <= 10; idx++) {
+    auto server = std::make_shared<DownstreamState>(ComboAddress("192.0.2." + std::to_string(idx) + ":53"));
+    server->setUp();
+    pool.addServer(server);
+    serversMap[server] = 0;
+  }
+  const auto servers = pool.getServers();
+
+  benchPolicy(pol);
+
+  /* unlike chashed, the default weight is enough to get a good distribution */
+  std::vector<std::shared_ptr<DownstreamState>> selected;
+  for (const auto& name : names) {
+    auto dq = getDQ(&name);
+    auto server = pol.getSelectedBackend(pool, dq);
+    BOOST_REQUIRE(serversMap.count(server) == 1);
+    ++serversMap[server];
+    selected.push_back(server);
+  }
+
+  /* the same selection is made without the table of the pool, which has to be built every time */
+  for (size_t idx = 0; idx < 10; idx++) {
+    auto dq = getDQ(&names.at(idx));
+    BOOST_CHECK(pol.getSelectedBackend(*servers, dq) == selected.at(idx));
+  }
+
+  uint64_t total = 0;
+  for (const auto& entry : serversMap) {
+    BOOST_CHECK_GT(entry.second, (names.size() / servers->size() / 2));
+    BOOST_CHECK_LT(entry.second, (names.size() / servers->size() * 2));
+    total += entry.second;
+  }
+  BOOST_CHECK_EQUAL(total, names.size());
+
+  /* request 1000 times the same name, we should go to the same server every time */
+  {
+    auto dq = getDQ(&names.at(0));
+    auto server = pol.getSelectedBackend(pool, dq);
+    for (size_t idx = 0; idx < 1000; idx++) {
+      BOOST_CHECK(pol.getSelectedBackend(pool, dq) == server);
+    }
+  }
+
+  /* a server is down, only the queries it was getting should move */
+  auto removed = servers->at(4).second;
+  removed->setDown();
+  for (size_t idx = 0; idx < names.size(); idx++) {
+    auto dq = getDQ(&names.at(idx));
+    auto server = pol.getSelectedBackend(pool, dq);
+    BOOST_REQUIRE(server != nullptr);
+    BOOST_CHECK(server != removed);
+    if (selected.at(idx) != removed) {
+      BOOST_CHECK(server == selected.at(idx));
+    }
+  }
+  removed->setUp();
+
+  /* the server is removed from the pool, the table is rebuilt and only a small part of the queries
+     that were not going to that server should move */
+  pool.removeServer(removed);
+  {
+    size_t kept = 0;
+    size_t expected = 0;
+    for (size_t idx = 0; idx < names.size(); idx++) {
+      auto dq = getDQ(&names.at(idx));
+      auto server = pol.getSelectedBackend(pool, dq);
+      BOOST_REQUIRE(server != nullptr);
+      BOOST_CHECK(server != removed);
+      if (selected.at(idx) != removed) {
+        expected++;
+        if (server == selected.at(idx)) {
+          kept++;
+        }
+      }
+    }
+    BOOST_CHECK_GT(kept, expected * 9 / 10);
+  }
+
+  /* change the weight of the last server to 10, others stay at 1 */
+  serversMap.erase(removed);
+  for (auto& entry : serversMap) {
+    entry.second = 0;
+  }
+  auto last = servers->at(servers->size()-1).second;
+  last->setWeight(10);
+  pool.serverChanged(*last);
+
+  for (const auto& name : names) {
+    auto dq = getDQ(&name);
+    auto server = pol.getSelectedBackend(pool, dq);
+    BOOST_REQUIRE(serversMap.count(server) == 1);
+    ++serversMap[server];
+  }
+
+  total = 0;
+  uint64_t totalW = 0;
+  for (const auto& entry : serversMap) {
+    total += entry.second;
+    totalW += entry.first->weight;
+  }
+  BOOST_CHECK_EQUAL(total, names.size());
+  const auto got = serversMap[last];
+  float expected = (names.size() * 1.0 * last->weight) / totalW;
+  BOOST_CHECK_GT(got, expected / 2);
+  BOOST_CHECK_LT(got, expected * 2);
+
+  /* every server is down */
+  for (auto& entry : *servers) {
+    entry.second->setDown();
+  }
+  auto dq = getDQ(&names.at(0));
+  BOOST_CHECK(pol.getSelectedBackend(pool, dq) == nullptr);
+}
+
+BOOST_AUTO_TEST_CASE(test_maglevTable) {
+  ServerPool pool;
+  ServerPool otherPool;
+  std::vector<std::shared_ptr<DownstreamState>> servers;
+  for (size_t idx = 1; idx <= 3; idx++) {
+    servers.push_back(std::make_shared<DownstreamState>(ComboAddress("192.0.2." + std::to_string(idx) + ":53")));
+    pool.addServer(servers.back());
+  }
+  otherPool.addServer(servers.at(0));
+
+  /* the table is built once, then shared until the servers of the pool change */
+  auto table = pool.getMaglevTable();
+  BOOST_REQUIRE(table != nullptr);
+  BOOST_CHECK_EQUAL(table->getServers().size(), 3U);
+  BOOST_CHECK(pool.getMaglevTable() == table);
+  auto otherTable = otherPool.getMaglevTable();
+  BOOST_CHECK_EQUAL(otherTable->getServers().size(), 1U);
+
+  pool.removeServer(servers.at(2));
+  auto newTable = pool.getMaglevTable();
+  BOOST_CHECK(newTable != table);
+  BOOST_CHECK_EQUAL(newTable->getServers().size(), 2U);
+  BOOST_CHECK(pool.getMaglevTable() == newTable);
+  /* the old table is still usable by the threads holding it */
+  BOOST_CHECK_EQUAL(table->getServers().size(), 3U);
+  /* and the other pool is not affected */
+  BOOST_CHECK(otherPool.getMaglevTable() == otherTable);
+
+  /* a change to a server rebuilds the tables of the pools it belongs to */
+  table = newTable;
+  servers.at(1)->setWeight(2);
+  pool.serverChanged(*servers.at(1));
+  otherPool.serverChanged(*servers.at(1));
+  newTable = pool.getMaglevTable();
+  BOOST_CHECK(newTable != table);
+  BOOST_CHECK(newTable->getGeneration() > table->getGeneration());
+  BOOST_CHECK(otherPool.getMaglevTable() == otherTable);
+
+  pool.addServer(servers.at(2));
+  BOOST_CHECK(pool.getMaglevTable() != newTable);
+  BOOST_CHECK_EQUAL(pool.getMaglevTable()->getServers().size(), 3U);
+}
+
+BOOST_AUTO_TEST_CASE(test_maglevBoundedLoad) {
+  std::vector<DNSName> names;
+  names.reserve(1000);
+  for (size_t idx = 0; idx < 1000; idx++) {
+    names.push_back(DNSName("powerdns-" + std::to_string(idx) + ".com."));
+  }
+
+  ServerPolicy pol{"maglevBoundedLoad", maglevBoundedLoadFromTable, maglevBoundedLoad};
+  ServerPolicy plain{"maglev", maglevFromTable, maglev};
+  ServerPool pool;
+  for (size_t idx = 1; idx <= 10; idx++) {
+    auto server = std::make_shared<DownstreamState>(ComboAddress("192.0.2." + std::to_string(idx) + ":53"));
+    server->setUp();
+    pool.addServer(server);
+  }
+  const auto servers = pool.getServers();
+
+  benchPolicy(pol);
+
+  /* no load, same selection as maglev */
+  for (const auto& name : names) {
+    auto dq = getDQ(&name);
+    BOOST_CHECK(pol.getSelectedBackend(pool, dq) == plain.getSelectedBackend(pool, dq));
+  }
+
+  /* the server selected for the first name is now overloaded */
+  auto dq = getDQ(&names.at(0));
+  auto overloaded = pol.getSelectedBackend(pool, dq);
+  BOOST_REQUIRE(overloaded != nullptr);
+  overloaded->outstanding = 1000;
+
+  for (const auto& name : names) {
+    auto namedq = getDQ(&name);
+    auto server = pol.getSelectedBackend(pool, namedq);
+    auto sticky = plain.getSelectedBackend(pool, namedq);
+    BOOST_REQUIRE(server != nullptr);
+    BOOST_CHECK(server != overloaded);
+    /* the queries for the other servers do not move */
+    if (sticky != overloaded) {
+      BOOST_CHECK(server == sticky);
+    }
+  }
+  /* the same selection is made without the table of the pool */
+  BOOST_CHECK(pol.getSelectedBackend(*servers, dq) == pol.getSelectedBackend(pool, dq));
+
+  /* a higher factor allows more imbalance */
+  const auto existingFactor = g_maglevBalancingFactor;
+  g_maglevBalancingFactor = 100;
+  BOOST_CHECK(pol.getSelectedBackend(pool, dq) == overloaded);
+  g_maglevBalancingFactor = existingFactor;
+
+  overloaded->outstanding = 0;
+  BOOST_CHECK(pol.getSelectedBackend(pool, dq) == overloaded);
+
+  /* every server is down */
+  for (auto& entry : *servers) {
+    entry.second->setDown();
+  }
+  BOOST_CHECK(pol.getSelectedBackend(pool, dq) == nullptr);
+}
+
 BOOST_AUTO_TEST_CASE(test_lua) {
   std::vector<DNSName> names;
   names.reserve(1000);
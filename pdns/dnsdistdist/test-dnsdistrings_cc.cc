@@ -273,4 +273,204 @@ BOOST_AUTO_TEST_CASE(test_Rings_Threaded) {
 #endif
 }
 
+BOOST_AUTO_TEST_CASE(test_Rings_PerThread) {
+  const size_t maxEntries = 100;
+  Rings rings(maxEntries, 1);
+  rings.setPerThreadRings(true);
+  BOOST_CHECK(rings.isPerThread());
+  BOOST_CHECK_EQUAL(rings.getNumberOfQueryEntries(), 0U);
+  BOOST_CHECK_EQUAL(rings.getNumberOfResponseEntries(), 0U);
+
+  dnsheader dh;
+  memset(&dh, 0, sizeof(dh));
+  dh.rcode = RCode::NXDomain;
+  DNSName qname("rings.powerdns.com.");
+  ComboAddress requestor1("192.0.2.1");
+  ComboAddress requestor2("2001:db8::2");
+  ComboAddress server("192.0.2.42:53");
+  uint16_t qtype = QType::AAAA;
+  uint16_t size = 42;
+  unsigned int latency = 100;
+  struct timespec now;
+  gettime(&now);
+
+  for (size_t idx = 0; idx < maxEntries; idx++) {
+    rings.insertQuery(now, requestor1, qname, qtype, size, dh);
+    rings.insertResponse(now, requestor1, qname, qtype, latency, size, dh, server);
+  }
+  BOOST_CHECK_EQUAL(rings.getNumberOfQueryEntries(), maxEntries);
+  BOOST_CHECK_EQUAL(rings.getNumberOfResponseEntries(), maxEntries);
+
+  /* push enough entries to get rid of the existing ones */
+  for (size_t idx = 0; idx < maxEntries; idx++) {
+    rings.insertQuery(now, requestor2, qname, qtype, size, dh);
+    rings.insertResponse(now, requestor2, qname, qtype, latency, size, dh, server);
+  }
+  BOOST_CHECK_EQUAL(rings.getNumberOfQueryEntries(), maxEntries);
+  BOOST_CHECK_EQUAL(rings.getNumberOfResponseEntries(), maxEntries);
+
+  size_t numberOfQueries = 0;
+  rings.forEachQuery([&](const Rings::Query& entry) {
+    BOOST_CHECK_EQUAL(entry.name, qname);
+    BOOST_CHECK_EQUAL(entry.qtype, qtype);
+    BOOST_CHECK_EQUAL(entry.size, size);
+    BOOST_CHECK_EQUAL(entry.when.tv_sec, now.tv_sec);
+    BOOST_CHECK_EQUAL(entry.when.tv_nsec, now.tv_nsec);
+    BOOST_CHECK_EQUAL(entry.requestor.toStringWithPort(), requestor2.toStringWithPort());
+    BOOST_CHECK_EQUAL(entry.dh.rcode, RCode::NXDomain);
+    numberOfQueries++;
+  });
+  BOOST_CHECK_EQUAL(numberOfQueries, maxEntries);
+
+  size_t numberOfResponses = 0;
+  rings.forEachResponse([&](const Rings::Response& entry) {
+    BOOST_CHECK_EQUAL(entry.name, qname);
+    BOOST_CHECK_EQUAL(entry.qtype, qtype);
+    BOOST_CHECK_EQUAL(entry.size, size);
+    BOOST_CHECK_EQUAL(entry.usec, latency);
+    BOOST_CHECK_EQUAL(entry.requestor.toStringWithPort(), requestor2.toStringWithPort());
+    BOOST_CHECK_EQUAL(entry.ds.toStringWithPort(), server.toStringWithPort());
+    numberOfResponses++;
+  });
+  BOOST_CHECK_EQUAL(numberOfResponses, maxEntries);
+
+  /* names that do not fit are stored as their longest suffix that does */
+  rings.clear();
+  BOOST_CHECK_EQUAL(rings.getNumberOfQueryEntries(), 0U);
+  DNSName longName("this-is-a-pretty-long-label.and-this-is-another-one.rings.powerdns.com.");
+  BOOST_REQUIRE_GT(longName.wirelength(), Rings::s_inlineQNameSize);
+  rings.insertQuery(now, requestor1, longName, qtype, size, dh);
+  rings.insertQuery(now, requestor1, DNSName("."), qtype, size, dh);
+  std::vector<DNSName> names;
+  rings.forEachQuery([&names](const Rings::Query& entry) {
+    names.push_back(entry.name);
+  });
+  BOOST_REQUIRE_EQUAL(names.size(), 2U);
+  BOOST_CHECK_EQUAL(names.at(0), DNSName("and-this-is-another-one.rings.powerdns.com."));
+  BOOST_CHECK(longName.isPartOf(names.at(0)));
+  BOOST_CHECK(names.at(1).isRoot());
+}
+
+static void perThreadRingReaderThread(Rings& rings, std::atomic<bool>& done, size_t maxEntries, const DNSName& qname)
+{
+  size_t iterationsDone = 0;
+
+  while (done == false) {
+    size_t numberOfQueries = 0;
+    size_t numberOfResponses = 0;
+    bool valid = true;
+
+    rings.forEachQuery([&](const Rings::Query& c) {
+      numberOfQueries++;
+      // BOOST_CHECK* is slow as hell..
+      if (c.name != qname) {
+        valid = false;
+      }
+    });
+    rings.forEachResponse([&](const Rings::Response& c) {
+      numberOfResponses++;
+      if (c.name != qname) {
+        valid = false;
+      }
+    });
+
+    if (!valid) {
+      cerr<<"Invalid entry read from the per-thread rings!"<<endl;
+      return;
+    }
+
+    BOOST_CHECK_LE(numberOfQueries, maxEntries);
+    BOOST_CHECK_LE(numberOfResponses, maxEntries);
+    iterationsDone++;
+    usleep(10000);
+  }
+
+  BOOST_CHECK_GT(iterationsDone, 1U);
+}
+
+BOOST_AUTO_TEST_CASE(test_Rings_PerThread_Threaded) {
+  size_t numberOfEntries = 100000;
+  size_t numberOfShards = 10;
+  size_t numberOfWriterThreads = 4;
+  size_t entriesPerThread = numberOfEntries / numberOfShards;
+
+  struct timespec now;
+  gettime(&now);
+  dnsheader dh;
+  memset(&dh, 0, sizeof(dh));
+  DNSName qname("rings.powerdns.com.");
+  ComboAddress requestor("192.0.2.1");
+  ComboAddress server("192.0.2.42");
+  unsigned int latency = 100;
+  uint16_t qtype = QType::AAAA;
+  uint16_t size = 42;
+
+  Rings rings(numberOfEntries, numberOfShards);
+  rings.setPerThreadRings(true);
+  Rings::Query query({now, requestor, qname, size, qtype, dh});
+  Rings::Response response({now, requestor, qname, qtype, latency, size, dh, server});
+
+  std::atomic<bool> done(false);
+  std::vector<std::thread> writerThreads;
+  std::thread readerThread(perThreadRingReaderThread, std::ref(rings), std::ref(done), entriesPerThread * numberOfWriterThreads, std::cref(qname));
+
+  for (size_t idx = 0; idx < numberOfWriterThreads; idx++) {
+    writerThreads.push_back(std::thread(ringWriterThread, std::ref(rings), 100 * entriesPerThread, query, response));
+  }
+
+  for (auto& t : writerThreads) {
+    t.join();
+  }
+
+  done = true;
+  readerThread.join();
+
+  /* every writer got its own rings, which should now be full */
+  BOOST_CHECK_EQUAL(rings.getNumberOfQueryEntries(), entriesPerThread * numberOfWriterThreads);
+  BOOST_CHECK_EQUAL(rings.getNumberOfResponseEntries(), entriesPerThread * numberOfWriterThreads);
+
+  size_t totalQueries = 0;
+  rings.forEachQuery([&](const Rings::Query& entry) {
+    BOOST_CHECK_EQUAL(entry.qtype, qtype);
+    totalQueries++;
+  });
+  BOOST_CHECK_EQUAL(totalQueries, entriesPerThread * numberOfWriterThreads);
+}
+
+BOOST_AUTO_TEST_CASE(test_Rings_PerThread_Capacity) {
+  const size_t maxEntries = 100;
+  const size_t numberOfShards = 2;
+  Rings rings(maxEntries, numberOfShards);
+  rings.setPerThreadRings(true);
+
+  struct timespec now;
+  gettime(&now);
+  dnsheader dh;
+  memset(&dh, 0, sizeof(dh));
+  DNSName qname("rings.powerdns.com.");
+  ComboAddress requestor("192.0.2.1");
+  ComboAddress server("192.0.2.42");
+  Rings::Query query({now, requestor, qname, 42, QType::A, dh});
+  Rings::Response response({now, requestor, qname, QType::A, 100, 42, dh, server});
+
+  /* the first two threads get half of the capacity each, then the whole capacity has been
+     handed out so the third one only gets a single entry. The threads are running at the
+     same time since the shard of an exited thread might be reused by a new one getting the same id */
+  std::vector<std::thread> writerThreads;
+  for (size_t idx = 0; idx < numberOfShards + 1; idx++) {
+    writerThreads.push_back(std::thread(ringWriterThread, std::ref(rings), maxEntries, query, response));
+  }
+  for (auto& t : writerThreads) {
+    t.join();
+  }
+  BOOST_CHECK_EQUAL(rings.getNumberOfQueryEntries(), maxEntries + 1);
+  BOOST_CHECK_EQUAL(rings.getNumberOfResponseEntries(), maxEntries + 1);
+
+  /* and clearing the rings makes the whole capacity available again */
+  rings.clear();
+  std::thread another(ringWriterThread, std::ref(rings), maxEntries, query, response);
+  another.join();
+  BOOST_CHECK_EQUAL(rings.getNumberOfQueryEntries(), maxEntries / numberOfShards);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
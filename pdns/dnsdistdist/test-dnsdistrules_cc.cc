@@ -101,5 +101,200 @@ BOOST_AUTO_TEST_CASE(test_MaxQPSIPRule) {
   BOOST_CHECK_EQUAL(scanned, 0U);
 }
 
+struct TestRuleAction
+{
+  std::shared_ptr<DNSRule> d_rule;
+};
+
+static std::vector<TestRuleAction> getTestRuleChain()
+{
+  SuffixMatchNode smn;
+  smn.add(DNSName("powerdns.com."));
+  smn.add(DNSName("sub.powerdns.com."));
+  SuffixMatchNode other;
+  other.add(DNSName("a.sub.powerdns.com."));
+  DNSNameSet names;
+  names.insert(DNSName("example.org."));
+  names.insert(DNSName("www.powerdns.com."));
+
+  std::vector<TestRuleAction> rules;
+  rules.push_back({std::make_shared<QTypeRule>(QType::A)});
+  rules.push_back({std::make_shared<AllRule>()});
+  rules.push_back({std::make_shared<QTypeRule>(QType::AAAA)});
+  rules.push_back({std::make_shared<QClassRule>(QClass::CHAOS)});
+  rules.push_back({std::make_shared<OpcodeRule>(Opcode::Update)});
+  rules.push_back({std::make_shared<DSTPortRule>(5300)});
+  rules.push_back({std::make_shared<SNIRule>("dot.powerdns.com")});
+  rules.push_back({std::make_shared<SuffixMatchNodeRule>(smn)});
+  rules.push_back({std::make_shared<QNameRule>(DNSName("www.powerdns.com."))});
+  rules.push_back({std::make_shared<QNameSetRule>(names)});
+  rules.push_back({std::make_shared<SuffixMatchNodeRule>(other)});
+  /* the most selective discriminator should be used */
+  rules.push_back({std::make_shared<AndRule>(std::vector<std::pair<int, std::shared_ptr<DNSRule>>>{{1, std::make_shared<QTypeRule>(QType::TXT)}, {2, std::make_shared<QNameRule>(DNSName("powerdns.com."))}, {3, std::make_shared<TCPRule>(true)}})});
+  /* no discriminator before the first rule that might have side effects */
+  rules.push_back({std::make_shared<AndRule>(std::vector<std::pair<int, std::shared_ptr<DNSRule>>>{{1, std::make_shared<RDRule>()}, {2, std::make_shared<QTypeRule>(QType::TXT)}})});
+  rules.push_back({std::make_shared<OrRule>(std::vector<std::pair<int, std::shared_ptr<DNSRule>>>{{1, std::make_shared<QTypeRule>(QType::A)}, {2, std::make_shared<QTypeRule>(QType::MX)}})});
+  /* different types, no discriminator */
+  rules.push_back({std::make_shared<OrRule>(std::vector<std::pair<int, std::shared_ptr<DNSRule>>>{{1, std::make_shared<QTypeRule>(QType::MX)}, {2, std::make_shared<QNameRule>(DNSName("example.org."))}})});
+  std::shared_ptr<DNSRule> notA = std::make_shared<QTypeRule>(QType::A);
+  rules.push_back({std::make_shared<NotRule>(notA)});
+  rules.push_back({std::make_shared<QTypeRule>(QType::A)});
+  return rules;
+}
+
+BOOST_AUTO_TEST_CASE(test_CompiledRuleChain) {
+  const auto rules = getTestRuleChain();
+  CompiledRuleChain<TestRuleAction> chain;
+  chain.update(rules);
+  /* AllRule, the AndRule starting with RDRule, the mixed OrRule and NotRule */
+  BOOST_CHECK_EQUAL(chain.getAlwaysEvaluatedCount(), 4U);
+
+  const std::vector<DNSName> qnames{DNSName("powerdns.com."), DNSName("www.powerdns.com."), DNSName("WWW.PowerDNS.com."), DNSName("sub.powerdns.com."), DNSName("a.sub.powerdns.com."), DNSName("b.a.sub.powerdns.com."), DNSName("example.org."), DNSName("www.example.org."), g_rootdnsname};
+  const std::vector<uint16_t> qtypes{QType::A, QType::AAAA, QType::MX, QType::TXT};
+  const std::vector<uint16_t> qclasses{QClass::IN, QClass::CHAOS};
+  const std::vector<ComboAddress> locals{ComboAddress("127.0.0.1:53"), ComboAddress("[::1]:5300")};
+  const std::vector<std::string> snis{"", "dot.powerdns.com"};
+  const std::vector<uint8_t> opcodes{Opcode::Query, Opcode::Update};
+  ComboAddress rem("192.0.2.1:42");
+  struct timespec queryRealTime;
+  gettime(&queryRealTime, true);
+
+  size_t evaluated = 0;
+  size_t total = 0;
+  for (const auto& qname : qnames) {
+    for (const auto qtype : qtypes) {
+      for (const auto qclass : qclasses) {
+        for (const auto& local : locals) {
+          for (const auto& sni : snis) {
+            for (const auto opcode : opcodes) {
+              for (const bool isTcp : {false, true}) {
+                PacketBuffer packet(sizeof(dnsheader));
+                auto dh = reinterpret_cast<dnsheader*>(packet.data());
+                dh->opcode = opcode;
+                dh->rd = 1;
+                DNSQuestion dq(&qname, qtype, qclass, &local, &rem, packet, isTcp, &queryRealTime);
+                dq.sni = sni;
+
+                std::vector<size_t> expected;
+                for (size_t idx = 0; idx < rules.size(); idx++) {
+                  if (rules.at(idx).d_rule->matches(&dq)) {
+                    expected.push_back(idx);
+                  }
+                }
+
+                std::vector<size_t> got;
+                chain.forEachCandidate(dq, [&](const TestRuleAction& rule) {
+                  evaluated++;
+                  if (rule.d_rule->matches(&dq)) {
+                    got.push_back(&rule - rules.data());
+                  }
+                  return false;
+                });
+                total += rules.size();
+
+                BOOST_CHECK(got == expected);
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+
+  /* a lot of these queries are built to match as many rules as possible,
+     but we should still have skipped a fair share of them */
+  BOOST_CHECK_LT(evaluated, total * 3 / 5);
+
+  /* stop as soon as the visitor asks to */
+  const DNSName qname("www.powerdns.com.");
+  const ComboAddress local("127.0.0.1:53");
+  PacketBuffer packet(sizeof(dnsheader));
+  DNSQuestion dq(&qname, QType::A, QClass::IN, &local, &rem, packet, false, &queryRealTime);
+  size_t visited = 0;
+  chain.forEachCandidate(dq, [&](const TestRuleAction& rule) {
+    visited++;
+    return visited == 2;
+  });
+  BOOST_CHECK_EQUAL(visited, 2U);
+
+  /* a new chain gets compiled, a small one is scanned linearly */
+  std::vector<TestRuleAction> small{{std::make_shared<QTypeRule>(QType::AAAA)}, {std::make_shared<QTypeRule>(QType::A)}};
+  chain.update(small);
+  BOOST_CHECK_EQUAL(chain.getAlwaysEvaluatedCount(), small.size());
+  visited = 0;
+  chain.forEachCandidate(dq, [&](const TestRuleAction& rule) {
+    visited++;
+    return rule.d_rule->matches(&dq);
+  });
+  BOOST_CHECK_EQUAL(visited, 2U);
+}
+
+BOOST_AUTO_TEST_CASE(test_CompiledRuleChain_Bench) {
+#if BENCH_RULES
+  /* a large set of rules, mostly blocking specific names and types,
+     like the ones generated from a threat feed */
+  std::vector<TestRuleAction> rules;
+  for (size_t idx = 0; idx < 1000; idx++) {
+    SuffixMatchNode smn;
+    smn.add(DNSName("blocked-" + std::to_string(idx) + ".powerdns.com."));
+    rules.push_back({std::make_shared<SuffixMatchNodeRule>(smn)});
+  }
+  for (size_t idx = 0; idx < 1000; idx++) {
+    rules.push_back({std::make_shared<QNameRule>(DNSName("exact-" + std::to_string(idx) + ".powerdns.com."))});
+  }
+  for (const auto qtype : {QType::ANY, QType::AXFR, QType::IXFR, QType::HINFO, QType::RRSIG}) {
+    rules.push_back({std::make_shared<QTypeRule>(qtype)});
+  }
+  rules.push_back({std::make_shared<OpcodeRule>(Opcode::Notify)});
+  rules.push_back({std::make_shared<QClassRule>(QClass::CHAOS)});
+
+  std::vector<DNSName> names;
+  names.reserve(1000);
+  for (size_t idx = 0; idx < 1000; idx++) {
+    names.push_back(DNSName("name-" + std::to_string(idx) + ".blocked-" + std::to_string(idx) + ".powerdns.com."));
+  }
+
+  const ComboAddress local("127.0.0.1:53");
+  const ComboAddress rem("192.0.2.1:42");
+  PacketBuffer packet(sizeof(dnsheader));
+  struct timespec queryRealTime;
+  gettime(&queryRealTime, true);
+
+  size_t matches = 0;
+  StopWatch sw;
+  sw.start();
+  for (size_t idx = 0; idx < 100; idx++) {
+    for (const auto& name : names) {
+      DNSQuestion dq(&name, QType::A, QClass::IN, &local, &rem, packet, false, &queryRealTime);
+      for (const auto& rule : rules) {
+        if (rule.d_rule->matches(&dq)) {
+          matches++;
+        }
+      }
+    }
+  }
+  cerr<<"linear evaluation of "<<rules.size()<<" rules took "<<std::to_string(sw.udiff())<<" us for "<<(100 * names.size())<<" queries, "<<matches<<" matches"<<endl;
+
+  CompiledRuleChain<TestRuleAction> chain;
+  sw.start();
+  chain.update(rules);
+  cerr<<"compiling "<<rules.size()<<" rules took "<<std::to_string(sw.udiff())<<" us"<<endl;
+
+  matches = 0;
+  sw.start();
+  for (size_t idx = 0; idx < 100; idx++) {
+    for (const auto& name : names) {
+      DNSQuestion dq(&name, QType::A, QClass::IN, &local, &rem, packet, false, &queryRealTime);
+      chain.forEachCandidate(dq, [&](const TestRuleAction& rule) {
+        if (rule.d_rule->matches(&dq)) {
+          matches++;
+        }
+        return false;
+      });
+    }
+  }
+  cerr<<"compiled evaluation of "<<rules.size()<<" rules took "<<std::to_string(sw.udiff())<<" us for "<<(100 * names.size())<<" queries, "<<matches<<" matches"<<endl;
+#endif /* BENCH_RULES */
+}
 
 BOOST_AUTO_TEST_SUITE_END()
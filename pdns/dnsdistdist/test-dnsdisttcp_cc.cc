@@ -22,6 +22,7 @@
 #define BOOST_TEST_DYN_LINK
 #define BOOST_TEST_NO_MAIN
 
+#include <thread>
 #include <boost/test/unit_test.hpp>
 
 #include "dnswriter.hh"
@@ -1610,6 +1611,108 @@ BOOST_AUTO_TEST_CASE(test_IncomingConnection_BackendNoOOOR)
 
 }
 
+BOOST_AUTO_TEST_CASE(test_IncomingConnection_BackendConnectionsReuse)
+{
+  ComboAddress local("192.0.2.1:80");
+  ClientState localCS(local, true, false, false, "", {});
+  auto tlsCtx = std::make_shared<MockupTLSCtx>();
+  localCS.tlsFrontend = std::make_shared<TLSFrontend>(tlsCtx);
+
+  struct timeval now;
+  gettimeofday(&now, nullptr);
+
+  PacketBuffer query;
+  GenericDNSPacketWriter<PacketBuffer> pwQ(query, DNSName("powerdns.com."), QType::A, QClass::IN, 0);
+  pwQ.getHeader()->rd = 1;
+
+  uint16_t querySize = static_cast<uint16_t>(query.size());
+  const uint8_t sizeBytes[] = { static_cast<uint8_t>(querySize / 256), static_cast<uint8_t>(querySize % 256) };
+  query.insert(query.begin(), sizeBytes, sizeBytes + 2);
+
+  auto backend = std::make_shared<DownstreamState>(ComboAddress("192.0.2.42:53"), ComboAddress("0.0.0.0:0"), 0, std::string(), 1, false);
+  backend->d_tlsCtx = tlsCtx;
+
+  s_processQuery = [backend](DNSQuestion& dq, ClientState& cs, LocalHolders& holders, std::shared_ptr<DownstreamState>& selectedBackend) -> ProcessQueryResult {
+    selectedBackend = backend;
+    return ProcessQueryResult::PassToBackend;
+  };
+  s_processResponse = [](PacketBuffer& response, LocalStateHolder<vector<DNSDistResponseRuleAction> >& localRespRuleActions, DNSResponse& dr, bool muted) -> bool {
+    return true;
+  };
+
+  enum class BackendConnection { reused, opened, evictedThenOpened };
+  /* a client connection sending a single query, then closing */
+  auto runClientConnection = [&](BackendConnection backendConnection, const struct timeval& connNow) {
+    TCPClientThreadData threadData;
+    TEST_INIT("=> Query to backend over a new or reused connection");
+    s_readBuffer = query;
+    s_backendReadBuffer = query;
+
+    s_steps = {
+      { ExpectedStep::ExpectedRequest::handshakeClient, IOState::Done },
+      { ExpectedStep::ExpectedRequest::readFromClient, IOState::Done, 2 },
+      { ExpectedStep::ExpectedRequest::readFromClient, IOState::Done, query.size() - 2 },
+    };
+    if (backendConnection == BackendConnection::evictedThenOpened) {
+      s_steps.push_back({ ExpectedStep::ExpectedRequest::closeBackend, IOState::Done });
+    }
+    if (backendConnection != BackendConnection::reused) {
+      s_steps.push_back({ ExpectedStep::ExpectedRequest::connectToBackend, IOState::Done });
+    }
+    s_steps.insert(s_steps.end(), {
+      { ExpectedStep::ExpectedRequest::writeToBackend, IOState::Done, query.size() },
+      { ExpectedStep::ExpectedRequest::readFromBackend, IOState::Done, 2 },
+      { ExpectedStep::ExpectedRequest::readFromBackend, IOState::Done, query.size() - 2 },
+      { ExpectedStep::ExpectedRequest::writeToClient, IOState::Done, query.size() },
+      { ExpectedStep::ExpectedRequest::readFromClient, IOState::Done, 0 },
+      /* closing client connection, the connection to the backend goes back to the idle pool */
+      { ExpectedStep::ExpectedRequest::closeClient, IOState::Done },
+    });
+
+    auto state = std::make_shared<IncomingTCPConnectionState>(ConnectionInfo(&localCS), threadData, connNow);
+    IncomingTCPConnectionState::handleIO(state, connNow);
+    BOOST_CHECK_EQUAL(s_writeBuffer.size(), query.size());
+    BOOST_CHECK_EQUAL(s_backendWriteBuffer.size(), query.size());
+    BOOST_CHECK(s_steps.empty());
+  };
+
+  {
+    /* per-thread pool: the second client connection reuses the connection to the backend opened for the first one */
+    runClientConnection(BackendConnection::opened, now);
+    runClientConnection(BackendConnection::reused, now);
+    BOOST_CHECK_EQUAL(backend->tcpReusedConnections.load(), 1U);
+    BOOST_CHECK_EQUAL(backend->tcpIdlePoolMisses.load(), 1U);
+
+    s_steps = { { ExpectedStep::ExpectedRequest::closeBackend, IOState::Done } };
+    BOOST_CHECK_EQUAL(IncomingTCPConnectionState::clearAllDownstreamConnections(), 1U);
+  }
+
+  {
+    /* shared pool: the connection opened by one thread is reused by another one */
+    g_downstreamTCPSharedIdlePool = true;
+    runClientConnection(BackendConnection::opened, now);
+    std::thread other(runClientConnection, BackendConnection::reused, now);
+    other.join();
+    BOOST_CHECK_EQUAL(backend->tcpReusedConnections.load(), 2U);
+    BOOST_CHECK_EQUAL(backend->tcpIdlePoolMisses.load(), 2U);
+
+    /* the connection has now been idle for too long, so it is closed and a new one is opened */
+    g_downstreamTCPMaxIdleTime = 10;
+    struct timeval later = now;
+    later.tv_sec += 11;
+    runClientConnection(BackendConnection::evictedThenOpened, later);
+    BOOST_CHECK_EQUAL(backend->tcpReusedConnections.load(), 2U);
+    BOOST_CHECK_EQUAL(backend->tcpIdlePoolMisses.load(), 3U);
+    BOOST_CHECK_EQUAL(backend->tcpIdlePoolEvictions.load(), 1U);
+
+    s_steps = { { ExpectedStep::ExpectedRequest::closeBackend, IOState::Done } };
+    BOOST_CHECK_EQUAL(IncomingTCPConnectionState::clearAllDownstreamConnections(), 1U);
+
+    g_downstreamTCPMaxIdleTime = 300;
+    g_downstreamTCPSharedIdlePool = false;
+  }
+}
+
 BOOST_AUTO_TEST_CASE(test_IncomingConnectionOOOR_BackendOOOR)
 {
   ComboAddress local("192.0.2.1:80");
@@ -0,0 +1,116 @@
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_NO_MAIN
+
+#include <boost/test/unit_test.hpp>
+
+#include "remote_logger.hh"
+
+BOOST_AUTO_TEST_SUITE(remote_logger_cc)
+
+static std::vector<std::string> readFrames(const std::string& buffer)
+{
+  std::vector<std::string> frames;
+  size_t pos = 0;
+  while (pos + 2 <= buffer.size()) {
+    size_t len = (static_cast<uint8_t>(buffer.at(pos)) << 8) + static_cast<uint8_t>(buffer.at(pos + 1));
+    BOOST_REQUIRE(pos + 2 + len <= buffer.size());
+    frames.push_back(buffer.substr(pos + 2, len));
+    pos += 2 + len;
+  }
+  BOOST_CHECK_EQUAL(pos, buffer.size());
+  return frames;
+}
+
+static std::string flushToString(CircularWriteBuffer& writer)
+{
+  int fds[2];
+  BOOST_REQUIRE_EQUAL(pipe(fds), 0);
+  writer.flush(fds[1]);
+  close(fds[1]);
+
+  std::string result;
+  char buffer[4096];
+  ssize_t got;
+  while ((got = read(fds[0], buffer, sizeof(buffer))) > 0) {
+    result.append(buffer, got);
+  }
+  close(fds[0]);
+  return result;
+}
+
+BOOST_AUTO_TEST_CASE(test_FrameRingBuffer) {
+  /* rounded up to 128 */
+  FrameRingBuffer ring(100);
+  CircularWriteBuffer writer(1000);
+
+  BOOST_CHECK(!ring.isHalfFull());
+  BOOST_CHECK(ring.push(std::string(40, 'a')));
+  BOOST_CHECK(ring.push(std::string(40, 'b')));
+  BOOST_CHECK(ring.isHalfFull());
+  /* 84 bytes used, no room for 40 + 2 more */
+  BOOST_CHECK(!ring.push(std::string(50, 'c')));
+  BOOST_CHECK_EQUAL(ring.getQueued(), 2U);
+  BOOST_CHECK_EQUAL(ring.getDrops(), 1U);
+
+  BOOST_CHECK_EQUAL(ring.drainTo(writer), 2U);
+  BOOST_CHECK(!ring.isHalfFull());
+
+  /* these ones wrap around the end of the ring */
+  BOOST_CHECK(ring.push(std::string(60, 'd')));
+  BOOST_CHECK(ring.push(std::string(30, 'e')));
+  BOOST_CHECK_EQUAL(ring.drainTo(writer), 2U);
+  BOOST_CHECK_EQUAL(ring.drainTo(writer), 0U);
+
+  auto frames = readFrames(flushToString(writer));
+  BOOST_REQUIRE_EQUAL(frames.size(), 4U);
+  BOOST_CHECK_EQUAL(frames.at(0), std::string(40, 'a'));
+  BOOST_CHECK_EQUAL(frames.at(1), std::string(40, 'b'));
+  BOOST_CHECK_EQUAL(frames.at(2), std::string(60, 'd'));
+  BOOST_CHECK_EQUAL(frames.at(3), std::string(30, 'e'));
+
+  /* frames are only moved when the outgoing buffer has room for all of them */
+  CircularWriteBuffer small(50);
+  BOOST_CHECK(ring.push(std::string(40, 'f')));
+  BOOST_CHECK(ring.push(std::string(40, 'g')));
+  BOOST_CHECK_EQUAL(ring.drainTo(small), 1U);
+  BOOST_CHECK_EQUAL(small.available(), 50U - 42U);
+  frames = readFrames(flushToString(small));
+  BOOST_REQUIRE_EQUAL(frames.size(), 1U);
+  BOOST_CHECK_EQUAL(frames.at(0), std::string(40, 'f'));
+  BOOST_CHECK_EQUAL(ring.drainTo(small), 1U);
+  frames = readFrames(flushToString(small));
+  BOOST_REQUIRE_EQUAL(frames.size(), 1U);
+  BOOST_CHECK_EQUAL(frames.at(0), std::string(40, 'g'));
+}
+
+BOOST_AUTO_TEST_CASE(test_FrameRingBuffer_Threads) {
+  FrameRingBuffer ring(1024);
+  const size_t count = 100000;
+
+  std::thread producer([&ring]() {
+    for (size_t idx = 0; idx < count; idx++) {
+      while (!ring.push(std::to_string(idx))) {
+        std::this_thread::yield();
+      }
+    }
+  });
+
+  size_t received = 0;
+  while (received < count) {
+    CircularWriteBuffer writer(512);
+    if (ring.drainTo(writer) == 0) {
+      std::this_thread::yield();
+      continue;
+    }
+    for (const auto& frame : readFrames(flushToString(writer))) {
+      BOOST_REQUIRE_EQUAL(frame, std::to_string(received));
+      received++;
+    }
+  }
+
+  producer.join();
+  BOOST_CHECK_EQUAL(ring.getQueued(), count);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -20,6 +20,7 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 #pragma once
+#include <array>
 #include <cstring>
 #include <string>
 #include <vector>
@@ -275,8 +276,59 @@ struct SuffixMatchTree
     return *this;
   }
   
+  /* a raw label pointing into the wire representation of a name, to look up
+     a child without having to copy the label into a std::string */
+  struct LabelView
+  {
+    const char* data;
+    size_t size;
+  };
+
+  /* same ordering as strcasecmp(), which stops at the first NUL byte */
+  static bool labelLessThan(const char* a, size_t aSize, const char* b, size_t bSize)
+  {
+    const void* aNul = memchr(a, 0, aSize);
+    if (aNul != nullptr) {
+      aSize = static_cast<const char*>(aNul) - a;
+    }
+    const void* bNul = memchr(b, 0, bSize);
+    if (bNul != nullptr) {
+      bSize = static_cast<const char*>(bNul) - b;
+    }
+
+    const size_t common = std::min(aSize, bSize);
+    for (size_t idx = 0; idx < common; idx++) {
+      const unsigned char aChar = dns_tolower(a[idx]);
+      const unsigned char bChar = dns_tolower(b[idx]);
+      if (aChar != bChar) {
+        return aChar < bChar;
+      }
+    }
+    return aSize < bSize;
+  }
+
+  struct LabelCompare
+  {
+    using is_transparent = void;
+
+    bool operator()(const SuffixMatchTree& a, const SuffixMatchTree& b) const
+    {
+      return a < b;
+    }
+
+    bool operator()(const SuffixMatchTree& a, const LabelView& b) const
+    {
+      return labelLessThan(a.d_name.data(), a.d_name.size(), b.data, b.size);
+    }
+
+    bool operator()(const LabelView& a, const SuffixMatchTree& b) const
+    {
+      return labelLessThan(a.data, a.size, b.d_name.data(), b.d_name.size());
+    }
+  };
+
   std::string d_name;
-  mutable std::set<SuffixMatchTree> children;
+  mutable std::set<SuffixMatchTree, LabelCompare> children;
   mutable bool endNode;
   mutable T d_value;
   bool operator<(const SuffixMatchTree& rhs) const
@@ -374,6 +426,14 @@ struct SuffixMatchTree
   }
 
   T* lookup(const DNSName& name)  const
+  {
+    const auto& storage = name.getStorage();
+    return lookup(storage.data(), storage.size());
+  }
+
+  /* look up a name in wire format, for example straight from the question section of
+     an uncompressed query. wireLength is the length of the name including the root label */
+  T* lookup(const char* wire, size_t wireLength) const
   {
     if (children.empty()) { // speed up empty set
       if (endNode) {
@@ -382,8 +442,44 @@ struct SuffixMatchTree
       return nullptr;
     }
 
-    auto labels = name.getRawLabels();
-    return lookup(labels);
+    /* walk the labels straight from the wire representation of the name, last one first,
+       instead of building a vector of strings on every lookup. A name is at most 255 bytes
+       long so it cannot hold more than 127 labels, each starting at an offset below 255. */
+    std::array<uint8_t, 127> offsets;
+    size_t count = 0;
+    for (size_t pos = 0; pos < wireLength && wire[pos] != 0 && count < offsets.size(); pos += static_cast<uint8_t>(wire[pos]) + 1) {
+      if (pos + 1 + static_cast<uint8_t>(wire[pos]) > wireLength) {
+        /* truncated label */
+        return nullptr;
+      }
+      offsets[count++] = static_cast<uint8_t>(pos);
+    }
+    return lookup(wire, offsets, count);
+  }
+
+  T* lookup(const char* wire, const std::array<uint8_t, 127>& offsets, size_t remaining) const
+  {
+    if (remaining == 0) {
+      if (endNode) {
+        return &d_value;
+      }
+      return nullptr;
+    }
+
+    const size_t offset = offsets[remaining - 1];
+    const LabelView label{wire + offset + 1, static_cast<uint8_t>(wire[offset])};
+    auto child = children.find(label);
+    if (child == children.end()) {
+      if(endNode) {
+        return &d_value;
+      }
+      return nullptr;
+    }
+    auto result = child->lookup(wire, offsets, remaining - 1);
+    if (result) {
+      return result;
+    }
+    return endNode ? &d_value : nullptr;
   }
 
   T* lookup(std::vector<std::string>& labels) const
@@ -105,6 +105,9 @@ struct DOHFrontend
   HTTPVersionStats d_http2Stats;
   uint32_t d_internalPipeBufferSize{0};
   bool d_sendCacheControlHeaders{true};
+  /* whether the queries are processed in the thread handling the HTTP connections
+     instead of being passed to a separate thread over a pipe */
+  bool d_processQueriesInline{false};
   bool d_trustForwardedForHeader{false};
   /* whether we require tue query path to exactly match one of configured ones,
      or accept everything below these paths. */
@@ -108,7 +108,7 @@ void EpollFDMultiplexer::addFD(callbackmap_t& cbmap, int fd, callbackfunc_t toDo
   eevent.data.fd=fd;
 
   if (epoll_ctl(d_epollfd, EPOLL_CTL_ADD, fd, &eevent) < 0) {
-    cbmap.erase(fd);
+    accountingRemoveFD(cbmap, fd);
     throw FDMultiplexerException("Adding fd to epoll set: "+stringerror());
   }
 }
@@ -136,7 +136,7 @@ void EpollFDMultiplexer::alterFD(callbackmap_t& from, callbackmap_t& to, int fd,
   eevent.data.fd = fd;
 
   if (epoll_ctl(d_epollfd, EPOLL_CTL_MOD, fd, &eevent) < 0) {
-    to.erase(fd);
+    accountingRemoveFD(to, fd);
     throw FDMultiplexerException("Altering fd in epoll set: "+stringerror());
   }
 }
@@ -91,6 +91,7 @@ FrameStreamLogger::FrameStreamLogger(const int family, const std::string& addres
       { "bufferHint", fstrm_iothr_options_set_buffer_hint },
       { "flushTimeout", fstrm_iothr_options_set_flush_timeout },
       { "inputQueueSize", fstrm_iothr_options_set_input_queue_size },
+      { "numInputQueues", fstrm_iothr_options_set_num_input_queues },
       { "outputQueueSize", fstrm_iothr_options_set_output_queue_size },
       { "queueNotifyThreshold", fstrm_iothr_options_set_queue_notify_threshold },
       { "setReopenInterval", fstrm_iothr_options_set_reopen_interval }
@@ -111,9 +112,17 @@ FrameStreamLogger::FrameStreamLogger(const int family, const std::string& addres
         throw std::runtime_error("FrameStreamLogger: fstrm_iothr_init() failed.");
       }
 
-      d_ioqueue = fstrm_iothr_get_input_queue(d_iothr);
-      if (!d_ioqueue) {
-        throw std::runtime_error("FrameStreamLogger: fstrm_iothr_get_input_queue() failed.");
+      size_t numInputQueues = 1;
+      if (options.find("numInputQueues") != options.end() && options.at("numInputQueues")) {
+        numInputQueues = options.at("numInputQueues");
+      }
+
+      for (size_t idx = 0; idx < numInputQueues; idx++) {
+        auto ioqueue = fstrm_iothr_get_input_queue_idx(d_iothr, idx);
+        if (!ioqueue) {
+          throw std::runtime_error("FrameStreamLogger: fstrm_iothr_get_input_queue_idx() failed.");
+        }
+        d_ioqueues.push_back(ioqueue);
       }
     }
   } catch (std::runtime_error &e) {
@@ -157,11 +166,17 @@ FrameStreamLogger::~FrameStreamLogger()
   this->cleanup();
 }
 
+static std::atomic<size_t> s_frameStreamThreads{0};
+
 void FrameStreamLogger::queueData(const std::string& data)
 {
-  if (!d_ioqueue || !d_iothr) {
+  if (d_ioqueues.empty() || !d_iothr) {
     return;
   }
+
+  static thread_local const size_t t_threadIdx = s_frameStreamThreads++;
+  auto ioqueue = d_ioqueues.at(t_threadIdx % d_ioqueues.size());
+
   uint8_t *frame = (uint8_t*)malloc(data.length());
   if (!frame) {
 #ifdef RECURSOR
@@ -174,7 +189,7 @@ void FrameStreamLogger::queueData(const std::string& data)
   memcpy(frame, data.c_str(), data.length());
 
   fstrm_res res;
-  res = fstrm_iothr_submit(d_iothr, d_ioqueue, frame, data.length(), fstrm_free_wrapper, nullptr);
+  res = fstrm_iothr_submit(d_iothr, ioqueue, frame, data.length(), fstrm_free_wrapper, nullptr);
 
   if (res == fstrm_res_success) {
     // Frame successfully queued.
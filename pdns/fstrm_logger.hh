@@ -48,7 +48,9 @@ private:
 
   const int d_family;
   const std::string d_address;
-  struct fstrm_iothr_queue *d_ioqueue{nullptr};
+  /* every thread submits to the same input queue, picked when it first logs, to spread the
+     contention over several queues */
+  std::vector<struct fstrm_iothr_queue*> d_ioqueues;
   struct fstrm_writer_options *d_fwopt{nullptr};
   struct fstrm_unix_writer_options *d_uwopt{nullptr};
 #ifdef HAVE_FSTRM_TCP_WRITER_INIT
@@ -88,7 +88,7 @@ void KqueueFDMultiplexer::addFD(callbackmap_t& cbmap, int fd, callbackfunc_t toD
   EV_SET(&kqevent, fd, (&cbmap == &d_readCallbacks) ? EVFILT_READ : EVFILT_WRITE, EV_ADD, 0,0,0);
 
   if(kevent(d_kqueuefd, &kqevent, 1, 0, 0, 0) < 0) {
-    cbmap.erase(fd);
+    accountingRemoveFD(cbmap, fd);
     throw FDMultiplexerException("Adding fd to kqueue set: "+stringerror());
   }
 }
@@ -29,6 +29,10 @@
 #include <boost/multi_index/ordered_index.hpp>
 #include <boost/multi_index/hashed_index.hpp>
 #include <boost/multi_index/key_extractors.hpp>
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <tuple>
 #include <vector>
 #include <map>
 #include <stdexcept>
@@ -45,6 +49,181 @@ public:
 };
 
 
+/** Hierarchical timing wheel keeping track of the time-to-die of file descriptors.
+    Arming and disarming a timer are O(1), and expiring them is amortized O(1) per
+    timer since a timer only moves down a level, to a finer-grained wheel, at most
+    once per level. Times are in milliseconds, and there are 6 levels of 256 slots
+    each, covering 2^48 ms. Timers that are due are kept in an 'expired' list until
+    they are disarmed or armed again.
+*/
+class FDTimerWheel
+{
+public:
+  static uint64_t toTick(const struct timeval& tv)
+  {
+    return static_cast<uint64_t>(tv.tv_sec) * 1000 + static_cast<uint64_t>(tv.tv_usec) / 1000;
+  }
+
+  FDTimerWheel()
+  {
+    d_heads.fill(s_none);
+  }
+
+  void arm(int fd, uint64_t tick)
+  {
+    if (fd == s_none) {
+      return;
+    }
+    auto& nodes = fd >= 0 ? d_nodes : d_negativeNodes;
+    const size_t idx = getIndex(fd);
+    if (idx >= nodes.size()) {
+      nodes.resize(idx + 1);
+    }
+    disarm(fd);
+    getNode(fd).tick = tick;
+    place(fd);
+    ++d_count;
+  }
+
+  void disarm(int fd)
+  {
+    const auto& nodes = fd >= 0 ? d_nodes : d_negativeNodes;
+    if (fd == s_none || getIndex(fd) >= nodes.size() || getNode(fd).list == s_unarmed) {
+      return;
+    }
+    unlink(fd);
+    --d_count;
+  }
+
+  /* move every timer that is due at 'now' to the expired list. Time going backward
+     is fine, it only means that some timers in the expired list are not due yet */
+  void advance(uint64_t now)
+  {
+    if (now <= d_current) {
+      return;
+    }
+
+    /* collect the timers from every slot we are moving into, at every level,
+       then put them back where they belong relative to the new time */
+    int collected = s_none;
+    for (size_t level = 0; level < s_levels; level++) {
+      const uint64_t oldIdx = d_current >> (level * s_bitsPerLevel);
+      const uint64_t newIdx = now >> (level * s_bitsPerLevel);
+      if (oldIdx == newIdx) {
+        break;
+      }
+      const uint64_t steps = std::min(newIdx - oldIdx, static_cast<uint64_t>(s_slotsPerLevel));
+      for (uint64_t step = 1; step <= steps; step++) {
+        const size_t list = level * s_slotsPerLevel + ((oldIdx + step) & (s_slotsPerLevel - 1));
+        while (d_heads[list] != s_none) {
+          const int fd = d_heads[list];
+          unlink(fd);
+          getNode(fd).next = collected;
+          collected = fd;
+        }
+      }
+    }
+
+    d_current = now;
+    while (collected != s_none) {
+      const int fd = collected;
+      collected = getNode(fd).next;
+      place(fd);
+    }
+  }
+
+  /* call visitor(fd) for every expired timer. The visitor is not allowed to arm or disarm timers */
+  template <typename Visitor>
+  void forEachExpired(Visitor&& visitor) const
+  {
+    for (int fd = d_heads[s_expired]; fd != s_none; fd = getNode(fd).next) {
+      visitor(fd);
+    }
+  }
+
+  size_t size() const
+  {
+    return d_count;
+  }
+
+private:
+  static constexpr size_t s_bitsPerLevel{8};
+  static constexpr size_t s_slotsPerLevel{1 << s_bitsPerLevel};
+  static constexpr size_t s_levels{6};
+  static constexpr uint16_t s_expired{s_levels * s_slotsPerLevel};
+  static constexpr uint16_t s_unarmed{s_expired + 1};
+  /* the lists are linked by descriptor, and nothing is ever registered for that one */
+  static constexpr int s_none{std::numeric_limits<int>::min()};
+
+  struct Node
+  {
+    uint64_t tick{0};
+    int prev{s_none};
+    int next{s_none};
+    uint16_t list{s_unarmed};
+  };
+
+  /* negative descriptors are not valid, but nothing prevents them from being registered to
+     the multiplexer (the unit tests do), so they get a table of their own */
+  static size_t getIndex(int fd)
+  {
+    return fd >= 0 ? static_cast<size_t>(fd) : static_cast<size_t>(-(fd + 1));
+  }
+
+  Node& getNode(int fd)
+  {
+    return fd >= 0 ? d_nodes[fd] : d_negativeNodes[getIndex(fd)];
+  }
+
+  const Node& getNode(int fd) const
+  {
+    return fd >= 0 ? d_nodes[fd] : d_negativeNodes[getIndex(fd)];
+  }
+
+  void place(int fd)
+  {
+    auto& node = getNode(fd);
+    size_t list = s_expired;
+    if (node.tick > d_current) {
+      /* the level is the one of the highest 8-bit digit that differs from the current time */
+      const size_t highestBit = 63 - __builtin_clzll(node.tick ^ d_current);
+      const size_t level = std::min(highestBit / s_bitsPerLevel, s_levels - 1);
+      list = level * s_slotsPerLevel + ((node.tick >> (level * s_bitsPerLevel)) & (s_slotsPerLevel - 1));
+    }
+
+    node.list = list;
+    node.prev = s_none;
+    node.next = d_heads[list];
+    if (node.next != s_none) {
+      getNode(node.next).prev = fd;
+    }
+    d_heads[list] = fd;
+  }
+
+  void unlink(int fd)
+  {
+    auto& node = getNode(fd);
+    if (node.prev != s_none) {
+      getNode(node.prev).next = node.next;
+    }
+    else {
+      d_heads[node.list] = node.next;
+    }
+    if (node.next != s_none) {
+      getNode(node.next).prev = node.prev;
+    }
+    node.prev = s_none;
+    node.next = s_none;
+    node.list = s_unarmed;
+  }
+
+  std::vector<Node> d_nodes;
+  std::vector<Node> d_negativeNodes;
+  std::array<int, s_levels * s_slotsPerLevel + 1> d_heads;
+  uint64_t d_current{0};
+  size_t d_count{0};
+};
+
 /** Very simple FD multiplexer, based on callbacks and boost::any parameters
     As a special service, this parameter is kept around and can be modified, 
     allowing for state to be stored inside the multiplexer.
@@ -117,10 +296,14 @@ public:
       throw FDMultiplexerException("attempt to timestamp fd not in the multiplexer");
     }
 
-    auto newEntry = *it;
     tv.tv_sec += timeout;
-    newEntry.d_ttd = tv;
-    d_readCallbacks.replace(it, newEntry);
+    d_readCallbacks.modify(it, [&tv](Callback& cb) { cb.d_ttd = tv; });
+    if (tv.tv_sec != 0) {
+      d_readTimers.arm(fd, FDTimerWheel::toTick(tv));
+    }
+    else {
+      d_readTimers.disarm(fd);
+    }
   }
 
   virtual void setWriteTTD(int fd, struct timeval tv, int timeout)
@@ -130,10 +313,14 @@ public:
       throw FDMultiplexerException("attempt to timestamp fd not in the multiplexer");
     }
 
-    auto newEntry = *it;
     tv.tv_sec += timeout;
-    newEntry.d_ttd = tv;
-    d_writeCallbacks.replace(it, newEntry);
+    d_writeCallbacks.modify(it, [&tv](Callback& cb) { cb.d_ttd = tv; });
+    if (tv.tv_sec != 0) {
+      d_writeTimers.arm(fd, FDTimerWheel::toTick(tv));
+    }
+    else {
+      d_writeTimers.disarm(fd);
+    }
   }
 
   virtual void alterFDToRead(int fd, callbackfunc_t toDo, const funcparam_t& parameter=funcparam_t(), const struct timeval* ttd=nullptr)
@@ -146,17 +333,41 @@ public:
     this->alterFD(d_readCallbacks, d_writeCallbacks, fd, toDo, parameter, ttd);
   }
 
+  /* the FDs whose TTD is before tv, the oldest TTD first */
   virtual std::vector<std::pair<int, funcparam_t> > getTimeouts(const struct timeval& tv, bool writes=false)
   {
-    std::vector<std::pair<int, funcparam_t> > ret;
     const auto tied = boost::tie(tv.tv_sec, tv.tv_usec);
-    auto& idx = writes ? d_writeCallbacks.get<TTDOrderedTag>() : d_readCallbacks.get<TTDOrderedTag>();
-
-    for (auto it = idx.begin(); it != idx.end(); ++it) {
-      if (it->d_ttd.tv_sec == 0 || tied <= boost::tie(it->d_ttd.tv_sec, it->d_ttd.tv_usec)) {
-        break;
+    const auto& cbmap = writes ? d_writeCallbacks : d_readCallbacks;
+    auto& timers = writes ? d_writeTimers : d_readTimers;
+    timers.advance(FDTimerWheel::toTick(tv));
+
+    std::vector<const Callback*> expired;
+    std::vector<int> stale;
+    timers.forEachExpired([&](int fd) {
+      const auto it = cbmap.find(fd);
+      if (it == cbmap.end() || it->d_ttd.tv_sec == 0) {
+        /* removed without going through accountingRemoveFD() */
+        stale.push_back(fd);
+        return;
       }
-      ret.push_back(std::make_pair(it->d_fd, it->d_parameter));
+      if (tied <= boost::tie(it->d_ttd.tv_sec, it->d_ttd.tv_usec)) {
+        return;
+      }
+      expired.push_back(&*it);
+    });
+
+    for (const auto fd : stale) {
+      timers.disarm(fd);
+    }
+
+    std::sort(expired.begin(), expired.end(), [](const Callback* a, const Callback* b) {
+      return std::tie(a->d_ttd.tv_sec, a->d_ttd.tv_usec) < std::tie(b->d_ttd.tv_sec, b->d_ttd.tv_usec);
+    });
+
+    std::vector<std::pair<int, funcparam_t> > ret;
+    ret.reserve(expired.size());
+    for (const auto cb : expired) {
+      ret.push_back(std::make_pair(cb->d_fd, cb->d_parameter));
     }
 
     return ret;
@@ -190,42 +401,24 @@ public:
 
 protected:
   struct FDBasedTag {};
-  struct TTDOrderedTag {};
-  struct ttd_compare
-  {
-    /* we want a 0 TTD (no timeout) to come _after_ everything else */
-    bool operator() (const struct timeval& lhs, const struct timeval& rhs) const
-    {
-      /* special treatment if at least one of the TTD is 0,
-         normal comparison otherwise */
-      if (lhs.tv_sec == 0 && rhs.tv_sec == 0) {
-        return false;
-      }
-      if (lhs.tv_sec == 0 && rhs.tv_sec != 0) {
-        return false;
-      }
-      if (lhs.tv_sec != 0 && rhs.tv_sec == 0) {
-        return true;
-      }
-
-      return std::tie(lhs.tv_sec, lhs.tv_usec) < std::tie(rhs.tv_sec, rhs.tv_usec);
-    }
-  };
 
+  /* the TTDs are tracked by d_readTimers and d_writeTimers */
   typedef multi_index_container<
     Callback,
     indexed_by <
                 hashed_unique<tag<FDBasedTag>,
                               member<Callback,int,&Callback::d_fd>
-                              >,
-                ordered_non_unique<tag<TTDOrderedTag>,
-                                   member<Callback,struct timeval,&Callback::d_ttd>,
-                                   ttd_compare
-                                   >
+                              >
                >
   > callbackmap_t;
 
   callbackmap_t d_readCallbacks, d_writeCallbacks;
+  FDTimerWheel d_readTimers, d_writeTimers;
+
+  FDTimerWheel& getTimers(const callbackmap_t& cbmap)
+  {
+    return &cbmap == &d_readCallbacks ? d_readTimers : d_writeTimers;
+  }
 
   virtual void addFD(callbackmap_t& cbmap, int fd, callbackfunc_t toDo, const funcparam_t& parameter, const struct timeval* ttd=nullptr)=0;
   virtual void removeFD(callbackmap_t& cbmap, int fd)=0;
@@ -248,6 +441,14 @@ protected:
     if (!pair.second) {
       throw FDMultiplexerException("Tried to add fd "+std::to_string(fd)+ " to multiplexer twice");
     }
+
+    auto& timers = getTimers(cbmap);
+    if (ttd && ttd->tv_sec != 0) {
+      timers.arm(fd, FDTimerWheel::toTick(*ttd));
+    }
+    else {
+      timers.disarm(fd);
+    }
   }
 
   void accountingRemoveFD(callbackmap_t& cbmap, int fd) 
@@ -255,6 +456,7 @@ protected:
     if(!cbmap.erase(fd)) {
       throw FDMultiplexerException("Tried to remove unlisted fd "+std::to_string(fd)+ " from multiplexer");
     }
+    getTimers(cbmap).disarm(fd);
   }
 
   virtual void alterFD(callbackmap_t& from, callbackmap_t& to, int fd, callbackfunc_t toDo, const funcparam_t& parameter, const struct timeval* ttd)
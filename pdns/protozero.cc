@@ -71,6 +71,33 @@ void pdns::ProtoZero::Message::setRequest(const boost::uuids::uuid& uniqueId, co
   setToPort(local.getPort());
 }
 
+void pdns::ProtoZero::Message::setRequest(const boost::uuids::uuid& uniqueId, const ComboAddress& requestor, const ComboAddress& local, const std::string& encodedQuestion, uint16_t id, bool tcp, size_t len)
+{
+  setMessageIdentity(uniqueId);
+  setSocketFamily(requestor.sin4.sin_family);
+  setSocketProtocol(tcp);
+  setFrom(requestor);
+  setTo(local);
+  setInBytes(len);
+  setTime();
+  setId(id);
+  setEncodedQuestion(encodedQuestion);
+  setFromPort(requestor.getPort());
+  setToPort(local.getPort());
+}
+
+void pdns::ProtoZero::Message::encodeQuestion(std::string& buffer, const DNSName& qname, uint16_t qtype, uint16_t qclass)
+{
+  protozero::pbf_writer message{buffer};
+  protozero::pbf_writer pbf_question{message, static_cast<protozero::pbf_tag_type>(Field::question)};
+  {
+    protozero::pbf_writer pbf_name{pbf_question, static_cast<protozero::pbf_tag_type>(QuestionField::qName)};
+    qname.toString(buffer);
+  }
+  pbf_question.add_uint32(static_cast<protozero::pbf_tag_type>(QuestionField::qType), qtype);
+  pbf_question.add_uint32(static_cast<protozero::pbf_tag_type>(QuestionField::qClass), qclass);
+}
+
 void pdns::ProtoZero::Message::setResponse(const DNSName& qname, uint16_t qtype, uint16_t qclass)
 {
   setType(pdns::ProtoZero::Message::MessageType::DNSResponseType);
@@ -101,7 +128,6 @@ void pdns::ProtoZero::Message::addRRsFromPacket(const char* packet, const size_t
   uint16_t ancount = ntohs(dh->ancount);
   uint16_t rrtype;
   uint16_t rrclass;
-  string blob;
   struct dnsrecordheader ah;
 
   rrname = pr.getName();
@@ -126,10 +152,16 @@ void pdns::ProtoZero::Message::addRRsFromPacket(const char* packet, const size_t
     rrname = pr.getName();
     pr.getDnsrecordheader(ah);
 
-    if (ah.d_type == QType::A || ah.d_type == QType::AAAA) {
-      pr.xfrBlob(blob);
+    /* we copy the content of A and AAAA records straight from the packet, and skip the other
+       ones, instead of copying them into a string first */
+    const size_t rdataPos = pr.getPosition();
+    if (rdataPos + ah.d_clen > len) {
+      throw std::out_of_range("Record content out of range");
+    }
 
-      addRR(rrname, ah.d_type, ah.d_class, ah.d_ttl, blob);
+    if (ah.d_type == QType::A || ah.d_type == QType::AAAA) {
+      addRR(rrname, ah.d_type, ah.d_class, ah.d_ttl, packet + rdataPos, ah.d_clen);
+      pr.skip(ah.d_clen);
 
     } else if (ah.d_type == QType::CNAME && includeCNAME) {
       protozero::pbf_writer pbf_rr{d_response, static_cast<protozero::pbf_tag_type>(pdns::ProtoZero::Message::ResponseField::rrs)};
@@ -143,7 +175,7 @@ void pdns::ProtoZero::Message::addRRsFromPacket(const char* packet, const size_t
       encodeDNSName(pbf_rr, d_buffer, static_cast<protozero::pbf_tag_type>(pdns::ProtoZero::Message::RRField::rdata), target);
     }
     else {
-      pr.xfrBlob(blob);
+      pr.skip(ah.d_clen);
     }
   }
 }
@@ -157,3 +189,13 @@ void pdns::ProtoZero::Message::addRR(const DNSName& name, uint16_t uType, uint16
   pbf_rr.add_uint32(static_cast<protozero::pbf_tag_type>(pdns::ProtoZero::Message::RRField::ttl), uTTL);
   pbf_rr.add_string(static_cast<protozero::pbf_tag_type>(pdns::ProtoZero::Message::RRField::rdata), blob);
 }
+
+void pdns::ProtoZero::Message::addRR(const DNSName& name, uint16_t uType, uint16_t uClass, uint32_t uTTL, const char* blob, size_t blobSize)
+{
+  protozero::pbf_writer pbf_rr{d_response, static_cast<protozero::pbf_tag_type>(pdns::ProtoZero::Message::ResponseField::rrs)};
+  encodeDNSName(pbf_rr, d_buffer, static_cast<protozero::pbf_tag_type>(pdns::ProtoZero::Message::RRField::name), name);
+  pbf_rr.add_uint32(static_cast<protozero::pbf_tag_type>(pdns::ProtoZero::Message::RRField::type), uType);
+  pbf_rr.add_uint32(static_cast<protozero::pbf_tag_type>(pdns::ProtoZero::Message::RRField::class_), uClass);
+  pbf_rr.add_uint32(static_cast<protozero::pbf_tag_type>(pdns::ProtoZero::Message::RRField::ttl), uTTL);
+  pbf_rr.add_bytes(static_cast<protozero::pbf_tag_type>(pdns::ProtoZero::Message::RRField::rdata), blob, blobSize);
+}
@@ -48,6 +48,8 @@ namespace pdns {
       Message& operator=(Message&&) = delete;
 
       void setRequest(const boost::uuids::uuid& uniqueId, const ComboAddress& requestor, const ComboAddress& local, const DNSName& qname, uint16_t qtype, uint16_t qclass, uint16_t id, bool tcp, size_t len);
+      /* same but with a question section previously encoded via encodeQuestion() */
+      void setRequest(const boost::uuids::uuid& uniqueId, const ComboAddress& requestor, const ComboAddress& local, const std::string& encodedQuestion, uint16_t id, bool tcp, size_t len);
       void setResponse(const DNSName& qname, uint16_t qtype, uint16_t qclass);
 
       void setType(MessageType mtype)
@@ -117,6 +119,16 @@ namespace pdns {
         pbf_question.add_uint32(static_cast<protozero::pbf_tag_type>(QuestionField::qClass), qclass);
       }
 
+      /* encode the question section once, so that it can be copied as-is into several messages
+         via setEncodedQuestion() instead of encoding the qname every time */
+      static void encodeQuestion(std::string& buffer, const DNSName& qname, uint16_t qtype, uint16_t qclass);
+
+      void setEncodedQuestion(const std::string& encodedQuestion)
+      {
+        /* this is only valid at the top level of the message, not inside the response */
+        d_buffer.append(encodedQuestion);
+      }
+
       void setEDNSSubnet(const Netmask& nm, uint8_t mask)
       {
         encodeNetmask(static_cast<protozero::pbf_tag_type>(Field::originalRequestorSubnet), nm, mask);
@@ -209,6 +221,7 @@ namespace pdns {
 
       void addRRsFromPacket(const char* packet, const size_t len, bool includeCNAME=false);
       void addRR(const DNSName& name, uint16_t uType, uint16_t uClass, uint32_t uTTL, const std::string& blob);
+      void addRR(const DNSName& name, uint16_t uType, uint16_t uClass, uint32_t uTTL, const char* blob, size_t blobSize);
 
     protected:
       void encodeComboAddress(protozero::pbf_tag_type type, const ComboAddress& ca);
@@ -1,4 +1,5 @@
 #include <unistd.h>
+#include <unordered_map>
 #include "threadname.hh"
 #include "remote_logger.hh"
 #include <sys/uio.h>
@@ -35,6 +36,16 @@ bool CircularWriteBuffer::write(const std::string& str)
   return true;
 }
 
+bool CircularWriteBuffer::append(const char* data, size_t size)
+{
+  if (size > available()) {
+    return false;
+  }
+
+  d_buffer.insert(d_buffer.end(), data, data + size);
+  return true;
+}
+
 bool CircularWriteBuffer::flush(int fd)
 {
   if (d_buffer.empty()) {
@@ -97,7 +108,99 @@ bool CircularWriteBuffer::flush(int fd)
   return true;
 }
 
-RemoteLogger::RemoteLogger(const ComboAddress& remote, uint16_t timeout, uint64_t maxQueuedBytes, uint8_t reconnectWaitTime, bool asyncConnect): d_writer(maxQueuedBytes), d_remote(remote), d_timeout(timeout), d_reconnectWaitTime(reconnectWaitTime), d_asyncConnect(asyncConnect)
+FrameRingBuffer::FrameRingBuffer(size_t size)
+{
+  size_t capacity = 64;
+  while (capacity < size) {
+    capacity <<= 1;
+  }
+  d_buffer.resize(capacity);
+  d_mask = capacity - 1;
+}
+
+void FrameRingBuffer::copyIn(size_t pos, const char* src, size_t size)
+{
+  const size_t start = pos & d_mask;
+  const size_t first = std::min(size, d_buffer.size() - start);
+  memcpy(&d_buffer.at(start), src, first);
+  if (first < size) {
+    memcpy(&d_buffer.at(0), src + first, size - first);
+  }
+}
+
+void FrameRingBuffer::copyOut(size_t pos, char* dest, size_t size) const
+{
+  const size_t start = pos & d_mask;
+  const size_t first = std::min(size, d_buffer.size() - start);
+  memcpy(dest, &d_buffer.at(start), first);
+  if (first < size) {
+    memcpy(dest + first, &d_buffer.at(0), size - first);
+  }
+}
+
+bool FrameRingBuffer::push(const std::string& frame)
+{
+  /* the producer is the only one updating the head and these counters,
+     so we don't need read-modify-write operations */
+  const size_t head = d_head.load(std::memory_order_relaxed);
+  const size_t tail = d_tail.load(std::memory_order_acquire);
+  const size_t needed = frame.size() + 2;
+
+  if (frame.size() > std::numeric_limits<uint16_t>::max() || needed > d_buffer.size() - (head - tail)) {
+    d_drops.store(d_drops.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    return false;
+  }
+
+  uint16_t len = htons(frame.size());
+  copyIn(head, reinterpret_cast<const char*>(&len), sizeof(len));
+  copyIn(head + sizeof(len), frame.data(), frame.size());
+
+  /* make the frame visible to the consumer */
+  d_head.store(head + needed, std::memory_order_release);
+  d_queued.store(d_queued.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  return true;
+}
+
+bool FrameRingBuffer::isHalfFull() const
+{
+  const size_t head = d_head.load(std::memory_order_relaxed);
+  const size_t tail = d_tail.load(std::memory_order_relaxed);
+  return (head - tail) >= (d_buffer.size() / 2);
+}
+
+size_t FrameRingBuffer::drainTo(CircularWriteBuffer& writer)
+{
+  size_t tail = d_tail.load(std::memory_order_relaxed);
+  const size_t head = d_head.load(std::memory_order_acquire);
+  size_t count = 0;
+
+  while ((head - tail) >= sizeof(uint16_t)) {
+    uint16_t len;
+    copyOut(tail, reinterpret_cast<char*>(&len), sizeof(len));
+    const size_t frameSize = sizeof(len) + ntohs(len);
+    if (frameSize > writer.available()) {
+      break;
+    }
+
+    const size_t start = tail & d_mask;
+    const size_t first = std::min(frameSize, d_buffer.size() - start);
+    writer.append(&d_buffer.at(start), first);
+    if (first < frameSize) {
+      writer.append(&d_buffer.at(0), frameSize - first);
+    }
+
+    tail += frameSize;
+    ++count;
+  }
+
+  /* release the space to the producer */
+  d_tail.store(tail, std::memory_order_release);
+  return count;
+}
+
+static std::atomic<uint64_t> s_remoteLoggerIDs{0};
+
+RemoteLogger::RemoteLogger(const ComboAddress& remote, uint16_t timeout, uint64_t maxQueuedBytes, uint8_t reconnectWaitTime, bool asyncConnect): d_writer(maxQueuedBytes), d_remote(remote), d_id(s_remoteLoggerIDs++), d_queueSize(maxQueuedBytes), d_timeout(timeout), d_reconnectWaitTime(reconnectWaitTime), d_asyncConnect(asyncConnect)
 {
   if (!d_asyncConnect) {
     reconnect();
@@ -113,12 +216,8 @@ bool RemoteLogger::reconnect()
     newSock->setNonBlocking();
     newSock->connect(d_remote, d_timeout);
 
-    {
-      /* we are now successfully connected, time to take the lock and update the
-         socket */
-      std::lock_guard<std::mutex> lock(d_mutex);
-      d_socket = std::move(newSock);
-    }
+    /* only the writer thread accesses the socket once it has been started */
+    d_socket = std::move(newSock);
   }
   catch (const std::exception& e) {
 #ifdef WE_ARE_RECURSOR
@@ -132,48 +231,69 @@ bool RemoteLogger::reconnect()
   return true;
 }
 
+FrameRingBuffer& RemoteLogger::getQueue()
+{
+  /* indexed by the ID of the logger rather than by its address, which could be reused by a new logger */
+  static thread_local std::unordered_map<uint64_t, FrameRingBuffer*> t_queues;
+
+  auto it = t_queues.find(d_id);
+  if (it != t_queues.end()) {
+    return *it->second;
+  }
+
+  auto queue = std::make_unique<FrameRingBuffer>(d_queueSize);
+  auto ptr = queue.get();
+  {
+    std::lock_guard<std::mutex> lock(d_queuesMutex);
+    d_queues.push_back(std::move(queue));
+  }
+  t_queues[d_id] = ptr;
+  return *ptr;
+}
+
 void RemoteLogger::queueData(const std::string& data)
 {
   if (data.size() > std::numeric_limits<uint16_t>::max()) {
     throw std::runtime_error("Got a request to write an object of size " + std::to_string(data.size()));
   }
 
-  std::lock_guard<std::mutex> lock(d_mutex);
+  auto& queue = getQueue();
+  if (!queue.push(data)) {
+    /* the writer thread is not keeping up, or we are not connected and the buffer is full, just drop */
+    return;
+  }
 
-  if (!d_writer.hasRoomFor(data)) {
-    /* not connected, queue is full, just drop */
-    if (!d_socket) {
-      ++d_drops;
-      return;
-    }
-    try {
-      /* we try to flush some data */
-      if (!d_writer.flush(d_socket->getHandle())) {
-        /* but failed, let's just drop */
-        ++d_drops;
-        return;
-      }
+  if (queue.isHalfFull()) {
+    d_wakeUp.notify_one();
+  }
+}
 
-      /* see if we freed enough data */
-      if (!d_writer.hasRoomFor(data)) {
-        /* we didn't */
-        ++d_drops;
-        return;
-      }
-    }
-    catch(const std::exception& e) {
-      //      cout << "Got exception writing: "<<e.what()<<endl;
-      ++d_drops;
-      d_socket.reset();
-      return;
+std::string RemoteLogger::toString() const
+{
+  uint64_t queued = 0;
+  uint64_t drops = 0;
+  {
+    std::lock_guard<std::mutex> lock(d_queuesMutex);
+    for (const auto& queue : d_queues) {
+      queued += queue->getQueued();
+      drops += queue->getDrops();
     }
   }
 
-  d_writer.write(data);
-  ++d_queued;
+  return d_remote.toStringWithPort() + " (" + std::to_string(queued) + " queued, " + std::to_string(drops) + " dropped)";
+}
+
+size_t RemoteLogger::drainQueues()
+{
+  size_t count = 0;
+  std::lock_guard<std::mutex> lock(d_queuesMutex);
+  for (auto& queue : d_queues) {
+    count += queue->drainTo(d_writer);
+  }
+  return count;
 }
 
-void RemoteLogger::maintenanceThread() 
+void RemoteLogger::maintenanceThread()
 {
   try {
 #ifdef WE_ARE_RECURSOR
@@ -183,44 +303,43 @@ void RemoteLogger::maintenanceThread()
 #endif
     setThreadName(threadName);
 
+    time_t lastConnectionAttempt = 0;
+
     for (;;) {
       if (d_exiting) {
         break;
       }
 
-      bool connected = true;
       if (d_socket == nullptr) {
-        // if it was unset, it will remain so, we are the only ones setting it!
-        connected = reconnect();
+        time_t now = time(nullptr);
+        if (now - lastConnectionAttempt >= d_reconnectWaitTime) {
+          lastConnectionAttempt = now;
+          reconnect();
+        }
       }
 
-      /* we will just go to sleep if the reconnection just failed */
-      if (connected) {
+      /* we keep draining the queues when we are not connected, until the outgoing buffer is full */
+      size_t drained = drainQueues();
+
+      if (d_socket) {
         try {
-          /* we don't want to take the lock while trying to reconnect */
-          std::lock_guard<std::mutex> lock(d_mutex);
-          if (d_socket) { // check if it is set
-            /* if flush() returns false, it means that we couldn't flush anything yet
-               either because there is nothing to flush, or because the outgoing TCP
-               buffer is full. That's fine by us */
-            d_writer.flush(d_socket->getHandle());
-          }
-          else {
-            connected = false;
-          }
+          /* if flush() returns false, it means that we couldn't flush anything yet
+             either because there is nothing to flush, or because the outgoing TCP
+             buffer is full. That's fine by us */
+          d_writer.flush(d_socket->getHandle());
         }
-        catch(const std::exception& e) {
+        catch (const std::exception& e) {
           d_socket.reset();
-          connected = false;
-        }
-
-        if (!connected) {
-          /* let's try to reconnect right away, we are about to sleep anyway */
-          reconnect();
+          /* let's try to reconnect right away */
+          lastConnectionAttempt = 0;
         }
       }
 
-      sleep(d_reconnectWaitTime);
+      if (drained == 0) {
+        /* nothing to do, wait until one of the queues fills up or for the next batch */
+        std::unique_lock<std::mutex> lock(d_wakeUpMutex);
+        d_wakeUp.wait_for(lock, std::chrono::milliseconds(s_flushIntervalMs));
+      }
     }
   }
   catch (const std::exception& e)
@@ -235,6 +354,7 @@ void RemoteLogger::maintenanceThread()
 RemoteLogger::~RemoteLogger()
 {
   d_exiting = true;
+  d_wakeUp.notify_one();
 
   d_thread.join();
 }
@@ -25,9 +25,11 @@
 #endif
 
 #include <atomic>
+#include <condition_variable>
 #include <queue>
 #include <mutex>
 #include <thread>
+#include <vector>
 
 #include "iputils.hh"
 #include "circular_buffer.hh"
@@ -52,11 +54,61 @@ public:
 
   bool hasRoomFor(const std::string& str) const;
   bool write(const std::string& str);
+  /* append data that has already been framed, if there is enough room for it */
+  bool append(const char* data, size_t size);
+  size_t available() const
+  {
+    return d_buffer.capacity() - d_buffer.size();
+  }
   bool flush(int fd);
 private:
   boost::circular_buffer<char> d_buffer;
 };
 
+/* Lock-free queue of frames, prefixed by their size in network byte order like
+   CircularWriteBuffer does, stored in a fixed-size ring of bytes.
+   A frame is either entirely queued or not at all, and the producer never waits
+   for the consumer: when there is not enough room left, the frame is refused.
+
+   This class is only safe to use from one producer thread and one consumer thread.
+*/
+class FrameRingBuffer
+{
+public:
+  /* the size is rounded up to the next power of two */
+  explicit FrameRingBuffer(size_t size);
+
+  /* producer side */
+  bool push(const std::string& frame);
+  /* whether at least half of the ring is used */
+  bool isHalfFull() const;
+  uint64_t getQueued() const
+  {
+    return d_queued.load(std::memory_order_relaxed);
+  }
+  uint64_t getDrops() const
+  {
+    return d_drops.load(std::memory_order_relaxed);
+  }
+
+  /* consumer side, moves as many complete frames as possible to that buffer,
+     in order, and returns the number of frames moved */
+  size_t drainTo(CircularWriteBuffer& writer);
+
+private:
+  void copyIn(size_t pos, const char* src, size_t size);
+  void copyOut(size_t pos, char* dest, size_t size) const;
+
+  std::vector<char> d_buffer;
+  size_t d_mask;
+  /* only written by the producer */
+  alignas(64) std::atomic<size_t> d_head{0};
+  std::atomic<uint64_t> d_queued{0};
+  std::atomic<uint64_t> d_drops{0};
+  /* only written by the consumer */
+  alignas(64) std::atomic<size_t> d_tail{0};
+};
+
 class RemoteLoggerInterface
 {
 public:
@@ -75,9 +127,13 @@ private:
 };
 
 /* Thread safe. Will connect asynchronously on request.
-   Runs a reconnection thread that also periodicall flushes.
+   Every thread queueing data gets its own lock-free queue, so that the
+   threads do not contend with each other. A writer thread moves the
+   queued frames, in batches, to an outgoing buffer that it flushes with
+   writev(), and takes care of reconnecting.
    Note that the buffer only runs as long as there is a connection.
-   If there is no connection we don't buffer a thing
+   If there is no connection we only buffer until the queues are full,
+   dropping the frames that do not fit.
 */
 class RemoteLogger : public RemoteLoggerInterface
 {
@@ -88,29 +144,37 @@ public:
                bool asyncConnect=false);
   ~RemoteLogger();
   void queueData(const std::string& data) override;
-  std::string toString() const override
-  {
-    return d_remote.toStringWithPort() + " (" + std::to_string(d_queued) + " queued, " + std::to_string(d_drops) + " dropped)";
-  }
+  std::string toString() const override;
   void stop()
   {
     d_exiting = true;
   }
 
 private:
+  /* how long the writer thread waits for frames to accumulate, in milliseconds */
+  static const unsigned int s_flushIntervalMs{10};
+
   bool reconnect();
   void maintenanceThread();
+  FrameRingBuffer& getQueue();
+  size_t drainQueues();
 
+  /* only accessed by the writer thread once it has been started */
   CircularWriteBuffer d_writer;
   ComboAddress d_remote;
-  std::atomic<uint64_t> d_drops{0};
-  std::atomic<uint64_t> d_queued{0};
   std::unique_ptr<Socket> d_socket{nullptr};
+  const uint64_t d_id;
+  const size_t d_queueSize;
   uint16_t d_timeout;
   uint8_t d_reconnectWaitTime;
   std::atomic<bool> d_exiting{false};
   bool d_asyncConnect{false};
 
-  std::mutex d_mutex;
+  /* protects the list of per-thread queues, only taken when a new thread starts logging */
+  mutable std::mutex d_queuesMutex;
+  std::vector<std::unique_ptr<FrameRingBuffer>> d_queues;
+  /* lets the writer thread know that one of the queues is filling up */
+  std::mutex d_wakeUpMutex;
+  std::condition_variable d_wakeUp;
   std::thread d_thread;
 };
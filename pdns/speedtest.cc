@@ -10,10 +10,13 @@
 #include <fstream>
 #include "uuid-utils.hh"
 #include "dnssecinfra.hh"
+#include "protozero.hh"
 
 #ifndef RECURSOR
 #include "statbag.hh"
 #include "base64.hh"
+#include "dnsdist.hh"
+#include "dnsdist-cache.hh"
 StatBag S;
 #endif
 
@@ -835,6 +838,117 @@ struct NetmaskTreeTest
   }
 };
 
+struct ProtobufMessageTest
+{
+  /* if 'reuse' is set, the message is built into the same buffer every time, with a question
+     section encoded once, instead of a new buffer with a freshly encoded question */
+  explicit ProtobufMessageTest(bool reuse) : d_reuse(reuse)
+  {
+    pdns::ProtoZero::Message::encodeQuestion(d_encodedQuestion, d_qname, QType::A, QClass::IN);
+  }
+
+  string getName() const
+  {
+    return d_reuse ? "protobuf message, reused buffer and encoded question" : "protobuf message, new buffer";
+  }
+
+  void operator()() const
+  {
+    std::string fresh;
+    std::string& buffer = d_reuse ? d_buffer : fresh;
+    buffer.clear();
+    if (buffer.capacity() < 128) {
+      buffer.reserve(128);
+    }
+
+    pdns::ProtoZero::Message message{buffer};
+    message.setType(pdns::ProtoZero::Message::MessageType::DNSResponseType);
+    if (d_reuse) {
+      message.setRequest(d_uuid, d_requestor, d_local, d_encodedQuestion, 42, false, 512);
+    }
+    else {
+      message.setRequest(d_uuid, d_requestor, d_local, d_qname, QType::A, QClass::IN, 42, false, 512);
+    }
+    message.startResponse();
+    message.setQueryTime(42, 42);
+    message.setResponseCode(0);
+    message.addRR(d_qname, QType::A, QClass::IN, 3600, d_blob.data(), d_blob.size());
+    message.commitResponse();
+  }
+
+  DNSName d_qname{"www.powerdns.com."};
+  ComboAddress d_requestor{"192.0.2.1:4242"};
+  ComboAddress d_local{"192.0.2.2:53"};
+  boost::uuids::uuid d_uuid{getUniqueID()};
+  std::string d_blob{"\x7f\x00\x00\x01", 4};
+  std::string d_encodedQuestion;
+  mutable std::string d_buffer;
+  bool d_reuse;
+};
+
+#ifndef RECURSOR
+struct PacketCacheLookupTest
+{
+  /* looks up, in turn, every entry of a cache filled with 'numberOfEntries' answers */
+  PacketCacheLookupTest(const std::string& engineName, DNSDistPacketCache::Engine engine, size_t numberOfEntries) : d_engineName(engineName), d_cache(std::make_shared<DNSDistPacketCache>(numberOfEntries * 2, 86400, 0, 60, 3600, 60, false, 20, true, false, engine))
+  {
+    gettime(&d_queryTime);
+    d_names.reserve(numberOfEntries);
+    d_queries.reserve(numberOfEntries);
+
+    for (size_t counter = 0; counter < numberOfEntries; ++counter) {
+      d_names.push_back(DNSName(std::to_string(counter) + ".powerdns.com."));
+      const auto& name = d_names.back();
+
+      PacketBuffer query;
+      GenericDNSPacketWriter<PacketBuffer> pwQ(query, name, QType::A, QClass::IN, 0);
+      pwQ.getHeader()->rd = 1;
+
+      PacketBuffer response;
+      GenericDNSPacketWriter<PacketBuffer> pwR(response, name, QType::A, QClass::IN, 0);
+      pwR.getHeader()->rd = 1;
+      pwR.getHeader()->ra = 1;
+      pwR.getHeader()->qr = 1;
+      pwR.startRecord(name, QType::A, 7200, QClass::IN, DNSResourceRecord::ANSWER);
+      pwR.xfr32BitInt(0x01020304);
+      pwR.commit();
+
+      PacketBuffer copy(query);
+      uint32_t key = 0;
+      boost::optional<Netmask> subnet;
+      DNSQuestion dq(&name, QType::A, QClass::IN, &d_remote, &d_remote, copy, false, &d_queryTime);
+      d_cache->get(dq, 0, &key, subnet, false);
+      d_cache->insert(key, subnet, *(getFlagsFromDNSHeader(dq.getHeader())), false, name, QType::A, QClass::IN, response, false, 0, boost::none);
+      d_queries.push_back(std::move(query));
+    }
+  }
+
+  string getName() const
+  {
+    return "packet cache lookup, " + d_engineName + " engine, " + std::to_string(d_names.size()) + " entries";
+  }
+
+  void operator()() const
+  {
+    const auto idx = d_idx++ % d_names.size();
+    d_query = d_queries.at(idx);
+    uint32_t key = 0;
+    boost::optional<Netmask> subnet;
+    DNSQuestion dq(&d_names.at(idx), QType::A, QClass::IN, &d_remote, &d_remote, d_query, false, &d_queryTime);
+    g_ret = d_cache->get(dq, 0, &key, subnet, false);
+  }
+
+  std::string d_engineName;
+  std::shared_ptr<DNSDistPacketCache> d_cache;
+  std::vector<DNSName> d_names;
+  std::vector<PacketBuffer> d_queries;
+  ComboAddress d_remote;
+  struct timespec d_queryTime;
+  mutable PacketBuffer d_query;
+  mutable size_t d_idx{0};
+};
+#endif
+
 struct UUIDGenTest
 {
   string getName() const { return "UUIDGenTest"; }
@@ -949,6 +1063,14 @@ try
 
   doRun(UUIDGenTest());
 
+  doRun(ProtobufMessageTest(false));
+  doRun(ProtobufMessageTest(true));
+
+#ifndef RECURSOR
+  doRun(PacketCacheLookupTest("map", DNSDistPacketCache::Engine::UnorderedMap, 500000));
+  doRun(PacketCacheLookupTest("flat", DNSDistPacketCache::Engine::OpenAddressing, 500000));
+#endif
+
   doRun(NSEC3HashTest(1, "ABCD"));
   doRun(NSEC3HashTest(10, "ABCD"));
   doRun(NSEC3HashTest(50, "ABCD"));
@@ -60,6 +60,17 @@ void StatNode::submit(const DNSName& domain, int rcode, unsigned int bytes, boos
   children[*last].submit(last, tmp.begin(), "", rcode, bytes, remote, 1);
 }
 
+void StatNode::submit(const DNSName& domain, const Stat& stat)
+{
+  std::vector<string> tmp = domain.getRawLabels();
+  if (tmp.empty()) {
+    return;
+  }
+
+  auto last = tmp.end() - 1;
+  children[*last].submit(last, tmp.begin(), "", stat, 1);
+}
+
 /* www.powerdns.com. -> 
    .                 <- fullnames
    com.
@@ -125,3 +136,29 @@ void StatNode::submit(std::vector<string>::const_iterator end, std::vector<strin
     children[*end].submit(end, begin, fullname, rcode, bytes, remote, count+1);
   }
 }
+
+void StatNode::submit(std::vector<string>::const_iterator end, std::vector<string>::const_iterator begin, const std::string& domain, const Stat& stat, unsigned int count)
+{
+  if (name.empty()) {
+    name=*end;
+  }
+
+  if (fullname.empty()) {
+    size_t needed = name.size() + 1 + domain.size();
+    if (fullname.capacity() < needed) {
+      fullname.reserve(needed);
+    }
+    fullname = name;
+    fullname.append(".");
+    fullname.append(domain);
+    labelsCount = count;
+  }
+
+  if (end == begin) {
+    s += stat;
+  }
+  else {
+    --end;
+    children[*end].submit(end, begin, fullname, stat, count+1);
+  }
+}
@@ -2,6 +2,8 @@
 #define BOOST_TEST_NO_MAIN
 
 #include <boost/test/unit_test.hpp>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "ednscookies.hh"
 #include "ednsoptions.hh"
@@ -222,6 +224,115 @@ BOOST_AUTO_TEST_CASE(test_PacketCacheSharded) {
   }
 }
 
+BOOST_AUTO_TEST_CASE(test_PacketCacheOpenAddressing) {
+  const size_t maxEntries = 150000;
+  const size_t numberOfShards = 10;
+  DNSDistPacketCache PC(maxEntries, 86400, 1, 60, 3600, 60, false, numberOfShards, true, false, DNSDistPacketCache::Engine::OpenAddressing);
+  BOOST_CHECK(PC.getEngine() == DNSDistPacketCache::Engine::OpenAddressing);
+  BOOST_CHECK_EQUAL(PC.getSize(), 0U);
+  struct timespec queryTime;
+  gettime(&queryTime);  // does not have to be accurate ("realTime") in tests
+
+  size_t counter = 0;
+  size_t skipped = 0;
+  ComboAddress remote;
+  bool dnssecOK = false;
+  const time_t now = time(nullptr);
+
+  try {
+    for (counter = 0; counter < 100000; ++counter) {
+      DNSName a(std::to_string(counter) + ".powerdns.com.");
+
+      PacketBuffer query;
+      GenericDNSPacketWriter<PacketBuffer> pwQ(query, a, QType::A, QClass::IN, 0);
+      pwQ.getHeader()->rd = 1;
+
+      PacketBuffer response;
+      GenericDNSPacketWriter<PacketBuffer> pwR(response, a, QType::A, QClass::IN, 0);
+      pwR.getHeader()->rd = 1;
+      pwR.getHeader()->ra = 1;
+      pwR.getHeader()->qr = 1;
+      pwR.getHeader()->id = pwQ.getHeader()->id;
+      pwR.startRecord(a, QType::A, 7200, QClass::IN, DNSResourceRecord::ANSWER);
+      pwR.xfr32BitInt(0x01020304);
+      pwR.commit();
+
+      uint32_t key = 0;
+      boost::optional<Netmask> subnet;
+      DNSQuestion dq(&a, QType::A, QClass::IN, &remote, &remote, query, false, &queryTime);
+      bool found = PC.get(dq, 0, &key, subnet, dnssecOK);
+      BOOST_CHECK_EQUAL(found, false);
+
+      PC.insert(key, subnet, *(getFlagsFromDNSHeader(dq.getHeader())), dnssecOK, a, QType::A, QClass::IN, response, false, 0, boost::none);
+
+      found = PC.get(dq, pwR.getHeader()->id, &key, subnet, dnssecOK, 0, true);
+      if (found == true) {
+        BOOST_CHECK_EQUAL(dq.getData().size(), response.size());
+        int match = memcmp(dq.getData().data(), response.data(), dq.getData().size());
+        BOOST_CHECK_EQUAL(match, 0);
+      }
+      else {
+        skipped++;
+      }
+    }
+
+    BOOST_CHECK_EQUAL(skipped, PC.getInsertCollisions());
+    BOOST_CHECK_EQUAL(PC.getSize(), counter - skipped);
+
+    /* remove every other entry among the first 400 ones, which shifts the remaining entries of the probe sequences around */
+    size_t deleted = 0;
+    for (counter = 0; counter < 400; counter += 2) {
+      deleted += PC.expungeByName(DNSName(std::to_string(counter) + ".powerdns.com."));
+    }
+    BOOST_CHECK_EQUAL(PC.getSize(), 100000U - skipped - deleted);
+
+    size_t matches = 0;
+    for (counter = 0; counter < 100000; ++counter) {
+      DNSName a(std::to_string(counter) + ".powerdns.com.");
+
+      PacketBuffer query;
+      GenericDNSPacketWriter<PacketBuffer> pwQ(query, a, QType::A, QClass::IN, 0);
+      pwQ.getHeader()->rd = 1;
+      uint32_t key = 0;
+      boost::optional<Netmask> subnet;
+      DNSQuestion dq(&a, QType::A, QClass::IN, &remote, &remote, query, false, &queryTime);
+      bool found = PC.get(dq, pwQ.getHeader()->id, &key, subnet, dnssecOK);
+      if (counter < 400 && counter % 2 == 0) {
+        BOOST_CHECK_EQUAL(found, false);
+      }
+      else if (found) {
+        matches++;
+      }
+    }
+
+    BOOST_CHECK_EQUAL(matches, PC.getSize());
+
+    auto remaining = PC.getSize();
+
+    /* no entry should have expired */
+    BOOST_CHECK_EQUAL(PC.purgeExpired(0, now), 0U);
+
+    /* but after the TTL .. let's ask for at most 1k entries */
+    auto removed = PC.purgeExpired(1000, now + 7200 + 3600);
+    BOOST_CHECK_EQUAL(removed, remaining - 1000U);
+    BOOST_CHECK_EQUAL(PC.getSize(), 1000U);
+
+    /* keep only 100 entries */
+    removed = PC.expunge(100);
+    BOOST_CHECK_EQUAL(removed, 900U);
+    BOOST_CHECK_EQUAL(PC.getSize(), 100U);
+
+    /* now remove everything */
+    removed = PC.expungeByName(DNSName("powerdns.com."), QType::ANY, true);
+    BOOST_CHECK_EQUAL(removed, 100U);
+    BOOST_CHECK_EQUAL(PC.getSize(), 0U);
+  }
+  catch (const PDNSException& e) {
+    cerr<<"Had error: "<<e.reason<<endl;
+    throw;
+  }
+}
+
 BOOST_AUTO_TEST_CASE(test_PacketCacheServFailTTL) {
   const size_t maxEntries = 150000;
   DNSDistPacketCache PC(maxEntries, 86400, 1);
@@ -585,7 +696,7 @@ BOOST_AUTO_TEST_CASE(test_PCCollision) {
           ednsOptions.push_back(std::make_pair(EDNSOptionCode::ECS, makeEDNSSubnetOptsString(opt)));
           pwFQ.addOpt(512, 0, 0, ednsOptions);
           pwFQ.commit();
-          secondKey = pc.getKey(qname.toDNSString(), qname.wirelength(), secondQuery, false);
+          secondKey = pc.getKey(secondQuery, qname.wirelength(), false);
           auto pair = colMap.insert(std::make_pair(secondKey, opt.source));
           total++;
           if (!pair.second) {
@@ -655,4 +766,318 @@ BOOST_AUTO_TEST_CASE(test_PCDNSSECCollision) {
 
 }
 
+BOOST_AUTO_TEST_CASE(test_PacketCacheQueryCollapsing) {
+  DNSDistPacketCache PC(1000, 86400, 0, 60, 3600, 60, false, 4);
+  BOOST_CHECK(!PC.isQueryCollapsingEnabled());
+  /* at most 2 waiters, for at most 500 ms */
+  PC.setQueryCollapsing(2, 500);
+  BOOST_CHECK(PC.isQueryCollapsingEnabled());
+
+  const DNSName qname("collapsing.powerdns.com.");
+  const uint16_t qtype = QType::A;
+  const uint16_t flags = 0x0100;
+  const boost::optional<Netmask> subnet;
+  const uint32_t key = 42;
+
+  struct timespec now{1000, 0};
+  auto makeWaiter = [&now](uint16_t id) {
+    InFlightWaiter waiter;
+    waiter.qname = DNSName("COLLAPSING.powerdns.com.");
+    waiter.queryTime = now;
+    waiter.origID = id;
+    return waiter;
+  };
+
+  /* the first one is sent */
+  BOOST_CHECK(PC.addInFlightQuery(key, flags, qname, qtype, QClass::IN, false, subnet, makeWaiter(1)) == DNSDistPacketCache::InFlightResult::Leader);
+  BOOST_CHECK_EQUAL(PC.getInFlightCount(), 1U);
+  /* the next two wait for its response */
+  BOOST_CHECK(PC.addInFlightQuery(key, flags, qname, qtype, QClass::IN, false, subnet, makeWaiter(2)) == DNSDistPacketCache::InFlightResult::Attached);
+  BOOST_CHECK(PC.addInFlightQuery(key, flags, qname, qtype, QClass::IN, false, subnet, makeWaiter(3)) == DNSDistPacketCache::InFlightResult::Attached);
+  /* too many waiters */
+  BOOST_CHECK(PC.addInFlightQuery(key, flags, qname, qtype, QClass::IN, false, subnet, makeWaiter(4)) == DNSDistPacketCache::InFlightResult::NotCollapsed);
+  /* same key but a different query (DO bit) */
+  BOOST_CHECK(PC.addInFlightQuery(key, flags, qname, qtype, QClass::IN, true, subnet, makeWaiter(5)) == DNSDistPacketCache::InFlightResult::NotCollapsed);
+  BOOST_CHECK_EQUAL(PC.getCollapsedQueries(), 2U);
+
+  /* not the right query */
+  auto waiters = PC.takeInFlightWaiters(key, flags, qname, QType::AAAA, QClass::IN, false, subnet);
+  BOOST_CHECK_EQUAL(waiters.size(), 0U);
+
+  waiters = PC.takeInFlightWaiters(key, flags, qname, qtype, QClass::IN, false, subnet);
+  BOOST_REQUIRE_EQUAL(waiters.size(), 2U);
+  BOOST_CHECK_EQUAL(waiters.at(0).origID, 2U);
+  BOOST_CHECK_EQUAL(waiters.at(1).origID, 3U);
+  BOOST_CHECK_EQUAL(PC.getInFlightCount(), 0U);
+  /* the response has been received, nothing is in flight anymore */
+  waiters = PC.takeInFlightWaiters(key, flags, qname, qtype, QClass::IN, false, subnet);
+  BOOST_CHECK_EQUAL(waiters.size(), 0U);
+
+  /* a response that never arrives */
+  BOOST_CHECK(PC.addInFlightQuery(key, flags, qname, qtype, QClass::IN, false, subnet, makeWaiter(6)) == DNSDistPacketCache::InFlightResult::Leader);
+  now.tv_nsec = 400000000;
+  BOOST_CHECK(PC.addInFlightQuery(key, flags, qname, qtype, QClass::IN, false, subnet, makeWaiter(7)) == DNSDistPacketCache::InFlightResult::Attached);
+  /* too late, that one is sent and the existing waiter will get its response */
+  now.tv_nsec = 600000000;
+  BOOST_CHECK(PC.addInFlightQuery(key, flags, qname, qtype, QClass::IN, false, subnet, makeWaiter(8)) == DNSDistPacketCache::InFlightResult::Leader);
+  BOOST_CHECK_EQUAL(PC.purgeInFlight(now), 0U);
+  BOOST_CHECK_EQUAL(PC.getInFlightCount(), 1U);
+
+  /* the waiter has now been waiting for too long */
+  now.tv_sec += 1;
+  BOOST_CHECK_EQUAL(PC.purgeInFlight(now), 1U);
+  BOOST_CHECK_EQUAL(PC.getCollapsedTimeouts(), 1U);
+  BOOST_CHECK_EQUAL(PC.getInFlightCount(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(test_PacketCachePrefetch) {
+  DNSDistPacketCache PC(1000, 86400, 0, 60, 3600, 60, false, 4);
+  BOOST_CHECK(!PC.isPrefetchEnabled());
+  BOOST_CHECK(!PC.tracksInFlightQueries());
+
+  ComboAddress remote;
+  const DNSName qname("prefetch.powerdns.com.");
+  const uint16_t qtype = QType::A;
+  const uint16_t qid = 0x4242;
+  struct timespec queryTime{1000, 0};
+
+  PacketBuffer query;
+  GenericDNSPacketWriter<PacketBuffer> pwQ(query, qname, qtype, QClass::IN, 0);
+  pwQ.getHeader()->rd = 1;
+  pwQ.getHeader()->id = qid;
+  const PacketBuffer originalQuery = query;
+  const uint16_t queryFlags = *(getFlagsFromDNSHeader(pwQ.getHeader()));
+
+  PacketBuffer response;
+  GenericDNSPacketWriter<PacketBuffer> pwR(response, qname, qtype, QClass::IN, 0);
+  pwR.getHeader()->rd = 1;
+  pwR.getHeader()->ra = 1;
+  pwR.getHeader()->qr = 1;
+  pwR.getHeader()->id = qid;
+  pwR.startRecord(qname, qtype, 100, QClass::IN, DNSResourceRecord::ANSWER);
+  pwR.xfr32BitInt(0x01020304);
+  pwR.commit();
+
+  uint32_t key = 0;
+  boost::optional<Netmask> subnet;
+  {
+    DNSQuestion dq(&qname, qtype, QClass::IN, &remote, &remote, query, false, &queryTime);
+    BOOST_CHECK(!PC.get(dq, qid, &key, subnet, false));
+  }
+  PC.insert(key, subnet, queryFlags, false, qname, qtype, QClass::IN, response, false, 0, boost::none);
+
+  /* disabled, a hit does not request a refresh */
+  PacketBuffer refreshQuery;
+  query = originalQuery;
+  {
+    DNSQuestion dq(&qname, qtype, QClass::IN, &remote, &remote, query, false, &queryTime);
+    BOOST_CHECK(PC.get(dq, qid, &key, subnet, false, 0, false, &refreshQuery));
+    BOOST_CHECK(refreshQuery.empty());
+  }
+
+  /* the entry has just been inserted, nowhere near the end of its TTL */
+  PC.setPrefetchPercentage(10);
+  BOOST_CHECK(PC.isPrefetchEnabled());
+  BOOST_CHECK(PC.tracksInFlightQueries());
+  query = originalQuery;
+  {
+    DNSQuestion dq(&qname, qtype, QClass::IN, &remote, &remote, query, false, &queryTime);
+    BOOST_CHECK(PC.get(dq, qid, &key, subnet, false, 0, false, &refreshQuery));
+    BOOST_CHECK(refreshQuery.empty());
+  }
+
+  /* every hit is now close enough to the end of the TTL */
+  PC.setPrefetchPercentage(100);
+  query = originalQuery;
+  {
+    DNSQuestion dq(&qname, qtype, QClass::IN, &remote, &remote, query, false, &queryTime);
+    BOOST_CHECK(PC.get(dq, qid, &key, subnet, false, 0, false, &refreshQuery));
+    /* we got the response, and the query to send */
+    BOOST_CHECK(query == response);
+    BOOST_CHECK(refreshQuery == originalQuery);
+  }
+  BOOST_CHECK_EQUAL(PC.getPrefetches(), 1U);
+  BOOST_CHECK_EQUAL(PC.getInFlightCount(), 1U);
+
+  /* a refresh is already in flight */
+  refreshQuery.clear();
+  query = originalQuery;
+  {
+    DNSQuestion dq(&qname, qtype, QClass::IN, &remote, &remote, query, false, &queryTime);
+    BOOST_CHECK(PC.get(dq, qid, &key, subnet, false, 0, false, &refreshQuery));
+    BOOST_CHECK(refreshQuery.empty());
+  }
+  BOOST_CHECK_EQUAL(PC.getPrefetches(), 1U);
+
+  /* the response to the refresh arrives, nobody was waiting for it */
+  auto waiters = PC.takeInFlightWaiters(key, queryFlags, qname, qtype, QClass::IN, false, subnet);
+  BOOST_CHECK_EQUAL(waiters.size(), 0U);
+  BOOST_CHECK_EQUAL(PC.getInFlightCount(), 0U);
+
+  query = originalQuery;
+  {
+    DNSQuestion dq(&qname, qtype, QClass::IN, &remote, &remote, query, false, &queryTime);
+    BOOST_CHECK(PC.get(dq, qid, &key, subnet, false, 0, false, &refreshQuery));
+    BOOST_CHECK(refreshQuery == originalQuery);
+  }
+  BOOST_CHECK_EQUAL(PC.getPrefetches(), 2U);
+
+  /* that response never arrives, the next hit after the maximum wait time requests a new refresh */
+  refreshQuery.clear();
+  queryTime.tv_sec += 2;
+  query = originalQuery;
+  {
+    DNSQuestion dq(&qname, qtype, QClass::IN, &remote, &remote, query, false, &queryTime);
+    BOOST_CHECK(PC.get(dq, qid, &key, subnet, false, 0, false, &refreshQuery));
+    BOOST_CHECK(refreshQuery == originalQuery);
+  }
+  BOOST_CHECK_EQUAL(PC.getPrefetches(), 3U);
+
+  /* and the lost one is eventually forgotten */
+  queryTime.tv_sec += 2;
+  BOOST_CHECK_EQUAL(PC.purgeInFlight(queryTime), 0U);
+  BOOST_CHECK_EQUAL(PC.getInFlightCount(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(test_PacketCacheSnapshot) {
+  const size_t maxEntries = 1000;
+  DNSDistPacketCache PC(maxEntries, 86400, 0, 60, 3600, 60, false, 4, true, true, DNSDistPacketCache::Engine::OpenAddressing);
+
+  char snapshotPath[] = "/tmp/test_dnsdist_cache_snapshot.XXXXXX";
+  int fd = mkstemp(snapshotPath);
+  BOOST_REQUIRE(fd >= 0);
+  close(fd);
+
+  ComboAddress remote;
+  struct timespec queryTime;
+  gettime(&queryTime);
+  const size_t count = 100;
+  for (size_t idx = 0; idx < count; idx++) {
+    DNSName qname(std::to_string(idx) + ".snapshot.powerdns.com.");
+    PacketBuffer query;
+    GenericDNSPacketWriter<PacketBuffer> pwQ(query, qname, QType::A, QClass::IN, 0);
+    pwQ.getHeader()->rd = 1;
+    /* half of them have an ECS option */
+    if (idx % 2) {
+      GenericDNSPacketWriter<PacketBuffer>::optvect_t ednsOptions;
+      EDNSSubnetOpts opt;
+      opt.source = Netmask("192.0.2." + std::to_string(idx) + "/32");
+      ednsOptions.push_back(std::make_pair(EDNSOptionCode::ECS, makeEDNSSubnetOptsString(opt)));
+      pwQ.addOpt(512, 0, 0, ednsOptions);
+      pwQ.commit();
+    }
+
+    PacketBuffer response;
+    GenericDNSPacketWriter<PacketBuffer> pwR(response, qname, QType::A, QClass::IN, 0);
+    pwR.getHeader()->rd = 1;
+    pwR.getHeader()->ra = 1;
+    pwR.getHeader()->qr = 1;
+    pwR.startRecord(qname, QType::A, 3600, QClass::IN, DNSResourceRecord::ANSWER);
+    pwR.xfr32BitInt(0x01020304);
+    pwR.commit();
+
+    uint32_t key = 0;
+    boost::optional<Netmask> subnet;
+    DNSQuestion dq(&qname, QType::A, QClass::IN, &remote, &remote, query, false, &queryTime);
+    BOOST_CHECK(!PC.get(dq, 0, &key, subnet, false));
+    PC.insert(key, subnet, *(getFlagsFromDNSHeader(pwQ.getHeader())), false, qname, QType::A, QClass::IN, response, false, 0, boost::none);
+  }
+  BOOST_CHECK_EQUAL(PC.getSize(), count);
+
+  BOOST_CHECK_EQUAL(PC.saveSnapshot(snapshotPath), count);
+
+  /* a different engine and number of shards */
+  DNSDistPacketCache restored(maxEntries, 86400, 0, 60, 3600, 60, false, 2, true, true);
+  BOOST_CHECK_EQUAL(restored.loadSnapshot(snapshotPath), count);
+  BOOST_CHECK_EQUAL(restored.getSize(), count);
+
+  for (size_t idx = 0; idx < count; idx++) {
+    DNSName qname(std::to_string(idx) + ".snapshot.powerdns.com.");
+    PacketBuffer query;
+    GenericDNSPacketWriter<PacketBuffer> pwQ(query, qname, QType::A, QClass::IN, 0);
+    pwQ.getHeader()->rd = 1;
+    if (idx % 2) {
+      GenericDNSPacketWriter<PacketBuffer>::optvect_t ednsOptions;
+      EDNSSubnetOpts opt;
+      opt.source = Netmask("192.0.2." + std::to_string(idx) + "/32");
+      ednsOptions.push_back(std::make_pair(EDNSOptionCode::ECS, makeEDNSSubnetOptsString(opt)));
+      pwQ.addOpt(512, 0, 0, ednsOptions);
+      pwQ.commit();
+    }
+
+    uint32_t key = 0;
+    boost::optional<Netmask> subnet;
+    DNSQuestion dq(&qname, QType::A, QClass::IN, &remote, &remote, query, false, &queryTime);
+    BOOST_CHECK(restored.get(dq, 0, &key, subnet, false));
+    if (idx % 2) {
+      BOOST_REQUIRE(subnet);
+      BOOST_CHECK_EQUAL(subnet->toString(), "192.0.2." + std::to_string(idx) + "/32");
+    }
+  }
+
+  /* the keys would not match */
+  DNSDistPacketCache cookieHashing(maxEntries, 86400, 0, 60, 3600, 60, false, 1, true, true);
+  cookieHashing.setCookieHashing(true);
+  BOOST_CHECK_THROW(cookieHashing.loadSnapshot(snapshotPath), std::runtime_error);
+
+  /* neither would the keys of the queries with an ECS option */
+  DNSDistPacketCache noECSParsing(maxEntries);
+  BOOST_CHECK_THROW(noECSParsing.loadSnapshot(snapshotPath), std::runtime_error);
+
+  /* an entry too small to hold a header and the qname is skipped, the next one and a header-only one are loaded */
+  {
+    std::string snapshot = "DNSDISTPC";
+    snapshot.append({2 /* version */, 0 /* cookie hashing */, 0 /* ECS parsing */});
+    const auto appendEntry = [&snapshot](const DNSName& qname, const std::string& response) {
+      const auto storage = qname.toDNSString();
+      const int64_t added = time(nullptr);
+      const int64_t validity = added + 3600;
+      const uint16_t qtype = QType::A;
+      const uint16_t qclass = QClass::IN;
+      const uint16_t queryFlags = 0;
+      const uint16_t len = response.size();
+      const uint16_t qnameLen = storage.size();
+      const uint32_t key = qname.hash();
+      snapshot.append(reinterpret_cast<const char*>(&key), sizeof(key));
+      snapshot.append(reinterpret_cast<const char*>(&added), sizeof(added));
+      snapshot.append(reinterpret_cast<const char*>(&validity), sizeof(validity));
+      snapshot.append(reinterpret_cast<const char*>(&qtype), sizeof(qtype));
+      snapshot.append(reinterpret_cast<const char*>(&qclass), sizeof(qclass));
+      snapshot.append(reinterpret_cast<const char*>(&queryFlags), sizeof(queryFlags));
+      snapshot.append(reinterpret_cast<const char*>(&len), sizeof(len));
+      snapshot.append(reinterpret_cast<const char*>(&qnameLen), sizeof(qnameLen));
+      snapshot.append({0 /* TCP */, 0 /* DNSSEC OK */, 0 /* no subnet */});
+      snapshot.append(storage);
+      snapshot.append(response);
+    };
+    const DNSName qname("short.snapshot.powerdns.com.");
+    appendEntry(qname, std::string(sizeof(dnsheader) + 4, '\0'));
+    appendEntry(qname, std::string(sizeof(dnsheader), '\0') + qname.toDNSString() + std::string(4, '\0'));
+    appendEntry(DNSName("header-only.snapshot.powerdns.com."), std::string(sizeof(dnsheader), '\0'));
+
+    fd = open(snapshotPath, O_WRONLY | O_TRUNC);
+    BOOST_REQUIRE(fd >= 0);
+    BOOST_REQUIRE_EQUAL(write(fd, snapshot.data(), snapshot.size()), static_cast<ssize_t>(snapshot.size()));
+    close(fd);
+    DNSDistPacketCache crafted(maxEntries);
+    BOOST_CHECK_EQUAL(crafted.loadSnapshot(snapshotPath), 2U);
+    BOOST_CHECK_EQUAL(crafted.getSize(), 2U);
+  }
+
+  /* truncated */
+  BOOST_REQUIRE_EQUAL(truncate(snapshotPath, 64), 0);
+  DNSDistPacketCache truncated(maxEntries);
+  BOOST_CHECK_THROW(truncated.loadSnapshot(snapshotPath), std::runtime_error);
+
+  /* not a snapshot */
+  fd = open(snapshotPath, O_WRONLY | O_TRUNC);
+  BOOST_REQUIRE(fd >= 0);
+  BOOST_REQUIRE_EQUAL(write(fd, "not a snapshot", 14), 14);
+  close(fd);
+  BOOST_CHECK_THROW(truncated.loadSnapshot(snapshotPath), std::runtime_error);
+
+  unlink(snapshotPath);
+  BOOST_CHECK_THROW(truncated.loadSnapshot(snapshotPath), std::runtime_error);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -635,6 +635,68 @@ BOOST_AUTO_TEST_CASE(test_suffixmatch_tree) {
   BOOST_CHECK_EQUAL(count, 0U);
 }
 
+BOOST_AUTO_TEST_CASE(test_suffixmatch_tree_labels) {
+  /* the lookups are done straight from the wire representation, make sure that
+     labels sharing a prefix, escaped characters, case differences and names
+     with a lot of labels are handled the same way than at insertion time */
+  SuffixMatchTree<DNSName> smt;
+  const std::vector<DNSName> names{DNSName("ww.powerdns.com."), DNSName("www.powerdns.com."), DNSName("wwww.powerdns.com."), DNSName("w\\.w.powerdns.com."), DNSName("\\255.powerdns.com.")};
+  for (const auto& name : names) {
+    smt.add(name, DNSName(name));
+  }
+
+  for (const auto& name : names) {
+    BOOST_REQUIRE(smt.lookup(name));
+    BOOST_CHECK_EQUAL(*smt.lookup(name), name);
+    BOOST_REQUIRE(smt.lookup(DNSName("sub") + name));
+    BOOST_CHECK_EQUAL(*smt.lookup(DNSName("sub") + name), name);
+  }
+
+  BOOST_REQUIRE(smt.lookup(DNSName("WWW.PowerDNS.COM.")));
+  BOOST_CHECK_EQUAL(*smt.lookup(DNSName("WWW.PowerDNS.COM.")), DNSName("www.powerdns.com."));
+  BOOST_CHECK(smt.lookup(DNSName("w.powerdns.com.")) == nullptr);
+  BOOST_CHECK(smt.lookup(DNSName("wwwww.powerdns.com.")) == nullptr);
+  BOOST_CHECK(smt.lookup(DNSName("w.w.powerdns.com.")) == nullptr);
+  BOOST_CHECK(smt.lookup(DNSName("powerdns.com.")) == nullptr);
+
+  /* 127 labels, the maximum */
+  smt.add(DNSName("b.c."), DNSName("b.c."));
+  DNSName longName;
+  for (size_t idx = 0; idx < 125; idx++) {
+    longName.appendRawLabel("a");
+  }
+  longName += DNSName("b.c.");
+  BOOST_REQUIRE(smt.lookup(longName));
+  BOOST_CHECK_EQUAL(*smt.lookup(longName), DNSName("b.c."));
+
+  smt.add(longName, DNSName(longName));
+  BOOST_REQUIRE(smt.lookup(longName));
+  BOOST_CHECK_EQUAL(*smt.lookup(longName), longName);
+}
+
+BOOST_AUTO_TEST_CASE(test_suffixmatch_tree_wire) {
+  SuffixMatchTree<DNSName> smt;
+  smt.add(DNSName("powerdns.com."), DNSName("powerdns.com."));
+
+  /* straight from the question section of a query */
+  vector<uint8_t> packet;
+  DNSPacketWriter pw(packet, DNSName("WWW.PowerDNS.com."), QType::A);
+  pw.commit();
+  const auto wireLength = DNSName("www.powerdns.com.").wirelength();
+  const auto wire = reinterpret_cast<const char*>(&packet.at(sizeof(dnsheader)));
+  BOOST_REQUIRE(smt.lookup(wire, wireLength));
+  BOOST_CHECK_EQUAL(*smt.lookup(wire, wireLength), DNSName("powerdns.com."));
+
+  /* the last label does not fit in the buffer */
+  BOOST_CHECK(smt.lookup(wire, wireLength - 2) == nullptr);
+
+  /* the root name */
+  BOOST_CHECK(smt.lookup("", 1) == nullptr);
+  smt.add(g_rootdnsname, DNSName("root."));
+  BOOST_REQUIRE(smt.lookup("", 1));
+  BOOST_CHECK_EQUAL(*smt.lookup("", 1), DNSName("root."));
+}
+
 
 BOOST_AUTO_TEST_CASE(test_concat) {
   DNSName first("www."), second("powerdns.com.");
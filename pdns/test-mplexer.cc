@@ -2,6 +2,8 @@
 #define BOOST_TEST_DYN_LINK
 #define BOOST_TEST_NO_MAIN
 
+#include <map>
+#include <set>
 #include <thread>
 #include <boost/test/unit_test.hpp>
 
@@ -205,5 +207,171 @@ BOOST_AUTO_TEST_CASE(test_MPlexer) {
   close(pipes[1]);
 }
 
+static std::set<int> getExpired(const FDTimerWheel& wheel)
+{
+  std::set<int> result;
+  wheel.forEachExpired([&result](int fd) {
+    result.insert(fd);
+  });
+  return result;
+}
+
+BOOST_AUTO_TEST_CASE(test_TimerWheel) {
+  FDTimerWheel wheel;
+  /* roughly the number of milliseconds since the epoch */
+  const uint64_t start = 1600000000000ULL;
+
+  wheel.advance(start);
+  BOOST_CHECK_EQUAL(wheel.size(), 0U);
+  BOOST_CHECK_EQUAL(getExpired(wheel).size(), 0U);
+
+  /* already expired */
+  wheel.arm(0, start - 5000);
+  /* in the same slot of the first level */
+  wheel.arm(1, start + 1);
+  /* several levels up */
+  wheel.arm(2, start + 10000);
+  wheel.arm(3, start + 3600 * 1000);
+  /* very far away */
+  wheel.arm(4, start + 365ULL * 86400 * 1000);
+  BOOST_CHECK_EQUAL(wheel.size(), 5U);
+  BOOST_CHECK(getExpired(wheel) == std::set<int>({0}));
+
+  wheel.advance(start + 1);
+  BOOST_CHECK(getExpired(wheel) == std::set<int>({0, 1}));
+
+  /* time going backward does not change anything */
+  wheel.advance(start - 10000);
+  BOOST_CHECK(getExpired(wheel) == std::set<int>({0, 1}));
+
+  wheel.advance(start + 9999);
+  BOOST_CHECK(getExpired(wheel) == std::set<int>({0, 1}));
+  wheel.advance(start + 10000);
+  BOOST_CHECK(getExpired(wheel) == std::set<int>({0, 1, 2}));
+
+  /* re-arming moves the timer back into the wheel */
+  wheel.arm(0, start + 20000);
+  BOOST_CHECK(getExpired(wheel) == std::set<int>({1, 2}));
+  wheel.disarm(1);
+  wheel.disarm(1);
+  BOOST_CHECK_EQUAL(wheel.size(), 4U);
+  BOOST_CHECK(getExpired(wheel) == std::set<int>({2}));
+
+  /* a large jump */
+  wheel.advance(start + 2 * 3600 * 1000);
+  BOOST_CHECK(getExpired(wheel) == std::set<int>({0, 2, 3}));
+  wheel.advance(start + 400ULL * 86400 * 1000);
+  BOOST_CHECK(getExpired(wheel) == std::set<int>({0, 2, 3, 4}));
+
+  /* unknown FDs are ignored */
+  wheel.disarm(-1);
+  wheel.disarm(4242);
+  BOOST_CHECK_EQUAL(wheel.size(), 4U);
+
+  /* negative FDs are not valid but they can be registered to the multiplexer */
+  wheel.arm(-1, start + 400ULL * 86400 * 1000 + 1);
+  wheel.arm(-2, start);
+  BOOST_CHECK_EQUAL(wheel.size(), 6U);
+  BOOST_CHECK(getExpired(wheel) == std::set<int>({-2, 0, 2, 3, 4}));
+  wheel.advance(start + 400ULL * 86400 * 1000 + 1);
+  BOOST_CHECK(getExpired(wheel) == std::set<int>({-2, -1, 0, 2, 3, 4}));
+  wheel.disarm(-1);
+  wheel.disarm(-2);
+  BOOST_CHECK(getExpired(wheel) == std::set<int>({0, 2, 3, 4}));
+}
+
+BOOST_AUTO_TEST_CASE(test_TimerWheel_Random) {
+  /* compare with a simple reference implementation, with random timers and time jumps */
+  FDTimerWheel wheel;
+  std::map<int, uint64_t> reference;
+  uint64_t now = 1600000000000ULL;
+  wheel.advance(now);
+  std::srand(42);
+
+  for (size_t round = 0; round < 2000; round++) {
+    for (size_t idx = 0; idx < 50; idx++) {
+      /* a few negative ones as well */
+      const int fd = (std::rand() % 1010) - 10;
+      const auto action = std::rand() % 4;
+      if (action == 0) {
+        wheel.disarm(fd);
+        reference.erase(fd);
+      }
+      else {
+        /* mostly short timeouts, and a few long ones */
+        const uint64_t delay = action == 1 ? (std::rand() % 100000000) : (std::rand() % 5000);
+        wheel.arm(fd, now + delay);
+        reference[fd] = now + delay;
+      }
+    }
+
+    now += (round % 100 == 0) ? (std::rand() % 100000000) : (std::rand() % 2000);
+    wheel.advance(now);
+
+    std::set<int> expected;
+    for (const auto& entry : reference) {
+      if (entry.second <= now) {
+        expected.insert(entry.first);
+      }
+    }
+    BOOST_REQUIRE(getExpired(wheel) == expected);
+    BOOST_REQUIRE_EQUAL(wheel.size(), reference.size());
+
+    /* remove the expired ones, as the users of the multiplexer do */
+    for (const auto fd : expected) {
+      wheel.disarm(fd);
+      reference.erase(fd);
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_TimerWheel_Bench) {
+#ifdef BENCH_MPLEXER
+  const size_t count = 1000000;
+  FDTimerWheel wheel;
+  uint64_t now = 1600000000000ULL;
+  wheel.advance(now);
+
+  DTime dt;
+  dt.set();
+  for (size_t fd = 0; fd < count; fd++) {
+    wheel.arm(fd, now + 1000 + (fd % 30000));
+  }
+  cerr<<"arming "<<count<<" timers took "<<dt.udiff()<<" us"<<endl;
+
+  /* every connection is active, pushing its timer back */
+  dt.set();
+  for (size_t fd = 0; fd < count; fd++) {
+    wheel.arm(fd, now + 2000 + (fd % 30000));
+  }
+  cerr<<"re-arming "<<count<<" timers took "<<dt.udiff()<<" us"<<endl;
+
+  /* then every one of them expires, one millisecond at a time */
+  size_t expired = 0;
+  dt.set();
+  for (size_t ms = 0; ms < 33000; ms++) {
+    now++;
+    wheel.advance(now);
+    std::vector<int> fds;
+    wheel.forEachExpired([&fds](int fd) {
+      fds.push_back(fd);
+    });
+    for (const auto fd : fds) {
+      wheel.disarm(fd);
+    }
+    expired += fds.size();
+  }
+  cerr<<"expiring "<<expired<<" timers took "<<dt.udiff()<<" us"<<endl;
+
+  dt.set();
+  for (size_t fd = 0; fd < count; fd++) {
+    wheel.arm(fd, now + 1000 + (fd % 30000));
+  }
+  for (size_t fd = 0; fd < count; fd++) {
+    wheel.disarm(fd);
+  }
+  cerr<<"arming and disarming "<<count<<" timers took "<<dt.udiff()<<" us"<<endl;
+#endif /* BENCH_MPLEXER */
+}
 
 BOOST_AUTO_TEST_SUITE_END()
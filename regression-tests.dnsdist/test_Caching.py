@@ -852,6 +852,74 @@ class TestTempFailureCacheTTLAction(DNSDistTest):
         self.assertEquals(receivedResponse, response)
 
 
+class TestCachingPrefetch(DNSDistTest):
+
+    _config_template = """
+    pc = newPacketCache(100, {maxTTL=86400, minTTL=1, prefetchPercentage=50})
+    getPool(""):setCache(pc)
+    newServer{address="127.0.0.1:%d"}
+    """
+
+    def testPrefetch(self):
+        """
+        Cache: Entries are refreshed before they expire
+
+        dnsdist is configured to refresh the entries that have less than half
+        of their TTL remaining. We fill the cache, wait for more than half of
+        the TTL, then check that the next query is still answered from the
+        cache while a refresh is sent to the backend, and that the following
+        queries get the refreshed entry.
+        """
+        ttl = 4
+        name = 'prefetch.cache.tests.powerdns.com.'
+        query = dns.message.make_query(name, 'AAAA', 'IN')
+        response = dns.message.make_response(query)
+        rrset = dns.rrset.from_text(name,
+                                    ttl,
+                                    dns.rdataclass.IN,
+                                    dns.rdatatype.AAAA,
+                                    '::1')
+        response.answer.append(rrset)
+        refreshedResponse = dns.message.make_response(query)
+        refreshedRRset = dns.rrset.from_text(name,
+                                             ttl,
+                                             dns.rdataclass.IN,
+                                             dns.rdatatype.AAAA,
+                                             '2001:db8::1')
+        refreshedResponse.answer.append(refreshedRRset)
+
+        # first query to fill the cache
+        (receivedQuery, receivedResponse) = self.sendUDPQuery(query, response)
+        self.assertTrue(receivedQuery)
+        self.assertTrue(receivedResponse)
+        receivedQuery.id = query.id
+        self.assertEquals(query, receivedQuery)
+        self.assertEquals(receivedResponse, response)
+
+        # more than half of the TTL has elapsed
+        time.sleep(ttl / 2 + 0.5)
+
+        # this one is still answered from the cache, but the entry is refreshed
+        (receivedQuery, receivedResponse) = self.sendUDPQuery(query, refreshedResponse)
+        self.assertTrue(receivedQuery)
+        self.assertTrue(receivedResponse)
+        receivedQuery.id = query.id
+        self.assertEquals(query, receivedQuery)
+        self.assertEquals(receivedResponse.answer[0].items, rrset.items)
+        self.assertLess(receivedResponse.answer[0].ttl, ttl)
+
+        # give the response to the refresh some time to be inserted
+        time.sleep(0.2)
+
+        (_, receivedResponse) = self.sendUDPQuery(query, response=None, useQueue=False)
+        self.assertEquals(receivedResponse.answer[0].items, refreshedRRset.items)
+
+        total = 0
+        for key in self._responsesCounter:
+            total += self._responsesCounter[key]
+
+        self.assertEquals(total, 2)
+
 class TestCachingWithExistingEDNS(DNSDistTest):
 
     _config_template = """
@@ -0,0 +1,169 @@
+#!/usr/bin/env python
+import dns
+import requests
+import socket
+from dnsdisttests import DNSDistTest
+
+class IOUringHelpers(object):
+    _webTimeout = 2.0
+    _webServerPort = 8083
+    _webServerAPIKey = 'apisecret'
+
+    def getFrontendsUDPSyscalls(self):
+        headers = {'x-api-key': self._webServerAPIKey}
+        url = 'http://127.0.0.1:' + str(self._webServerPort) + '/api/v1/servers/localhost'
+        r = requests.get(url, headers=headers, timeout=self._webTimeout)
+        self.assertTrue(r)
+        self.assertEquals(r.status_code, 200)
+        content = r.json()
+        result = {}
+        for frontend in content['frontends']:
+            if frontend['udp']:
+                result[frontend['address']] = frontend['udpSyscalls']
+        return result
+
+    def checkForwarded(self, name, port=None):
+        query = dns.message.make_query(name, 'A', 'IN')
+        response = dns.message.make_response(query)
+        rrset = dns.rrset.from_text(name,
+                                    3600,
+                                    dns.rdataclass.IN,
+                                    dns.rdatatype.A,
+                                    '127.0.0.1')
+        response.answer.append(rrset)
+
+        if port is None:
+            (receivedQuery, receivedResponse) = self.sendUDPQuery(query, response)
+        else:
+            self._toResponderQueue.put(response, True, 2.0)
+            sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+            sock.settimeout(2.0)
+            sock.connect(("127.0.0.1", port))
+            sock.send(query.to_wire())
+            receivedResponse = dns.message.from_wire(sock.recv(4096))
+            sock.close()
+            receivedQuery = self._fromResponderQueue.get(True, 2.0)
+
+        self.assertTrue(receivedQuery)
+        self.assertTrue(receivedResponse)
+        receivedQuery.id = query.id
+        self.assertEquals(query, receivedQuery)
+        self.assertEquals(response, receivedResponse)
+
+class IOUringTest(IOUringHelpers):
+    """
+    Queries forwarded to the backend and self-answered ones should get the same responses
+    whether the UDP frontend uses io_uring or falls back to the regular receive loop,
+    which happens when dnsdist is built without liburing or when the kernel does not
+    support multishot receives.
+    """
+
+    def testForwarded(self):
+        """
+        io_uring: Queries forwarded to the backend
+        """
+        for idx in range(10):
+            self.checkForwarded(str(idx) + '.forwarded.iouring.tests.powerdns.com.')
+
+    def testSelfAnswered(self):
+        """
+        io_uring: Self-answered queries, sent as immediate responses
+        """
+        name = 'spoofed.iouring.tests.powerdns.com.'
+        query = dns.message.make_query(name, 'A', 'IN')
+        query.flags &= ~dns.flags.RD
+        expectedResponse = dns.message.make_response(query)
+        rrset = dns.rrset.from_text(name,
+                                    60,
+                                    dns.rdataclass.IN,
+                                    dns.rdatatype.A,
+                                    '192.0.2.1')
+        expectedResponse.answer.append(rrset)
+
+        for _ in range(10):
+            (_, receivedResponse) = self.sendUDPQuery(query, response=None, useQueue=False)
+            self.assertTrue(receivedResponse)
+            self.assertEquals(expectedResponse, receivedResponse)
+
+    def testBurst(self):
+        """
+        io_uring: A burst of self-answered queries, all of them answered
+        """
+        name = 'burst.spoofed.iouring.tests.powerdns.com.'
+        count = 100
+        sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        sock.settimeout(2.0)
+        sock.connect(("127.0.0.1", self._dnsDistPort))
+        queries = {}
+        for idx in range(count):
+            query = dns.message.make_query(name, 'A', 'IN')
+            query.id = idx
+            queries[idx] = query
+            sock.send(query.to_wire())
+
+        for _ in range(count):
+            response = dns.message.from_wire(sock.recv(4096))
+            self.assertIn(response.id, queries)
+            self.assertTrue(response.is_response(queries[response.id]))
+            del queries[response.id]
+        sock.close()
+        self.assertEquals(len(queries), 0)
+
+        # the number of system calls is reported in both cases
+        syscalls = self.getFrontendsUDPSyscalls()
+        self.assertEquals(len(syscalls), 1)
+        for address in syscalls:
+            self.assertGreater(syscalls[address], 0)
+
+class TestIOUring(IOUringTest, DNSDistTest):
+
+    _config_params = ['_dnsDistPort', '_testServerPort', '_webServerPort', '_webServerAPIKey']
+    _config_template = """
+    setUDPMultipleMessagesVectorSize(10)
+    setLocal("127.0.0.1:%s", {ioUring=true})
+    addAction(SuffixMatchNodeRule("spoofed.iouring.tests.powerdns.com."), SpoofAction("192.0.2.1"))
+    newServer{address="127.0.0.1:%s"}
+    webserver("127.0.0.1:%s")
+    setWebserverConfig({apiKey="%s"})
+    """
+    _skipListeningOnCL = True
+
+class TestRecvmmsgWithoutIOUring(IOUringTest, DNSDistTest):
+
+    _config_params = ['_dnsDistPort', '_testServerPort', '_webServerPort', '_webServerAPIKey']
+    _config_template = """
+    setUDPMultipleMessagesVectorSize(10)
+    setLocal("127.0.0.1:%s")
+    addAction(SuffixMatchNodeRule("spoofed.iouring.tests.powerdns.com."), SpoofAction("192.0.2.1"))
+    newServer{address="127.0.0.1:%s"}
+    webserver("127.0.0.1:%s")
+    setWebserverConfig({apiKey="%s"})
+    """
+    _skipListeningOnCL = True
+
+class TestIOUringGroup(IOUringHelpers, DNSDistTest):
+
+    _dnsDistPort2 = 5341
+    _config_params = ['_dnsDistPort', '_dnsDistPort2', '_testServerPort', '_webServerPort', '_webServerAPIKey']
+    _config_template = """
+    setUDPMultipleMessagesVectorSize(10)
+    setLocal("127.0.0.1:%s", {ioUringGroup=1})
+    addLocal("127.0.0.1:%s", {ioUringGroup=1})
+    newServer{address="127.0.0.1:%s"}
+    webserver("127.0.0.1:%s")
+    setWebserverConfig({apiKey="%s"})
+    """
+    _skipListeningOnCL = True
+
+    def testGroup(self):
+        """
+        io_uring: Two listeners handled by the same thread, or by one thread each after a fallback
+        """
+        for idx in range(5):
+            self.checkForwarded(str(idx) + '.first.group.iouring.tests.powerdns.com.')
+            self.checkForwarded(str(idx) + '.second.group.iouring.tests.powerdns.com.', port=self._dnsDistPort2)
+
+        syscalls = self.getFrontendsUDPSyscalls()
+        self.assertEquals(len(syscalls), 2)
+        for address in syscalls:
+            self.assertGreater(syscalls[address], 0)
@@ -0,0 +1,123 @@
+#!/usr/bin/env python
+import dns
+import os
+from dnsdisttests import DNSDistTest
+
+class TCPAcceptInWorkersTest(object):
+    """
+    Every TCP worker accepts the connections on its own SO_REUSEPORT listening socket,
+    whether the kernel distributes them based on a hash or on the CPU that processed them.
+    """
+
+    _tcpWorkers = 4
+    _maxTCPConnsPerClient = 10
+
+    def getListeningSocketsCount(self):
+        count = 0
+        local = '0100007F:%04X' % (self._dnsDistPort)
+        with open('/proc/net/tcp') as fp:
+            next(fp)
+            for line in fp:
+                fields = line.split()
+                # 0A is TCP_LISTEN
+                if fields[1] == local and fields[3] == '0A':
+                    count = count + 1
+        return count
+
+    def testListeningSockets(self):
+        """
+        TCP Accept In Workers: One listening socket per worker
+        """
+        if not os.path.exists('/proc/net/tcp'):
+            self.skipTest('/proc/net/tcp is not available')
+
+        self.assertEqual(self.getListeningSocketsCount(), self._tcpWorkers)
+
+    def testManyConnections(self):
+        """
+        TCP Accept In Workers: Queries over many connections opened at the same time
+        """
+        name = 'connections.accept-in-workers.tests.powerdns.com.'
+        query = dns.message.make_query(name, 'A', 'IN')
+        response = dns.message.make_response(query)
+        rrset = dns.rrset.from_text(name,
+                                    3600,
+                                    dns.rdataclass.IN,
+                                    dns.rdatatype.A,
+                                    '127.0.0.1')
+        response.answer.append(rrset)
+
+        # keep them open so that they are spread over the workers
+        conns = []
+        for idx in range(self._maxTCPConnsPerClient):
+            conns.append(self.openTCPConnection())
+
+        for conn in conns:
+            self._toResponderQueue.put(response, True, 2.0)
+            self.sendTCPQueryOverConnection(conn, query)
+            receivedResponse = self.recvTCPResponseOverConnection(conn)
+            receivedQuery = self._fromResponderQueue.get(True, 2.0)
+            self.assertTrue(receivedQuery)
+            self.assertTrue(receivedResponse)
+            receivedQuery.id = query.id
+            self.assertEqual(query, receivedQuery)
+            self.assertEqual(response, receivedResponse)
+
+        for conn in conns:
+            conn.close()
+
+    def testConnsPerClient(self):
+        """
+        TCP Accept In Workers: The maximum number of connections per client is shared by the workers
+        """
+        name = 'maxconnsperclient.accept-in-workers.tests.powerdns.com.'
+        query = dns.message.make_query(name, 'A', 'IN')
+        query.flags &= ~dns.flags.RD
+        expectedResponse = dns.message.make_response(query)
+        expectedResponse.set_rcode(dns.rcode.REFUSED)
+
+        conns = []
+        for idx in range(self._maxTCPConnsPerClient + 1):
+            conns.append(self.openTCPConnection())
+
+        count = 0
+        failed = 0
+        for conn in conns:
+            try:
+                self.sendTCPQueryOverConnection(conn, query)
+                response = self.recvTCPResponseOverConnection(conn)
+                if response:
+                    self.assertEqual(expectedResponse, response)
+                    count = count + 1
+                else:
+                    failed = failed + 1
+            except:
+                failed = failed + 1
+
+        for conn in conns:
+            conn.close()
+
+        self.assertEqual(count, self._maxTCPConnsPerClient)
+        self.assertEqual(failed, 1)
+
+class TestTCPAcceptInWorkers(TCPAcceptInWorkersTest, DNSDistTest):
+
+    _config_params = ['_tcpWorkers', '_maxTCPConnsPerClient', '_testServerPort']
+    _config_template = """
+    setTCPAcceptInWorkers(true)
+    setMaxTCPClientThreads(%s)
+    setMaxTCPConnectionsPerClient(%s)
+    addAction("maxconnsperclient.accept-in-workers.tests.powerdns.com.", RCodeAction(DNSRCode.REFUSED))
+    newServer{address="127.0.0.1:%s"}
+    """
+
+class TestTCPAcceptInWorkersCPUSteering(TCPAcceptInWorkersTest, DNSDistTest):
+
+    _config_params = ['_tcpWorkers', '_maxTCPConnsPerClient', '_testServerPort']
+    _config_template = """
+    setTCPAcceptInWorkers(true, true)
+    setMaxTCPClientThreads(%s)
+    setMaxTCPConnectionsPerClient(%s)
+    addAction("maxconnsperclient.accept-in-workers.tests.powerdns.com.", RCodeAction(DNSRCode.REFUSED))
+    newServer{address="127.0.0.1:%s"}
+    """